@@ -0,0 +1,105 @@
+//
+//  active_tiles.cpp
+//  2D-StableFluids
+//
+
+#include "active_tiles.hpp"
+
+#include <algorithm>
+
+void ActiveTileMask::resize(int N, int tile_size){
+    n = N;
+    tile = std::max(1, tile_size);
+    tiles = (N + tile - 1) / tile;
+    active.assign(tileCount(), 0);
+    next.assign(tileCount(), 0);
+    dirty.assign(tileCount(), 1);   // 現在の値はわからないので、最初の判定では全てのタイルを調べる
+    active_list.clear();
+    retired_list.clear();
+    spans.clear();
+    span_offset.assign(tiles + 1, 0);
+}
+
+void ActiveTileMask::touch(int i_begin, int i_end, int j_begin, int j_end){
+    if (tiles == 0) return;
+    // 内部セル i のタイルは (i - 1) / tile
+    int tx0 = std::clamp((i_begin - 1) / tile, 0, tiles - 1);
+    int tx1 = std::clamp((i_end - 2) / tile, 0, tiles - 1);
+    int ty0 = std::clamp((j_begin - 1) / tile, 0, tiles - 1);
+    int ty1 = std::clamp((j_end - 2) / tile, 0, tiles - 1);
+    for (int ty = ty0; ty <= ty1; ++ty){
+        for (int tx = tx0; tx <= tx1; ++tx){
+            dirty[tx + tiles * ty] = 1;
+        }
+    }
+}
+
+void ActiveTileMask::touchAll(){
+    std::fill(dirty.begin(), dirty.end(), 1);
+}
+
+const std::vector<int>& ActiveTileMask::beginUpdate(){
+    candidate_list.clear();
+    for (int t = 0; t < tileCount(); ++t){
+        if (active[t] || dirty[t]) candidate_list.push_back(t);
+    }
+    return candidate_list;
+}
+
+void ActiveTileMask::finishUpdate(const std::vector<unsigned char>& seed, int halo){
+    std::fill(next.begin(), next.end(), 0);
+    for (int t : candidate_list){
+        if (!seed[t]) continue;
+        int tx = t % tiles;
+        int ty = t / tiles;
+        for (int y = std::max(0, ty - halo); y <= std::min(tiles - 1, ty + halo); ++y){
+            for (int x = std::max(0, tx - halo); x <= std::min(tiles - 1, tx + halo); ++x){
+                next[x + tiles * y] = 1;
+            }
+        }
+    }
+    retired_list.clear();
+    for (int t : candidate_list){
+        if (!next[t]) retired_list.push_back(t);
+    }
+    active.swap(next);
+    std::fill(dirty.begin(), dirty.end(), 0);
+
+    active_list.clear();
+    spans.clear();
+    for (int ty = 0; ty < tiles; ++ty){
+        span_offset[ty] = (int)spans.size();
+        for (int tx = 0; tx < tiles; ++tx){
+            int t = tx + tiles * ty;
+            if (!active[t]) continue;
+            active_list.push_back(t);
+            int i_begin = 1 + tx * tile;
+            int i_end = std::min(n + 1, i_begin + tile);
+            if (tx > 0 && active[t - 1]){
+                spans.back().i_end = i_end;     // 左隣の有効なタイルと続ける
+            } else {
+                spans.push_back(Span{ i_begin, i_end });
+            }
+        }
+    }
+    span_offset[tiles] = (int)spans.size();
+}
+
+double ActiveTileMask::activeFraction() const{
+    return tileCount() > 0 ? (double)active_list.size() / tileCount() : 0.0;
+}
+
+void ActiveTileMask::bounds(int t, int& i_begin, int& i_end, int& j_begin, int& j_end) const{
+    int tx = t % tiles;
+    int ty = t / tiles;
+    i_begin = 1 + tx * tile;
+    i_end = std::min(n + 1, i_begin + tile);
+    j_begin = 1 + ty * tile;
+    j_end = std::min(n + 1, j_begin + tile);
+}
+
+const ActiveTileMask::Span* ActiveTileMask::rowSpans(int j, int& count) const{
+    int ty = (j - 1) / tile;
+    count = span_offset[ty + 1] - span_offset[ty];
+    return spans.data() + span_offset[ty];
+}
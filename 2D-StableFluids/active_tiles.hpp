@@ -0,0 +1,77 @@
+//
+//  active_tiles.hpp
+//  2D-StableFluids
+//
+//  疎な領域だけを処理するための有効タイルの管理。
+//  格子の内部セルを一辺 tile のタイルに分け、速度か色の絶対値がしきい値を超えるタイルと、
+//  その周囲 halo タイルを「有効」とする。移流・拡散・圧力勾配の適用は有効なタイルだけで行う。
+//  無効なタイルの値は常に0に保つ（無効になったときに0にする）ので、判定し直すのは
+//  前のステップで有効だったタイルと、イベント（外力・スタンプ）で touch されたタイルだけでよい。
+//
+
+#pragma once
+#include <vector>
+
+// 有効タイルの設定
+struct SparseOptions {
+    bool enabled = false;               // 有効なタイルだけを処理するか（既定は無効）
+    int tile = 16;                      // タイルの一辺（セル数）
+    int halo = 1;                       // しきい値を超えたタイルの周囲で有効にするタイルの幅（1以上）
+    float velocity_threshold = 1e-4f;   // 速度の成分の絶対値のしきい値
+    float dye_threshold = 1e-4f;        // 色とトレーサーの絶対値のしきい値
+};
+
+class ActiveTileMask {
+public:
+    // 1つの行で有効なセルの範囲 [i_begin, i_end)
+    struct Span {
+        int i_begin;
+        int i_end;
+    };
+
+    // 一辺 N の格子を一辺 tile のタイルに分ける（全てのタイルを touch 済み・無効にする）
+    void resize(int N, int tile);
+    int size() const { return n; }
+    int tileSize() const { return tile; }
+    int tilesPerSide() const { return tiles; }
+    int tileCount() const { return tiles * tiles; }
+
+    // 内部セルの矩形 [i_begin, i_end) x [j_begin, j_end) を含むタイルを、次の判定の対象にする
+    void touch(int i_begin, int i_end, int j_begin, int j_end);
+    // 全てのタイルを次の判定の対象にする（格子全体を書き換える処理の後で呼ぶ）
+    void touchAll();
+
+    // 判定の対象（有効なタイルと touch されたタイル）の一覧を作って返す
+    const std::vector<int>& beginUpdate();
+    /**
+     * seed[t] が 0 でないタイルの周囲 halo タイルを有効にする（seed は tileCount() 要素で、対象外のタイルは 0）
+     * 有効でも touch されてもいなかったタイルは0のままなので、無効になったタイルは retired() で返す
+     * （値が残っている可能性があるので、呼び出し側で0にする）
+     */
+    void finishUpdate(const std::vector<unsigned char>& seed, int halo);
+
+    bool isActive(int t) const { return active[t] != 0; }
+    const std::vector<int>& activeTiles() const { return active_list; }
+    // 直前の finishUpdate で無効になったタイル（touch されたがしきい値を超えなかったタイルを含む）
+    const std::vector<int>& retired() const { return retired_list; }
+    // 有効なタイルの割合
+    double activeFraction() const;
+
+    // タイル t のセルの範囲
+    void bounds(int t, int& i_begin, int& i_end, int& j_begin, int& j_end) const;
+    // 行 j で有効なセルの範囲（隣り合う有効なタイルはまとめる）。count に個数を返す
+    const Span* rowSpans(int j, int& count) const;
+
+private:
+    int n = 0;
+    int tile = 16;
+    int tiles = 0;      // 一辺のタイル数
+    std::vector<unsigned char> active;
+    std::vector<unsigned char> dirty;
+    std::vector<unsigned char> next;    // finishUpdate の作業領域
+    std::vector<int> active_list;
+    std::vector<int> candidate_list;
+    std::vector<int> retired_list;
+    std::vector<Span> spans;        // タイルの行ごとの有効な範囲
+    std::vector<int> span_offset;   // タイルの行 t の範囲は spans[span_offset[t], span_offset[t + 1])
+};
@@ -0,0 +1,399 @@
+//
+//  advect_kernels.cpp
+//  2D-StableFluids
+//
+//  注意: FMA への縮約が起きるとスカラー版（とソース項を融合しない add_source）と結果が変わるため、
+//  このファイルと simulation.cpp, distributed_simulation.cpp では縮約を禁止する（下の pragma と CMakeLists.txt を参照）。
+//
+
+// FMA への縮約を禁止する（CMake では -ffp-contract=off を付けるが、Xcode のプロジェクトなど他のビルドでも効くように）
+// 含めるヘッダーのテンプレートにも効くよう、#include より前に置く
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "advect_kernels.hpp"
+
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SF_X86 1
+#endif
+
+// GCC / Clang のベクトル拡張（x86 では SSE、arm64 では NEON の命令になる）
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__) || defined(__ARM_NEON))
+#define SF_VEC4 1
+#endif
+
+namespace {
+
+// 1セル分の移流（全ての版で端数処理に使う）
+// kSource: d0 にソース項を足してから補間する、kVelSource: 速度にソース項を足してから逆追跡する
+template <bool kSource, bool kVelSource, typename T>
+inline void advect_cell(int N, int stride, const BasicAdvectFields<T>& f, T dt0, int i, int j){
+    int k = i + stride * j;
+    T uk = f.u[k];
+    T vk = f.v[k];
+    if constexpr (kVelSource){
+        uk = uk + f.dt * f.us[k];
+        vk = vk + f.dt * f.vs[k];
+    }
+    T x = i - dt0 * uk;     // x方向の移流後の位置を逆に辿る
+    T y = j - dt0 * vk;     // y方向の移流後の位置を逆に辿る
+    // xとyの範囲をクリップしてシミュレーション領域外にでないようにする
+    const T lo = T(0.5);
+    const T hi = N + T(0.5);
+    if (x < lo) x = lo;
+    if (x > hi) x = hi;
+    int i0 = (int)x;
+    if (y < lo) y = lo;
+    if (y > hi) y = hi;
+    int j0 = (int)y;
+    T s1 = x - i0;
+    T s0 = 1 - s1;
+    T t1 = y - j0;
+    T t0 = 1 - t1;
+    int k00 = i0 + stride * j0;     // (i0, j0)
+    for (int c = 0; c < f.channels; ++c){
+        const T* src = f.d0[c];
+        T d00 = src[k00];
+        T d01 = src[k00 + stride];
+        T d10 = src[k00 + 1];
+        T d11 = src[k00 + 1 + stride];
+        if constexpr (kSource){
+            const T* add = f.s[c];
+            d00 = d00 + f.dt * add[k00];
+            d01 = d01 + f.dt * add[k00 + stride];
+            d10 = d10 + f.dt * add[k00 + 1];
+            d11 = d11 + f.dt * add[k00 + 1 + stride];
+        }
+        f.d[c][k] = s0 * (t0 * d00 + t1 * d01) + s1 * (t0 * d10 + t1 * d11);
+    }
+}
+
+// ソース項の有無に応じた版を呼ぶ（内側のループで分岐しないよう、組み合わせごとに実体化する）
+template <typename T, typename F>
+inline void with_sources(const BasicAdvectFields<T>& f, F&& fn){
+    if (f.s){
+        if (f.us) fn(std::true_type{}, std::true_type{});
+        else fn(std::true_type{}, std::false_type{});
+    } else {
+        if (f.us) fn(std::false_type{}, std::true_type{});
+        else fn(std::false_type{}, std::false_type{});
+    }
+}
+
+template <bool kSource, bool kVelSource, typename T>
+void advect_scalar_impl(int N, int stride, const BasicAdvectFields<T>& f, T dt0,
+                        int i_begin, int i_end, int j_begin, int j_end){
+    for (int j = j_begin; j < j_end; ++j){
+        for (int i = i_begin; i < i_end; ++i){
+            advect_cell<kSource, kVelSource>(N, stride, f, dt0, i, j);
+        }
+    }
+}
+
+template <typename T>
+void advect_scalar(int N, int stride, const BasicAdvectFields<T>& f, T dt0,
+                   int i_begin, int i_end, int j_begin, int j_end){
+    with_sources(f, [&](auto src, auto vel){
+        advect_scalar_impl<src(), vel()>(N, stride, f, dt0, i_begin, i_end, j_begin, j_end);
+    });
+}
+
+#ifdef SF_VEC4
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int v4i __attribute__((vector_size(16)));
+
+inline v4f load4(const float* p){
+    v4f r;
+    std::memcpy(&r, p, sizeof(r));
+    return r;
+}
+
+inline void store4(float* p, v4f x){
+    std::memcpy(p, &x, sizeof(x));
+}
+
+// NEON にはギャザーがないので、4点はレーンごとに読む
+inline v4f gather4(const float* p, v4i k){
+    return v4f{ p[k[0]], p[k[1]], p[k[2]], p[k[3]] };
+}
+
+// スカラー版の if (x < lo) x = lo; と同じ（NaN はそのまま残る）
+inline v4f select4(v4i mask, v4f a, v4f b){
+    return (v4f)(((v4i)a & mask) | ((v4i)b & ~mask));
+}
+
+template <bool kSource, bool kVelSource>
+void advect_vec4_impl(int N, int stride, const AdvectFields& f, float dt0,
+                      int i_begin, int i_end, int j_begin, int j_end){
+    const v4f lo = { 0.5f, 0.5f, 0.5f, 0.5f };
+    const float h = N + 0.5f;
+    const v4f hi = { h, h, h, h };
+    const v4f one = { 1.0f, 1.0f, 1.0f, 1.0f };
+    const v4f vdt0 = { dt0, dt0, dt0, dt0 };
+    const v4f vdt = { f.dt, f.dt, f.dt, f.dt };
+    const v4f lane = { 0, 1, 2, 3 };
+    for (int j = j_begin; j < j_end; ++j){
+        const v4f vj = { (float)j, (float)j, (float)j, (float)j };
+        int i = i_begin;
+        for (; i + 4 <= i_end; i += 4){
+            int k = i + stride * j;
+            v4f uk = load4(f.u + k);
+            v4f vk = load4(f.v + k);
+            if constexpr (kVelSource){
+                uk = uk + vdt * load4(f.us + k);
+                vk = vk + vdt * load4(f.vs + k);
+            }
+            v4f vi = v4f{ (float)i, (float)i, (float)i, (float)i } + lane;
+            v4f x = vi - vdt0 * uk;
+            v4f y = vj - vdt0 * vk;
+            x = select4(x < lo, lo, x);
+            x = select4(x > hi, hi, x);
+            y = select4(y < lo, lo, y);
+            y = select4(y > hi, hi, y);
+            v4i i0 = __builtin_convertvector(x, v4i);
+            v4i j0 = __builtin_convertvector(y, v4i);
+            v4f s1 = x - __builtin_convertvector(i0, v4f);
+            v4f s0 = one - s1;
+            v4f t1 = y - __builtin_convertvector(j0, v4f);
+            v4f t0 = one - t1;
+            v4i k00 = i0 + j0 * stride;
+            v4i k01 = k00 + stride;
+            for (int c = 0; c < f.channels; ++c){
+                const float* src = f.d0[c];
+                v4f d00 = gather4(src, k00);
+                v4f d01 = gather4(src, k01);
+                v4f d10 = gather4(src + 1, k00);
+                v4f d11 = gather4(src + 1, k01);
+                if constexpr (kSource){
+                    const float* add = f.s[c];
+                    d00 = d00 + vdt * gather4(add, k00);
+                    d01 = d01 + vdt * gather4(add, k01);
+                    d10 = d10 + vdt * gather4(add + 1, k00);
+                    d11 = d11 + vdt * gather4(add + 1, k01);
+                }
+                store4(f.d[c] + k, s0 * (t0 * d00 + t1 * d01) + s1 * (t0 * d10 + t1 * d11));
+            }
+        }
+        for (; i < i_end; ++i){
+            advect_cell<kSource, kVelSource>(N, stride, f, dt0, i, j);
+        }
+    }
+}
+
+void advect_vec4(int N, int stride, const AdvectFields& f, float dt0,
+                 int i_begin, int i_end, int j_begin, int j_end){
+    with_sources(f, [&](auto src, auto vel){
+        advect_vec4_impl<src(), vel()>(N, stride, f, dt0, i_begin, i_end, j_begin, j_end);
+    });
+}
+
+#endif // SF_VEC4
+
+#ifdef SF_X86
+
+template <bool kSource, bool kVelSource>
+__attribute__((target("avx2")))
+void advect_avx2_impl(int N, int stride, const AdvectFields& f, float dt0,
+                      int i_begin, int i_end, int j_begin, int j_end){
+    const __m256 lo = _mm256_set1_ps(0.5f);
+    const __m256 hi = _mm256_set1_ps(N + 0.5f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 vdt0 = _mm256_set1_ps(dt0);
+    const __m256 vdt = _mm256_set1_ps(f.dt);
+    const __m256i vstride = _mm256_set1_epi32(stride);
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int j = j_begin; j < j_end; ++j){
+        const __m256 vj = _mm256_set1_ps((float)j);
+        int i = i_begin;
+        for (; i + 8 <= i_end; i += 8){
+            int k = i + stride * j;
+            __m256 uk = _mm256_loadu_ps(f.u + k);
+            __m256 vk = _mm256_loadu_ps(f.v + k);
+            if constexpr (kVelSource){
+                uk = _mm256_add_ps(uk, _mm256_mul_ps(vdt, _mm256_loadu_ps(f.us + k)));
+                vk = _mm256_add_ps(vk, _mm256_mul_ps(vdt, _mm256_loadu_ps(f.vs + k)));
+            }
+            __m256 vi = _mm256_add_ps(_mm256_set1_ps((float)i), lane);
+            __m256 x = _mm256_sub_ps(vi, _mm256_mul_ps(vdt0, uk));
+            __m256 y = _mm256_sub_ps(vj, _mm256_mul_ps(vdt0, vk));
+            x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+            y = _mm256_min_ps(_mm256_max_ps(y, lo), hi);
+            __m256i i0 = _mm256_cvttps_epi32(x);
+            __m256i j0 = _mm256_cvttps_epi32(y);
+            __m256 s1 = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i0));
+            __m256 s0 = _mm256_sub_ps(one, s1);
+            __m256 t1 = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j0));
+            __m256 t0 = _mm256_sub_ps(one, t1);
+            __m256i k00 = _mm256_add_epi32(i0, _mm256_mullo_epi32(j0, vstride));
+            __m256i k01 = _mm256_add_epi32(k00, vstride);
+            for (int c = 0; c < f.channels; ++c){
+                const float* src = f.d0[c];
+                __m256 d00 = _mm256_i32gather_ps(src, k00, 4);
+                __m256 d01 = _mm256_i32gather_ps(src, k01, 4);
+                __m256 d10 = _mm256_i32gather_ps(src + 1, k00, 4);
+                __m256 d11 = _mm256_i32gather_ps(src + 1, k01, 4);
+                if constexpr (kSource){
+                    const float* add = f.s[c];
+                    d00 = _mm256_add_ps(d00, _mm256_mul_ps(vdt, _mm256_i32gather_ps(add, k00, 4)));
+                    d01 = _mm256_add_ps(d01, _mm256_mul_ps(vdt, _mm256_i32gather_ps(add, k01, 4)));
+                    d10 = _mm256_add_ps(d10, _mm256_mul_ps(vdt, _mm256_i32gather_ps(add + 1, k00, 4)));
+                    d11 = _mm256_add_ps(d11, _mm256_mul_ps(vdt, _mm256_i32gather_ps(add + 1, k01, 4)));
+                }
+                __m256 a = _mm256_add_ps(_mm256_mul_ps(t0, d00), _mm256_mul_ps(t1, d01));
+                __m256 b = _mm256_add_ps(_mm256_mul_ps(t0, d10), _mm256_mul_ps(t1, d11));
+                _mm256_storeu_ps(f.d[c] + k, _mm256_add_ps(_mm256_mul_ps(s0, a), _mm256_mul_ps(s1, b)));
+            }
+        }
+        for (; i < i_end; ++i){
+            advect_cell<kSource, kVelSource>(N, stride, f, dt0, i, j);
+        }
+    }
+}
+
+void advect_avx2(int N, int stride, const AdvectFields& f, float dt0,
+                 int i_begin, int i_end, int j_begin, int j_end){
+    with_sources(f, [&](auto src, auto vel){
+        advect_avx2_impl<src(), vel()>(N, stride, f, dt0, i_begin, i_end, j_begin, j_end);
+    });
+}
+
+template <bool kSource, bool kVelSource>
+__attribute__((target("avx512f")))
+void advect_avx512_impl(int N, int stride, const AdvectFields& f, float dt0,
+                        int i_begin, int i_end, int j_begin, int j_end){
+    const __m512 lo = _mm512_set1_ps(0.5f);
+    const __m512 hi = _mm512_set1_ps(N + 0.5f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 vdt0 = _mm512_set1_ps(dt0);
+    const __m512 vdt = _mm512_set1_ps(f.dt);
+    const __m512i vstride = _mm512_set1_epi32(stride);
+    const __m512 lane = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    for (int j = j_begin; j < j_end; ++j){
+        const __m512 vj = _mm512_set1_ps((float)j);
+        int i = i_begin;
+        for (; i + 16 <= i_end; i += 16){
+            int k = i + stride * j;
+            __m512 uk = _mm512_loadu_ps(f.u + k);
+            __m512 vk = _mm512_loadu_ps(f.v + k);
+            if constexpr (kVelSource){
+                uk = _mm512_add_ps(uk, _mm512_mul_ps(vdt, _mm512_loadu_ps(f.us + k)));
+                vk = _mm512_add_ps(vk, _mm512_mul_ps(vdt, _mm512_loadu_ps(f.vs + k)));
+            }
+            __m512 vi = _mm512_add_ps(_mm512_set1_ps((float)i), lane);
+            __m512 x = _mm512_sub_ps(vi, _mm512_mul_ps(vdt0, uk));
+            __m512 y = _mm512_sub_ps(vj, _mm512_mul_ps(vdt0, vk));
+            x = _mm512_min_ps(_mm512_max_ps(x, lo), hi);
+            y = _mm512_min_ps(_mm512_max_ps(y, lo), hi);
+            __m512i i0 = _mm512_cvttps_epi32(x);
+            __m512i j0 = _mm512_cvttps_epi32(y);
+            __m512 s1 = _mm512_sub_ps(x, _mm512_cvtepi32_ps(i0));
+            __m512 s0 = _mm512_sub_ps(one, s1);
+            __m512 t1 = _mm512_sub_ps(y, _mm512_cvtepi32_ps(j0));
+            __m512 t0 = _mm512_sub_ps(one, t1);
+            __m512i k00 = _mm512_add_epi32(i0, _mm512_mullo_epi32(j0, vstride));
+            __m512i k01 = _mm512_add_epi32(k00, vstride);
+            for (int c = 0; c < f.channels; ++c){
+                const float* src = f.d0[c];
+                __m512 d00 = _mm512_i32gather_ps(k00, src, 4);
+                __m512 d01 = _mm512_i32gather_ps(k01, src, 4);
+                __m512 d10 = _mm512_i32gather_ps(k00, src + 1, 4);
+                __m512 d11 = _mm512_i32gather_ps(k01, src + 1, 4);
+                if constexpr (kSource){
+                    const float* add = f.s[c];
+                    d00 = _mm512_add_ps(d00, _mm512_mul_ps(vdt, _mm512_i32gather_ps(k00, add, 4)));
+                    d01 = _mm512_add_ps(d01, _mm512_mul_ps(vdt, _mm512_i32gather_ps(k01, add, 4)));
+                    d10 = _mm512_add_ps(d10, _mm512_mul_ps(vdt, _mm512_i32gather_ps(k00, add + 1, 4)));
+                    d11 = _mm512_add_ps(d11, _mm512_mul_ps(vdt, _mm512_i32gather_ps(k01, add + 1, 4)));
+                }
+                __m512 a = _mm512_add_ps(_mm512_mul_ps(t0, d00), _mm512_mul_ps(t1, d01));
+                __m512 b = _mm512_add_ps(_mm512_mul_ps(t0, d10), _mm512_mul_ps(t1, d11));
+                _mm512_storeu_ps(f.d[c] + k, _mm512_add_ps(_mm512_mul_ps(s0, a), _mm512_mul_ps(s1, b)));
+            }
+        }
+        for (; i < i_end; ++i){
+            advect_cell<kSource, kVelSource>(N, stride, f, dt0, i, j);
+        }
+    }
+}
+
+void advect_avx512(int N, int stride, const AdvectFields& f, float dt0,
+                   int i_begin, int i_end, int j_begin, int j_end){
+    with_sources(f, [&](auto src, auto vel){
+        advect_avx512_impl<src(), vel()>(N, stride, f, dt0, i_begin, i_end, j_begin, j_end);
+    });
+}
+
+#endif // SF_X86
+
+} // namespace
+
+SimdIsa detect_simd_isa(){
+#ifdef SF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdIsa::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdIsa::AVX2;
+#endif
+#ifdef SF_VEC4
+    return SimdIsa::Vector4;    // SSE2 / NEON は x86-64 / arm64 の基本の命令セットに含まれる
+#else
+    return SimdIsa::Scalar;
+#endif
+}
+
+namespace {
+
+// 命令セットの幅の順位（広いほど大きい）
+int isa_rank(SimdIsa isa){
+    switch (isa){
+        case SimdIsa::Vector4: return 1;
+        case SimdIsa::AVX2: return 2;
+        case SimdIsa::AVX512: return 3;
+        default: return 0;
+    }
+}
+
+} // namespace
+
+SimdIsa resolve_simd_isa(SimdIsa isa){
+    SimdIsa best = detect_simd_isa();
+    if (isa == SimdIsa::Auto) return best;
+    // CPU が対応していない命令セットが指定されたら、対応する範囲で最も広いものに落とす
+    if (isa_rank(isa) > isa_rank(best)) isa = best;
+    return isa;
+}
+
+AdvectKernel advect_kernel(SimdIsa isa){
+    switch (resolve_simd_isa(isa)){
+#ifdef SF_X86
+        case SimdIsa::AVX512: return advect_avx512;
+        case SimdIsa::AVX2: return advect_avx2;
+#endif
+#ifdef SF_VEC4
+        case SimdIsa::Vector4: return advect_vec4;
+#endif
+        default: return advect_scalar<float>;
+    }
+}
+
+BasicAdvectKernel<double> advect_kernel_f64(){
+    return advect_scalar<double>;
+}
+
+const char* simd_isa_name(SimdIsa isa){
+    switch (isa){
+        case SimdIsa::Auto: return "auto";
+        case SimdIsa::Scalar: return "scalar";
+        case SimdIsa::Vector4: return "vec4";
+        case SimdIsa::AVX2: return "avx2";
+        case SimdIsa::AVX512: return "avx512";
+    }
+    return "unknown";
+}
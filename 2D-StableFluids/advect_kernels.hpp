@@ -0,0 +1,96 @@
+//
+//  advect_kernels.hpp
+//  2D-StableFluids
+//
+//  セミラグランジュ法による移流のカーネル。
+//  メモリ順（i が内側）に走査し、逆追跡した位置から周囲4セルを双線形補間する。
+//  AVX2 / AVX-512 版は補間位置と重みをベクトルレジスタで計算し、4点をギャザーで読む。
+//  4幅版は GCC / Clang のベクトル拡張で書き、arm64（Apple Silicon）では NEON、x86 では SSE の命令になる
+//  （ギャザーのない NEON に合わせて、4点はレーンごとに読む）。
+//  どの版もスカラー版と同じ順序で演算するため、結果はビット単位で一致する。
+//  複数のチャンネル（r, g, b やトレーサー）は同じ速度場で移流されるため、
+//  逆追跡の位置と補間の重みはセルごとに1度だけ計算し、全チャンネルで共有する。
+//  ソース項を渡すと、補間に使う4点と逆追跡に使う速度にその場で dt * s を足す（融合した輸送処理）。
+//  足し算は add_source と同じ順序で行うので、先に add_source してから移流した結果とビット単位で一致する。
+//  fp64 の場（BasicSimulation<double>）にはスカラー版だけを用意する。
+//
+
+#pragma once
+
+// 移流カーネルの命令セット
+enum class SimdIsa {
+    Auto,       // 実行時に CPU が対応する最も広い命令セットを選ぶ
+    Scalar,     // 移植性のあるスカラー実装
+    Vector4,    // 4幅のベクトル拡張（NEON / SSE）
+    AVX2,
+    AVX512,
+};
+
+// 移流カーネルに渡す場（ポインタは格子の (0, 0) を指す、T は場の要素の型）
+template <typename T>
+struct BasicAdvectFields {
+    int channels = 0;
+    T* const* d = nullptr;          // d[c]: c 番目のチャンネルの移流後の値
+    const T* const* d0 = nullptr;   // d0[c]: 移流前の値
+    const T* const* s = nullptr;    // s[c]: ソース項（nullptr でなければ d0[c] + dt * s[c] を移流する）
+    const T* u = nullptr;           // 逆追跡に使う速度
+    const T* v = nullptr;
+    const T* us = nullptr;          // 速度のソース項（nullptr でなければ (u + dt * us, v + dt * vs) で逆追跡する）
+    const T* vs = nullptr;
+    T dt = T(0);                    // ソース項に掛ける時間ステップ
+};
+using AdvectFields = BasicAdvectFields<float>;
+
+// タイル [i_begin, i_end) x [j_begin, j_end) の内部セルを移流する
+// stride: 行の要素数（Grid2D::pitch、(i, j) は i + stride * j）、dt0: dt * N
+template <typename T>
+using BasicAdvectKernel = void (*)(int N, int stride, const BasicAdvectFields<T>& f, T dt0,
+                                   int i_begin, int i_end, int j_begin, int j_end);
+using AdvectKernel = BasicAdvectKernel<float>;
+
+// 実行中の CPU で使える最も広い命令セット
+SimdIsa detect_simd_isa();
+
+// isa に対応するカーネル（Auto や CPU が対応しない命令セットは使える範囲に落とす）
+AdvectKernel advect_kernel(SimdIsa isa);
+// fp64 の場のカーネル（スカラー版のみ）
+BasicAdvectKernel<double> advect_kernel_f64();
+
+// 実際に使われる命令セット（advect_kernel と同じ規則で解決したもの）
+SimdIsa resolve_simd_isa(SimdIsa isa);
+
+const char* simd_isa_name(SimdIsa isa);
+
+// 格納形式 S（dye_storage.hpp）の場を移流する汎用のスカラー版（補間は速度と同じ型 R で行い、結果を S::store で書く）
+// stride: d, d0 の行の要素数、vel_stride: u, v の行の要素数（要素の大きさが違うと pitch も違う）
+template <typename S, typename R>
+void advect_tile_stored(int N, int stride, int vel_stride, int channels,
+                        typename S::value_type* const* d, const typename S::value_type* const* d0,
+                        const R* u, const R* v, R dt0,
+                        int i_begin, int i_end, int j_begin, int j_end){
+    const R lo = R(0.5);
+    const R hi = N + R(0.5);
+    for (int j = j_begin; j < j_end; ++j){
+        for (int i = i_begin; i < i_end; ++i){
+            int k = i + vel_stride * j;
+            R x = i - dt0 * u[k];
+            R y = j - dt0 * v[k];
+            if (x < lo) x = lo;
+            if (x > hi) x = hi;
+            int i0 = (int)x;
+            if (y < lo) y = lo;
+            if (y > hi) y = hi;
+            int j0 = (int)y;
+            R s1 = x - i0;
+            R s0 = 1 - s1;
+            R t1 = y - j0;
+            R t0 = 1 - t1;
+            int k00 = i0 + stride * j0;
+            for (int c = 0; c < channels; ++c){
+                const typename S::value_type* src = d0[c];
+                d[c][i + stride * j] = S::store(s0 * (t0 * (R)S::load(src[k00]) + t1 * (R)S::load(src[k00 + stride])) +
+                                                s1 * (t0 * (R)S::load(src[k00 + 1]) + t1 * (R)S::load(src[k00 + 1 + stride])));
+            }
+        }
+    }
+}
@@ -0,0 +1,281 @@
+//
+//  cg_solver.cpp
+//  2D-StableFluids
+//
+
+#include "cg_solver.hpp"
+
+#include <cmath>
+
+template <typename T, typename Acc>
+template <typename F>
+void BasicConjugateGradientSolver<T, Acc>::for_rows(F&& fn){
+    if (pool){
+        pool->parallel_for(1, n + 1, fn);
+    } else {
+        fn(1, n + 1);
+    }
+}
+
+template <typename T, typename Acc>
+void BasicConjugateGradientSolver<T, Acc>::bind(int N, FieldArena& arena, Grid2D<T>& residual){
+    diag = arena.take<T>(N, T(0));
+    precon = arena.take<T>(N, T(0));
+    r = residual.alias();
+    z = arena.take<T>(N, T(0));
+    p = arena.take<T>(N, T(0));
+    q = arena.take<T>(N, T(0));
+    row_sum.assign(N + 2, 0.0);
+    n = -1;     // 次の setup で係数を作り直す（同じ大きさなので resize は値の初期化だけになる）
+}
+
+template <typename T, typename Acc>
+void BasicConjugateGradientSolver<T, Acc>::setup(int N, int b, T a, T c){
+    if (N != n){
+        diag.resize(N, T(0));
+        precon.resize(N, T(0));
+        r.resize(N, T(0));
+        z.resize(N, T(0));
+        p.resize(N, T(0));
+        q.resize(N, T(0));
+        row_sum.assign(N + 2, 0.0);
+        prepared = Preconditioner::None;
+        bnd = -1;
+    }
+    if (N == n && b == bnd && a == coef_a && c == coef_c && prepared == options.preconditioner){
+        return;
+    }
+    n = N;
+    bnd = b;
+    coef_a = a;
+    coef_c = c;
+    // b = 0 かつ c = 4a のときは行和が0になり、定数ベクトルだけずれた解が全て解になる
+    singular = (b == 0 && c == T(4) * a);
+    int s = diag.pitch();
+
+    // 境界に接するセルでは、ゴーストセルが内部セルの値（b により符号反転）になるため対角成分に繰り込む
+    T sx = b == 1 ? T(-1) : T(1);
+    T sy = b == 2 ? T(-1) : T(1);
+    for (int j = 1; j <= N; ++j){
+        int by = (j == 1) + (j == N);
+        for (int i = 1; i <= N; ++i){
+            int bx = (i == 1) + (i == N);
+            diag[i + s * j] = c - a * (sx * bx + sy * by);
+        }
+    }
+
+    if (options.preconditioner == Preconditioner::IncompleteCholesky){
+        // IC(0): 非対角成分は隣接する内部セル間で -a
+        // ゴーストセルの precon は0なので、境界の条件分岐は不要
+        for (int j = 1; j <= N; ++j){
+            for (int i = 1; i <= N; ++i){
+                int k = i + s * j;
+                T e = diag[k];
+                T li = a * precon[k - 1];
+                T lj = a * precon[k - s];
+                e -= li * li + lj * lj;
+                // 特異な系では最後のセルで e が0に近づくため、小さくなりすぎたら元の対角成分に戻す
+                if (e < T(0.25) * diag[k]) e = diag[k];
+                precon[k] = T(1) / std::sqrt(e);
+            }
+        }
+    }
+    prepared = options.preconditioner;
+}
+
+template <typename T, typename Acc>
+void BasicConjugateGradientSolver<T, Acc>::apply_operator(const Grid2D<T>& in, Grid2D<T>& out){
+    int s = diag.pitch();
+    Acc a = coef_a;
+    for_rows([&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            for (int i = 1; i <= n; ++i){
+                int k = i + s * j;
+                out[k] = (T)((Acc)diag[k] * in[k] - a * ((Acc)in[k - 1] + in[k + 1] + in[k - s] + in[k + s]));
+            }
+        }
+    });
+}
+
+// A * in を T に丸めずに rhs から引く（Acc が T より広ければ、丸めるのは残差だけになる）
+template <typename T, typename Acc>
+void BasicConjugateGradientSolver<T, Acc>::compute_residual(const Grid2D<T>& rhs, const Grid2D<T>& in, Grid2D<T>& out){
+    int s = diag.pitch();
+    Acc a = coef_a;
+    for_rows([&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            for (int i = 1; i <= n; ++i){
+                int k = i + s * j;
+                Acc ax = (Acc)diag[k] * in[k] - a * ((Acc)in[k - 1] + in[k + 1] + in[k - s] + in[k + s]);
+                out[k] = (T)(rhs[k] - ax);
+            }
+        }
+    });
+}
+
+template <typename T, typename Acc>
+void BasicConjugateGradientSolver<T, Acc>::apply_preconditioner(const Grid2D<T>& in, Grid2D<T>& out){
+    int s = diag.pitch();
+    T a = coef_a;
+    switch (options.preconditioner){
+        case Preconditioner::None:
+            for_rows([&](int j_begin, int j_end){
+                for (int j = j_begin; j < j_end; ++j){
+                    for (int i = 1; i <= n; ++i){
+                        out[i + s * j] = in[i + s * j];
+                    }
+                }
+            });
+            break;
+        case Preconditioner::Jacobi:
+            for_rows([&](int j_begin, int j_end){
+                for (int j = j_begin; j < j_end; ++j){
+                    for (int i = 1; i <= n; ++i){
+                        out[i + s * j] = in[i + s * j] / diag[i + s * j];
+                    }
+                }
+            });
+            break;
+        case Preconditioner::IncompleteCholesky:
+            // 前進代入 L q = in（out に q を書く）
+            for (int j = 1; j <= n; ++j){
+                for (int i = 1; i <= n; ++i){
+                    int k = i + s * j;
+                    out[k] = (in[k] + a * (precon[k - 1] * out[k - 1] + precon[k - s] * out[k - s])) * precon[k];
+                }
+            }
+            // 後退代入 L^T z = q（逆順に処理するので out をそのまま上書きできる）
+            for (int j = n; j >= 1; --j){
+                for (int i = n; i >= 1; --i){
+                    int k = i + s * j;
+                    out[k] = (out[k] + a * precon[k] * (out[k + 1] + out[k + s])) * precon[k];
+                }
+            }
+            break;
+    }
+}
+
+template <typename T, typename Acc>
+double BasicConjugateGradientSolver<T, Acc>::dot(const Grid2D<T>& u, const Grid2D<T>& v){
+    int s = diag.pitch();
+    for_rows([&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            double sum = 0.0;
+            for (int i = 1; i <= n; ++i){
+                sum += (double)u[i + s * j] * v[i + s * j];
+            }
+            row_sum[j] = sum;
+        }
+    });
+    double total = 0.0;
+    for (int j = 1; j <= n; ++j){
+        total += row_sum[j];
+    }
+    return total;
+}
+
+template <typename T, typename Acc>
+void BasicConjugateGradientSolver<T, Acc>::remove_mean(Grid2D<T>& v){
+    int s = diag.pitch();
+    double mean = 0.0;
+    for (int j = 1; j <= n; ++j){
+        for (int i = 1; i <= n; ++i){
+            mean += v[i + s * j];
+        }
+    }
+    T m = (T)(mean / ((double)n * n));
+    for (int j = 1; j <= n; ++j){
+        for (int i = 1; i <= n; ++i){
+            v[i + s * j] -= m;
+        }
+    }
+}
+
+template <typename T, typename Acc>
+SolveStats BasicConjugateGradientSolver<T, Acc>::solve(int N, int b, Grid2D<T>& x, const Grid2D<T>& x0,
+                                                     T a, T c, ThreadPool* tp){
+    pool = tp;
+    setup(N, b, a, c);
+    int s = diag.pitch();
+    SolveStats stats;
+
+    // ||x0||（特異な系では値域に射影した右辺で測る）
+    for (int j = 1; j <= N; ++j){
+        for (int i = 1; i <= N; ++i){
+            z[i + s * j] = x0[i + s * j];
+        }
+    }
+    if (singular) remove_mean(z);
+    double b_norm = std::sqrt(dot(z, z));
+
+    // r = x0 - A x（x のゴーストセルは使わず、p にゴースト0で内部セルだけ写してから評価する）
+    for (int j = 1; j <= N; ++j){
+        for (int i = 1; i <= N; ++i){
+            p[i + s * j] = x[i + s * j];
+        }
+    }
+    compute_residual(z, p, r);
+
+    double rr = dot(r, r);
+    stats.initial_residual = (float)std::sqrt(rr);
+    double target = (double)options.tolerance * b_norm;
+    if (std::sqrt(rr) <= target){
+        stats.residual = stats.initial_residual;
+        stats.converged = true;
+        return stats;
+    }
+
+    apply_preconditioner(r, z);
+    if (singular) remove_mean(z);
+    for (int j = 1; j <= N; ++j){
+        for (int i = 1; i <= N; ++i){
+            p[i + s * j] = z[i + s * j];
+        }
+    }
+    double rz = dot(r, z);
+
+    while (stats.iterations < options.max_iterations){
+        apply_operator(p, q);
+        double pq = dot(p, q);
+        if (!(pq > 0.0)){
+            break;  // 破綻（正定値でない、または NaN）
+        }
+        Acc alpha = (Acc)(rz / pq);
+        for_rows([&](int j_begin, int j_end){
+            for (int j = j_begin; j < j_end; ++j){
+                for (int i = 1; i <= N; ++i){
+                    int k = i + s * j;
+                    x[k] = (T)(x[k] + alpha * p[k]);
+                    r[k] = (T)(r[k] - alpha * q[k]);
+                }
+            }
+        });
+        ++stats.iterations;
+
+        rr = dot(r, r);
+        if (std::sqrt(rr) <= target){
+            stats.converged = true;
+            break;
+        }
+
+        apply_preconditioner(r, z);
+        if (singular) remove_mean(z);
+        double rz_new = dot(r, z);
+        Acc beta = (Acc)(rz_new / rz);
+        rz = rz_new;
+        for_rows([&](int j_begin, int j_end){
+            for (int j = j_begin; j < j_end; ++j){
+                for (int i = 1; i <= N; ++i){
+                    int k = i + s * j;
+                    p[k] = (T)(z[k] + beta * p[k]);
+                }
+            }
+        });
+    }
+    stats.residual = (float)std::sqrt(rr);
+    return stats;
+}
+
+template class BasicConjugateGradientSolver<float>;
+template class BasicConjugateGradientSolver<double>;
+template class BasicConjugateGradientSolver<float, double>;
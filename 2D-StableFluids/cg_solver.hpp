@@ -0,0 +1,88 @@
+//
+//  cg_solver.hpp
+//  2D-StableFluids
+//
+//  lin_solve と同じ線形系 c * x[i,j] - a * (x[i-1,j] + x[i+1,j] + x[i,j-1] + x[i,j+1]) = x0[i,j]
+//  （ゴーストセルは set_bnd(N, b, x) と同じ扱い）を前処理付き共役勾配法で解く。
+//  行列は持たず、ステンシルを直接評価する（matrix-free）。
+//  T は格子の要素の型、Acc は行列ベクトル積・残差・ベクトルの更新を計算する型（T = float, Acc = double で混合精度）。
+//  内積は T によらず double で足し合わせる。
+//
+
+#pragma once
+#include <vector>
+
+#include "field_arena.hpp"
+#include "grid2d.hpp"
+#include "solve_stats.hpp"
+#include "thread_pool.hpp"
+
+// 前処理の種類
+enum class Preconditioner {
+    None,                   // 前処理なし
+    Jacobi,                 // 対角スケーリング（並列化可能）
+    IncompleteCholesky,     // 不完全コレスキー分解 IC(0)（前進・後退代入は逐次）
+};
+
+struct ConjugateGradientOptions {
+    Preconditioner preconditioner = Preconditioner::IncompleteCholesky;
+    float tolerance = 1e-4f;    // 相対残差 ||r|| / ||x0|| の許容値
+    int max_iterations = 200;   // 反復回数の上限
+};
+
+template <typename T, typename Acc = T>
+class BasicConjugateGradientSolver {
+public:
+    BasicConjugateGradientSolver() = default;
+
+    void setOptions(const ConjugateGradientOptions& opt) { options = opt; }
+    const ConjugateGradientOptions& getOptions() const { return options; }
+
+    /**
+     * N: グリッドの一辺、b: 境界条件（set_bnd と同じ）
+     * x: 解（初期値として使う）、x0: 右辺、a, c: ステンシルの係数
+     * pool: 内積・行列ベクトル積を並列化するスレッドプール（nullptr ならシングルスレッド）
+     */
+    SolveStats solve(int N, int b, Grid2D<T>& x, const Grid2D<T>& x0,
+                     T a, T c, ThreadPool* pool);
+
+    /**
+     * 一辺 N 用の作業領域を arena から切り出す（以後 N で solve してもメモリの確保は起きない）
+     * residual: 残差に使う格子（呼び出し側の作業領域と共有する）
+     */
+    void bind(int N, FieldArena& arena, Grid2D<T>& residual);
+    // bind が arena から切り出すバイト数
+    static std::size_t workspace_bytes(int N) { return 5 * FieldArena::bytes_for<T>(N); }
+
+private:
+    // N, b, a, c に合わせて対角成分と前処理を作り直す（変わらなければ何もしない）
+    void setup(int N, int b, T a, T c);
+    // out = A * in（in のゴーストセルは0のまま）
+    void apply_operator(const Grid2D<T>& in, Grid2D<T>& out);
+    // out = rhs - A * in
+    void compute_residual(const Grid2D<T>& rhs, const Grid2D<T>& in, Grid2D<T>& out);
+    // out = M^-1 * in
+    void apply_preconditioner(const Grid2D<T>& in, Grid2D<T>& out);
+    double dot(const Grid2D<T>& u, const Grid2D<T>& v);
+    // 内部セルの平均を引く（特異なノイマン問題用）
+    void remove_mean(Grid2D<T>& v);
+
+    template <typename F>
+    void for_rows(F&& fn);
+
+    ConjugateGradientOptions options;
+    ThreadPool* pool = nullptr;
+
+    // 現在の設定
+    int n = -1, bnd = -1;
+    T coef_a = T(0), coef_c = T(0);
+    Preconditioner prepared = Preconditioner::None;
+    bool singular = false;  // 純ノイマン問題（定数ベクトルが零空間）か
+
+    Grid2D<T> diag;             // 境界の影響を含めた対角成分
+    Grid2D<T> precon;           // IC(0) の対角成分の逆数の平方根
+    Grid2D<T> r, z, p, q;       // 残差・前処理後の残差・探索方向・A*p
+    std::vector<double> row_sum;    // 行ごとの部分和（合計順序をスレッド数に依存させない）
+};
+
+using ConjugateGradientSolver = BasicConjugateGradientSolver<float>;
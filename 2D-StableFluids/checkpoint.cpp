@@ -0,0 +1,343 @@
+//
+//  checkpoint.cpp
+//  2D-StableFluids
+//
+
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.hpp"
+
+namespace {
+
+constexpr char kMagic[8] = { 'S', 'F', 'C', 'K', 'P', 'T', '\0', '\0' };
+constexpr std::uint32_t kByteOrder = 0x01020304u;
+
+std::size_t align_up(std::size_t v){
+    return (v + kCheckpointAlignment - 1) / kCheckpointAlignment * kCheckpointAlignment;
+}
+
+// ブロックが [0, bytes) に収まるか（offset + bytes の桁あふれを避けて比べる）
+bool block_in_range(const CheckpointField& f, std::size_t bytes){
+    return f.offset <= bytes && f.bytes <= bytes - f.offset;
+}
+
+// 場の要素の大きさ・一辺・行の要素数が、ヘッダーの一辺とブロックの大きさと矛盾しないか
+// （Simulation が付け替える前に自分の場と比べるが、その前に読む側が壊れた表を使わないように確かめる）
+bool field_consistent(const CheckpointField& f, std::uint32_t n){
+    if (f.elem_bytes == 0 || f.elem_bytes > 8 || f.n != n || f.pitch < (std::uint64_t)n + 2){
+        return false;
+    }
+    // 少なくとも (n + 2) 行 x pitch 要素は入っている
+    const std::uint64_t rows = (std::uint64_t)n + 2;
+    return f.bytes / f.elem_bytes / f.pitch >= rows;
+}
+
+// ヘッダーと場の表の大きさ（最初のブロックの位置）
+std::size_t table_bytes(std::size_t fields){
+    return align_up(sizeof(CheckpointHeader) + fields * sizeof(CheckpointField));
+}
+
+std::uint64_t rotl(std::uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+constexpr std::uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+constexpr std::uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr std::uint64_t kPrime3 = 0x165667B19E3779F9ull;
+
+std::uint64_t mix(std::uint64_t acc, std::uint64_t v){
+    return rotl(acc + v * kPrime2, 31) * kPrime1;
+}
+
+// ヘッダーと場の表のチェックサム（header_checksum を0として計算する）
+std::uint64_t header_checksum(const unsigned char* image){
+    CheckpointHeader h;
+    std::memcpy(&h, image, sizeof(h));
+    std::size_t bytes = sizeof(CheckpointHeader) + (std::size_t)h.field_count * sizeof(CheckpointField);
+    std::vector<unsigned char> copy(image, image + bytes);
+    std::memset(copy.data() + offsetof(CheckpointHeader, header_checksum), 0, sizeof(std::uint64_t));
+    return checkpoint_checksum(copy.data(), copy.size());
+}
+
+[[noreturn]] void fail(const std::string& what, const std::string& path){
+    throw std::runtime_error(what + ": " + path);
+}
+
+} // namespace
+
+// 32 バイトごとに4系列へ混ぜ、最後に系列と残りのバイトをまとめる（xxHash64 と同じ形の簡易版）
+std::uint64_t checkpoint_checksum(const void* data, std::size_t bytes){
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    std::uint64_t acc[4] = { kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1 };
+    std::size_t k = 0;
+    for (; k + 32 <= bytes; k += 32){
+        for (int l = 0; l < 4; ++l){
+            std::uint64_t v;
+            std::memcpy(&v, p + k + 8 * l, sizeof(v));
+            acc[l] = mix(acc[l], v);
+        }
+    }
+    std::uint64_t h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+    h += bytes;
+    for (; k + 8 <= bytes; k += 8){
+        std::uint64_t v;
+        std::memcpy(&v, p + k, sizeof(v));
+        h = rotl(h ^ mix(0, v), 27) * kPrime1 + kPrime3;
+    }
+    for (; k < bytes; ++k){
+        h = rotl(h ^ (p[k] * kPrime3), 11) * kPrime1;
+    }
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    return h;
+}
+
+std::size_t checkpoint_bytes(const std::vector<CheckpointBlock>& blocks){
+    std::size_t bytes = table_bytes(blocks.size());
+    for (const CheckpointBlock& b : blocks){
+        bytes += align_up(b.bytes);
+    }
+    return bytes;
+}
+
+void checkpoint_serialize(const CheckpointHeader& header, const std::vector<CheckpointBlock>& blocks, unsigned char* image){
+    std::size_t total = checkpoint_bytes(blocks);
+    CheckpointHeader h = header;
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kCheckpointVersion;
+    h.byte_order = kByteOrder;
+    h.header_bytes = sizeof(CheckpointHeader);
+    h.field_count = (std::uint32_t)blocks.size();
+    h.file_bytes = total;
+    h.header_checksum = 0;
+
+    std::size_t offset = table_bytes(blocks.size());
+    std::memset(image, 0, offset);
+    for (std::size_t k = 0; k < blocks.size(); ++k){
+        const CheckpointBlock& b = blocks[k];
+        CheckpointField f = {};
+        std::strncpy(f.name, b.name.c_str(), sizeof(f.name) - 1);
+        f.elem_bytes = b.elem_bytes;
+        f.n = b.n;
+        f.pitch = b.pitch;
+        f.offset = offset;
+        f.bytes = b.bytes;
+        std::memcpy(image + sizeof(CheckpointHeader) + k * sizeof(CheckpointField), &f, sizeof(f));
+
+        std::memcpy(image + offset, b.base, b.bytes);
+        std::size_t padded = align_up(b.bytes);
+        std::memset(image + offset + b.bytes, 0, padded - b.bytes);
+        offset += padded;
+    }
+    std::memcpy(image, &h, sizeof(h));
+}
+
+void checkpoint_finalize(unsigned char* image, std::size_t bytes){
+    CheckpointHeader h;
+    std::memcpy(&h, image, sizeof(h));
+    if (table_bytes(h.field_count) > bytes){
+        throw std::runtime_error("checkpoint field table out of range");
+    }
+    for (std::uint32_t k = 0; k < h.field_count; ++k){
+        unsigned char* entry = image + sizeof(CheckpointHeader) + k * sizeof(CheckpointField);
+        CheckpointField f;
+        std::memcpy(&f, entry, sizeof(f));
+        if (!block_in_range(f, bytes)){
+            throw std::runtime_error("checkpoint block out of range");
+        }
+        f.checksum = checkpoint_checksum(image + f.offset, f.bytes);
+        std::memcpy(entry, &f, sizeof(f));
+    }
+    h.header_checksum = header_checksum(image);
+    std::memcpy(image + offsetof(CheckpointHeader, header_checksum), &h.header_checksum, sizeof(h.header_checksum));
+}
+
+void checkpoint_write_file(const std::string& path, const unsigned char* image, std::size_t bytes){
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) fail(std::string("cannot create checkpoint (") + std::strerror(errno) + ")", tmp);
+    std::size_t done = 0;
+    while (done < bytes){
+        ssize_t w = ::write(fd, image + done, bytes - done);
+        if (w < 0){
+            if (errno == EINTR) continue;
+            int e = errno;
+            ::close(fd);
+            ::unlink(tmp.c_str());
+            fail(std::string("cannot write checkpoint (") + std::strerror(e) + ")", tmp);
+        }
+        done += (std::size_t)w;
+    }
+    if (::fsync(fd) != 0 || ::close(fd) != 0){
+        ::unlink(tmp.c_str());
+        fail("cannot flush checkpoint", tmp);
+    }
+    if (::rename(tmp.c_str(), path.c_str()) != 0){
+        ::unlink(tmp.c_str());
+        fail(std::string("cannot rename checkpoint (") + std::strerror(errno) + ")", path);
+    }
+    // rename はディレクトリの項目の書き換えなので、ディレクトリも書き出さないと電源断で古いファイルに戻ることがある
+    // （ディレクトリの fsync に対応しないファイルシステムは EINVAL を返すので、それは無視する）
+    const std::size_t slash = path.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) fail(std::string("cannot open checkpoint directory (") + std::strerror(errno) + ")", dir);
+    if (::fsync(dfd) != 0 && errno != EINVAL){
+        int e = errno;
+        ::close(dfd);
+        fail(std::string("cannot flush checkpoint directory (") + std::strerror(e) + ")", dir);
+    }
+    ::close(dfd);
+}
+
+MappedCheckpoint::MappedCheckpoint(const std::string& path, bool verify){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) fail("cannot open checkpoint", path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(CheckpointHeader)){
+        ::close(fd);
+        fail("not a checkpoint", path);
+    }
+    bytes = (std::size_t)st.st_size;
+    // 書き込みも許すが MAP_PRIVATE なので、書き換えたページだけがプロセス内で複製される
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) fail("cannot map checkpoint", path);
+    base = static_cast<unsigned char*>(p);
+
+    try {
+        const CheckpointHeader& h = header();
+        if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0) fail("not a checkpoint", path);
+        if (h.version != kCheckpointVersion) fail("unsupported checkpoint version " + std::to_string(h.version), path);
+        if (h.byte_order != kByteOrder) fail("checkpoint written with a different byte order", path);
+        if (h.header_bytes != sizeof(CheckpointHeader) || h.file_bytes != bytes ||
+            table_bytes(h.field_count) > bytes){
+            fail("truncated checkpoint", path);
+        }
+        if (header_checksum(base) != h.header_checksum) fail("checkpoint header checksum mismatch", path);
+        for (std::uint32_t k = 0; k < h.field_count; ++k){
+            const CheckpointField& f = *reinterpret_cast<const CheckpointField*>(base + sizeof(CheckpointHeader) + k * sizeof(CheckpointField));
+            if (f.offset % kCheckpointAlignment != 0 || !block_in_range(f, bytes)){
+                fail(std::string("checkpoint field out of range: ") + f.name, path);
+            }
+            if (!field_consistent(f, h.n)){
+                fail(std::string("checkpoint field layout is inconsistent: ") + f.name, path);
+            }
+            if (verify && checkpoint_checksum(base + f.offset, f.bytes) != f.checksum){
+                fail(std::string("checkpoint checksum mismatch: ") + f.name, path);
+            }
+        }
+    } catch (...){
+        ::munmap(base, bytes);
+        throw;
+    }
+}
+
+MappedCheckpoint::~MappedCheckpoint(){
+    ::munmap(base, bytes);
+}
+
+const CheckpointField* MappedCheckpoint::find(const std::string& name) const{
+    const CheckpointHeader& h = header();
+    for (std::uint32_t k = 0; k < h.field_count; ++k){
+        const CheckpointField* f = reinterpret_cast<const CheckpointField*>(base + sizeof(CheckpointHeader) + k * sizeof(CheckpointField));
+        if (std::strncmp(f->name, name.c_str(), sizeof(f->name)) == 0) return f;
+    }
+    return nullptr;
+}
+
+CheckpointHeader read_checkpoint_header(const std::string& path){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) fail("cannot open checkpoint", path);
+    CheckpointHeader h;
+    ssize_t r = ::read(fd, &h, sizeof(h));
+    ::close(fd);
+    if (r != (ssize_t)sizeof(h) || std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0) fail("not a checkpoint", path);
+    if (h.version != kCheckpointVersion) fail("unsupported checkpoint version " + std::to_string(h.version), path);
+    return h;
+}
+
+CheckpointWriter::CheckpointWriter(){
+    worker = std::thread([this]{ run(); });
+}
+
+CheckpointWriter::~CheckpointWriter(){
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this]{ return !pending; });
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+
+bool CheckpointWriter::wait(){
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{ return !pending; });
+    return failures == 0;
+}
+
+std::string CheckpointWriter::lastError() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return error;
+}
+
+std::uint64_t CheckpointWriter::written() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return done;
+}
+
+std::uint64_t CheckpointWriter::failed() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return failures;
+}
+
+void CheckpointWriter::start(const std::string& path){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        target = path;
+        pending = true;
+    }
+    cv.notify_all();
+}
+
+// ワーカースレッド: submit で写した内容にチェックサムを付けて書き出す
+void CheckpointWriter::run(){
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true){
+        cv.wait(lock, [this]{ return pending || stopping; });
+        if (!pending) return;
+        std::string path = target;
+        lock.unlock();
+        bool success = true;
+        std::string what;
+        try {
+            checkpoint_finalize(image.data(), image.size());
+            checkpoint_write_file(path, image.data(), image.size());
+        } catch (const std::exception& e){
+            success = false;
+            what = e.what();
+            SF_LOG_ERROR("checkpoint write failed (see CheckpointWriter::lastError)");
+        }
+        lock.lock();
+        if (success){
+            ++done;
+        } else {
+            error = what;
+            ++failures;
+        }
+        pending = false;
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,175 @@
+//
+//  checkpoint.hpp
+//  2D-StableFluids
+//
+//  Simulation の状態（場・粘性係数・拡散率・N・ステップ数）のバイナリ形式のチェックポイント。
+//
+//  ファイルの構成（リトルエンディアン、全ての位置はファイル先頭からのバイト数）:
+//    CheckpointHeader（128 バイト）
+//    CheckpointField × field_count（場の名前・要素の大きさ・位置・大きさ・チェックサム）
+//    場ごとのブロック（64 バイト境界。Grid2D の領域を先頭のずらし・ゴーストセル・行末の詰め物も含めてそのまま置く）
+//  ブロックの中の並びは Grid2D と同じなので、ファイルを mmap してブロックの先頭をそのまま Grid2D の領域にできる
+//  （MAP_PRIVATE で写すので、書き換えはプロセス内だけに留まり、ページは触れたときに初めて読み込まれる）。
+//  チェックサムはヘッダー（と場の表）とブロックごとに持つ。
+//
+//  書き出しは一時ファイルに書いて fsync してから名前を付け替えるので、途中で止まっても前のファイルは壊れない。
+//  CheckpointWriter は場を作業領域に写すところまでを呼び出し側で行い、チェックサムと書き出しを別スレッドで行う。
+//
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "grid2d.hpp"
+
+constexpr std::uint32_t kCheckpointVersion = 1;
+constexpr std::size_t kCheckpointAlignment = 64;    // ブロックの境界（Grid2D::kAlignment と同じ）
+
+struct CheckpointHeader {
+    char magic[8];                  // "SFCKPT\0\0"
+    std::uint32_t version;          // kCheckpointVersion
+    std::uint32_t byte_order;       // 0x01020304（書いた機械のバイト順の確認）
+    std::uint32_t header_bytes;     // sizeof(CheckpointHeader)
+    std::uint32_t field_count;
+    std::uint32_t n;                // 格子の一辺（内部セル数）
+    std::uint32_t real_bytes;       // 場の要素の大きさ（BasicSimulation の Real）
+    std::uint32_t accum_bytes;      // BasicSimulation の Accum の大きさ
+    std::uint32_t dye_storage;      // DyeStorage の値
+    std::uint32_t channels;         // 色とトレーサーのチャンネル数（r, g, b + トレーサー）
+    std::uint32_t reserved0;
+    double viscosity;
+    double diffusion;
+    double time;                    // 進めたシミュレーション時間の合計
+    std::uint64_t step;             // update を呼んだ回数
+    std::uint64_t file_bytes;       // ファイル全体の大きさ
+    std::uint64_t header_checksum;  // ヘッダーと場の表（このメンバーは0として計算する）
+    std::uint8_t reserved[32];
+};
+static_assert(sizeof(CheckpointHeader) == 128, "checkpoint header layout");
+
+struct CheckpointField {
+    char name[16];                  // 場の名前（"u", "dye0_prev" など、0 で終わる）
+    std::uint32_t elem_bytes;       // 要素の大きさ
+    std::uint32_t n;                // 格子の一辺
+    std::uint32_t pitch;            // 行の要素数（Grid2D::pitch）
+    std::uint32_t reserved0;
+    std::uint64_t offset;           // ブロックの位置（kCheckpointAlignment の倍数）
+    std::uint64_t bytes;            // ブロックの大きさ（Grid2D::storage_size(n) 要素分）
+    std::uint64_t checksum;
+};
+static_assert(sizeof(CheckpointField) == 56, "checkpoint field layout");
+
+// 書き出す場（Grid2D の領域の先頭と大きさ）
+struct CheckpointBlock {
+    std::string name;
+    const void* base = nullptr;     // Grid2D::base()
+    std::uint32_t elem_bytes = 0;
+    std::uint32_t n = 0;
+    std::uint32_t pitch = 0;
+    std::uint64_t bytes = 0;
+
+    template <typename T>
+    static CheckpointBlock of(std::string name, const Grid2D<T>& g){
+        CheckpointBlock b;
+        b.name = std::move(name);
+        b.base = g.base();
+        b.elem_bytes = sizeof(T);
+        b.n = (std::uint32_t)g.n();
+        b.pitch = (std::uint32_t)g.pitch();
+        b.bytes = Grid2D<T>::storage_size(g.n()) * sizeof(T);
+        return b;
+    }
+};
+
+// ブロックの内容のチェックサム（64 ビット、8 バイト単位の4系列を混ぜる）
+std::uint64_t checkpoint_checksum(const void* data, std::size_t bytes);
+
+// blocks を書き出したときのファイルの大きさ
+std::size_t checkpoint_bytes(const std::vector<CheckpointBlock>& blocks);
+// header（magic, version, 大きさ, 場の数, 位置は埋める）と blocks を image（checkpoint_bytes バイト、64 バイト境界）に並べる
+// チェックサムは checkpoint_finalize で書く
+void checkpoint_serialize(const CheckpointHeader& header, const std::vector<CheckpointBlock>& blocks, unsigned char* image);
+// image のブロックとヘッダーのチェックサムを計算して書き込む
+void checkpoint_finalize(unsigned char* image, std::size_t bytes);
+// image を path に書き出す（一時ファイル → fsync → rename）。失敗したら std::runtime_error
+void checkpoint_write_file(const std::string& path, const unsigned char* image, std::size_t bytes);
+
+// チェックポイントのファイルを mmap で開く（ファイルの大きさ・ヘッダー・場の表の整合性を確かめる）
+// verify: ブロックのチェックサムも確かめる（全てのページを一度読むことになる）
+// 形式が違う・壊れている場合は std::runtime_error
+class MappedCheckpoint {
+public:
+    explicit MappedCheckpoint(const std::string& path, bool verify = true);
+    ~MappedCheckpoint();
+
+    MappedCheckpoint(const MappedCheckpoint&) = delete;
+    MappedCheckpoint& operator=(const MappedCheckpoint&) = delete;
+
+    const CheckpointHeader& header() const { return *reinterpret_cast<const CheckpointHeader*>(base); }
+    // 名前が name の場（なければ nullptr）
+    const CheckpointField* find(const std::string& name) const;
+    // 場のブロックの先頭（書き換えてもファイルには反映されない）
+    void* block(const CheckpointField& f) const { return base + f.offset; }
+
+private:
+    unsigned char* base = nullptr;
+    std::size_t bytes = 0;
+};
+
+// ヘッダーだけを読む（Simulation を同じ設定で作るため）。読めない・形式が違う場合は std::runtime_error
+CheckpointHeader read_checkpoint_header(const std::string& path);
+
+/**
+ * 非同期のチェックポイント書き出し
+ * submit は前回の書き出しが終わるのを待ってから、場を作業領域に写して戻る（写す間だけ呼び出し側を止める）
+ * チェックサムの計算とファイルへの書き出しはワーカースレッドで行う
+ * 失敗は後の書き出しが成功しても消えない（submit は前回の結果を返さないので、定期的な書き出しの失敗を見落とさないため）
+ */
+class CheckpointWriter {
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();    // 書き出し中なら終わるまで待つ
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // sim の状態を path に書き出す（sim は BasicSimulation。checkpointBytes / serializeCheckpoint を使う）
+    template <typename Sim>
+    void submit(const Sim& sim, const std::string& path){
+        wait();
+        image.resize(sim.checkpointBytes());
+        sim.serializeCheckpoint(image.data());
+        start(path);
+    }
+
+    // 書き出し中の処理が終わるまで待つ（これまでの書き出しが全て成功したら true）
+    bool wait();
+    // 最後に失敗した書き出しのエラー（なければ空）
+    std::string lastError() const;
+    // 書き出しに成功した回数
+    std::uint64_t written() const;
+    // 書き出しに失敗した回数
+    std::uint64_t failed() const;
+
+private:
+    void start(const std::string& path);
+    void run();
+
+    std::vector<unsigned char, AlignedAllocator<unsigned char, kCheckpointAlignment>> image;  // 書き出す内容
+    std::string target;
+
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    bool pending = false;   // 書き出す内容がある（ワーカーが処理中を含む）
+    bool stopping = false;
+    std::string error;
+    std::uint64_t done = 0;
+    std::uint64_t failures = 0;
+    std::thread worker;
+};
@@ -0,0 +1,434 @@
+//
+//  distributed_simulation.cpp
+//  2D-StableFluids
+//
+
+// FMA への縮約を禁止する（CMake では -ffp-contract=off を付けるが、Xcode のプロジェクトなど他のビルドでも効くように）
+// 含めるヘッダーのテンプレートにも効くよう、#include より前に置く
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include "distributed_simulation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "grid2d.hpp"
+
+namespace {
+
+// 袖の行のメッセージの tag（下のランクへ送る行と上のランクへ送る行を分ける）
+constexpr int kTagDown = 1;
+constexpr int kTagUp = 2;
+constexpr int kTagGather = 3;
+// 袖より広い移流のために中継する行（上のランクへ送る行と下のランクへ送る行）
+constexpr int kTagWideUp = 4;
+constexpr int kTagWideDown = 5;
+
+// ランク r が持つ内部の行の先頭（ThreadPool の区間の分け方と同じ）
+int slab_begin(int N, int r, int ranks){
+    return 1 + (int)((long long)N * r / ranks);
+}
+
+} // namespace
+
+DistributedSimulation::DistributedSimulation(int N, HaloTransport& transport, int h, int tracer_count)
+    : comm(transport), n(N), halo(h){
+    if (N <= 0){
+        throw std::invalid_argument("grid size must be positive");
+    }
+    if (h < 1){
+        throw std::invalid_argument("halo must be at least one row");
+    }
+    if (tracer_count < 0){
+        throw std::invalid_argument("tracer count must be non-negative");
+    }
+    const int r = comm.rank();
+    const int ranks = comm.size();
+    // 袖は隣のランク1つから受け取るので、各ランクの行数は halo 以上必要
+    // （最も少ないランクの行数 N / ranks で確かめ、全てのランクで同じように投げる）
+    if (N / ranks < halo){
+        throw std::invalid_argument("each rank needs at least " + std::to_string(halo) + " rows (N=" +
+                                    std::to_string(N) + ", ranks=" + std::to_string(ranks) + ")");
+    }
+    j_begin = slab_begin(N, r, ranks);
+    j_end = slab_begin(N, r + 1, ranks);
+    rank_below = r > 0 ? r - 1 : -1;
+    rank_above = r + 1 < ranks ? r + 1 : -1;
+    own_lo = rank_below < 0 ? 0 : j_begin;
+    own_hi = rank_above < 0 ? N + 2 : j_end;
+    row_lo = std::max(0, j_begin - halo);
+    row_hi = std::min(N + 2, j_end + halo);
+
+    // Grid2D と同じ行の並び（(1, j) が 64 バイト境界に揃う）で、持っている行だけを確保する
+    using G = Grid2D<float>;
+    const int pitch = G::pitch_for(N);
+    const std::size_t count = (std::size_t)(G::kLanes - 1) + (std::size_t)pitch * (row_hi - row_lo);
+    const std::size_t field_bytes = (count * sizeof(float) + G::kAlignment - 1) / G::kAlignment * G::kAlignment;
+    const int channels = 3 + tracer_count;
+    arena.reserve(field_bytes * (6 + 2 * channels));
+    auto take = [&](float value){
+        float* base = arena.take_array<float>(count);
+        std::fill(base, base + count, value);
+        Slab s;
+        s.origin = base + (G::kLanes - 1) - (std::ptrdiff_t)pitch * row_lo;
+        s.pitch = pitch;
+        s.valid = halo;
+        return s;
+    };
+    // 初期値は Simulation と同じ
+    u = take(0.0f);
+    v = take(0.0f);
+    u_prev = take(2.0f);
+    v_prev = take(-2.0f);
+    pressure = take(0.0f);
+    divergence = take(0.0f);
+    for (int c = 0; c < channels; ++c){
+        dye.push_back(take(0.0f));
+        dye_prev.push_back(take(0.0f));
+    }
+    advect_fn = advect_kernel(SimdIsa::Auto);
+}
+
+void DistributedSimulation::add_source(Slab& x, Slab& s, float dt){
+    for (int j = row_lo; j < row_hi; ++j){
+        float* xr = x.row(j);
+        const float* sr = s.row(j);
+        for (int i = 0; i < x.pitch; ++i){
+            xr[i] += dt * sr[i];
+        }
+    }
+    x.valid = std::min(x.valid, s.valid);
+}
+
+void DistributedSimulation::fill(Slab& x, float value){
+    for (int j = row_lo; j < row_hi; ++j){
+        std::fill(x.row(j), x.row(j) + x.pitch, value);
+    }
+    x.valid = halo;
+}
+
+// Simulation の copy_projection と同じく角のセルは写さない
+void DistributedSimulation::copy_projection(Slab& x, const Slab& s){
+    for (int j = row_lo; j < row_hi; ++j){
+        const int i_begin = (j == 0 || j == n + 1) ? 1 : 0;
+        const int i_end = (j == 0 || j == n + 1) ? n + 1 : n + 2;
+        std::copy(s.row(j) + i_begin, s.row(j) + i_end, x.row(j) + i_begin);
+    }
+    x.valid = s.valid;
+}
+
+void DistributedSimulation::ensure_halo(Slab& x, int width){
+    // valid は全てのランクで同じように変わるので、送り合うかどうかも全てのランクで揃う
+    if (x.valid >= width) return;
+    const std::size_t bytes = sizeof(float) * (std::size_t)x.pitch * width;
+    // 先に両方へ送ってから受け取る（send は相手を待たない）
+    if (rank_below >= 0) comm.send(rank_below, kTagDown, x.row(j_begin), bytes);
+    if (rank_above >= 0) comm.send(rank_above, kTagUp, x.row(j_end - width), bytes);
+    if (rank_below >= 0) comm.recv(rank_below, kTagUp, x.row(j_begin - width), bytes);
+    if (rank_above >= 0) comm.recv(rank_above, kTagDown, x.row(j_end), bytes);
+    x.valid = width;
+}
+
+// Simulation::set_bnd と同じ値（角は書かない）。上下のゴースト行は最初と最後のランクだけが書く
+void DistributedSimulation::set_bnd(int b, Slab& x){
+    const float sx = b == 1 ? -1.0f : 1.0f;
+    const float sy = b == 2 ? -1.0f : 1.0f;
+    if (own_lo == 0){
+        for (int i = 1; i <= n; ++i){
+            x(i, 0) = sy * x(i, 1);
+        }
+    }
+    for (int j = j_begin; j < j_end; ++j){
+        x(0, j) = sx * x(1, j);
+        x(n + 1, j) = sx * x(n, j);
+    }
+    if (own_hi == n + 2){
+        for (int i = 1; i <= n; ++i){
+            x(i, n + 1) = sy * x(i, n);
+        }
+    }
+    x.valid = 0;
+}
+
+void DistributedSimulation::lin_solve(int b, Slab& x, Slab& x0, float a, float c, int iters){
+    const float inv_c = 1.0f / c;
+    const int stride = x.pitch;
+    for (int k = 0; k < iters; ++k){
+        // 赤（i + j が偶数）のセルを更新してから黒のセルを更新する。各色は前の色の袖を読む
+        for (int color = 0; color < 2; ++color){
+            ensure_halo(x, 1);
+            for (int j = j_begin; j < j_end; ++j){
+                float* xc = x.row(j);
+                const float* x0c = x0.row(j);
+                for (int i = 1 + ((1 + j + color) & 1); i < n + 1; i += 2){
+                    xc[i] = (x0c[i] + a * (xc[i - 1] + xc[i + 1] + xc[i - stride] + xc[i + stride])) * inv_c;
+                }
+            }
+            x.valid = 0;
+        }
+        set_bnd(b, x);
+    }
+}
+
+void DistributedSimulation::diffuse(int b, Slab& x, Slab& x0, float diff, float dt){
+    float a = dt * diff * n * n;
+    lin_solve(b, x, x0, a, 1 + 4 * a, 20);
+}
+
+double DistributedSimulation::advect_reach(Slab& vu, Slab& vv, Slab* su, Slab* sv, float dt){
+    const float dt0 = dt * n;
+    float vmax = 0.0f;
+    for (int j = j_begin; j < j_end; ++j){
+        for (int i = 1; i <= n; ++i){
+            float a = vu(i, j);
+            float b = vv(i, j);
+            if (su){
+                // add_source と同じ演算（移流のときの速度と同じ値になる）
+                a += dt * (*su)(i, j);
+                b += dt * (*sv)(i, j);
+            }
+            // NaN は max で落ちるので、別に数える
+            if (!std::isfinite(a) || !std::isfinite(b)) vmax = INFINITY;
+            vmax = std::max(vmax, std::max(std::fabs(a), std::fabs(b)));
+        }
+    }
+    return comm.allreduce_max((double)(dt0 * vmax));
+}
+
+int DistributedSimulation::advect_width(double reach){
+    // 逆追跡の距離（セル数）の全体での最大値。補間で1つ先の行も読むので + 1
+    // 有限でなければ（Simulation と同じく位置は格子の中に丸められるので）全ての行を送り合う
+    const int width = std::isfinite(reach) && reach < n ? (int)std::ceil(reach) + 1 : n + 2;
+    last_width = std::max(last_width, width);
+    return width;
+}
+
+// 袖に収まらない行も、隣のランクが持っている行を順に中継して集める
+// ランク k の持つ行と必要な行は全てのランクで同じように計算できるので、h 段目に送り合う行も揃う
+// （h 段目を終えると、ランク k は k - h 番目のランクまでの行のうち必要なものを持っている）
+const float* DistributedSimulation::exchange_wide(Slab& x, int width){
+    using G = Grid2D<float>;
+    const int ranks = comm.size();
+    const int r = comm.rank();
+    auto own_begin = [&](int k){ return k <= 0 ? 0 : slab_begin(n, k, ranks); };
+    auto own_end = [&](int k){ return k >= ranks - 1 ? n + 2 : slab_begin(n, k + 1, ranks); };
+    auto need_lo = [&](int k){ return std::max(0, slab_begin(n, k, ranks) - width); };
+    auto need_hi = [&](int k){ return std::min(n + 2, slab_begin(n, k + 1, ranks) + width); };
+    // h 段目を終えた後のランク k の持つ行 [have_lo, have_hi)
+    auto have_lo = [&](int k, int h){ return std::max(need_lo(k), own_begin(k - h)); };
+    auto have_hi = [&](int k, int h){ return std::min(need_hi(k), own_end(k + h)); };
+
+    const int lo = need_lo(r);
+    const int hi = need_hi(r);
+    wide_rows.resize((std::size_t)(G::kLanes - 1) + (std::size_t)x.pitch * (hi - lo));
+    float* origin = wide_rows.data() + (G::kLanes - 1) - (std::ptrdiff_t)x.pitch * lo;
+    std::copy(x.row(own_lo), x.row(own_hi), origin + (std::ptrdiff_t)x.pitch * own_lo);
+    auto bytes = [&](int rows){ return sizeof(float) * (std::size_t)x.pitch * rows; };
+    for (int h = 1; h < ranks; ++h){
+        // 上のランクへ、そのランクがこの段で受け取る行（自分はその前の段までに持っている）
+        if (rank_above >= 0){
+            int a = have_lo(r + 1, h), b = have_lo(r + 1, h - 1);
+            if (a < b) comm.send(rank_above, kTagWideUp, origin + (std::ptrdiff_t)x.pitch * a, bytes(b - a));
+        }
+        if (rank_below >= 0){
+            int a = have_hi(r - 1, h - 1), b = have_hi(r - 1, h);
+            if (a < b) comm.send(rank_below, kTagWideDown, origin + (std::ptrdiff_t)x.pitch * a, bytes(b - a));
+        }
+        if (rank_below >= 0){
+            int a = have_lo(r, h), b = have_lo(r, h - 1);
+            if (a < b) comm.recv(rank_below, kTagWideUp, origin + (std::ptrdiff_t)x.pitch * a, bytes(b - a));
+        }
+        if (rank_above >= 0){
+            int a = have_hi(r, h - 1), b = have_hi(r, h);
+            if (a < b) comm.recv(rank_above, kTagWideDown, origin + (std::ptrdiff_t)x.pitch * a, bytes(b - a));
+        }
+    }
+    return origin;
+}
+
+void DistributedSimulation::advect(int b, Slab& d, Slab& d0, Slab& vu, Slab& vv, float dt, int width){
+    const float* src[1];
+    if (width <= halo){
+        ensure_halo(d0, width);
+        src[0] = d0.origin;
+    } else {
+        src[0] = exchange_wide(d0, width);
+    }
+    float* dst[1] = { d.origin };
+    AdvectFields f;
+    f.channels = 1;
+    f.d = dst;
+    f.d0 = src;
+    f.u = vu.origin;
+    f.v = vv.origin;
+    f.dt = dt;
+    advect_fn(n, d.pitch, f, dt * n, 1, n + 1, j_begin, j_end);
+    set_bnd(b, d);
+}
+
+void DistributedSimulation::project(Slab& pu, Slab& pv, Slab& p, Slab& div){
+    const float h = 1.0f / n;
+    ensure_halo(pu, 1);
+    ensure_halo(pv, 1);
+    for (int j = j_begin; j < j_end; ++j){
+        for (int i = 1; i <= n; ++i){
+            div(i, j) = -0.5f * h * (pu(i + 1, j) - pu(i - 1, j) + pv(i, j + 1) - pv(i, j - 1));
+            p(i, j) = 0;
+        }
+    }
+    set_bnd(0, div);
+    set_bnd(0, p);
+    lin_solve(0, p, div, 1.0f, 4.0f, 40);
+    ensure_halo(p, 1);
+    for (int j = j_begin; j < j_end; ++j){
+        for (int i = 1; i <= n; ++i){
+            pu(i, j) = pu(i, j) - 0.5f * (p(i + 1, j) - p(i - 1, j)) / h;
+            pv(i, j) = pv(i, j) - 0.5f * (p(i, j + 1) - p(i, j - 1)) / h;
+        }
+    }
+    set_bnd(1, pu);
+    set_bnd(2, pv);
+}
+
+// Simulation::vel_step と同じ手順（前ステップの値の場に移流してから射影し、元の場に拡散する。最後の圧力と発散を前ステップの値の場に残す）
+// width: 速度の移流で送り合う行数（update が場を変える前に決める）
+void DistributedSimulation::vel_step(float dt, int width){
+    add_source(u, u_prev, dt);
+    add_source(v, v_prev, dt);
+    advect(1, u_prev, u, u, v, dt, width);
+    advect(2, v_prev, v, u, v, dt, width);
+    project(u_prev, v_prev, pressure, divergence);
+    diffuse(1, u, u_prev, viscosity, dt);
+    diffuse(2, v, v_prev, viscosity, dt);
+    project(u, v, pressure, divergence);
+    copy_projection(u_prev, pressure);
+    copy_projection(v_prev, divergence);
+}
+
+// Simulation::dens_step と同じ手順（チャンネルごとに、ソース項の加算・拡散・移流）
+void DistributedSimulation::dens_step(float dt){
+    const int width = advect_width(advect_reach(u, v, nullptr, nullptr, dt));
+    for (std::size_t c = 0; c < dye.size(); ++c){
+        add_source(dye[c], dye_prev[c], dt);
+        diffuse(0, dye_prev[c], dye[c], diffusion, dt);
+        advect(0, dye[c], dye_prev[c], u, v, dt, width);
+    }
+}
+
+void DistributedSimulation::update(int N, float dt){
+    if (N != n){
+        throw std::invalid_argument("grid size does not match the distributed simulation");
+    }
+    // 速度の移流の距離は、ソース項を足した後の速度から場を変える前に求める
+    // 発散した速度はここで投げるので、投げた場合はこのランクの状態は変わらない（全てのランクで揃って投げる）
+    const double reach = advect_reach(u, v, &u_prev, &v_prev, dt);
+    if (!std::isfinite(reach)){
+        throw std::runtime_error("velocity is not finite");
+    }
+    last_width = 0;
+    const int width = advect_width(reach);
+    ++step_count;
+    vel_step(dt, width);
+    dens_step(dt);
+}
+
+void DistributedSimulation::add_force(int X, int Y, int N, float fu, float fv){
+    if (X <= 0 || X > N || Y <= 0 || Y > N){
+        throw std::out_of_range("Index is  out of range.");
+    }
+    // Simulation と同じく (Y, X) のセル（行は X）
+    if (has_row(X)){
+        u_prev(Y, X) = fu;
+        v_prev(Y, X) = fv;
+    }
+}
+
+void DistributedSimulation::stamp(int X, int Y, int W, int H, int N, float R, float G, float B){
+    if (X <= 0 || X > N || Y <= 0 || Y > N || X + W > N || Y + H > N){
+        throw std::out_of_range("Index is out of range");
+    }
+    const float add[3] = { R, G, B };
+    for (int c = 0; c < 3; ++c){
+        Slab& p = dye_prev[c];
+        for (int i = Y; i < Y + H; ++i){
+            for (int j = std::max(X, row_lo); j < std::min(X + W, row_hi); ++j){
+                p(i, j) += add[c];
+            }
+        }
+    }
+}
+
+void DistributedSimulation::sink(int X, int Y, int W, int H, int N){
+    if (X <= 0 || X > N || Y <= 0 || Y > N || X + W > N || Y + H > N){
+        throw std::out_of_range("Index is out of range");
+    }
+    for (Slab& p : dye_prev){
+        for (int i = Y; i < Y + H; ++i){
+            for (int j = std::max(X, row_lo); j < std::min(X + W, row_hi); ++j){
+                p(i, j) = 0;
+            }
+        }
+    }
+}
+
+void DistributedSimulation::stampTracer(int id, int X, int Y, int W, int H, int N, float amount){
+    if (X <= 0 || X > N || Y <= 0 || Y > N || X + W > N || Y + H > N){
+        throw std::out_of_range("Index is out of range");
+    }
+    if (id < 0 || id >= getTracerCount()){
+        throw std::out_of_range("Tracer id is out of range");
+    }
+    Slab& t = dye_prev[3 + id];
+    for (int i = Y; i < Y + H; ++i){
+        for (int j = std::max(X, row_lo); j < std::min(X + W, row_hi); ++j){
+            t(i, j) += amount;
+        }
+    }
+}
+
+// Simulation::reset と同じ（前ステップの値を0にしてから、2つのシンクを置く）
+void DistributedSimulation::reset(int N){
+    fill(u_prev, 0.0f);
+    fill(v_prev, 0.0f);
+    for (Slab& p : dye_prev){
+        fill(p, 0.0f);
+    }
+    sink(10, 10, 2, 2, N);
+    sink(20, 20, 2, 2, N);
+}
+
+void DistributedSimulation::gatherDensity(int N, float* dst){
+    if (N != n){
+        throw std::invalid_argument("grid size does not match the distributed simulation");
+    }
+    // 自分の内部の行を readDensity(RGB32F) と同じ並びに詰める
+    auto pack = [&](float* out){
+        for (int j = j_begin; j < j_end; ++j){
+            for (int i = 1; i <= n; ++i){
+                float* px = out + ((std::size_t)(j - j_begin) * n + (i - 1)) * 3;
+                px[0] = std::max(dye[0](i, j), 0.0f);
+                px[1] = dye[1](i, j);
+                px[2] = dye[2](i, j);
+            }
+        }
+    };
+    const std::size_t row_floats = (std::size_t)n * 3;
+    if (comm.rank() != 0){
+        gather_rows.resize(row_floats * (j_end - j_begin));
+        pack(gather_rows.data());
+        comm.send(0, kTagGather, gather_rows.data(), gather_rows.size() * sizeof(float));
+        return;
+    }
+    pack(dst);
+    for (int r = 1; r < comm.size(); ++r){
+        const int lo = slab_begin(n, r, comm.size());
+        const int hi = slab_begin(n, r + 1, comm.size());
+        comm.recv(r, kTagGather, dst + row_floats * (lo - 1), row_floats * (hi - lo) * sizeof(float));
+    }
+}
@@ -0,0 +1,127 @@
+//
+//  distributed_simulation.hpp
+//  2D-StableFluids
+//
+//  1つのアドレス空間に入りきらない大きな格子を、複数のランク（プロセス）に行の帯（slab）で分けて進める領域分割版。
+//  - ランク r は内部の行 [rowBegin, rowEnd)（ThreadPool と同じ区間の分け方）と、その上下 halo 行の袖を持つ
+//    最初と最後のランクは格子の上下のゴースト行も持つ。左右のゴースト列は全てのランクが自分の行の分を持つ
+//  - 場を書き換えた後、隣のランクと一致している袖の行数を場ごとに覚えておき、読む処理の前に必要な行数だけ送り合う
+//    ステンシル（拡散・圧力の反復、発散と圧力勾配）は1行、移流は逆追跡の距離（CFL 数）+ 1 行
+//    移流の距離が袖に収まらないステップは、その場だけ必要な行を別の領域に集める（隣のランクが中継するので、
+//    1つのランクの行数より遠くても届く）
+//  - 拡散と圧力は赤黒ガウス・ザイデル法（色ごとの半反復の後に袖を送り合う）
+//  手順と演算の順序は Simulation（setLinearSolver(RedBlackGaussSeidel)、圧力は Iterative、融合なし）と同じで、
+//  全てのランクの行を集めた結果は、ランクの数と袖の行数によらずビット単位で一致する。
+//  精度は fp32、色とトレーサーは fp32 の格納形式だけ。
+//  全てのランクが同じ順で同じ引数で呼ぶ（イベントの適用も全てのランクで行う。自分の行に掛からないものは何もしない）。
+//
+
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "advect_kernels.hpp"
+#include "field_arena.hpp"
+#include "halo_transport.hpp"
+
+class DistributedSimulation {
+public:
+    /**
+     * 一辺 N の格子のうち transport.rank() の行の帯を持つ
+     * halo: 袖の行数。移流で逆追跡する距離（dt * N * max|u| セル）+ 1 以上にしておくと、移流も袖だけで済む
+     *       足りないステップは移流の読む行を隣のランクから中継して集める（結果は同じで、通信が増える）
+     * 各ランクの行数は halo 以上であること（足りない場合は std::invalid_argument）
+     */
+    DistributedSimulation(int N, HaloTransport& transport, int halo = 4, int tracer_count = 0);
+
+    DistributedSimulation(const DistributedSimulation&) = delete;
+    DistributedSimulation& operator=(const DistributedSimulation&) = delete;
+
+    // 内部の行のうちこのランクが持つ範囲 [rowBegin, rowEnd)
+    int rowBegin() const { return j_begin; }
+    int rowEnd() const { return j_end; }
+    int getHalo() const { return halo; }
+    int getTracerCount() const { return (int)dye.size() - 3; }
+
+    void setViscosity(float visc) { viscosity = visc; }
+    void setDiffusion(float diff) { diffusion = diff; }
+    float getViscosity() const { return viscosity; }
+    float getDiffusion() const { return diffusion; }
+
+    // Simulation と同じ範囲の確認と書き込み（このランクの行と袖に掛かる部分だけを書く）
+    void add_force(int X, int Y, int N, float u, float v);
+    void stamp(int X, int Y, int W, int H, int N, float R, float G, float B);
+    void sink(int X, int Y, int W, int H, int N);
+    void stampTracer(int id, int X, int Y, int W, int H, int N, float amount);
+    void reset(int N);
+
+    // 時間 dt だけ進める（全てのランクで呼ぶ）
+    // 速度が有限でない場合は、何も変えずに std::runtime_error を投げる（全てのランクで揃って投げる）
+    void update(int N, float dt);
+
+    /**
+     * 全てのランクの色を集めて、ランク 0 の dst に readDensity(N, float*) と同じ並びで書き出す（全てのランクで呼ぶ）
+     * ランク 0 以外では dst は使わない（nullptr でよい）
+     */
+    void gatherDensity(int N, float* dst);
+
+    std::uint64_t getStepCount() const { return step_count; }
+    // 直近の update の移流で必要だった袖の行数の最大値（halo を超えた分は中継して集めた）
+    int getLastHaloWidth() const { return last_width; }
+
+private:
+    // このランクの行の帯（全体の行番号 j で参照する）
+    struct Slab {
+        float* origin = nullptr;    // 全体の (0, 0) に当たる位置（持っている行 [row_lo, row_hi) だけを参照する）
+        int pitch = 0;              // 行の要素数（Grid2D と同じ）
+        int valid = 0;              // 隣のランクと一致している袖の行数
+        float& operator()(int i, int j) const { return origin[i + pitch * j]; }
+        float* row(int j) const { return origin + pitch * j; }
+    };
+
+    // 持っている全ての行（袖を含む）への要素ごとの処理（袖が一致していれば、処理した後も一致する）
+    void add_source(Slab& x, Slab& s, float dt);
+    void fill(Slab& x, float value);
+    // 最後の投影の圧力・発散 s を前ステップの値の場 x に写す
+    void copy_projection(Slab& x, const Slab& s);
+    // 袖の行数が width に足りなければ、隣のランクと width 行ずつ送り合う
+    void ensure_halo(Slab& x, int width);
+    void set_bnd(int b, Slab& x);
+    // 赤黒ガウス・ザイデル法（Simulation::red_black_sweep と gauss_seidel の RedBlackGaussSeidel と同じ演算）
+    void lin_solve(int b, Slab& x, Slab& x0, float a, float c, int iters);
+    void diffuse(int b, Slab& x, Slab& x0, float diff, float dt);
+    // 速度 (u + dt * su, v + dt * sv) で dt だけ移流するときの逆追跡の距離の全てのランクでの最大値（su, sv は省略可）
+    double advect_reach(Slab& u, Slab& v, Slab* su, Slab* sv, float dt);
+    // 距離 reach の移流で読む行数（reach + 1、有限でなければ全ての行）
+    int advect_width(double reach);
+    // x の持っている行と、上下 width 行を wide_rows に集め、全体の (0, 0) に当たる位置を返す
+    const float* exchange_wide(Slab& x, int width);
+    // 移流（d0 の上下 width 行を読む。halo 以下なら袖を送り合い、超えれば exchange_wide で集める）
+    void advect(int b, Slab& d, Slab& d0, Slab& u, Slab& v, float dt, int width);
+    void project(Slab& u, Slab& v, Slab& p, Slab& div);
+    void vel_step(float dt, int width);
+    void dens_step(float dt);
+    // 全体の行 j がこのランクの持つ行（袖を含む）か
+    bool has_row(int j) const { return j >= row_lo && j < row_hi; }
+
+    HaloTransport& comm;
+    int n;
+    int halo;
+    int j_begin, j_end;     // 持っている内部の行
+    int own_lo, own_hi;     // 書き込む行（最初と最後のランクは上下のゴースト行を含む）
+    int row_lo, row_hi;     // 記憶領域のある行（袖を含む）
+    int rank_below, rank_above;     // 隣のランク（いなければ -1）
+
+    FieldArena arena;
+    Slab u, v, u_prev, v_prev, pressure, divergence;
+    std::vector<Slab> dye;          // 色成分（赤・緑・青）とトレーサー
+    std::vector<Slab> dye_prev;
+    std::vector<float> gather_rows; // gatherDensity の受け取り用
+    std::vector<float, AlignedAllocator<float, 64>> wide_rows;  // exchange_wide で集めた行
+
+    float viscosity = 0.0f;
+    float diffusion = 0.001f;
+    AdvectKernel advect_fn = nullptr;
+    std::uint64_t step_count = 0;
+    int last_width = 0;
+};
@@ -0,0 +1,166 @@
+//
+//  dye_storage.hpp
+//  2D-StableFluids
+//
+//  色とトレーサーの場（受動スカラー）の格納形式。
+//  格納形式はポリシー型で表し、value_type で格子の要素を、load / store で fp32 との変換を与える。
+//  カーネルは要素を読むときに load で計算用の型に直し、計算はシミュレーションの精度（BasicSimulation の Real）
+//  で行ってから store で書き戻す。
+//  16 ビットの形式では格子の大きさとメモリ転送量が半分になる（表示は 8 ビットなので精度は足りる）。
+//    - Float32Storage: float のまま（既定。load / store は何もしないので、従来の結果とビット単位で一致する）
+//    - Float64Storage: double のまま（BasicSimulation<double> の既定）
+//    - Float16Storage: IEEE 754 半精度（_Float16 と同じビット列。F16C のない環境で _Float16 を使うと
+//                      変換がライブラリ呼び出しになるため、整数演算で変換する）
+//    - BFloat16Storage: bfloat16（float の上位 16 ビット、最近接偶数丸め）。範囲は float と同じで仮数は 8 ビット
+//    - Fixed16Storage: 符号なし 16 ビット固定小数点（既定は小数部 8 ビット: 0〜256 を 1/256 刻み）
+//                      負の値は 0 に、範囲を超える値は最大値に飽和する（色とトレーサーは負にならない）
+//                      刻みが一様なので、拡散の反復のたびに丸めると 1/512 未満の裾が消えて色が減り続ける。
+//                      そのため拡散は Real の作業領域で解き、1ステップに1度だけ store_carry で丸めて書き戻す
+//
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "grid2d.hpp"
+#include "pixel_format.hpp"
+
+enum class DyeStorage {
+    Float32,
+    Float16,
+    BFloat16,
+    Fixed16,
+    Float64,
+};
+
+inline const char* dye_storage_name(DyeStorage s){
+    switch (s){
+        case DyeStorage::Float32: return "fp32";
+        case DyeStorage::Float16: return "fp16";
+        case DyeStorage::BFloat16: return "bf16";
+        case DyeStorage::Fixed16: return "fixed16";
+        case DyeStorage::Float64: return "fp64";
+    }
+    return "unknown";
+}
+
+struct Float32Storage {
+    using value_type = float;
+    static float load(float v) { return v; }
+    static float store(float f) { return f; }
+};
+
+struct Float64Storage {
+    using value_type = double;
+    static double load(double v) { return v; }
+    static double store(double f) { return f; }
+};
+
+// 変換は分岐の少ない形にしている（カーネルの内側で毎回呼ぶため）
+// 結果は pixel_format.hpp の float_to_half / half_to_float と同じ（NaN だけは静かな NaN 1つにまとめる）
+struct Float16Storage {
+    using value_type = std::uint16_t;
+    static float load(value_type v){
+        std::uint32_t x = (std::uint32_t)(v & 0x7fffu) << 13;
+        std::uint32_t exp = x & 0x0f800000u;
+        x += (127 - 15) << 23;              // 指数のバイアスを付け替える
+        float f;
+        if (exp == 0x0f800000u){
+            x += (128 - 16) << 23;          // 無限大と NaN
+            std::memcpy(&f, &x, sizeof(f));
+        } else if (exp == 0){
+            x += 1u << 23;                  // 非正規化数: 暗黙の1を足した値から 2^-14 を引く
+            std::memcpy(&f, &x, sizeof(f));
+            f -= 6.103515625e-05f;
+        } else {
+            std::memcpy(&f, &x, sizeof(f));
+        }
+        return (v & 0x8000u) ? -f : f;
+    }
+    static value_type store(float f){
+        std::uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        std::uint32_t sign = x & 0x80000000u;
+        x ^= sign;
+        std::uint32_t h;
+        if (x >= (127u + 16u) << 23){
+            h = x > 0x7f800000u ? 0x7e00u : 0x7c00u;   // NaN、無限大（表せない大きさを含む）
+        } else if (x < (127u - 14u) << 23){
+            // 非正規化数: 仮数の最下位が 2^-24 になる数を足し、浮動小数点の丸め（最近接偶数）に任せる
+            const std::uint32_t magic_bits = (127u - 15u + 23u - 10u + 1u) << 23;
+            float magic, g;
+            std::memcpy(&magic, &magic_bits, sizeof(magic));
+            std::memcpy(&g, &x, sizeof(g));
+            g += magic;
+            std::memcpy(&h, &g, sizeof(h));
+            h -= magic_bits;
+        } else {
+            std::uint32_t odd = (x >> 13) & 1u;
+            x += ((std::uint32_t)(15 - 127) << 23) + 0xfffu + odd;  // 最近接偶数丸め
+            h = x >> 13;
+        }
+        return (value_type)(h | (sign >> 16));
+    }
+};
+
+struct BFloat16Storage {
+    using value_type = std::uint16_t;
+    static float load(value_type v){
+        std::uint32_t x = (std::uint32_t)v << 16;
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+    static value_type store(float f){
+        std::uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        if ((x & 0x7fffffffu) > 0x7f800000u){
+            return (value_type)((x >> 16) | 0x40u);     // NaN は静かな NaN のまま残す
+        }
+        x += 0x7fffu + ((x >> 16) & 1u);    // 最近接偶数丸め（溢れたら無限大になる）
+        return (value_type)(x >> 16);
+    }
+};
+
+template <int FracBits = 8>
+struct Fixed16Storage {
+    using value_type = std::uint16_t;
+    static constexpr float kScale = (float)(1 << FracBits);
+    static float load(value_type v) { return v * (1.0f / kScale); }
+    static value_type store(float f){
+        float x = f * kScale + 0.5f;
+        if (!(x > 0.0f)) return 0;          // 負の値と NaN
+        if (x >= 65535.0f) return 65535;
+        return (value_type)x;
+    }
+    // 誤差を送りながら丸める: f + carry を丸め、丸めで失った分を carry に返す
+    // 行の順に呼ぶと、丸めた値の総和が元の値の総和から 1/kScale 未満しかずれない（小さな値も平均では残る）
+    static value_type store_carry(float f, float& carry){
+        float want = f + carry;
+        value_type q = store(want);
+        carry = want - load(q);
+        return q;
+    }
+};
+
+// 固定小数点の格納形式か（拡散を Real の作業領域で解くかどうかの判定に使う）
+template <typename S>
+struct is_fixed_point_storage : std::false_type {};
+template <int FracBits>
+struct is_fixed_point_storage<Fixed16Storage<FracBits>> : std::true_type {};
+
+// 色とトレーサーの場（チャンネルは r, g, b, トレーサーの順）
+template <typename S>
+struct DyeFields {
+    using storage = S;
+    using value_type = typename S::value_type;
+    std::vector<Grid2D<value_type>> cur;    // 現在の値
+    std::vector<Grid2D<value_type>> prev;   // 前ステップの値（ソース項）
+    // 複数チャンネルの処理に渡すポインタ配列（cur, prev はこれ以降サイズを変えないので、ポインタは有効なまま）
+    std::vector<Grid2D<value_type>*> cur_list;
+    std::vector<Grid2D<value_type>*> prev_list;
+
+    int channels() const { return (int)cur.size(); }
+};
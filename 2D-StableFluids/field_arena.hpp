@@ -0,0 +1,183 @@
+//
+//  field_arena.hpp
+//  2D-StableFluids
+//
+//  格子の記憶領域をまとめて確保するアリーナと、現在値・前ステップ値の組を入れ替えるピンポンバッファ。
+//  - FieldArena は一度だけ大きな領域を確保し、そこから Grid2D を切り出す（切り出した格子は領域を所有しない）
+//    Simulation の全ての場が1つの連続した領域に並ぶので、確保の回数と NUMA ノード上の配置が予測できる
+//    setDeferredFill(true) の間に切り出した格子は値を書かずに覚えておき、fill_deferred で行の区間ごとに書く
+//    （各スレッドが自分の担当する行を最初に書く first-touch で、ページをそのスレッドの NUMA ノードに置く）
+//  - PingPong は格子そのものではなく、格子へのポインタの役割（書き込み先 / 読み出し元）を入れ替える
+//
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "grid2d.hpp"
+
+class FieldArena {
+public:
+    static constexpr std::size_t kAlignment = 4096;    // 領域の先頭はページ境界に揃える
+
+    FieldArena() = default;
+    explicit FieldArena(std::size_t bytes) { reserve(bytes); }
+
+    // bytes バイトの領域を確保する（それまでに切り出した格子は無効になる）
+    void reserve(std::size_t bytes){
+        std::size_t rounded = round_up(bytes);
+        void* p = rounded ? std::aligned_alloc(kAlignment, rounded) : nullptr;
+        if (rounded && !p) throw std::bad_alloc();
+        base = std::unique_ptr<unsigned char, Free>(static_cast<unsigned char*>(p), Free(true));
+        capacity_ = rounded;
+        used_ = 0;
+    }
+    // 外部の領域 memory（kAlignment バイト境界、bytes バイト）から切り出す（領域は所有しない）
+    // 複数の Simulation の場を1つの連続した領域に並べる場合に使う
+    void attach(void* memory, std::size_t bytes){
+        base = std::unique_ptr<unsigned char, Free>(static_cast<unsigned char*>(memory), Free(false));
+        capacity_ = bytes;
+        used_ = 0;
+    }
+    // reserve に渡す大きさを kAlignment の倍数に切り上げたもの
+    static std::size_t round_up(std::size_t bytes) { return (bytes + kAlignment - 1) / kAlignment * kAlignment; }
+
+    // 一辺 n の Grid2D<T> 1枚分のバイト数（格子の境界に合わせて切り上げる）
+    template <typename T>
+    static std::size_t bytes_for(int n){
+        std::size_t a = Grid2D<T>::kAlignment;
+        return (Grid2D<T>::storage_size(n) * sizeof(T) + a - 1) / a * a;
+    }
+
+    // 一辺 n の格子を切り出し、value で埋める
+    template <typename T>
+    Grid2D<T> take(int n, T value = T()){
+        static_assert(std::is_trivially_copyable_v<T>, "arena fields must be trivially copyable");
+        T* p = static_cast<T*>(take_bytes(bytes_for<T>(n)));
+        Grid2D<T> g(p, n);
+        if (defer_fill){
+            static_assert(sizeof(T) <= sizeof(Deferred::value), "deferred fill value is too large");
+            Deferred d{ p, n, &fill_rows<T>, {} };
+            std::memcpy(d.value, &value, sizeof(T));
+            deferred.push_back(d);
+        } else {
+            g.fill(value);
+        }
+        return g;
+    }
+
+    // true の間に take した格子は値を書かずに覚えておく（領域のページにはまだ触れない）
+    void setDeferredFill(bool on) { defer_fill = on; }
+    bool getDeferredFill() const { return defer_fill; }
+    /**
+     * 覚えておいた格子のうち、行全体を rows 等分したときの区間 [lo, hi) に当たる行を take の value で埋める
+     * 各格子の行（ゴースト行を含む n + 2 行）を同じ割合で分けるので、大きさの違う格子（マルチグリッドの粗い格子）も
+     * 区間を受け持つスレッドが同じ割合の行を書く。全ての区間を埋めた後に clear_deferred を呼ぶ
+     */
+    void fill_deferred(int lo, int hi, int rows) const{
+        for (const Deferred& d : deferred){
+            d.fill(d, lo, hi, rows);
+        }
+    }
+    void clear_deferred() { deferred.clear(); }
+
+    // count 要素の配列を切り出す（値は不定）
+    template <typename T>
+    T* take_array(std::size_t count){
+        static_assert(std::is_trivially_copyable_v<T>, "arena arrays must be trivially copyable");
+        std::size_t a = Grid2D<T>::kAlignment;
+        return static_cast<T*>(take_bytes((count * sizeof(T) + a - 1) / a * a));
+    }
+
+    std::size_t capacity() const { return capacity_; }
+    std::size_t used() const { return used_; }
+    const void* data() const { return base.get(); }
+
+private:
+    // 値を書くのを後回しにした格子
+    struct Deferred {
+        void* base;
+        int n;
+        void (*fill)(const Deferred&, int lo, int hi, int rows);
+        alignas(8) unsigned char value[8];
+    };
+
+    template <typename T>
+    static void fill_rows(const Deferred& d, int lo, int hi, int rows){
+        T value;
+        std::memcpy(&value, d.value, sizeof(T));
+        T* base = static_cast<T*>(d.base);
+        const long long total = d.n + 2;
+        const int j_lo = (int)(total * lo / rows);
+        const int j_hi = (int)(total * hi / rows);
+        if (j_lo >= j_hi) return;
+        // 先頭のずらしは 0 行目と一緒に書く
+        const std::size_t offset = Grid2D<T>::kLanes - 1;
+        const std::size_t pitch = Grid2D<T>::pitch_for(d.n);
+        T* first = j_lo == 0 ? base : base + offset + pitch * j_lo;
+        T* last = base + offset + pitch * j_hi;
+        std::fill(first, last, value);
+    }
+
+    void* take_bytes(std::size_t bytes){
+        if (used_ + bytes > capacity_) throw std::bad_alloc();
+        void* p = base.get() + used_;
+        used_ += bytes;
+        return p;
+    }
+
+    struct Free {
+        Free() : owned(true) {}
+        explicit Free(bool owns) : owned(owns) {}
+        void operator()(unsigned char* p) const { if (owned) std::free(p); }
+        bool owned;     // false なら attach した外部の領域（解放しない）
+    };
+    std::unique_ptr<unsigned char, Free> base;
+    std::size_t capacity_ = 0;
+    std::size_t used_ = 0;
+    bool defer_fill = false;
+    std::vector<Deferred> deferred;
+};
+
+// 書き込み先（cur）と読み出し元（prev）の組を最大 MaxChannels チャンネル分まとめて扱う
+// flip() はポインタを入れ替えるだけなので、格子の中身の複製も確保も起きない
+template <typename T, int MaxChannels = 16>
+class PingPong {
+public:
+    PingPong(Grid2D<T>& cur, Grid2D<T>& prev) : count(1){
+        cur_[0] = &cur;
+        prev_[0] = &prev;
+    }
+    PingPong(int channels, Grid2D<T>* const* cur, Grid2D<T>* const* prev) : count(channels){
+        for (int c = 0; c < count; ++c){
+            cur_[c] = cur[c];
+            prev_[c] = prev[c];
+        }
+    }
+
+    int channels() const { return count; }
+    Grid2D<T>& cur(int c = 0) const { return *cur_[c]; }
+    Grid2D<T>& prev(int c = 0) const { return *prev_[c]; }
+    // 複数チャンネルのカーネルに渡すポインタ配列
+    Grid2D<T>* const* curs() const { return cur_; }
+    Grid2D<T>* const* prevs() const { return prev_; }
+
+    // 書き込み先と読み出し元の役割を入れ替える（直前に書いた場が次の読み出し元になる）
+    void flip(){
+        for (int c = 0; c < count; ++c){
+            std::swap(cur_[c], prev_[c]);
+        }
+    }
+
+private:
+    Grid2D<T>* cur_[MaxChannels];
+    Grid2D<T>* prev_[MaxChannels];
+    int count;
+};
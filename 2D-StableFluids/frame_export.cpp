@@ -0,0 +1,325 @@
+//
+//  frame_export.cpp
+//  2D-StableFluids
+//
+
+#include "frame_export.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <stdexcept>
+
+#ifdef SF_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "logger.hpp"
+
+namespace {
+
+// path の最初の %d（%05d のような幅の指定を含む）の位置と長さ、幅。なければ false
+bool find_placeholder(const std::string& path, std::size_t& pos, std::size_t& len, int& width){
+    for (std::size_t k = 0; k + 1 < path.size(); ++k){
+        if (path[k] != '%') continue;
+        std::size_t e = k + 1;
+        int w = 0;
+        while (e < path.size() && path[e] >= '0' && path[e] <= '9'){
+            w = w * 10 + (path[e] - '0');
+            ++e;
+        }
+        if (e < path.size() && path[e] == 'd'){
+            pos = k;
+            len = e + 1 - k;
+            width = std::min(w, 20);
+            return true;
+        }
+    }
+    return false;
+}
+
+// フレーム index のファイル名
+std::string frame_path(const std::string& pattern, std::uint64_t index){
+    std::size_t pos = 0, len = 0;
+    int width = 0;
+    find_placeholder(pattern, pos, len, width);
+    std::string num = std::to_string(index);
+    if ((int)num.size() < width){
+        num.insert(0, width - num.size(), '0');
+    }
+    return pattern.substr(0, pos) + num + pattern.substr(pos + len);
+}
+
+bool write_file(const std::string& path, const unsigned char* data, std::size_t bytes){
+    std::FILE* fp = std::fopen(path.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = std::fwrite(data, 1, bytes, fp) == bytes;
+    return std::fclose(fp) == 0 && ok;
+}
+
+const std::array<std::uint32_t, 256>& crc_table(){
+    static const std::array<std::uint32_t, 256> table = []{
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t k = 0; k < 256; ++k){
+            std::uint32_t c = k;
+            for (int b = 0; b < 8; ++b){
+                c = (c & 1u) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[k] = c;
+        }
+        return t;
+    }();
+    return table;
+}
+
+std::uint32_t crc32(const unsigned char* p, std::size_t bytes){
+    const auto& t = crc_table();
+    std::uint32_t c = 0xFFFFFFFFu;
+    for (std::size_t k = 0; k < bytes; ++k){
+        c = t[(c ^ p[k]) & 0xFFu] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+void put_u32(std::vector<unsigned char>& out, std::uint32_t v){
+    out.push_back((unsigned char)(v >> 24));
+    out.push_back((unsigned char)(v >> 16));
+    out.push_back((unsigned char)(v >> 8));
+    out.push_back((unsigned char)v);
+}
+
+// PNG のチャンク（長さ・種類・内容・CRC）
+void put_chunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, std::size_t bytes){
+    put_u32(out, (std::uint32_t)bytes);
+    std::size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + bytes);
+    put_u32(out, crc32(out.data() + start, out.size() - start));
+}
+
+#ifndef SF_HAVE_ZLIB
+// 無圧縮のブロックだけの zlib 形式
+void zlib_stored(const std::vector<unsigned char>& raw, std::vector<unsigned char>& out){
+    out.clear();
+    out.push_back(0x78);
+    out.push_back(0x01);
+    std::size_t k = 0;
+    do {
+        std::size_t len = std::min<std::size_t>(65535, raw.size() - k);
+        bool last = k + len == raw.size();
+        out.push_back(last ? 1 : 0);
+        out.push_back((unsigned char)len);
+        out.push_back((unsigned char)(len >> 8));
+        out.push_back((unsigned char)~len);
+        out.push_back((unsigned char)(~len >> 8));
+        out.insert(out.end(), raw.begin() + k, raw.begin() + k + len);
+        k += len;
+    } while (k < raw.size());
+    std::uint32_t a = 1, b = 0;
+    for (unsigned char c : raw){
+        a = (a + c) % 65521u;
+        b = (b + a) % 65521u;
+    }
+    put_u32(out, (b << 16) | a);
+}
+#endif
+
+} // namespace
+
+const char* frame_format_name(FrameFormat f){
+    switch (f){
+        case FrameFormat::Raw: return "raw";
+        case FrameFormat::Png: return "png";
+        case FrameFormat::Pipe: return "pipe";
+    }
+    return "unknown";
+}
+
+// 各行の前にフィルタ Up（上の行との差）を付ける。色の場は滑らかなので、差を取ると圧縮が効きやすい
+void encode_png(const unsigned char* rgb, int width, int rows, int level, std::vector<unsigned char>& out){
+    const std::size_t stride = (std::size_t)width * 3;
+    std::vector<unsigned char> raw((stride + 1) * rows);
+    for (int r = 0; r < rows; ++r){
+        const unsigned char* src = rgb + stride * (rows - 1 - r);  // 画像の上の行から
+        const unsigned char* above = r > 0 ? rgb + stride * (rows - r) : nullptr;
+        unsigned char* dst = raw.data() + (stride + 1) * r;
+        dst[0] = 2;
+        for (std::size_t k = 0; k < stride; ++k){
+            dst[1 + k] = (unsigned char)(src[k] - (above ? above[k] : 0));
+        }
+    }
+
+    std::vector<unsigned char> z;
+#ifdef SF_HAVE_ZLIB
+    uLongf zbytes = compressBound((uLong)raw.size());
+    z.resize(zbytes);
+    if (compress2(z.data(), &zbytes, raw.data(), (uLong)raw.size(), std::clamp(level, 0, 9)) != Z_OK){
+        throw std::runtime_error("png compression failed");
+    }
+    z.resize(zbytes);
+#else
+    (void)level;
+    zlib_stored(raw, z);
+#endif
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.assign(signature, signature + 8);
+    std::vector<unsigned char> ihdr;
+    put_u32(ihdr, (std::uint32_t)width);
+    put_u32(ihdr, (std::uint32_t)rows);
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });     // 8 ビット、RGB、deflate、フィルタ方式0、インターレースなし
+    put_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+    put_chunk(out, "IDAT", z.data(), z.size());
+    put_chunk(out, "IEND", nullptr, 0);
+}
+
+FrameExporter::FrameExporter(int N, const FrameExportOptions& options) : n(N), opt(options) {
+    if (N <= 0 || opt.path.empty()){
+        throw std::invalid_argument("frame export requires a positive size and an output path");
+    }
+    std::size_t pos, len;
+    int width;
+    if (opt.format != FrameFormat::Pipe && !find_placeholder(opt.path, pos, len, width)){
+        throw std::invalid_argument("frame path must contain a frame number such as %05d: " + opt.path);
+    }
+    opt.queue_depth = std::max(1, opt.queue_depth);
+    // パイプにはフレームの順に書く必要があるので、書き出しは1スレッドで行う
+    opt.workers = opt.format == FrameFormat::Pipe ? 1 : std::max(1, opt.workers);
+    opt.fps = std::max(1, opt.fps);
+
+    if (opt.format == FrameFormat::Pipe){
+        if (opt.path.find('\'') != std::string::npos){
+            throw std::invalid_argument("video path must not contain a single quote: " + opt.path);
+        }
+        std::string size = std::to_string(N) + "x" + std::to_string(N);
+        std::string cmd = opt.ffmpeg + " -y -loglevel error -f rawvideo -pix_fmt rgb24 -s " + size +
+                          " -framerate " + std::to_string(opt.fps) + " -i - " + opt.ffmpeg_args + " '" + opt.path + "'";
+        pipe = ::popen(cmd.c_str(), "w");
+        if (!pipe){
+            throw std::runtime_error("cannot start " + opt.ffmpeg);
+        }
+    }
+
+    frames.resize(opt.queue_depth);
+    for (Frame& f : frames){
+        f.pixels.resize((std::size_t)N * N * pixel_size(pixelFormat()));
+        free_frames.push_back(&f);
+    }
+    for (int t = 0; t < opt.workers; ++t){
+        workers.emplace_back([this]{ run(); });
+    }
+}
+
+FrameExporter::~FrameExporter(){
+    finish();
+}
+
+// 空いている領域を取る（なければ空くまで待つか、drop_when_full では nullptr を返す）
+FrameExporter::Frame* FrameExporter::acquire(){
+    std::unique_lock<std::mutex> lock(mtx);
+    if (finished){
+        throw std::logic_error("FrameExporter::submit after finish");
+    }
+    if (free_frames.empty()){
+        if (opt.drop_when_full){
+            ++counters.dropped;
+            return nullptr;
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        cv.wait(lock, [this]{ return !free_frames.empty(); });
+        counters.stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+    Frame* f = free_frames.back();
+    free_frames.pop_back();
+    f->index = next_index++;
+    ++counters.submitted;
+    return f;
+}
+
+void FrameExporter::enqueue(Frame* f){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        ready.push_back(f);
+    }
+    cv.notify_all();
+}
+
+bool FrameExporter::finish(){
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (finished) return ok;
+        cv.wait(lock, [this]{ return ready.empty() && busy == 0; });
+        stopping = true;
+        finished = true;
+    }
+    cv.notify_all();
+    for (std::thread& t : workers){
+        t.join();
+    }
+    workers.clear();
+    if (pipe){
+        int status = ::pclose(pipe);
+        pipe = nullptr;
+        if (status != 0){
+            SF_LOG_ERROR("ffmpeg exited with status {}", status);
+            std::lock_guard<std::mutex> lock(mtx);
+            ok = false;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    return ok;
+}
+
+FrameExportStats FrameExporter::stats() const{
+    std::lock_guard<std::mutex> lock(mtx);
+    return counters;
+}
+
+// ワーカースレッド: 書き出し待ちのフレームを submit の順に取り出して書く
+void FrameExporter::run(){
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true){
+        cv.wait(lock, [this]{ return !ready.empty() || stopping; });
+        if (ready.empty()) return;
+        Frame* f = ready.front();
+        ready.pop_front();
+        ++busy;
+        lock.unlock();
+        bool success = write_frame(*f);
+        lock.lock();
+        if (success){
+            ++counters.written;
+        } else {
+            ++counters.failed;
+            ok = false;
+        }
+        free_frames.push_back(f);
+        --busy;
+        cv.notify_all();
+    }
+}
+
+bool FrameExporter::write_frame(Frame& f){
+    try {
+        switch (opt.format){
+            case FrameFormat::Raw:
+                if (write_file(frame_path(opt.path, f.index), f.pixels.data(), f.pixels.size())) return true;
+                break;
+            case FrameFormat::Png:
+                encode_png(f.pixels.data(), n, n, opt.png_level, f.encoded);
+                if (write_file(frame_path(opt.path, f.index), f.encoded.data(), f.encoded.size())) return true;
+                break;
+            case FrameFormat::Pipe: {
+                // ffmpeg の rawvideo は上の行から
+                const std::size_t stride = (std::size_t)n * 3;
+                for (int r = n - 1; r >= 0; --r){
+                    if (std::fwrite(f.pixels.data() + stride * r, 1, stride, pipe) != stride) return false;
+                }
+                return true;
+            }
+        }
+    } catch (const std::exception&){
+    }
+    SF_LOG_ERROR("cannot write frame {}", f.index);
+    return false;
+}
@@ -0,0 +1,120 @@
+//
+//  frame_export.hpp
+//  2D-StableFluids
+//
+//  色の場をフレームとして書き出す（ウィンドウなしでの連番画像・動画の作成用）。
+//  - Raw: readDensity(RGB32F) の内容をそのまま1フレーム1ファイルに書く（N * N * 3 個の float、行 j = 1 から）
+//  - Png: 8 ビットの RGB の PNG を1フレーム1ファイルに書く（画像の上が j = N。ビューアと同じ向き）
+//  - Pipe: RGB24 の生データを ffmpeg の標準入力に流し、1つの動画にする（向きは Png と同じ）
+//
+//  submit は呼び出し側スレッドで色の場をフレームの領域に写すだけで、PNG の圧縮とファイル・パイプへの書き出しは
+//  ワーカースレッドで行う。フレームの領域は queue_depth 個だけで、全て使用中なら submit は空くまで待つ
+//  （drop_when_full では待たずにそのフレームを捨てる）ので、書き出しが追いつかなくてもメモリは増えない。
+//
+
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pixel_format.hpp"
+
+enum class FrameFormat {
+    Raw,    // float の RGB をそのまま書く
+    Png,    // 8 ビット RGB の PNG の連番
+    Pipe,   // RGB24 を ffmpeg に渡して動画にする
+};
+
+const char* frame_format_name(FrameFormat f);
+
+// フレームの書き出しの設定
+struct FrameExportOptions {
+    FrameFormat format = FrameFormat::Png;
+    // Raw / Png: ファイル名（最初の %d または %05d などをフレーム番号に置き換える）、Pipe: 動画の出力先
+    std::string path;
+    int workers = 2;            // 圧縮と書き出しを行うスレッド数（Pipe では順番に書くので実質1つ）
+    int queue_depth = 4;        // 書き出し待ちにできるフレーム数（フレームの領域の数）
+    bool drop_when_full = false;    // 全ての領域が使用中のとき、待たずにフレームを捨てる
+    int png_level = 1;          // PNG の圧縮レベル（0〜9、zlib なしでビルドした場合は常に無圧縮）
+    std::string ffmpeg = "ffmpeg";  // Pipe で起動するコマンド
+    std::string ffmpeg_args = "-c:v libx264 -pix_fmt yuv420p";  // 出力側のエンコーダーの指定
+    int fps = 30;
+};
+
+// 書き出しの統計
+struct FrameExportStats {
+    std::uint64_t submitted = 0;    // submit で受け付けたフレーム数
+    std::uint64_t written = 0;      // 書き出したフレーム数
+    std::uint64_t dropped = 0;      // 領域が空いていなかったので捨てたフレーム数
+    std::uint64_t failed = 0;       // 書き出しに失敗したフレーム数
+    double stall_seconds = 0.0;     // submit が領域の空きを待った時間の合計
+};
+
+class FrameExporter {
+public:
+    /**
+     * 一辺 N の格子のフレームを書き出す
+     * Pipe では ffmpeg を起動する（起動できない場合や設定が不正な場合は std::runtime_error / std::invalid_argument）
+     * Pipe を使う場合、ffmpeg が途中で終了したときにプロセスが止まらないよう、呼び出し側で SIGPIPE を無視しておく
+     */
+    FrameExporter(int N, const FrameExportOptions& opt);
+    ~FrameExporter();   // finish と同じ
+
+    FrameExporter(const FrameExporter&) = delete;
+    FrameExporter& operator=(const FrameExporter&) = delete;
+
+    // sim（BasicSimulation）の色の場を1フレームとして書き出す。捨てた場合は false
+    template <typename Sim>
+    bool submit(const Sim& sim){
+        Frame* f = acquire();
+        if (!f) return false;
+        sim.readDensity(n, pixelFormat(), f->pixels.data());
+        enqueue(f);
+        return true;
+    }
+
+    // 書き出し待ちのフレームを全て書き出し、ffmpeg を終了させる（全て成功したら true）
+    bool finish();
+
+    FrameExportStats stats() const;
+    // submit で写す画素フォーマット（Raw は RGB32F、それ以外は RGB8）
+    PixelFormat pixelFormat() const { return opt.format == FrameFormat::Raw ? PixelFormat::RGB32F : PixelFormat::RGB8; }
+
+private:
+    struct Frame {
+        std::vector<unsigned char> pixels;
+        std::vector<unsigned char> encoded;     // PNG の作業領域
+        std::uint64_t index = 0;
+    };
+
+    Frame* acquire();
+    void enqueue(Frame* f);
+    void run();
+    bool write_frame(Frame& f);
+
+    int n;
+    FrameExportOptions opt;
+    std::vector<Frame> frames;
+    std::vector<Frame*> free_frames;
+    std::deque<Frame*> ready;           // 書き出し待ち（submit の順）
+
+    std::FILE* pipe = nullptr;
+    std::uint64_t next_index = 0;       // 次に submit するフレームの番号（Pipe はワーカーを1つにして submit の順に書く）
+
+    mutable std::mutex mtx;
+    std::condition_variable cv;         // ready・free_frames・busy・stopping の変化
+    int busy = 0;                       // ワーカーが処理中のフレーム数
+    bool stopping = false;
+    bool finished = false;
+    bool ok = true;
+    FrameExportStats counters;
+    std::vector<std::thread> workers;
+};
+
+// PNG（8 ビット RGB、上下を反転して上の行から）にする。rgb は下の行から rows 行、1行 width * 3 バイト
+void encode_png(const unsigned char* rgb, int width, int rows, int level, std::vector<unsigned char>& out);
@@ -0,0 +1,164 @@
+//
+//  grid2d.hpp
+//  2D-StableFluids
+//
+//  ゴーストセル1層付きの2次元格子。
+//  (i, j) は i が連続したメモリ方向（行内）、j が行の番号で、0 と n+1 がゴーストセル。
+//  - 記憶領域は 64 バイト境界に揃えて確保する
+//  - 行の長さ（pitch）は SIMD 幅（64 バイト分の要素数）の倍数に切り上げる
+//  - 先頭にずらしを入れ、全ての行で内部セル (1, j) が 64 バイト境界に来るようにする
+//
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+// 指定した境界に揃えてメモリを確保するアロケータ
+template <typename T, std::size_t Align>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Align>; };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align>&) noexcept {}
+
+    T* allocate(std::size_t n){
+        std::size_t bytes = (n * sizeof(T) + Align - 1) / Align * Align;
+        void* p = std::aligned_alloc(Align, bytes);
+        if (!p) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, std::size_t) noexcept { std::free(p); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Align>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Align>&) const noexcept { return false; }
+};
+
+// 格子の一部（内部セル・ゴースト層など）を指す参照
+template <typename T>
+struct GridView {
+    T* origin = nullptr;    // ビューの (0, 0) に当たる要素
+    int pitch = 0;          // 行の要素数
+    int width = 0;          // i 方向のセル数
+    int height = 0;         // j 方向のセル数
+
+    T& operator()(int i, int j) const { return origin[i + pitch * j]; }
+    T* row(int j) const { return origin + pitch * j; }
+};
+
+template <typename T>
+class Grid2D {
+public:
+    static constexpr int kAlignment = 64;                           // 記憶領域の境界（バイト）
+    static constexpr int kLanes = std::max<int>(1, kAlignment / (int)sizeof(T));   // 64 バイトに入る要素数
+
+    // 一辺 n の格子の行の要素数
+    static int pitch_for(int n) { return (n + 2 + kLanes - 1) / kLanes * kLanes; }
+    // 一辺 n の格子に必要な要素数（先頭のずらしを含む。外部の領域を使う場合の大きさ）
+    static std::size_t storage_size(int n) { return (std::size_t)(kLanes - 1) + (std::size_t)pitch_for(n) * (n + 2); }
+
+    Grid2D() = default;
+    // n: 内部セルの一辺
+    explicit Grid2D(int n, T value = T()) { resize(n, value); }
+    // 外部の領域 base（kAlignment バイト境界、storage_size(n) 要素）を使う格子（領域は所有しない）
+    Grid2D(T* base, int n) : base_(base), n_(n), pitch_(pitch_for(n)), offset_(kLanes - 1) {}
+
+    // 複製は常に自前の領域を確保する
+    Grid2D(const Grid2D& o) : storage_(o.base_, o.base_ + o.extent()), n_(o.n_), pitch_(o.pitch_), offset_(o.offset_){
+        base_ = storage_.data();
+    }
+    // 同じ大きさの格子への代入は値だけを写す（外部の領域を使う格子でも確保は発生しない）
+    Grid2D& operator=(const Grid2D& o){
+        if (this == &o) return *this;
+        if (base_ && n_ == o.n_){
+            std::copy(o.base_, o.base_ + o.extent(), base_);
+        } else {
+            *this = Grid2D(o);
+        }
+        return *this;
+    }
+    // ムーブは領域の付け替えだけを行う（std::swap は2つの格子の領域を交換するだけになる）
+    Grid2D(Grid2D&& o) noexcept { *this = std::move(o); }
+    Grid2D& operator=(Grid2D&& o) noexcept {
+        storage_ = std::move(o.storage_);
+        base_ = o.base_;
+        n_ = o.n_;
+        pitch_ = o.pitch_;
+        offset_ = o.offset_;
+        o.base_ = nullptr;
+        o.n_ = o.pitch_ = o.offset_ = 0;
+        return *this;
+    }
+
+    void resize(int n, T value = T()){
+        if (base_ && !owns() && n == n_){
+            fill(value);    // 外部の領域はそのまま使う
+            return;
+        }
+        n_ = n;
+        pitch_ = pitch_for(n);
+        // (1, j) が境界に揃うよう、先頭に kLanes - 1 要素分のずらしを入れる
+        offset_ = kLanes - 1;
+        storage_.assign(storage_size(n), value);
+        base_ = storage_.data();
+    }
+
+    int n() const { return n_; }
+    int pitch() const { return pitch_; }
+    // ゴーストセルと行末の詰め物を含めた要素数（data() から数える）
+    std::size_t size() const { return (std::size_t)pitch_ * (n_ + 2); }
+    // 自前の領域を持っているか（false なら外部の領域を参照している）
+    bool owns() const { return !storage_.empty(); }
+    // 同じ領域を参照する（所有しない）格子
+    Grid2D alias() { return Grid2D(base_, n_); }
+
+    T& operator()(int i, int j) { return data()[i + pitch_ * j]; }
+    const T& operator()(int i, int j) const { return data()[i + pitch_ * j]; }
+    int index(int i, int j) const { return i + pitch_ * j; }
+    // index(i, j) で求めた一次元インデックスでのアクセス
+    T& operator[](int k) { return data()[k]; }
+    const T& operator[](int k) const { return data()[k]; }
+
+    // 領域の先頭（先頭のずらしを含む。外部の領域を使う格子では Grid2D(T*, int) に渡した base）
+    T* base() { return base_; }
+    const T* base() const { return base_; }
+    // (0, 0) の要素へのポインタ
+    T* data() { return base_ + offset_; }
+    const T* data() const { return base_ + offset_; }
+    // 行 j の (0, j) へのポインタ
+    T* row(int j) { return data() + pitch_ * j; }
+    const T* row(int j) const { return data() + pitch_ * j; }
+
+    // ゴーストセルと詰め物も含めて全て value にする
+    void fill(T value) { std::fill(base_, base_ + extent(), value); }
+
+    // 内部セル（ビューの (0, 0) が格子の (1, 1)）
+    GridView<T> interior() { return view(1, 1, n_, n_); }
+    // ゴースト層（角のセルは含まない）
+    GridView<T> ghost_bottom() { return view(1, 0, n_, 1); }
+    GridView<T> ghost_top() { return view(1, n_ + 1, n_, 1); }
+    GridView<T> ghost_left() { return view(0, 1, 1, n_); }
+    GridView<T> ghost_right() { return view(n_ + 1, 1, 1, n_); }
+
+private:
+    GridView<T> view(int i, int j, int w, int h){
+        return GridView<T>{ &(*this)(i, j), pitch_, w, h };
+    }
+    // 先頭のずらしを含めた要素数
+    std::size_t extent() const { return base_ ? (std::size_t)offset_ + size() : 0; }
+
+    std::vector<T, AlignedAllocator<T, kAlignment>> storage_;
+    T* base_ = nullptr;     // 領域の先頭（自前の storage_ または外部の領域）
+    int n_ = 0;
+    int pitch_ = 0;
+    int offset_ = 0;
+};
@@ -0,0 +1,82 @@
+//
+//  halo_transport.cpp
+//  2D-StableFluids
+//
+
+#include "halo_transport.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+LoopbackHub::LoopbackHub(int r) : ranks(r) {
+    if (r <= 0){
+        throw std::invalid_argument("loopback transport requires at least one rank");
+    }
+}
+
+void LoopbackHub::abort(){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopped = true;
+    }
+    cv.notify_all();
+}
+
+namespace {
+
+[[noreturn]] void throw_aborted(){
+    throw std::runtime_error("halo transport aborted by another rank");
+}
+
+} // namespace
+
+LoopbackTransport::LoopbackTransport(LoopbackHub& h, int r) : hub(h), self(r) {
+    if (r < 0 || r >= h.size()){
+        throw std::out_of_range("rank is out of range");
+    }
+}
+
+void LoopbackTransport::send(int peer, int tag, const void* data, std::size_t bytes){
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    {
+        std::lock_guard<std::mutex> lock(hub.mtx);
+        hub.mail[{ self, peer, tag }].emplace_back(p, p + bytes);
+    }
+    hub.cv.notify_all();
+    count_sent(bytes);
+}
+
+void LoopbackTransport::recv(int peer, int tag, void* data, std::size_t bytes){
+    std::unique_lock<std::mutex> lock(hub.mtx);
+    auto& box = hub.mail[{ peer, self, tag }];
+    hub.cv.wait(lock, [&]{ return !box.empty() || hub.stopped; });
+    if (box.empty()) throw_aborted();
+    std::vector<unsigned char> msg = std::move(box.front());
+    box.pop_front();
+    lock.unlock();
+    if (msg.size() != bytes){
+        throw std::runtime_error("halo message size mismatch: expected " + std::to_string(bytes) +
+                                 " bytes, received " + std::to_string(msg.size()));
+    }
+    std::memcpy(data, msg.data(), bytes);
+}
+
+double LoopbackTransport::allreduce_max(double value){
+    std::unique_lock<std::mutex> lock(hub.mtx);
+    if (hub.stopped) throw_aborted();
+    hub.reduce_value = hub.arrived == 0 ? value : std::max(hub.reduce_value, value);
+    if (++hub.arrived == hub.size()){
+        // 最後に来たランクが結果を確定し、待っているランクを起こす
+        hub.reduce_result = hub.reduce_value;
+        hub.arrived = 0;
+        ++hub.generation;
+        hub.cv.notify_all();
+        return hub.reduce_result;
+    }
+    unsigned long gen = hub.generation;
+    hub.cv.wait(lock, [&]{ return hub.generation != gen || hub.stopped; });
+    if (hub.generation == gen) throw_aborted();
+    return hub.reduce_result;
+}
@@ -0,0 +1,94 @@
+//
+//  halo_transport.hpp
+//  2D-StableFluids
+//
+//  領域分割（DistributedSimulation）でランク間の袖（halo）の行を送り合うための通信の口。
+//  通信の方式は HaloTransport を実装して差し替える（MPI なら send / recv / allreduce_max をそれぞれ
+//  MPI_Send（バッファ付き）/ MPI_Recv / MPI_Allreduce で実装する）。
+//  同梱の LoopbackTransport は1つのプロセスの中のスレッドをランクとして、共有メモリの郵便受けで受け渡す
+//  （1台の Linux マシンで領域分割の手順をそのまま動かして確かめるためのもの）。
+//
+
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+class HaloTransport {
+public:
+    virtual ~HaloTransport() = default;
+
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+    // peer に bytes バイトを送る（相手が受け取る前に戻る。同じ peer, tag の間では送った順に届く）
+    virtual void send(int peer, int tag, const void* data, std::size_t bytes) = 0;
+    // peer から tag のメッセージを受け取るまで待つ（bytes が送られた大きさと違う場合は std::runtime_error）
+    virtual void recv(int peer, int tag, void* data, std::size_t bytes) = 0;
+    // 全てのランクの value の最大値（全てのランクが同じ順で呼ぶ）
+    virtual double allreduce_max(double value) = 0;
+    // recv と allreduce_max は、通信が打ち切られた場合（LoopbackHub::abort など）は待ち続けずに std::runtime_error を投げる
+
+    // これまでに send で送ったバイト数とメッセージの数
+    std::uint64_t bytesSent() const { return bytes_sent; }
+    std::uint64_t messagesSent() const { return messages_sent; }
+
+protected:
+    void count_sent(std::size_t bytes) { bytes_sent += bytes; ++messages_sent; }
+
+private:
+    std::uint64_t bytes_sent = 0;
+    std::uint64_t messages_sent = 0;
+};
+
+// LoopbackTransport のランクが共有する郵便受け（ランクの数だけの LoopbackTransport から使う）
+class LoopbackHub {
+public:
+    explicit LoopbackHub(int ranks);
+
+    LoopbackHub(const LoopbackHub&) = delete;
+    LoopbackHub& operator=(const LoopbackHub&) = delete;
+
+    int size() const { return ranks; }
+    /**
+     * 通信を打ち切る（例外で抜けるランクが呼ぶ。MPI の MPI_Abort に当たる）
+     * recv・allreduce_max で待っているランクと、その後に呼んだランクは std::runtime_error で抜ける
+     * 打ち切った後の hub は使い直せない
+     */
+    void abort();
+
+private:
+    friend class LoopbackTransport;
+    using Key = std::tuple<int, int, int>;  // (送り元, 宛先, tag)
+
+    int ranks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<Key, std::deque<std::vector<unsigned char>>> mail;
+    // allreduce_max の集計（全てのランクが揃うたびに generation を進める）
+    int arrived = 0;
+    unsigned long generation = 0;
+    double reduce_value = 0.0;
+    double reduce_result = 0.0;
+    bool stopped = false;   // abort が呼ばれた
+};
+
+// 同じ LoopbackHub を共有するスレッドをランクとする通信（ランクごとに1つ作り、そのランクのスレッドから使う）
+class LoopbackTransport : public HaloTransport {
+public:
+    LoopbackTransport(LoopbackHub& hub, int rank);
+
+    int rank() const override { return self; }
+    int size() const override { return hub.size(); }
+    void send(int peer, int tag, const void* data, std::size_t bytes) override;
+    void recv(int peer, int tag, void* data, std::size_t bytes) override;
+    double allreduce_max(double value) override;
+
+private:
+    LoopbackHub& hub;
+    int self;
+};
@@ -0,0 +1,120 @@
+//
+//  logger.cpp
+//  2D-StableFluids
+//
+
+#include "logger.hpp"
+
+#include <cstring>
+#include <string>
+
+const char* log_level_name(LogLevel level){
+    switch (level){
+        case LogLevel::Trace: return "trace";
+        case LogLevel::Debug: return "debug";
+        case LogLevel::Info: return "info";
+        case LogLevel::Warn: return "warn";
+        case LogLevel::Error: return "error";
+        case LogLevel::Off: return "off";
+    }
+    return "off";
+}
+
+LogLevel parse_log_level(const char* name){
+    for (LogLevel l : {LogLevel::Trace, LogLevel::Debug, LogLevel::Info, LogLevel::Warn, LogLevel::Error}){
+        if (std::strcmp(name, log_level_name(l)) == 0) return l;
+    }
+    return LogLevel::Off;
+}
+
+Logger& Logger::instance(){
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : origin(std::chrono::steady_clock::now()){
+}
+
+Logger::~Logger(){
+    if (running.exchange(false)){
+        wake();
+        worker.join();  // run() は止まる前に残りの記録を書き出す
+    }
+}
+
+void Logger::setLevel(LogLevel l){
+    level.store(l, std::memory_order_relaxed);
+    if (l != LogLevel::Off && !running.exchange(true)){
+        worker = std::thread([this]{ run(); });
+    }
+}
+
+void Logger::flush(){
+    std::uint64_t target = pushed.load(std::memory_order_acquire);
+    while (running.load(std::memory_order_relaxed) && written.load(std::memory_order_acquire) < target){
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+void Logger::wake(){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+    }
+    cv.notify_one();
+}
+
+// ログ用のスレッド: リングから取り出して整形・出力する
+// 空のときは条件変数で眠る。sleeping を立ててから積まれた数を確かめるので、log が sleeping を見落としても
+// こちらが積まれた記録を見落とすことはない（どちらも seq_cst）。起こすのは眠っているときだけなので、
+// 出力が続いている間の log は sleeping を読むだけで済む
+void Logger::run(){
+    Record r;
+    std::uint64_t consumed = 0;     // リングから取り出した記録の数
+    for (;;){
+        bool stopping = !running.load(std::memory_order_relaxed);
+        std::FILE* out = output.load(std::memory_order_relaxed);
+        int n = 0;
+        while (queue.pop(r)){
+            write(r, out);
+            ++n;
+        }
+        if (n > 0){
+            std::fflush(out);
+            written.fetch_add(n, std::memory_order_release);
+            consumed += n;
+        }
+        if (stopping) break;
+        if (n == 0){
+            std::unique_lock<std::mutex> lock(mtx);
+            sleeping.store(true, std::memory_order_seq_cst);
+            cv.wait(lock, [&]{
+                return pushed.load(std::memory_order_seq_cst) != consumed || !running.load(std::memory_order_relaxed);
+            });
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::write(const Record& r, std::FILE* out){
+    std::string line;
+    char buf[64];
+    double ms = std::chrono::duration<double, std::milli>(r.time - origin).count();
+    std::snprintf(buf, sizeof(buf), "[%10.3f ms] [%s] ", ms, log_level_name(r.level));
+    line += buf;
+    int k = 0;
+    for (const char* p = r.fmt; *p; ++p){
+        if (p[0] == '{' && p[1] == '}' && k < r.argc){
+            const LogArg& a = r.args[k++];
+            switch (a.type){
+                case LogArg::Type::Int: std::snprintf(buf, sizeof(buf), "%lld", a.i); line += buf; break;
+                case LogArg::Type::Double: std::snprintf(buf, sizeof(buf), "%g", a.d); line += buf; break;
+                case LogArg::Type::String: line += a.s ? a.s : "(null)"; break;
+            }
+            ++p;
+        } else {
+            line += *p;
+        }
+    }
+    line += '\n';
+    std::fwrite(line.data(), 1, line.size(), out);
+}
@@ -0,0 +1,156 @@
+//
+//  logger.hpp
+//  2D-StableFluids
+//
+//  レベル付きの非同期ログ。既定では無効（LogLevel::Off）。
+//  - 呼び出し側はレベルを確認し（atomic の読み込み1回）、書式文字列と引数の値をロックフリーのリングに積むだけ
+//  - 文字列への整形と出力はログ専用のスレッドが行うので、入力処理や描画のスレッドが出力で止まることはない
+//    ログ用のスレッドはリングが空になると条件変数で眠る（眠っているときだけ、積んだ側が起こす）
+//  - リングが満杯のときは記録を捨てて数を数える（出力の遅れが呼び出し側に伝わらないようにする）
+//
+//  書式文字列の "{}" が順に引数に置き換わる。書式文字列と文字列の引数は、整形されるまで有効なもの
+//  （文字列リテラルなど）を渡すこと。
+//    SF_LOG_DEBUG("cursor moved: {} | {}", x, y);
+//
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#include "mpsc_queue.hpp"
+
+enum class LogLevel {
+    Trace,
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off,
+};
+
+const char* log_level_name(LogLevel level);
+// "trace" / "debug" / "info" / "warn" / "error" / "off"（不明なものは Off）
+LogLevel parse_log_level(const char* name);
+
+// 整形前の引数
+struct LogArg {
+    enum class Type : std::uint8_t { Int, Double, String } type = Type::Int;
+    union {
+        long long i;
+        double d;
+        const char* s;
+    };
+    LogArg() : i(0) {}
+};
+
+class Logger {
+public:
+    static constexpr int kMaxArgs = 6;
+    static constexpr std::size_t kCapacity = 4096;  // リングに溜められる記録の数
+
+    // プロセス全体で共有するロガー
+    static Logger& instance();
+
+    Logger();
+    ~Logger();  // 溜まっている記録を書き出してからスレッドを止める
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    // level 以上の記録だけを出力する（Off 以外にしたときにログ用のスレッドを起動する）
+    void setLevel(LogLevel level);
+    LogLevel getLevel() const { return level.load(std::memory_order_relaxed); }
+    bool enabled(LogLevel l) const { return l >= level.load(std::memory_order_relaxed); }
+
+    // 出力先（既定は stdout）。ログ用のスレッドが書き込むので、呼び出し側で同時に使わないこと
+    void setOutput(std::FILE* out) { output.store(out, std::memory_order_relaxed); }
+
+    template <typename... Args>
+    void log(LogLevel l, const char* fmt, const Args&... args){
+        static_assert(sizeof...(Args) <= kMaxArgs, "too many log arguments");
+        Record r;
+        r.level = l;
+        r.time = std::chrono::steady_clock::now();
+        r.fmt = fmt;
+        r.argc = (std::uint8_t)sizeof...(Args);
+        int k = 0;
+        ((r.args[k++] = to_arg(args)), ...);
+        if (!queue.push(r)){
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        pushed.fetch_add(1, std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_seq_cst)){
+            wake();
+        }
+    }
+
+    // ここまでに積まれた記録が全て出力されるまで待つ
+    void flush();
+    // リングが満杯で捨てた記録の数
+    std::uint64_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    struct Record {
+        LogLevel level = LogLevel::Info;
+        std::chrono::steady_clock::time_point time;
+        const char* fmt = nullptr;
+        std::uint8_t argc = 0;
+        LogArg args[kMaxArgs];
+    };
+
+    template <typename T>
+    static LogArg to_arg(const T& v){
+        LogArg a;
+        if constexpr (std::is_floating_point_v<T>){
+            a.type = LogArg::Type::Double;
+            a.d = (double)v;
+        } else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>){
+            a.type = LogArg::Type::Int;
+            a.i = (long long)v;
+        } else {
+            static_assert(std::is_convertible_v<T, const char*>, "log arguments must be numbers or C strings");
+            a.type = LogArg::Type::String;
+            a.s = v;
+        }
+        return a;
+    }
+
+    void run();
+    // 眠っているログ用のスレッドを起こす
+    void wake();
+    void write(const Record& r, std::FILE* out);
+
+    std::atomic<LogLevel> level{LogLevel::Off};
+    std::atomic<std::FILE*> output{stdout};
+    std::chrono::steady_clock::time_point origin;
+
+    MpscQueue<Record, kCapacity> queue;
+    std::atomic<std::uint64_t> pushed{0};       // 積まれた記録の数
+    std::atomic<std::uint64_t> written{0};      // 出力した記録の数
+    std::atomic<std::uint64_t> dropped{0};
+
+    std::atomic<bool> running{false};
+    std::atomic<bool> sleeping{false};          // ログ用のスレッドが条件変数で待っているか
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread worker;
+};
+
+// レベルが有効なときだけ引数を評価して積む
+#define SF_LOG(lvl, ...) \
+    do { \
+        Logger& sf_logger_ = Logger::instance(); \
+        if (sf_logger_.enabled(lvl)) sf_logger_.log((lvl), __VA_ARGS__); \
+    } while (0)
+
+#define SF_LOG_TRACE(...) SF_LOG(LogLevel::Trace, __VA_ARGS__)
+#define SF_LOG_DEBUG(...) SF_LOG(LogLevel::Debug, __VA_ARGS__)
+#define SF_LOG_INFO(...) SF_LOG(LogLevel::Info, __VA_ARGS__)
+#define SF_LOG_WARN(...) SF_LOG(LogLevel::Warn, __VA_ARGS__)
+#define SF_LOG_ERROR(...) SF_LOG(LogLevel::Error, __VA_ARGS__)
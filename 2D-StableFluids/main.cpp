@@ -15,12 +15,14 @@
 #include <math.h>
 #include "shader.hpp"       // シェーダー管理
 #include "simulation.hpp"   // シミュレーション管理
+#include "sim_thread.hpp"   // シミュレーションスレッド
+#include "logger.hpp"       // 非同期ログ
 
 #define PI 3.141592653
 
-// フレームレートと更新間隔の設定
+// フレームレートと更新間隔の設定（シミュレーションスレッドは MS_PRE_UPDATE ごとに1ステップ進める）
 int FPS = 60;
-double MS_PRE_UPDATE = 1000 / FPS;
+double MS_PRE_UPDATE = 1000.0 / FPS;
 
 // ウィンドウの識別子とサイズ
 static int win_id;
@@ -48,21 +50,21 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
         rgb[0] = 1.0f;
         rgb[1] = 0.0f;
         rgb[2] = 0.0f;
-        std::cout << "Switching to red" << std::endl;
+        SF_LOG_INFO("Switching to red");
     }
     // 'W'キーが押されたら緑色に切り替え
     else if (key == GLFW_KEY_W && action == GLFW_PRESS){
         rgb[0] = 0.0f;
         rgb[1] = 1.0f;
         rgb[2] = 0.0f;
-        std::cout << "Switching to green" << std::endl;
+        SF_LOG_INFO("Switching to green");
     }
     // 'E' キーが押されたら青色に切り替え
     else if (key == GLFW_KEY_E && action == GLFW_PRESS){
         rgb[0] = 0.0f;
         rgb[1] = 0.0f;
         rgb[2] = 1.0f;
-        std::cout << "Switching to blue" << std::endl;
+        SF_LOG_INFO("Switching to blue");
     }
 }
 
@@ -70,7 +72,7 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 void mouse_move_callback(GLFWwindow *window, double x, double y){
     mx = x; // 現在のマウスのx位置を更新
     my = y; // 現在のマウスのy位置を更新
-    std::cout << "cursor moved: " << x << " | " << y << std::endl;
+    SF_LOG_TRACE("cursor moved: {} | {}", x, y);
 }
 
 // マウスボタンイベントのコールバック関数
@@ -79,13 +81,13 @@ void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
     if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS){
         // カーソルの位置を取得
         glfwGetCursorPos(window, &xpos, &ypos);
-        std::cout << "Right Cursor Pressed at (" << xpos << " : " << ypos << ")" << std::endl;
+        SF_LOG_DEBUG("Right Cursor Pressed at ({} : {})", xpos, ypos);
     }
     // 右クリックが離された場合
     else if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_RELEASE){
         // カーソルの位置を取得
         glfwGetCursorPos(window, &xpos, &ypos);
-        std::cout << "Right Cursor Released at (" << xpos << " : " << ypos << ")" << std::endl;
+        SF_LOG_DEBUG("Right Cursor Released at ({} : {})", xpos, ypos);
         xpos = -1; // 位置をリセット
         ypos = -1;
     }
@@ -100,13 +102,13 @@ void mouse_button_callback(GLFWwindow *window, int button, int action, int mods)
 
         mouse_down[0] = 1; // 左ボタンが押されている状態に設定
 
-        std::cout << "Left Cursor Pressed at (" << mx << " : " << my << ")" << std::endl;
+        SF_LOG_DEBUG("Left Cursor Pressed at ({} : {})", mx, my);
     }
     // 左クリックが離された場合
     else if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE){
         // カーソルの位置を取得
         glfwGetCursorPos(window, &mx, &my);
-        std::cout << "Left Cursor Released at (" << mx << " : " << my << ")" << std::endl;
+        SF_LOG_DEBUG("Left Cursor Released at ({} : {})", mx, my);
         mouse_down[0] = 0; // 左ボタンが押されていない状態に設定
     }
 }
@@ -119,17 +121,25 @@ void processInput(GLFWwindow* window);
 
 int main()
 {
-    double lag = 0; // 更新遅延時間
+    // ログは既定で無効。環境変数 SF_LOG_LEVEL（trace / debug / info / warn / error）で有効にする
+    if (const char *lv = std::getenv("SF_LOG_LEVEL")){
+        Logger::instance().setLevel(parse_log_level(lv));
+    }
     
     int size = 720; // ウィンドウサイズ（幅と高さ）
     int scale = 6;  // シミュレーションのグリッドのスケール
     
     // シミュレーションオブジェクトの生成
     Simulation *sim = new Simulation(size / scale);
+    // マウスのドラッグで大きな速度が入るので、速い間だけ部分ステップに分けて進める
+    TimestepOptions timestep;
+    timestep.adaptive = true;
+    sim->setTimestepOptions(timestep);
     int frame = 0;  // フレームカウンタ
     
-    // テクスチャデータを格納するベクター
-    std::vector<float> data;
+    // シミュレーションを別スレッドで固定の時間間隔で進める（描画ループは最新のフレームを転送するだけ）
+    SimulationThread simThread(*sim, size / scale, 0.1f, MS_PRE_UPDATE);
+    std::uint64_t uploaded_step = UINT64_MAX;   // 最後にテクスチャに転送したフレームのステップ数（まだ転送していなければ UINT64_MAX）
     
     // GLFWの初期化
     glfwInit();
@@ -218,6 +228,8 @@ int main()
     // テクスチャユニットをシェーダーに設定（ユニフォーム変数 "tex" にテクスチャユニット0を割り当て）
     glUniform1i(glGetUniformLocation(myShader.ID, "tex"), 0); // 手動で設定
 
+    simThread.start();
+    
     // レンダリングループ
     while(!glfwWindowShouldClose(window))
     {
@@ -230,8 +242,8 @@ int main()
         // イベントの処理
         glfwPollEvents();
 
-        /* ------------- シミュレーションの更新 --------------*/
-        sim->reset(size / scale);  // シミュレーションのリセット
+        /* ------------- シミュレーションへの入力 --------------*/
+        // リセットと更新はシミュレーションスレッドが行うので、ここでは入力をキューに送るだけ
 
         // マウス右クリックで染料を追加
         if (xpos >= 0 && ypos >= 0) {
@@ -241,7 +253,7 @@ int main()
                 int i = (int)((ypos / (float)size) * N + 1);
                 int j = (int)((xpos / (float)size) * N + 1);
                 // シミュレーションに染料を追加
-                sim->stamp(i, j, 1, 1, N, 100.0f * rgb[0], 100.0f * rgb[1], 100.0f * rgb[2]);
+                simThread.post({ SimulationEvent::Type::Stamp, i, j, 100.0f * rgb[0], 100.0f * rgb[1], 100.0f * rgb[2] });
                 // 速度ベクトルの追加（未実装）
             }
 
@@ -257,27 +269,27 @@ int main()
                 int i = (int)((my / (float)size) * N + 1);
                 int j = (int)((mx / (float)size) * N + 1);
             
-                std::cout << "Mouse Position (mx, my): " << mx << ", " << my << std::endl;
-                std::cout << "Grid Position (i, j): " << i << ", " << j << std::endl;
+                SF_LOG_TRACE("Mouse Position (mx, my): {}, {}", mx, my);
+                SF_LOG_TRACE("Grid Position (i, j): {}, {}", i, j);
             
                 // シミュレーションに力を追加
-                sim->add_force(i, j, N, force * (mx - omx), force * (my - omy));
+                simThread.post({ SimulationEvent::Type::Force, i, j, force * (float)(mx - omx), force * (float)(my - omy) });
                 // 前回のマウス位置を更新
                 omx = mx;
                 omy = my;
         }
 
-        // シミュレーションのステップを更新
-        sim->update(size / scale, 0.1f);
-
         // シェーダープログラムを再度使用
         myShader.use();
-        // シミュレーションから密度データを取得
-        data = sim->getDensity(size / scale);
+        // シミュレーションスレッドが公開した最新のフレームを取得
+        const SimulationFrame& latest = simThread.latest();
 
         /* ------------- レンダリング --------------*/
-        // 密度配列をテクスチャに変換してクワッドに適用
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size / scale, size / scale, 0, GL_RGB, GL_FLOAT, data.data());
+        // 密度配列をテクスチャに変換してクワッドに適用（新しいフレームが届いたときだけ転送する）
+        if (latest.step != uploaded_step){
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, size / scale, size / scale, 0, GL_RGB, GL_FLOAT, latest.rgb.data());
+            uploaded_step = latest.step;
+        }
 
         // 頂点属性の設定（位置）
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
@@ -298,6 +310,9 @@ int main()
         glfwPollEvents();
     }
 
+    // シミュレーションスレッドを止めてから解放する
+    simThread.stop();
+    
     // リソースの解放
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
@@ -0,0 +1,70 @@
+//
+//  mpsc_queue.hpp
+//  2D-StableFluids
+//
+//  生産者が複数・消費者1つのロックフリーな固定長キュー（リングバッファ）。
+//  各要素に通し番号を持たせ、生産者は書き込み位置を CAS で確保してから書き込む（Vyukov の有界キュー）。
+//  push / pop はどちらも待たずに失敗を返す（満杯なら push が false、空なら pop が false）。
+//
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+template <typename T, std::size_t Capacity>
+class MpscQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    MpscQueue(){
+        for (std::size_t k = 0; k < Capacity; ++k){
+            cells[k].seq.store(k, std::memory_order_relaxed);
+        }
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    // 生産者側（複数のスレッドから呼べる）
+    bool push(const T& item){
+        std::size_t pos = tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;){
+            cell = &cells[pos & (Capacity - 1)];
+            std::size_t seq = cell->seq.load(std::memory_order_acquire);
+            std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)pos;
+            if (diff == 0){
+                // この位置は空いている: 書き込み位置を確保する
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0){
+                return false;   // 満杯（消費者がまだ読んでいない）
+            } else {
+                pos = tail.load(std::memory_order_relaxed);     // 他の生産者に先を越された
+            }
+        }
+        cell->item = item;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 消費者側（1つのスレッドからだけ呼ぶ）
+    bool pop(T& item){
+        std::size_t pos = head.load(std::memory_order_relaxed);
+        Cell& cell = cells[pos & (Capacity - 1)];
+        if (cell.seq.load(std::memory_order_acquire) != pos + 1) return false;
+        item = cell.item;
+        cell.seq.store(pos + Capacity, std::memory_order_release);
+        head.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> seq;   // pos: 空き、pos + 1: 書き込み済み
+        T item;
+    };
+
+    Cell cells[Capacity];
+    alignas(64) std::atomic<std::size_t> tail{0};   // 次に確保する書き込み位置（生産者）
+    alignas(64) std::atomic<std::size_t> head{0};   // 次に読む位置（消費者）
+};
@@ -0,0 +1,279 @@
+//
+//  multigrid.cpp
+//  2D-StableFluids
+//
+
+#include "multigrid.hpp"
+
+#include <cmath>
+
+namespace {
+
+// ノイマン境界条件（set_bnd の b = 0 と同じ）
+// 双線形補間で角のセルも参照するため、角は隣接する2つのゴーストセルの平均とする
+template <typename T>
+void set_neumann(int n, Grid2D<T>& x){
+    const T half = T(0.5);
+    int s = x.pitch();
+    for (int i = 1; i <= n; ++i){
+        x[0 + s * i] = x[1 + s * i];
+        x[(n + 1) + s * i] = x[n + s * i];
+        x[i + s * 0] = x[i + s * 1];
+        x[i + s * (n + 1)] = x[i + s * n];
+    }
+    x[0] = half * (x[1] + x[s]);
+    x[n + 1] = half * (x[n] + x[(n + 1) + s]);
+    x[s * (n + 1)] = half * (x[1 + s * (n + 1)] + x[s * n]);
+    x[(n + 1) + s * (n + 1)] = half * (x[n + s * (n + 1)] + x[(n + 1) + s * n]);
+}
+
+// 一辺 n のレベルの次に粗いレベルの一辺（n が最も粗いレベルなら 0）
+// 奇数は (n + 1) / 2 に切り上げる（端の粗いセルは細かいセル1つ分の幅だけを受け持つ）ので、N の形によらず粗くできる
+int coarser(int n){
+    return n <= 4 ? 0 : (n + 1) / 2;
+}
+
+// 行 [1, n] をスレッドプールで分割して実行する
+template <typename F>
+void for_rows(ThreadPool* pool, int n, F&& fn){
+    if (pool){
+        pool->parallel_for(1, n + 1, fn);
+    } else {
+        fn(1, n + 1);
+    }
+}
+
+} // namespace
+
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::configure(int N){
+    if (!levels.empty() && levels[0].n == N) return;
+    build_levels(N, nullptr, nullptr);
+}
+
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::bind(int N, FieldArena& arena, Grid2D<T>& residual){
+    build_levels(N, &arena, &residual);
+}
+
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::build_levels(int N, FieldArena* arena, Grid2D<T>* residual){
+    levels.clear();
+    row_sum.assign(N + 2, 0.0);
+    int n = N;
+    for (;;){
+        Level lv;
+        lv.n = n;
+        if (arena){
+            lv.x = arena->take<T>(n, T(0));
+            lv.rhs = arena->take<T>(n, T(0));
+            lv.r = levels.empty() ? residual->alias() : arena->take<T>(n, T(0));
+        } else {
+            lv.x.resize(n, T(0));
+            lv.rhs.resize(n, T(0));
+            lv.r.resize(n, T(0));
+        }
+        levels.push_back(std::move(lv));
+        // 十分小さくなったらそこを最も粗いレベルとする
+        n = coarser(n);
+        if (n == 0) break;
+    }
+}
+
+template <typename T, typename Acc>
+std::size_t BasicMultigridSolver<T, Acc>::workspace_bytes(int N){
+    std::size_t bytes = 0;
+    int n = N;
+    for (bool finest = true;; finest = false){
+        // 最も細かいレベルの残差は呼び出し側の格子を使う
+        bytes += (finest ? 2 : 3) * FieldArena::bytes_for<T>(n);
+        n = coarser(n);
+        if (n == 0) break;
+    }
+    return bytes;
+}
+
+template <typename T, typename Acc>
+SolveStats BasicMultigridSolver<T, Acc>::solve(int N, Grid2D<T>& p, const Grid2D<T>& div, ThreadPool* tp){
+    pool = tp;
+    configure(N);
+    Level& fine = levels[0];
+    int s = fine.x.pitch();
+
+    // 純ノイマン問題は右辺の総和が0でないと解を持たないため、右辺の平均を取り除く
+    double mean = 0.0;
+    for (int j = 1; j <= N; ++j){
+        for (int i = 1; i <= N; ++i){
+            mean += div[i + s * j];
+        }
+    }
+    mean /= (double)N * N;
+    double rhs_norm2 = 0.0;
+    for (int j = 1; j <= N; ++j){
+        for (int i = 1; i <= N; ++i){
+            T v = div[i + s * j] - (T)mean;
+            fine.rhs[i + s * j] = v;
+            rhs_norm2 += (double)v * v;
+        }
+    }
+    fine.x = p;
+    set_neumann(N, fine.x);
+
+    SolveStats stats;
+    double rhs_norm = std::sqrt(rhs_norm2);
+    double res = std::sqrt(residual(fine));
+    stats.initial_residual = (float)res;
+    if (rhs_norm == 0.0){
+        // 発散が0なら圧力も0
+        fine.x.fill(T(0));
+        res = 0.0;
+    }
+    while (res > options.tolerance * rhs_norm && stats.iterations < options.max_cycles){
+        cycle(0, options.cycle);
+        res = std::sqrt(residual(fine));
+        ++stats.iterations;
+    }
+    stats.residual = (float)res;
+    stats.converged = res <= options.tolerance * rhs_norm;
+
+    p = fine.x;
+    return stats;
+}
+
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::cycle(int l, MultigridCycle type){
+    Level& lv = levels[l];
+    if (l + 1 == (int)levels.size()){
+        // 最も粗いレベル（一辺 4 以下）: 残差が右辺の tolerance 倍以下になるまでスムーザーを回す
+        // （coarse_sweeps は回数の上限。一辺 4 以下ではその前に収束する）
+        double rhs_norm2 = 0.0;
+        int s = lv.rhs.pitch();
+        for (int j = 1; j <= lv.n; ++j){
+            for (int i = 1; i <= lv.n; ++i){
+                rhs_norm2 += (double)lv.rhs[i + s * j] * lv.rhs[i + s * j];
+            }
+        }
+        const double target = (double)options.tolerance * options.tolerance * rhs_norm2;
+        for (int k = 0; k < options.coarse_sweeps; k += 2){
+            smooth(lv, 2);
+            if (residual(lv) <= target) break;
+        }
+        return;
+    }
+    Level& coarse = levels[l + 1];
+
+    smooth(lv, options.pre_smooth);
+    residual(lv);
+    restrict_residual(lv, coarse);
+    coarse.x.fill(T(0));
+    if (type == MultigridCycle::F){
+        cycle(l + 1, MultigridCycle::F);
+    }
+    cycle(l + 1, MultigridCycle::V);
+    prolongate_add(coarse, lv);
+    smooth(lv, options.post_smooth);
+}
+
+// 赤黒ガウス・ザイデル法によるスムージング
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::smooth(Level& lv, int sweeps){
+    int n = lv.n;
+    int s = lv.x.pitch();
+    T* x = lv.x.data();
+    const T* b = lv.rhs.data();
+    for (int k = 0; k < sweeps; ++k){
+        for (int color = 0; color < 2; ++color){
+            for_rows(pool, n, [&](int j_begin, int j_end){
+                for (int j = j_begin; j < j_end; ++j){
+                    int i_start = 1 + ((1 + j + color) & 1);
+                    for (int i = i_start; i <= n; i += 2){
+                        int c = i + s * j;
+                        x[c] = (T)(((Acc)b[c] + x[c - 1] + x[c + 1] + x[c - s] + x[c + s]) * Acc(0.25));
+                    }
+                }
+            });
+        }
+        set_neumann(n, lv.x);
+    }
+}
+
+template <typename T, typename Acc>
+double BasicMultigridSolver<T, Acc>::residual(Level& lv){
+    int n = lv.n;
+    int s = lv.x.pitch();
+    const T* x = lv.x.data();
+    const T* b = lv.rhs.data();
+    T* r = lv.r.data();
+    for_rows(pool, n, [&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            double sum = 0.0;
+            for (int i = 1; i <= n; ++i){
+                int c = i + s * j;
+                Acc v = b[c] - (Acc(4) * x[c] - ((Acc)x[c - 1] + x[c + 1] + x[c - s] + x[c + s]));
+                r[c] = (T)v;
+                sum += (double)v * v;
+            }
+            row_sum[j] = sum;
+        }
+    });
+    double total = 0.0;
+    for (int j = 1; j <= n; ++j){
+        total += row_sum[j];
+    }
+    return total;
+}
+
+// 制限: 粗いセルの右辺 = 対応する細かい 2x2 セルの残差の和
+// （粗いグリッドの格子間隔は2倍なので、平均に (2h/h)^2 = 4 を掛けたものになる）
+// 細かいレベルが奇数の場合、端の粗いセルは内部にある細かいセルだけを足す（右辺の総和は保たれる）
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::restrict_residual(const Level& fine, Level& coarse){
+    int nf = fine.n;
+    int nc = coarse.n;
+    int sf = fine.r.pitch();
+    int sc = coarse.rhs.pitch();
+    const T* r = fine.r.data();
+    T* b = coarse.rhs.data();
+    for_rows(pool, nc, [&](int j_begin, int j_end){
+        for (int J = j_begin; J < j_end; ++J){
+            const bool row2 = 2 * J <= nf;
+            for (int I = 1; I <= nc; ++I){
+                const bool col2 = 2 * I <= nf;
+                int f = (2 * I - 1) + sf * (2 * J - 1);
+                Acc sum = r[f];
+                if (col2) sum += r[f + 1];
+                if (row2) sum += r[f + sf];
+                if (col2 && row2) sum += r[f + sf + 1];
+                b[I + sc * J] = (T)sum;
+            }
+        }
+    });
+}
+
+// 補間: 粗いグリッドの補正量を双線形補間して細かいグリッドに足し込む
+template <typename T, typename Acc>
+void BasicMultigridSolver<T, Acc>::prolongate_add(Level& c, Level& fine){
+    set_neumann(c.n, c.x);  // 境界のセルも補間に使うため、ゴーストセルを更新
+    int nf = fine.n;
+    int sf = fine.x.pitch();
+    int sc = c.x.pitch();
+    const T* e = c.x.data();
+    T* x = fine.x.data();
+    for_rows(pool, nf, [&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            int J = (j + 1) / 2;                // 最も近い粗いセル
+            int J2 = (j % 2 == 1) ? J - 1 : J + 1;  // 次に近い粗いセル
+            for (int i = 1; i <= nf; ++i){
+                int I = (i + 1) / 2;
+                int I2 = (i % 2 == 1) ? I - 1 : I + 1;
+                x[i + sf * j] = (T)(x[i + sf * j] + (Acc(0.5625) * e[I + sc * J] + Acc(0.1875) * ((Acc)e[I2 + sc * J] + e[I + sc * J2])
+                                                    + Acc(0.0625) * e[I2 + sc * J2]));
+            }
+        }
+    });
+    set_neumann(nf, fine.x);
+}
+
+template class BasicMultigridSolver<float>;
+template class BasicMultigridSolver<double>;
+template class BasicMultigridSolver<float, double>;
@@ -0,0 +1,84 @@
+//
+//  multigrid.hpp
+//  2D-StableFluids
+//
+//  圧力のポアソン方程式 4p[i,j] - (p[i-1,j] + p[i+1,j] + p[i,j-1] + p[i,j+1]) = div[i,j]
+//  （境界はノイマン条件 = set_bnd(N, 0, p)）を幾何マルチグリッド法で解く。
+//  スムーザーは赤黒ガウス・ザイデル法、制限は 2x2 の和、補間は双線形。
+//  各レベルは一辺を (n + 1) / 2 に粗くし（奇数の N も粗くする）、一辺 4 以下のレベルを残差が許容値になるまで解く。
+//  T は格子の要素の型、Acc はステンシルと残差を計算する型（T = float, Acc = double で混合精度）。
+//
+
+#pragma once
+#include <vector>
+
+#include "field_arena.hpp"
+#include "grid2d.hpp"
+#include "solve_stats.hpp"
+#include "thread_pool.hpp"
+
+// マルチグリッドのサイクルの種類
+enum class MultigridCycle {
+    V,  // Vサイクル
+    F,  // Fサイクル（粗いレベルで Fサイクル → Vサイクルを行う）
+};
+
+struct MultigridOptions {
+    MultigridCycle cycle = MultigridCycle::V;
+    float tolerance = 1e-4f;    // 相対残差 ||r|| / ||div|| の許容値
+    int max_cycles = 20;        // サイクル数の上限
+    int pre_smooth = 2;         // 制限前のスムージング回数
+    int post_smooth = 2;        // 補間後のスムージング回数
+    int coarse_sweeps = 50;     // 最も粗いレベルでのスムージング回数の上限（残差が tolerance 倍になれば打ち切る）
+};
+
+template <typename T, typename Acc = T>
+class BasicMultigridSolver {
+public:
+    BasicMultigridSolver() = default;
+
+    void setOptions(const MultigridOptions& opt) { options = opt; }
+    const MultigridOptions& getOptions() const { return options; }
+
+    /**
+     * N: 最も細かいグリッドの一辺、p: 圧力（解、初期値として使う）、div: 右辺
+     * p, div は一辺 N の格子（ゴーストセルを含む）
+     * pool: スムージングを並列化するスレッドプール（nullptr ならシングルスレッド）
+     */
+    SolveStats solve(int N, Grid2D<T>& p, const Grid2D<T>& div, ThreadPool* pool);
+
+    /**
+     * 一辺 N 用の作業領域を arena から切り出す（以後 N で solve してもメモリの確保は起きない）
+     * residual: 最も細かいレベルの残差に使う格子（呼び出し側の作業領域と共有する）
+     */
+    void bind(int N, FieldArena& arena, Grid2D<T>& residual);
+    // bind が arena から切り出すバイト数
+    static std::size_t workspace_bytes(int N);
+
+private:
+    // 1レベル分の作業領域
+    struct Level {
+        int n = 0;                  // 一辺のセル数
+        Grid2D<T> x;                // 解（粗いレベルでは誤差の補正量）
+        Grid2D<T> rhs;              // 右辺
+        Grid2D<T> r;                // 残差
+    };
+
+    // N に合わせてレベルを作り直す（N が変わらなければ何もしない）
+    void configure(int N);
+    // レベルを作る（arena が nullptr なら各レベルが自前の領域を確保する）
+    void build_levels(int N, FieldArena* arena, Grid2D<T>* residual);
+    void cycle(int l, MultigridCycle type);
+    void smooth(Level& lv, int sweeps);
+    // 残差を計算し、その2乗和を返す
+    double residual(Level& lv);
+    void restrict_residual(const Level& fine, Level& coarse);
+    void prolongate_add(Level& coarse, Level& fine);
+
+    MultigridOptions options;
+    std::vector<Level> levels;  // levels[0] が最も細かいレベル
+    std::vector<double> row_sum;    // 行ごとの残差の2乗和（合計順序をスレッド数に依存させない）
+    ThreadPool* pool = nullptr;
+};
+
+using MultigridSolver = BasicMultigridSolver<float>;
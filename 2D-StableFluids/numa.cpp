@@ -0,0 +1,104 @@
+//
+//  numa.cpp
+//  2D-StableFluids
+//
+
+#include "numa.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+std::vector<int> allowed_cpus(){
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0){
+        for (int c = 0; c < CPU_SETSIZE; ++c){
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+    }
+#endif
+    return cpus;
+}
+
+int cpu_node(int cpu){
+#if defined(__linux__)
+    // /sys/devices/system/cpu/cpuN/ に nodeK というリンクがある（NUMA のないカーネルではない）
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    if (!fs::is_directory(dir, ec)) return -1;
+    for (const auto& entry : fs::directory_iterator(dir, ec)){
+        std::string name = entry.path().filename().string();
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+            name.find_first_not_of("0123456789", 4) == std::string::npos){
+            return std::stoi(name.substr(4));
+        }
+    }
+    return 0;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+bool pin_current_thread(int cpu){
+#if defined(__linux__)
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+NumaPlacement page_placement(const void* data, std::size_t bytes){
+    NumaPlacement out;
+#if defined(__linux__) && defined(SYS_move_pages)
+    if (!data || bytes == 0) return out;
+    const std::uintptr_t page = (std::uintptr_t)sysconf(_SC_PAGESIZE);
+    const std::uintptr_t begin = (std::uintptr_t)data / page * page;
+    const std::uintptr_t end = ((std::uintptr_t)data + bytes + page - 1) / page * page;
+    // move_pages に移動先を渡さないと、各ページの今のノードを status に返す（libnuma なしで問い合わせる）
+    constexpr std::size_t kBatch = 1024;
+    void* pages[kBatch];
+    int status[kBatch];
+    for (std::uintptr_t p = begin; p < end; ){
+        std::size_t count = 0;
+        for (; count < kBatch && p < end; ++count, p += page){
+            pages[count] = reinterpret_cast<void*>(p);
+        }
+        if (syscall(SYS_move_pages, 0, (unsigned long)count, pages, nullptr, status, 0) != 0){
+            return NumaPlacement{};     // コンテナなどで禁止されている
+        }
+        for (std::size_t k = 0; k < count; ++k){
+            if (status[k] < 0){
+                ++out.unplaced;         // -ENOENT: まだ触れていない
+                continue;
+            }
+            if ((std::size_t)status[k] >= out.pages.size()){
+                out.pages.resize(status[k] + 1, 0);
+            }
+            ++out.pages[status[k]];
+        }
+    }
+    out.available = true;
+    out.page_bytes = page;
+#else
+    (void)data;
+    (void)bytes;
+#endif
+    return out;
+}
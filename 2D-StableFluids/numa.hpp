@@ -0,0 +1,45 @@
+//
+//  numa.hpp
+//  2D-StableFluids
+//
+//  複数ソケットのマシンで場のページをそれを処理するスレッドの NUMA ノードに置くための設定と、
+//  スレッドの CPU への固定・ページの配置の問い合わせ。
+//  Linux 以外（macOS など）では固定も問い合わせもできない（pin_current_thread は false、配置は available = false）。
+//
+
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// Simulation のコンストラクタに渡す NUMA 向けの設定（既定はどちらも無効: 構築したスレッドが全ての場を書く）
+struct NumaOptions {
+    // 全ての場を、ソルバーのスレッドが行ループと同じ区間の分け方で最初に書く（first-touch）
+    // 各スレッドが担当する行のページが、そのスレッドが動いている CPU の NUMA ノードに置かれる
+    bool first_touch = false;
+    // ソルバーのスレッド（ThreadPool のワーカー）を CPU に固定する（t 番目のスレッドを許可された CPU の t 番目に置く）
+    // 固定しないとスレッドが別のノードに移り、first-touch で置いたページが遠くなる
+    // 0 番目（Simulation を構築・update する呼び出し側スレッド）は固定しない。そのスレッドの affinity は
+    // アプリケーションのものなので、0 番目の区間のページも近くに置きたい場合は、構築する前に
+    // pin_current_thread(allowed_cpus()[0]) などで呼び出し側が自分で固定する
+    bool pin_threads = false;
+    // 構築時のスレッド数（呼び出し側スレッドを含む、0 でハードウェアスレッド数。setThreadCount と同じ）
+    int threads = 1;
+};
+
+// 領域のページの NUMA ノードごとの数
+struct NumaPlacement {
+    bool available = false;             // 問い合わせができたか（false なら以下は空）
+    std::size_t page_bytes = 0;
+    std::vector<std::size_t> pages;     // pages[node]: そのノードに置かれたページ数
+    std::size_t unplaced = 0;           // まだ触れていない（物理ページのない）ページ数
+    std::vector<int> thread_nodes;      // ソルバーの t 番目のスレッドを固定した CPU のノード（固定していなければ -1）
+};
+
+// このプロセスが動いてよい CPU の番号（昇順。分からない場合は空）
+std::vector<int> allowed_cpus();
+// cpu の NUMA ノード（分からない場合は -1、ノードが1つの場合は 0）
+int cpu_node(int cpu);
+// 呼び出したスレッドを cpu に固定する（できなければ false）
+bool pin_current_thread(int cpu);
+// [data, data + bytes) のページの配置（スレッドのノードは空のまま返す）
+NumaPlacement page_placement(const void* data, std::size_t bytes);
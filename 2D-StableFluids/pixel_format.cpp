@@ -0,0 +1,26 @@
+//
+//  pixel_format.cpp
+//  2D-StableFluids
+//
+
+#include "pixel_format.hpp"
+
+std::size_t pixel_size(PixelFormat fmt){
+    switch (fmt){
+        case PixelFormat::RGB32F: return 3 * sizeof(float);
+        case PixelFormat::RGB16F: return 3 * sizeof(std::uint16_t);
+        case PixelFormat::RGBA8: return 4;
+        case PixelFormat::RGB8: return 3;
+    }
+    return 0;
+}
+
+const char* pixel_format_name(PixelFormat fmt){
+    switch (fmt){
+        case PixelFormat::RGB32F: return "rgb32f";
+        case PixelFormat::RGB16F: return "rgb16f";
+        case PixelFormat::RGBA8: return "rgba8";
+        case PixelFormat::RGB8: return "rgb8";
+    }
+    return "unknown";
+}
@@ -0,0 +1,83 @@
+//
+//  pixel_format.hpp
+//  2D-StableFluids
+//
+//  色データを書き出すときの画素フォーマット。
+//  どのフォーマットも (i, j) の i が行内、j が行の順に並べる（glTexImage2D にそのまま渡せる並び）。
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+enum class PixelFormat {
+    RGB32F,     // float x 3（GL_RGB, GL_FLOAT）
+    RGB16F,     // 半精度浮動小数点 x 3（GL_RGB, GL_HALF_FLOAT）
+    RGBA8,      // 0〜1 にクランプして 0〜255 に量子化、α は 255（GL_RGBA, GL_UNSIGNED_BYTE）
+    RGB8,       // RGBA8 の α なし（動画・画像の書き出し用の RGB24）
+};
+
+// 1画素のバイト数
+std::size_t pixel_size(PixelFormat fmt);
+
+// float を IEEE 754 半精度に変換する（最近接偶数丸め、範囲外は無限大）
+// 色の場を半精度で持つ場合（dye_storage.hpp）にカーネルの内側から呼ぶので、インライン関数にしている
+inline std::uint16_t float_to_half(float f){
+    std::uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    std::uint32_t sign = (x >> 16) & 0x8000u;
+    std::uint32_t exp = (x >> 23) & 0xffu;
+    std::uint32_t mant = x & 0x7fffffu;
+
+    if (exp == 0xffu){
+        // 無限大と NaN（NaN は仮数の上位ビットを立てて保つ）
+        return (std::uint16_t)(sign | 0x7c00u | (mant ? 0x200u | (mant >> 13) : 0u));
+    }
+    int e = (int)exp - 127 + 15;
+    if (e >= 31){
+        return (std::uint16_t)(sign | 0x7c00u);     // 表せない大きさは無限大
+    }
+    if (e <= 0){
+        // 非正規化数（小さすぎるものは符号付きの0）
+        if (e < -10) return (std::uint16_t)sign;
+        mant |= 0x800000u;
+        int shift = 14 - e;
+        std::uint32_t half = mant >> shift;
+        std::uint32_t rest = mant & ((1u << shift) - 1);
+        std::uint32_t mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1u))) ++half;
+        return (std::uint16_t)(sign | half);
+    }
+    std::uint32_t half = ((std::uint32_t)e << 10) | (mant >> 13);
+    std::uint32_t rest = mant & 0x1fffu;
+    // 繰り上がりで指数部に溢れても、そのまま正しい値（または無限大）になる
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) ++half;
+    return (std::uint16_t)(sign | half);
+}
+
+inline float half_to_float(std::uint16_t h){
+    std::uint32_t sign = (std::uint32_t)(h & 0x8000u) << 16;
+    std::uint32_t exp = (h >> 10) & 0x1fu;
+    std::uint32_t mant = h & 0x3ffu;
+    std::uint32_t x;
+    if (exp == 0x1fu){
+        x = sign | 0x7f800000u | (mant << 13);
+    } else if (exp == 0){
+        if (mant == 0){
+            x = sign;
+        } else {
+            // 非正規化数を正規化する
+            int e = -1;
+            do { mant <<= 1; ++e; } while ((mant & 0x400u) == 0);
+            x = sign | ((std::uint32_t)(127 - 15 - e) << 23) | ((mant & 0x3ffu) << 13);
+        }
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+const char* pixel_format_name(PixelFormat fmt);
@@ -0,0 +1,105 @@
+//
+//  profiler.cpp
+//  2D-StableFluids
+//
+
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+// トレースの tid に使うスレッド番号（最初に記録したスレッドから順に 1, 2, ...）
+std::uint32_t thread_number(){
+    static std::atomic<std::uint32_t> counter{0};
+    thread_local std::uint32_t id = ++counter;
+    return id;
+}
+
+// 昇順に並んだ値の q 分位点（最も近い順位の値）
+double percentile(const std::vector<double>& sorted, double q){
+    std::size_t k = (std::size_t)(q * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(k, sorted.size() - 1)];
+}
+
+} // namespace
+
+const char* stage_name(Stage s){
+    switch (s){
+        case Stage::Update: return "update";
+        case Stage::VelStep: return "vel_step";
+        case Stage::DensStep: return "dens_step";
+        case Stage::AddSource: return "add_source";
+        case Stage::Advect: return "advect";
+        case Stage::Diffuse: return "diffuse";
+        case Stage::Project: return "project";
+        case Stage::SetBnd: return "set_bnd";
+        case Stage::ReadDensity: return "read_density";
+        case Stage::ActiveTiles: return "active_tiles";
+        case Stage::Count: break;
+    }
+    return "unknown";
+}
+
+StageProfiler::StageProfiler() : origin(Clock::now()){
+    for (auto& r : rings){
+        r.samples.resize(kCapacity);
+    }
+}
+
+void StageProfiler::record(Stage s, Clock::time_point begin, Clock::time_point end){
+    std::lock_guard<std::mutex> lock(mtx);
+    Ring& r = rings[(std::size_t)s];
+    Sample& x = r.samples[r.next];
+    x.begin_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - origin).count();
+    x.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+    x.thread = thread_number();
+    r.next = (r.next + 1) % kCapacity;
+    if (r.count < kCapacity) ++r.count;
+}
+
+StageSummary StageProfiler::summary(Stage s) const{
+    const Ring& r = rings[(std::size_t)s];
+    StageSummary out;
+    out.count = r.count;
+    if (r.count == 0) return out;
+    std::vector<double> us(r.count);
+    for (std::size_t k = 0; k < r.count; ++k){
+        us[k] = r.samples[k].duration_ns * 1e-3;
+    }
+    std::sort(us.begin(), us.end());
+    out.p50 = percentile(us, 0.50);
+    out.p95 = percentile(us, 0.95);
+    out.p99 = percentile(us, 0.99);
+    out.max = us.back();
+    return out;
+}
+
+// 完了イベント（"ph": "X"）の配列として書き出す。ts と dur の単位はマイクロ秒
+void StageProfiler::writeChromeTrace(std::ostream& out) const{
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (std::size_t s = 0; s < rings.size(); ++s){
+        const Ring& r = rings[s];
+        // 古い記録から順に書く
+        std::size_t oldest = r.count < kCapacity ? 0 : r.next;
+        for (std::size_t k = 0; k < r.count; ++k){
+            const Sample& x = r.samples[(oldest + k) % kCapacity];
+            out << (first ? "\n" : ",\n")
+                << "{\"name\":\"" << stage_name((Stage)s) << "\",\"cat\":\"simulation\",\"ph\":\"X\""
+                << ",\"ts\":" << x.begin_ns / 1000 << "." << (x.begin_ns % 1000) / 100
+                << ",\"dur\":" << x.duration_ns / 1000 << "." << (x.duration_ns % 1000) / 100
+                << ",\"pid\":1,\"tid\":" << x.thread << "}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void StageProfiler::clear(){
+    for (auto& r : rings){
+        r.next = 0;
+        r.count = 0;
+    }
+}
@@ -0,0 +1,100 @@
+//
+//  profiler.hpp
+//  2D-StableFluids
+//
+//  Simulation の処理段階ごとの所要時間の計測。
+//  - 段階ごとのリングバッファに直近 kCapacity 回分の (開始時刻, 所要時間) を記録する
+//  - p50 / p95 / p99 を問い合わせたり、Chrome のトレース形式（chrome://tracing, Perfetto）で書き出せる
+//  計測は SF_PROFILE を定義してビルドしたときだけ有効（CMake の STABLEFLUIDS_ENABLE_PROFILING）。
+//  定義しない場合 SF_PROFILE_SCOPE は何も生成せず、Simulation も計測用のメンバーを持たない。
+//
+
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// 計測する処理段階
+enum class Stage {
+    Update,         // Simulation::update 全体
+    VelStep,
+    DensStep,
+    AddSource,
+    Advect,
+    Diffuse,
+    Project,
+    SetBnd,
+    ReadDensity,    // getDensity / readDensity の書き出し
+    ActiveTiles,    // 有効なタイルの判定
+    Count,
+};
+
+const char* stage_name(Stage s);
+
+// 段階ごとの統計（時間はマイクロ秒）
+struct StageSummary {
+    std::size_t count = 0;  // リングバッファに残っている記録の数
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+class StageProfiler {
+public:
+    static constexpr std::size_t kCapacity = 4096;  // 段階ごとに保持する記録の数
+
+    StageProfiler();
+
+    using Clock = std::chrono::steady_clock;
+
+    // 複数のスレッドから同時に呼んでよい（作業グラフで並行に進める段階）。読み出しは計測を止めてから行う
+    void record(Stage s, Clock::time_point begin, Clock::time_point end);
+
+    StageSummary summary(Stage s) const;
+    // 記録されている全ての区間を Chrome のトレース形式（JSON）で書き出す
+    void writeChromeTrace(std::ostream& out) const;
+    void clear();
+
+private:
+    struct Sample {
+        std::int64_t begin_ns;      // origin からの開始時刻
+        std::int64_t duration_ns;
+        std::uint32_t thread;       // 記録したスレッドの番号（トレースの tid）
+    };
+    struct Ring {
+        std::vector<Sample> samples;
+        std::size_t next = 0;       // 次に書き込む位置
+        std::size_t count = 0;      // 有効な記録の数（最大 kCapacity）
+    };
+
+    Clock::time_point origin;
+    std::mutex mtx;     // record 同士の排他
+    std::array<Ring, (std::size_t)Stage::Count> rings;
+};
+
+// スコープの開始から終了までを1区間として記録する
+class ScopedStage {
+public:
+    ScopedStage(StageProfiler& p, Stage s) : profiler(p), stage(s), begin(StageProfiler::Clock::now()) {}
+    ~ScopedStage() { profiler.record(stage, begin, StageProfiler::Clock::now()); }
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+    StageProfiler& profiler;
+    Stage stage;
+    StageProfiler::Clock::time_point begin;
+};
+
+#define SF_PROFILE_CONCAT_(a, b) a##b
+#define SF_PROFILE_CONCAT(a, b) SF_PROFILE_CONCAT_(a, b)
+
+#ifdef SF_PROFILE
+#define SF_PROFILE_SCOPE(profiler, stage) ScopedStage SF_PROFILE_CONCAT(sf_profile_scope_, __LINE__)((profiler), (stage))
+#else
+#define SF_PROFILE_SCOPE(profiler, stage) ((void)0)
+#endif
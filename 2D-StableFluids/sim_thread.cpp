@@ -0,0 +1,101 @@
+//
+//  sim_thread.cpp
+//  2D-StableFluids
+//
+
+#include "sim_thread.hpp"
+
+#include <chrono>
+#include <stdexcept>
+
+SimulationThread::SimulationThread(Simulation& s, int n, float step_dt, double ms)
+    : sim(s), N(n), dt(step_dt), step_ms(ms){
+    SimulationFrame blank;
+    blank.rgb.assign((std::size_t)3 * N * N, 0.0f);
+    frames.reset(blank);
+    merged.reserve(kEventCapacity);
+}
+
+SimulationThread::~SimulationThread(){
+    stop();
+}
+
+void SimulationThread::start(){
+    if (running.exchange(true)) return;
+    worker = std::thread([this]{ run(); });
+}
+
+void SimulationThread::stop(){
+    if (!running.exchange(false)) return;
+    worker.join();
+}
+
+// 固定の時間間隔でステップを進める
+// 予定の時刻より遅れていたら待たずに続けて実行し、kMaxCatchUpSteps を超える遅れは諦めて予定を現在に合わせる
+void SimulationThread::run(){
+    using clock = std::chrono::steady_clock;
+    auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(step_ms));
+    auto next = clock::now();
+    while (running.load(std::memory_order_relaxed)){
+        int behind = 0;
+        while (clock::now() >= next && behind < kMaxCatchUpSteps && running.load(std::memory_order_relaxed)){
+            step();
+            next += period;
+            ++behind;
+        }
+        auto now = clock::now();
+        if (now >= next){
+            next = now;     // 追いつけなかった分の遅れ（lag）は捨てる
+        } else {
+            std::this_thread::sleep_until(next);
+        }
+    }
+}
+
+void SimulationThread::step(){
+    sim.reset(N);   // シミュレーションのリセット（描画スレッドで毎フレーム呼んでいたもの）
+
+    // 届いている入力をまとめてから反映する
+    // 描画スレッドはフレームごとに入力を送るので、1ステップの間に同じセルへの入力が何度も届く
+    // 色はセルごとに1回だけ（最後の色で）追加し、力はマウスの移動量を足し合わせて1回だけ与える
+    // （フレームレートによらず、1フレームに1ステップ進めていたときと同じ量になる）
+    merged.clear();
+    SimulationEvent e;
+    while (events.pop(e)){
+        SimulationEvent* same = nullptr;
+        for (SimulationEvent& m : merged){
+            if (m.type == e.type && m.i == e.i && m.j == e.j){
+                same = &m;
+                break;
+            }
+        }
+        if (!same){
+            merged.push_back(e);
+        } else if (e.type == SimulationEvent::Type::Stamp){
+            *same = e;
+        } else {
+            same->a += e.a;
+            same->b += e.b;
+        }
+    }
+    for (const SimulationEvent& m : merged){
+        try {
+            if (m.type == SimulationEvent::Type::Stamp){
+                sim.stamp(m.i, m.j, 1, 1, N, m.a, m.b, m.c);
+            } else {
+                sim.add_force(m.i, m.j, N, m.a, m.b);
+            }
+        } catch (const std::out_of_range&){
+            // グリッドの端のクリックなど、範囲外の入力は無視する
+        }
+    }
+
+    sim.update(N, dt);
+    ++steps;
+
+    // 色データを書き込み用のバッファに書いて公開する（バッファは使い回すので確保は発生しない）
+    SimulationFrame& frame = frames.back();
+    sim.readDensity(N, frame.rgb.data());
+    frame.step = steps;
+    frames.publish();
+}
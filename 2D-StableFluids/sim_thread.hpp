@@ -0,0 +1,84 @@
+//
+//  sim_thread.hpp
+//  2D-StableFluids
+//
+//  シミュレーションを描画とは別のスレッドで固定の時間間隔で進める。
+//  - 入力（外力・染料の追加）は描画スレッドから SPSC キューで送る（ステップごとにセル単位でまとめて反映する）
+//  - 1ステップ進めるごとに色データを三重バッファに書き、描画スレッドは最新のものだけを読む
+//  どちらの受け渡しもロックを使わないため、遅いステップが入力処理や垂直同期を止めることはない。
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "simulation.hpp"
+#include "spsc_queue.hpp"
+#include "triple_buffer.hpp"
+
+// 描画スレッドからシミュレーションへの入力
+struct SimulationEvent {
+    enum class Type {
+        Stamp,  // (i, j) に色 (a, b, c) を追加（stamp と同じ座標）
+        Force,  // (i, j) に速度 (a, b) を与える（add_force と同じ座標）
+    };
+    Type type = Type::Stamp;
+    int i = 0, j = 0;
+    float a = 0.0f, b = 0.0f, c = 0.0f;
+};
+
+// シミュレーションスレッドが公開する1フレーム分の結果
+struct SimulationFrame {
+    std::vector<float> rgb;     // readDensity(N, ...) と同じ並びの RGB
+    std::uint64_t step = 0;     // このフレームを書いた時点のステップ数
+};
+
+class SimulationThread {
+public:
+    /**
+     * sim: 進めるシミュレーション（スレッドの実行中は描画スレッドから触らない）
+     * N: グリッドの一辺、dt: 1ステップのシミュレーション時間
+     * step_ms: 1ステップに割り当てる実時間（ミリ秒）
+     */
+    SimulationThread(Simulation& sim, int N, float dt, double step_ms);
+    ~SimulationThread();    // 実行中なら停止する
+
+    SimulationThread(const SimulationThread&) = delete;
+    SimulationThread& operator=(const SimulationThread&) = delete;
+
+    void start();
+    void stop();
+
+    // 描画スレッド: 入力を送る（キューが満杯なら捨てて false を返す）
+    bool post(const SimulationEvent& e) { return events.push(e); }
+
+    // 描画スレッド: 最新のフレーム（新しいフレームが届いていなければ前回と同じもの）
+    // 戻り値は次に latest を呼ぶまで有効
+    const SimulationFrame& latest(){
+        frames.update();
+        return frames.front();
+    }
+
+    // 遅れを取り戻すために連続して実行するステップ数の上限（これを超えた遅れは捨てる）
+    static constexpr int kMaxCatchUpSteps = 4;
+
+private:
+    void run();
+    void step();
+
+    Simulation& sim;
+    int N;
+    float dt;
+    double step_ms;
+
+    static constexpr std::size_t kEventCapacity = 1024;
+    SpscQueue<SimulationEvent, kEventCapacity> events;
+    std::vector<SimulationEvent> merged;    // step でまとめた入力（確保はコンストラクタで済ませる）
+    TripleBuffer<SimulationFrame> frames;
+    std::uint64_t steps = 0;
+
+    std::atomic<bool> running{false};
+    std::thread worker;
+};
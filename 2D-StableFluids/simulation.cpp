@@ -5,73 +5,402 @@
 //  Created by 堀田大智 on 2025/01/19.
 //
 
+// FMA への縮約を禁止する（CMake では -ffp-contract=off を付けるが、Xcode のプロジェクトなど他のビルドでも効くように）
+// 含めるヘッダーのテンプレートにも効くよう、#include より前に置く
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
 #include "simulation.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+#include "logger.hpp"
+
+namespace {
+
+// 複数チャンネルのカーネルに一度に渡すチャンネル数の上限（ポインタ配列をスタックに置くため）
+constexpr int kChannelBatch = 16;
+
+// 2つの残差の悪い方（どちらかを求めていなければ NaN）
+float worse_residual(float a, float b){
+    if (std::isnan(a) || std::isnan(b)) return std::numeric_limits<float>::quiet_NaN();
+    return std::max(a, b);
+}
+
+// 複数の系の収束情報を、最も悪いものにまとめる
+void merge_worst(SolveStats& into, const SolveStats& s){
+    into.iterations = std::max(into.iterations, s.iterations);
+    into.initial_residual = worse_residual(into.initial_residual, s.initial_residual);
+    into.residual = worse_residual(into.residual, s.residual);
+    into.converged = into.converged && s.converged;
+}
+
+// 最後の投影の圧力・発散 src を前ステップの値の場 dst に写す（角のセルは写さない）
+// 角は移流も拡散も書かず、作業領域の角には融合の検査などの値が残るので、dst の角は元の値のままにする
+template <typename T>
+void copy_projection(int N, const Grid2D<T>& src, Grid2D<T>& dst){
+    for (int j = 0; j <= N + 1; ++j){
+        const int i_begin = (j == 0 || j == N + 1) ? 1 : 0;
+        const int i_end = (j == 0 || j == N + 1) ? N + 1 : N + 2;
+        std::copy(src.row(j) + i_begin, src.row(j) + i_end, dst.row(j) + i_begin);
+    }
+}
+
+// 色とトレーサーの場を切り出す（値は0）
+template <typename S>
+DyeFields<S> make_dye(FieldArena& arena, int n, int channels){
+    DyeFields<S> d;
+    d.cur.reserve(channels);
+    d.prev.reserve(channels);
+    for (int c = 0; c < channels; ++c){
+        d.cur.push_back(arena.take<typename S::value_type>(n, S::store(0)));
+        d.prev.push_back(arena.take<typename S::value_type>(n, S::store(0)));
+    }
+    for (int c = 0; c < channels; ++c){
+        d.cur_list.push_back(&d.cur[c]);
+        d.prev_list.push_back(&d.prev[c]);
+    }
+    return d;
+}
+
+// 格納形式 storage の場1枚分のバイト数
+std::size_t dye_field_bytes(DyeStorage storage, int n){
+    switch (storage){
+        case DyeStorage::Float32: return FieldArena::bytes_for<float>(n);
+        case DyeStorage::Float64: return FieldArena::bytes_for<double>(n);
+        default: return FieldArena::bytes_for<std::uint16_t>(n);
+    }
+}
+
+// チェックポイント m の場 name の領域（要素の型と並びが g と違う場合は std::runtime_error）
+template <typename T>
+T* checkpoint_field(const MappedCheckpoint& m, const std::string& name, const Grid2D<T>& g){
+    const CheckpointField* f = m.find(name);
+    if (!f){
+        throw std::runtime_error("checkpoint has no field: " + name);
+    }
+    if (f->elem_bytes != sizeof(T) || f->n != (std::uint32_t)g.n() || f->pitch != (std::uint32_t)g.pitch() ||
+        f->bytes != Grid2D<T>::storage_size(g.n()) * sizeof(T)){
+        throw std::runtime_error("checkpoint field layout mismatch: " + name + " (elem_bytes=" +
+                                 std::to_string(f->elem_bytes) + ", n=" + std::to_string(f->n) + ", pitch=" +
+                                 std::to_string(f->pitch) + "; the simulation has " + std::to_string(sizeof(T)) + ", " +
+                                 std::to_string(g.n()) + ", " + std::to_string(g.pitch()) + ")");
+    }
+    return static_cast<T*>(m.block(*f));
+}
+
+} // namespace
+
 // コンストラクタ: シミュレーションの初期化
-Simulation::Simulation(int n) {
-    size = (n + 2) * (n + 2);   // グリッドサイズを計算
-    // ベクターを0で初期化
-    x.resize(size);
-    std::fill(x.begin(), x.end(), 0.0);
-    
-    y.resize(size);
-    std::fill(y.begin(), y.end(), 0.0);
-    
-    x_prev.resize(size);
-    std::fill(x_prev.begin(), x_prev.end(), 2.0);   // 前ステップのx速度を2.0で初期化
-    
-    y_prev.resize(size);
-    std::fill(y_prev.begin(), y_prev.end(), -2.0);  // 前ステップの速度を2.0で初期化
-    
-    dens.resize(size);
-    std::fill(dens.begin(), dens.end(), 0.0);   // 密度を0で初期化
-    
-    dens_prev.resize(size);
-    std::fill(dens_prev.begin(), dens_prev.end(), 0.0); // 前ステップの密度を0で初期化
-    
-    r.resize(size);
-    std::fill(r.begin(), r.end(), 0.0); // 赤色成分を0で初期化
-    
-    r_prev.resize(size);
-    std::fill(r_prev.begin(), r_prev.end(), 0.0);   // 前ステップの赤色成分を0で初期化
+// 全ての場（速度・密度・色・トレーサー・投影用の作業領域・ソルバーの作業領域）を1つのアリーナから切り出す
+template <typename Real, typename Accum>
+BasicSimulation<Real, Accum>::BasicSimulation(int n, int tracer_count, DyeStorage storage, void* memory,
+                                              const NumaOptions& numa) : dye_storage(storage), numa_options(numa) {
+    const int channels = 3 + tracer_count;  // r, g, b + トレーサー
+    if (memory){
+        arena.attach(memory, arenaBytes(n, tracer_count, storage));
+    } else {
+        arena.reserve(arenaBytes(n, tracer_count, storage));
+    }
+    // first-touch では切り出すときに値を書かず、最後にソルバーのスレッドで書く
+    arena.setDeferredFill(numa.first_touch);
     
-    g.resize(size);
-    std::fill(g.begin(), g.end(), 0.0); // 緑色成分を0で初期化
+    // 速度場と密度場を0で初期化
+    x = arena.take<Real>(n, Real(0));
+    y = arena.take<Real>(n, Real(0));
+    x_prev = arena.take<Real>(n, Real(2));    // 前ステップのx速度を2.0で初期化
+    y_prev = arena.take<Real>(n, Real(-2));   // 前ステップの速度を2.0で初期化
+    dens = arena.take<Real>(n, Real(0));      // 密度を0で初期化
+    dens_prev = arena.take<Real>(n, Real(0)); // 前ステップの密度を0で初期化
     
-    g_prev.resize(size);
-    std::fill(g_prev.begin(), g_prev.end(), 0.0);   // 前ステップの緑色成分を0で初期化
+    // 色成分（赤・緑・青）とトレーサー、それぞれの前ステップの値を0で初期化
+    switch (storage){
+        case DyeStorage::Float32: dye = make_dye<Float32Storage>(arena, n, channels); break;
+        case DyeStorage::Float16: dye = make_dye<Float16Storage>(arena, n, channels); break;
+        case DyeStorage::BFloat16: dye = make_dye<BFloat16Storage>(arena, n, channels); break;
+        case DyeStorage::Fixed16: dye = make_dye<Fixed16Storage<>>(arena, n, channels); break;
+        case DyeStorage::Float64: dye = make_dye<Float64Storage>(arena, n, channels); break;
+    }
     
-    b.resize(size);
-    std::fill(b.begin(), b.end(), 0.0); // 青色成分を0で初期化
+    // 投影処理とソルバーの作業領域
+    pressure = arena.take<Real>(n, Real(0));
+    divergence = arena.take<Real>(n, Real(0));
+    residual = arena.take<Real>(n, Real(0));
+    x_adv = arena.take<Real>(n, Real(0));
+    y_adv = arena.take<Real>(n, Real(0));
+    multigrid.bind(n, arena, residual);
+    cg.bind(n, arena, residual);
     
-    b_prev.resize(size);
-    std::fill(b_prev.begin(), b_prev.end(), 0.0);   // 前ステップの青色成分を0で初期化
+    row_speed.assign(n + 2, Real(0));
     
+    pool = std::make_unique<ThreadPool>(1, numa.pin_threads);
+    if (numa.first_touch || numa.threads != 1){
+        setThreadCount(numa.threads);
+    }
+    if (numa.first_touch){
+        // 行ループと同じく行を pool->size() 個の連続した区間に分け、t 番目のスレッドが t 番目の区間の行を最初に書く
+        pool->parallel_for(0, n + 2, [&](int lo, int hi){ arena.fill_deferred(lo, hi, n + 2); });
+        arena.clear_deferred();
+        arena.setDeferredFill(false);
+    }
+    setSimdIsa(SimdIsa::Auto);
+}
+
+template <typename Real, typename Accum>
+std::size_t BasicSimulation<Real, Accum>::arenaBytes(int n, int tracer_count, DyeStorage storage){
+    const int channels = 3 + tracer_count;  // r, g, b + トレーサー
+    const int fields = 6 + 5;   // 速度・密度の組 + 圧力・発散・残差・輸送先
+    return fields * FieldArena::bytes_for<Real>(n)
+           + 2 * channels * dye_field_bytes(storage, n)
+           + BasicMultigridSolver<Real, Accum>::workspace_bytes(n)
+           + BasicConjugateGradientSolver<Real, Accum>::workspace_bytes(n);
 }
 
 // デストラクタ
-Simulation::~Simulation(){
+template <typename Real, typename Accum>
+BasicSimulation<Real, Accum>::~BasicSimulation(){
     
 }
 
+// 移流カーネルの命令セットの設定
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::setSimdIsa(SimdIsa isa){
+    if constexpr (std::is_same_v<Real, float>){
+        simd_isa = resolve_simd_isa(isa);
+        advect_fn = advect_kernel(simd_isa);
+    } else {
+        simd_isa = SimdIsa::Scalar;     // fp64 の場はスカラー版だけ
+        advect_fn = advect_kernel_f64();
+    }
+}
+
+// スレッド数の設定
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::setThreadCount(int threads){
+    if (threads <= 0){
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (threads != pool->size()){
+        make_pools(threads);
+    }
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::setTaskGraph(bool on){
+    if (on != task_graph){
+        task_graph = on;
+        make_pools(pool->size());
+    }
+}
+
+// 作業グラフを使う場合、行ループも作業グラフと同じプールで分け合う（作業の中から pool->parallel_for を呼べる）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::make_pools(int threads){
+    pool.reset();   // tasks を参照しているので先に破棄する
+    tasks.reset();
+    if (task_graph){
+        tasks = std::make_unique<WorkStealingPool>(threads);
+        pool = std::make_unique<ThreadPool>(*tasks);
+    } else {
+        pool = std::make_unique<ThreadPool>(threads, numa_options.pin_threads);
+    }
+}
+
+template <typename Real, typename Accum>
+NumaPlacement BasicSimulation<Real, Accum>::getNumaPlacement() const{
+    NumaPlacement out = page_placement(arena.data(), arena.used());
+    for (int t = 0; t < pool->size(); ++t){
+        int cpu = tasks ? -1 : pool->cpu(t);
+        out.thread_nodes.push_back(cpu < 0 ? -1 : cpu_node(cpu));
+    }
+    return out;
+}
+
+// タイル分割したループ
+// タイルの行（j 方向）を単位としてスレッドに分割し、各タイルの中はメモリ順（i が内側）に走査する
+template <typename Real, typename Accum>
+template <typename F>
+void BasicSimulation<Real, Accum>::for_each_tile(int N, F&& fn){
+    int T = tile_size;
+    int tile_rows = (N + T - 1) / T;
+    pool->parallel_for(0, tile_rows, [&](int t_begin, int t_end){
+        for (int t = t_begin; t < t_end; ++t){
+            int j_begin = 1 + t * T;
+            int j_end = std::min(N + 1, j_begin + T);
+            for (int i_begin = 1; i_begin <= N; i_begin += T){
+                fn(i_begin, std::min(N + 1, i_begin + T), j_begin, j_end);
+            }
+        }
+    });
+}
+
+// 有効なタイルだけのループ
+// タイルの一覧を連続した区間に分けてスレッドに割り当てる（一覧はタイルの行の順に並んでいる）
+template <typename Real, typename Accum>
+template <typename F>
+void BasicSimulation<Real, Accum>::for_each_active_tile(int N, F&& fn){
+    if (!sparse_mask(N)){
+        for_each_tile(N, fn);
+        return;
+    }
+    const std::vector<int>& tiles = active_tiles.activeTiles();
+    pool->parallel_for(0, (int)tiles.size(), [&](int k_begin, int k_end){
+        for (int k = k_begin; k < k_end; ++k){
+            int i_begin, i_end, j_begin, j_end;
+            active_tiles.bounds(tiles[k], i_begin, i_end, j_begin, j_end);
+            fn(i_begin, i_end, j_begin, j_end);
+        }
+    });
+}
+
+// 格子の境界に接する無効なタイル（無効なタイルは移流しないが、ゴーストセルは set_bnd と同じく毎回書く）
+template <typename Real, typename Accum>
+template <typename F>
+void BasicSimulation<Real, Accum>::for_each_inactive_edge_tile(int N, F&& fn){
+    if (!sparse_mask(N)) return;
+    int n = active_tiles.tilesPerSide();
+    for (int t = 0; t < active_tiles.tileCount(); ++t){
+        int tx = t % n;
+        int ty = t / n;
+        if (active_tiles.isActive(t) || (tx != 0 && tx != n - 1 && ty != 0 && ty != n - 1)) continue;
+        int i_begin, i_end, j_begin, j_end;
+        active_tiles.bounds(t, i_begin, i_end, j_begin, j_end);
+        fn(i_begin, i_end, j_begin, j_end);
+    }
+}
+
+// 有効タイルは update で判定した大きさの格子にだけ使う（判定前や別の大きさの格子では全体を処理する）
+template <typename Real, typename Accum>
+const ActiveTileMask* BasicSimulation<Real, Accum>::sparse_mask(int N) const{
+    return sparse_options.enabled && active_tiles.size() == N ? &active_tiles : nullptr;
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::setSparseOptions(const SparseOptions& opt){
+    sparse_options = opt;
+    sparse_options.tile = std::max(1, opt.tile);
+    sparse_options.halo = std::max(1, opt.halo);   // 0 では有効な領域が広がらず、拡散した値が無効なタイルで消える
+    active_tiles = ActiveTileMask();    // 無効の間は全体を書き換えているので、次の update で全てのタイルを判定し直す
+}
+
+// 有効なタイルの判定
+// 無効なタイルの値は0なので、調べるのは有効なタイルと touch されたタイル（外力・スタンプ・格子全体を書き換えた後）だけ
+// 速度は前ステップの値（ソース項）も含めて、色とトレーサーは cur と prev の両方を調べる
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::update_active_tiles(int N){
+    SF_PROFILE_SCOPE(profiler, Stage::ActiveTiles);
+    if (active_tiles.size() != N || active_tiles.tileSize() != sparse_options.tile){
+        active_tiles.resize(N, sparse_options.tile);
+        tile_seed.assign(active_tiles.tileCount(), 0);
+    }
+    if (solver == LinearSolver::ConjugateGradient){
+        active_tiles.touchAll();    // 共役勾配法の拡散は無効なタイルにも値を書く
+    }
+    const std::vector<int>& candidates = active_tiles.beginUpdate();
+    const Real vthr = (Real)sparse_options.velocity_threshold;
+    const Real dthr = (Real)sparse_options.dye_threshold;
+    // タイルの中に絶対値が thr を超えるセルがあるか
+    auto exceeds = [](const auto& g, auto load, Real thr, int i_begin, int i_end, int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            const auto* r = g.row(j);
+            for (int i = i_begin; i < i_end; ++i){
+                Real v = (Real)load(r[i]);
+                if (v > thr || -v > thr) return true;
+            }
+        }
+        return false;
+    };
+    pool->parallel_for(0, (int)candidates.size(), [&](int k_begin, int k_end){
+        for (int k = k_begin; k < k_end; ++k){
+            int t = candidates[k];
+            int i_begin, i_end, j_begin, j_end;
+            active_tiles.bounds(t, i_begin, i_end, j_begin, j_end);
+            auto native = [](Real v){ return v; };
+            bool hot = false;
+            for (const Grid2D<Real>* g : { &x, &y, &x_prev, &y_prev }){
+                hot = hot || exceeds(*g, native, vthr, i_begin, i_end, j_begin, j_end);
+            }
+            if (!hot){
+                hot = std::visit([&](const auto& d){
+                    using S = typename std::decay_t<decltype(d)>::storage;
+                    auto load = [](typename S::value_type v){ return S::load(v); };
+                    for (int c = 0; c < d.channels(); ++c){
+                        if (exceeds(d.cur[c], load, dthr, i_begin, i_end, j_begin, j_end) ||
+                            exceeds(d.prev[c], load, dthr, i_begin, i_end, j_begin, j_end)) return true;
+                    }
+                    return false;
+                }, dye);
+            }
+            tile_seed[t] = hot;
+        }
+    });
+    active_tiles.finishUpdate(tile_seed, sparse_options.halo);
+    
+    // 無効になったタイルの内部セルと、タイルが接する境界のゴーストセル（角は除く）を0にする
+    const std::vector<int>& retired = active_tiles.retired();
+    pool->parallel_for(0, (int)retired.size(), [&](int k_begin, int k_end){
+        for (int k = k_begin; k < k_end; ++k){
+            int i_begin, i_end, j_begin, j_end;
+            active_tiles.bounds(retired[k], i_begin, i_end, j_begin, j_end);
+            auto clear = [&](auto& g, auto zero){
+                for (int j = j_begin; j < j_end; ++j){
+                    std::fill(g.row(j) + i_begin, g.row(j) + i_end, zero);
+                    if (i_begin == 1) g(0, j) = zero;
+                    if (i_end == N + 1) g(N + 1, j) = zero;
+                }
+                if (j_begin == 1) std::fill(g.row(0) + i_begin, g.row(0) + i_end, zero);
+                if (j_end == N + 1) std::fill(g.row(N + 1) + i_begin, g.row(N + 1) + i_end, zero);
+            };
+            for (Grid2D<Real>* g : { &x, &y, &x_prev, &y_prev, &x_adv, &y_adv }){
+                clear(*g, Real(0));
+            }
+            std::visit([&](auto& d){
+                using S = typename std::decay_t<decltype(d)>::storage;
+                for (int c = 0; c < d.channels(); ++c){
+                    clear(d.cur[c], S::store(0));
+                    clear(d.prev[c], S::store(0));
+                }
+            }, dye);
+        }
+    });
+}
+
 // ステップ1: 外力項の加算（クリックしたセルに対して外力を適用）
 // X, Y: クリックした座標
 // N: グリットサイズ
 // u, v: マウスの動く方向に働く力（速度）
-void Simulation::add_force(int X, int Y, int N, float u, float v){
-    std::cout << "This is add_force function" << std::endl;
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::add_force(int X, int Y, int N, Real u, Real v){
+    SF_LOG_TRACE("add_force ({}, {}) u={} v={}", X, Y, u, v);
     if (X <= 0 || X > N || Y <= 0 || Y > N){
         throw std::out_of_range("Index is  out of range.");
     }
     // クリックしたセルにおいて、速度フィールドの前ステップの値に速度u, vを代入
-    x_prev[IX(Y, X)] = u;
-    y_prev[IX(Y, X)] = v;
+    x_prev(Y, X) = u;
+    y_prev(Y, X) = v;
+    active_tiles.touch(Y, Y + 1, X, X + 1);
 }
 
 // 全てのセルに対して、外部からの影響を時間ステップに基づいて加算する
-void Simulation::add_source(int N, std::vector<float>& x, std::vector<float>& s, float dt){
-    for (int i = 0; i < size; ++i){
-        x[i] += dt * s[i];  // 各セルにソース項を加算
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::add_source(int N, Grid2D<Real>& x, Grid2D<Real>& s, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::AddSource);
+    // ゴーストセルと行末の詰め物も含めて連続した領域として処理する（詰め物の値は計算に使われない）
+    // N + 2 行（ゴースト行を含む）を行の要素数 pitch ごとに並べた全体
+    Real* xp = x.data();
+    const Real* sp = s.data();
+    std::size_t count = (std::size_t)x.pitch() * (N + 2);
+    for (std::size_t k = 0; k < count; ++k){
+        xp[k] += dt * sp[k];    // 各セルにソース項を加算
     }
 }
 
@@ -83,38 +412,87 @@ void Simulation::add_source(int N, std::vector<float>& x, std::vector<float>& s,
 // d0: 一つ前の時間ステップでの密度や速度場
 // (u, v): xy成分の速度
 // dt: 時間ステップの大きさ
-void Simulation::advect(int N, int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>& u, std::vector<float>& v, float dt){
-    int i, j, i0, j0, i1, j1;
-    float x, y, s0, t0, s1, t1, dt0;
-    dt0 = dt * N;   // 時間ステップとグリッドサイズに基づくスケーリング係数
-    // 全てのセルに対して処理
-    for (int i = 1; i <= N; ++i){
-        for(int j = 1; j <= N; ++j){
-            x = i - dt0 * u[IX(i, j)];  // x方向の移流後の位置を逆に辿る
-            y = j - dt0 * v[IX(i, j)];  // y方向の移流後の位置を逆に辿る
-            
-            // xとyの範囲をクリップしてシミュレーション領域外にでないようにする
-            if (x < 0.5) x = 0.5;
-            if (x > N + 0.5) x = N + 0.5;
-            i0 = (int)x;    // 移流元の整数部分のインデックス
-            i1 = i0 + 1;    // 隣接するインデックス（補間に使用)
-            
-            if (y < 0.5) y = 0.5;
-            if (y > N + 0.5) y = N + 0.5;
-            j0 = (int)y;    // 移流元の整数部分のインデックス
-            j1 = j0 + 1;    // 隣接するインデックス（補間に使用）
-            
-            s1 = x - i0;    // x方向の補間比率
-            s0 = 1 - s1;    // x方向の逆補間比率
-            t1 = y - j0;    // y方向の補間比率
-            t0 = 1 - t1;    // y方向の逆補間比率
-            
-            // 移流後の値を計算し、周囲4つのセルからの補間によって求める
-            d[IX(i, j)] = s0 * (t0 * d0[IX(i0, j0)] + t1 * d0[IX(i0, j1)]) +
-                          s1 * (t0 * d0[IX(i1, j0)] + t1 * d0[IX(i1, j1)]);
-        }
-    }
-    set_bnd(N, b, d);   // 境界条件を設定
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::advect(int N, int b, Grid2D<Real>& d, Grid2D<Real>& d0, Grid2D<Real>& u, Grid2D<Real>& v, Real dt){
+    Grid2D<Real>* dp = &d;
+    Grid2D<Real>* d0p = &d0;
+    advect(N, b, 1, &dp, &d0p, u, v, dt);
+}
+
+// 複数の場の移流処理
+// d[c]: c 番目の場の移流後の値、d0[c]: 移流前の値
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::advect(int N, int b, int channels, Grid2D<Real>* const* d, Grid2D<Real>* const* d0, Grid2D<Real>& u, Grid2D<Real>& v, Real dt){
+    int bs[kChannelBatch];
+    std::fill(bs, bs + kChannelBatch, b);
+    for (int c0 = 0; c0 < channels; c0 += kChannelBatch){
+        int count = std::min(kChannelBatch, channels - c0);
+        transport(N, count, bs, d + c0, d0 + c0, nullptr, u, v, nullptr, nullptr, dt);
+    }
+}
+
+// 融合した輸送処理
+// ソース項は補間に使う4点にその場で足すので、d0 + dt * s の場を作る走査がない
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::transport(int N, int channels, const int* b, Grid2D<Real>* const* d, Grid2D<Real>* const* d0, Grid2D<Real>* const* s,
+                           Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>* us, Grid2D<Real>* vs, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::Advect);
+    for (int c0 = 0; c0 < channels; c0 += kChannelBatch){
+        int count = std::min(kChannelBatch, channels - c0);
+        Real* dst[kChannelBatch];
+        const Real* src[kChannelBatch];
+        const Real* add[kChannelBatch];
+        for (int c = 0; c < count; ++c){
+            dst[c] = d[c0 + c]->data();
+            src[c] = d0[c0 + c]->data();
+            add[c] = s ? s[c0 + c]->data() : nullptr;
+        }
+        BasicAdvectFields<Real> f;
+        f.channels = count;
+        f.d = dst;
+        f.d0 = src;
+        f.s = s ? add : nullptr;
+        f.u = u.data();
+        f.v = v.data();
+        f.us = us ? us->data() : nullptr;
+        f.vs = vs ? vs->data() : nullptr;
+        f.dt = dt;
+        advect_tiles(N, u.pitch(), b + c0, f);
+    }
+}
+
+// 全てのセルに対して、逆に辿った位置の値を周囲4つのセルから補間する（タイル単位で並列処理）
+// カーネルの本体は advect_kernels.cpp（CPU に合わせて AVX2 / AVX-512 版を選ぶ）
+// 境界条件はタイルごとに適用する: タイルが接する境界のゴーストセルを、そのタイルを移流した直後に書く
+// （値も書く範囲も set_bnd と同じで、角のセルは書かない。ゴースト層だけを後から走査し直すことはない）
+// 有効タイルを使う場合、境界に接する無効なタイルのゴーストセルも書く（内部セルは0なので、set_bnd と同じく符号付きの0になる）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::advect_tiles(int N, int stride, const int* b, const BasicAdvectFields<Real>& f){
+    Real dt0 = f.dt * N;   // 時間ステップとグリッドサイズに基づくスケーリング係数
+    auto ghosts = [&](int i_begin, int i_end, int j_begin, int j_end){
+        for (int c = 0; c < f.channels; ++c){
+            Real* d = f.d[c];
+            Real sx = b[c] == 1 ? Real(-1) : Real(1);
+            Real sy = b[c] == 2 ? Real(-1) : Real(1);
+            if (j_begin == 1){
+                for (int i = i_begin; i < i_end; ++i) d[i] = sy * d[i + stride];    // 下端
+            }
+            if (i_begin == 1){
+                for (int j = j_begin; j < j_end; ++j) d[stride * j] = sx * d[1 + stride * j];     // 左端
+            }
+            if (i_end == N + 1){
+                for (int j = j_begin; j < j_end; ++j) d[N + 1 + stride * j] = sx * d[N + stride * j];     // 右端
+            }
+            if (j_end == N + 1){
+                for (int i = i_begin; i < i_end; ++i) d[i + stride * (N + 1)] = sy * d[i + stride * N];   // 上端
+            }
+        }
+    };
+    for_each_active_tile(N, [&](int i_begin, int i_end, int j_begin, int j_end){
+        advect_fn(N, stride, f, dt0, i_begin, i_end, j_begin, j_end);
+        ghosts(i_begin, i_end, j_begin, j_end);
+    });
+    for_each_inactive_edge_tile(N, ghosts);
 }
 
 // ステップ3: 粘性項の扱い（拡散方程式）
@@ -124,20 +502,231 @@ void Simulation::advect(int N, int b, std::vector<float>& d, std::vector<float>&
 // x0: 直前の時間ステップの値
 // diff: 拡散係数（粘性係数）
 // dt: 時間ステップ
-void Simulation::diffuse(int N, int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt){
-    int i, j, k;
-    float a = dt * diff * N * N;    // 粘性係数ν, Δt, 1 /Δx^2 をまとめたもの
-    for (k = 0; k < 20; ++k){   // ガウス・ザイデル法の反復回数
-        // 全てのセルに対して行う
-        for (i = 1; i <= N; ++i){
-            for (j = 1; j <= N; ++j){
-                // 拡散方程式を陰的な評価で離散化
-                x[IX(i, j)] = (x0[IX(i, j)] + a * (x[IX(i - 1, j)] + x[IX(i + 1, j)] +
-                                                   x[IX(i, j -1)] + x[IX(i, j + 1)])) / (1 + 4 * a);
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::diffuse(int N, int b, Grid2D<Real>& x, Grid2D<Real>& x0, Real diff, Real dt){
+    Grid2D<Real>* xp = &x;
+    Grid2D<Real>* x0p = &x0;
+    return diffuse(N, b, 1, &xp, &x0p, diff, dt);
+}
+
+// 複数の場の拡散処理
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::diffuse(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real diff, Real dt){
+    diffusion_stats = diffuse_solve(N, b, channels, x, x0, diff, dt);
+    return diffusion_stats;
+}
+
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::diffuse_solve(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real diff, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::Diffuse);
+    Real a = dt * diff * N * N;    // 粘性係数ν, Δt, 1 /Δx^2 をまとめたもの
+    // 拡散方程式を陰的な評価で離散化し、ガウス・ザイデル法で20回反復（有効タイルを使う場合は有効なタイルだけ）
+    if (solver == LinearSolver::ConjugateGradient){
+        return lin_solve(N, b, channels, x, x0, a, 1 + 4 * a, 20);
+    }
+    return gauss_seidel<NativeStorage>(N, b, channels, x, x0, a, 1 + 4 * a, 20, false, Real(0), sparse_mask(N));
+}
+
+// ソース項を融合した拡散処理
+// x[c]: 書き込み先（初期値はソース項）、x0[c]: 右辺（ソース項を足す前の場）
+// x0[c] に dt * x[c] を足してから diffuse するのと同じ結果になる
+// ガウス・ザイデル法では最初の反復で各行を更新する直前に右辺へ足すので、add_source の走査がない
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::diffuse_with_source(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real diff, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::Diffuse);
+    Real a = dt * diff * N * N;
+    if (solver == LinearSolver::ConjugateGradient){
+        // 共役勾配法は初期残差を求める前に右辺が揃っている必要がある
+        for (int ch = 0; ch < channels; ++ch){
+            add_source(N, *x0[ch], *x[ch], dt);
+        }
+        return lin_solve(N, b, channels, x, x0, a, 1 + 4 * a, 20);
+    }
+    return gauss_seidel<NativeStorage>(N, b, channels, x, x0, a, 1 + 4 * a, 20, true, dt, sparse_mask(N));
+}
+
+// 線形ソルバー
+// x: 解（初期値として現在の値を使う）
+// x0: 右辺
+// a: 隣接セルの係数、c: 対角成分
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::lin_solve(int N, int b, Grid2D<Real>& x, Grid2D<Real>& x0, Real a, Real c, int iters){
+    Grid2D<Real>* xp = &x;
+    Grid2D<Real>* x0p = &x0;
+    return lin_solve(N, b, 1, &xp, &x0p, a, c, iters);
+}
+
+// 複数の線形系をまとめて解く
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::lin_solve(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real a, Real c, int iters){
+    SolveStats stats;
+    if (solver == LinearSolver::ConjugateGradient){
+        // 共役勾配法は内積が系ごとに異なるため、1つずつ解いて最も悪い収束情報をまとめる
+        stats.converged = true;
+        for (int ch = 0; ch < channels; ++ch){
+            SolveStats s = cg.solve(N, b, *x[ch], *x0[ch], a, c, pool.get());
+            set_bnd(N, b, *x[ch]);
+            merge_worst(stats, s);
+        }
+        return stats;
+    }
+    return gauss_seidel<NativeStorage>(N, b, channels, x, x0, a, c, iters, false, Real(0));
+}
+
+// ガウス・ザイデル法（辞書式または赤黒）で channels 個の系を kChannelBatch 個ずつ解く
+// fold_source: 最初の反復で各行を更新する直前に x0[c] += dt * x[c] を行う（diffuse_with_source を参照）
+// 格納形式 S の要素は S::load で読み、A で計算する（NativeStorage では変換はない）
+template <typename Real, typename Accum>
+template <typename S, typename A>
+SolveStats BasicSimulation<Real, Accum>::gauss_seidel(int N, int b, int channels, Grid2D<typename S::value_type>* const* x, Grid2D<typename S::value_type>* const* x0,
+                                                      A a, A c, int iters, bool fold_source, Real dt, const ActiveTileMask* mask){
+    using T = typename S::value_type;
+    SolveStats stats;
+    if (!residual_telemetry){
+        stats.initial_residual = stats.residual = std::numeric_limits<float>::quiet_NaN();
+    }
+    for (int c0 = 0; c0 < channels; c0 += kChannelBatch){
+        int count = std::min(kChannelBatch, channels - c0);
+        T* dst[kChannelBatch];
+        T* rhs[kChannelBatch];
+        for (int ch = 0; ch < count; ++ch){
+            dst[ch] = x[c0 + ch]->data();
+            rhs[ch] = x0[c0 + ch]->data();
+            if (residual_telemetry){
+                float r = (float)residual_norm<S, A>(N, *x[c0 + ch], *x0[c0 + ch], a, c, fold_source ? dt : Real(0));
+                stats.initial_residual = std::max(stats.initial_residual, r);
+            }
+        }
+        if (solver == LinearSolver::RedBlackGaussSeidel){
+            for (int k = 0; k < iters; ++k){
+                red_black_sweep<S, A>(N, x[c0]->pitch(), count, dst, rhs, a, c, fold_source && k == 0, dt, mask);
+                // 境界条件の適用
+                for (int ch = 0; ch < count; ++ch){
+                    set_bnd_as<S>(N, b, *x[c0 + ch]);
+                }
+            }
+        } else {
+            gauss_seidel_wavefront<S, A>(N, x[c0]->pitch(), b, count, dst, rhs, a, c, iters, fold_source, dt, mask);
+        }
+        if (residual_telemetry){
+            // fold_source では右辺にソース項を足し終えているので、x0 をそのまま使う
+            for (int ch = 0; ch < count; ++ch){
+                float r = (float)residual_norm<S, A>(N, *x[c0 + ch], *x0[c0 + ch], a, c, Real(0));
+                stats.residual = std::max(stats.residual, r);
+            }
+        }
+    }
+    stats.iterations = iters;
+    return stats;
+}
+
+// 残差ノルム（反復とは別に1回走査する。並行に進む作業からも呼ぶので、場と作業領域には書かない）
+template <typename Real, typename Accum>
+template <typename S, typename A>
+double BasicSimulation<Real, Accum>::residual_norm(int N, const Grid2D<typename S::value_type>& x, const Grid2D<typename S::value_type>& x0,
+                                                   A a, A c, Real fold_dt) const{
+    double sum = 0.0;
+    for (int j = 1; j <= N; ++j){
+        for (int i = 1; i <= N; ++i){
+            A xc = S::load(x(i, j));
+            A rhs = (A)S::load(x0(i, j)) + (A)fold_dt * xc;
+            A r = rhs - (c * xc - a * ((A)S::load(x(i - 1, j)) + S::load(x(i + 1, j)) +
+                                       S::load(x(i, j - 1)) + S::load(x(i, j + 1))));
+            sum += (double)r * r;
+        }
+    }
+    return std::sqrt(sum);
+}
+
+// 辞書式順序のガウス・ザイデル法（メモリ順: 行 j ごとに i を順に更新）
+// 各チャンネルは独立なので、セルごとに全チャンネルを更新しても1チャンネルずつ解いた結果と一致する
+//
+// 反復 t の行 j は「反復 t の行 j-1」と「反復 t-1 の行 j+1」の更新後に計算できる。
+// そこでステージ s で反復 t の行 j = s - 2t + 1 を処理するウェーブフロント（時間方向のブロッキング）にすると、
+// 全反復を1回のグリッド走査で済ませられ、キャッシュ上にある約 2*iters 行だけを使い回す。
+// 境界条件は行ごとに適用する（左右のゴーストセルはその行、上下のゴースト行は行 1 と行 N から決まる）ので、
+// 1反復ずつ全体を走査して毎回 set_bnd を呼ぶ場合とビット単位で同じ結果になる。
+// 有効タイルを使う場合は、各行で有効なタイルの範囲だけを更新する（無効なタイルのセルは0で、近傍も0なら更新しても0のまま）
+template <typename Real, typename Accum>
+template <typename S, typename A>
+void BasicSimulation<Real, Accum>::gauss_seidel_wavefront(int N, int stride, int b, int channels, typename S::value_type* const* x, typename S::value_type* const* x0,
+                                                          A a, A c, int iters, bool fold_source, Real dt, const ActiveTileMask* mask){
+    using T = typename S::value_type;
+    Real sx = b == 1 ? Real(-1) : Real(1);   // 左右の境界での符号
+    Real sy = b == 2 ? Real(-1) : Real(1);   // 上下の境界での符号
+    const ActiveTileMask::Span full = { 1, N + 1 };
+    int stages = N + 2 * (iters - 1);
+    for (int s = 0; s < stages; ++s){
+        for (int t = 0; t < iters; ++t){
+            int j = s - 2 * t + 1;
+            if (j > N) continue;
+            if (j < 1) break;
+            int span_count = 1;
+            const ActiveTileMask::Span* spans = mask ? mask->rowSpans(j, span_count) : &full;
+            for (int ch = 0; ch < channels; ++ch){
+                T* xc = x[ch] + stride * j;     // 行 j の (0, j)
+                T* x0c = x0[ch] + stride * j;
+                for (int k = 0; k < span_count; ++k){
+                    int i_begin = spans[k].i_begin;
+                    int i_end = spans[k].i_end;
+                    if (fold_source && t == 0){
+                        // 最初の反復: この行はまだ更新していないので、xc は初期値（ソース項）のまま
+                        for (int i = i_begin; i < i_end; ++i) x0c[i] = S::store(S::load(x0c[i]) + dt * S::load(xc[i]));
+                    }
+                    for (int i = i_begin; i < i_end; ++i){
+                        xc[i] = S::store(((A)S::load(x0c[i]) + a * ((A)S::load(xc[i - 1]) + S::load(xc[i + 1]) +
+                                                                    S::load(xc[i - stride]) + S::load(xc[i + stride]))) / c);
+                    }
+                }
+                // この行の境界条件
+                xc[0] = S::store(sx * S::load(xc[1]));
+                xc[N + 1] = S::store(sx * S::load(xc[N]));
+                if (j == 1){
+                    for (int i = 1; i <= N; ++i) xc[i - stride] = S::store(sy * S::load(xc[i]));
+                }
+                if (j == N){
+                    for (int i = 1; i <= N; ++i) xc[i + stride] = S::store(sy * S::load(xc[i]));
+                }
             }
         }
-        // 境界条件の適用
-        set_bnd(N, b, x);
+    }
+}
+
+// 赤黒順序のガウス・ザイデル法
+// (i + j) が偶数のセル（赤）を先に全て更新し、次に奇数のセル（黒）を更新する
+// 同じ色のセルは互いに依存しないため、行（j）単位でスレッドに分割できる
+template <typename Real, typename Accum>
+template <typename S, typename A>
+void BasicSimulation<Real, Accum>::red_black_sweep(int N, int stride, int channels, typename S::value_type* const* x, typename S::value_type* const* x0,
+                                                   A a, A c, bool fold_source, Real dt, const ActiveTileMask* mask){
+    using T = typename S::value_type;
+    A inv_c = A(1) / c;
+    const ActiveTileMask::Span full = { 1, N + 1 };
+    for (int color = 0; color < 2; ++color){
+        pool->parallel_for(1, N + 1, [&](int j_begin, int j_end){
+            for (int j = j_begin; j < j_end; ++j){
+                int span_count = 1;
+                const ActiveTileMask::Span* spans = mask ? mask->rowSpans(j, span_count) : &full;
+                for (int ch = 0; ch < channels; ++ch){
+                    T* xc = x[ch] + stride * j;     // 行 j の (0, j)
+                    T* x0c = x0[ch] + stride * j;
+                    for (int k = 0; k < span_count; ++k){
+                        int i_begin = spans[k].i_begin;
+                        int i_end = spans[k].i_end;
+                        if (fold_source && color == 0){
+                            // 赤のセルを更新する前なので、この行の xc は全て初期値（ソース項）のまま
+                            for (int i = i_begin; i < i_end; ++i) x0c[i] = S::store(S::load(x0c[i]) + dt * S::load(xc[i]));
+                        }
+                        // この範囲で (i + j) % 2 == color となる最初の i
+                        int i_start = i_begin + ((i_begin + j + color) & 1);
+                        for (int i = i_start; i < i_end; i += 2){
+                            xc[i] = S::store(((A)S::load(x0c[i]) + a * ((A)S::load(xc[i - 1]) + S::load(xc[i + 1]) +
+                                                                        S::load(xc[i - stride]) + S::load(xc[i + stride]))) * inv_c);
+                        }
+                    }
+                }
+            }
+        });
     }
 }
 
@@ -146,175 +735,930 @@ void Simulation::diffuse(int N, int b, std::vector<float>& x, std::vector<float>
 // (u, v): 次の時間ステップの速度x, y成分
 // p: 圧力場
 // div: 速度場の発散
-void Simulation::project(int N, std::vector<float>& u, std::vector<float>& v, std::vector<float>& p, std::vector<float>& div){
-    int i, j, k;
-    float h = 1.0f / N; // グリッドの単位長さ
+// 発散・圧力の反復・圧力勾配は Accum で計算し、場に書くときだけ Real に丸める
+template <typename Real, typename Accum>
+SolveStats BasicSimulation<Real, Accum>::project(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& p, Grid2D<Real>& div){
+    SF_PROFILE_SCOPE(profiler, Stage::Project);
+    const Accum h = Accum(1) / N; // グリッドの単位長さ
     
     // 発散場を計算(中心差分法)
-    for (i = 1; i <= N; ++i){
-        for (j = 1; j <= N; ++j){
-            div[IX(i, j)] = -0.5f * h * (u[IX(i + 1, j)] - u[IX(i - 1, j)] +
-                                         v[IX(i, j + 1)] - v[IX(i, j - 1)]);
-            p[IX(i, j)] = 0.0f; // 圧力場を初期化
+    for_each_tile(N, [&](int i_begin, int i_end, int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            for (int i = i_begin; i < i_end; ++i){
+                div(i, j) = (Real)(Accum(-0.5) * h * ((Accum)u(i + 1, j) - u(i - 1, j) +
+                                                      v(i, j + 1) - v(i, j - 1)));
+                p(i, j) = Real(0); // 圧力場を初期化
+            }
         }
-    }
+    });
     set_bnd(N, 0, div); // 発散場に境界条件を適用
     set_bnd(N, 0, p);   // 圧力場に境界条件を適用
     
-    // ポアソン方程式をガウス・ザイデル法で反復的にとく
-    for (k = 0; k < 40; ++k){
-        for (i = 1; i <= N; ++i){
-            for (j = 1; j <= N; ++j){
-                p[IX(i, j)] = (div[IX(i, j)] + p[IX(i - 1, j)] + p[IX(i + 1, j)] +
-                               p[IX(i, j - 1)] + p[IX(i, j + 1)]) / 4.0f;
-            }
-        }
+    // ポアソン方程式を反復的にとく
+    if (pressure_solver == PressureSolver::Multigrid){
+        pressure_stats = multigrid.solve(N, p, div, pool.get());
         set_bnd(N, 0, p);   // 圧力場に境界条件を適用
+    } else if (solver == LinearSolver::ConjugateGradient){
+        pressure_stats = lin_solve(N, 0, p, div, Real(1), Real(4), 40);
+    } else {
+        Grid2D<Real>* pp = &p;
+        Grid2D<Real>* dp = &div;
+        pressure_stats = gauss_seidel<NativeStorage, Accum>(N, 0, 1, &pp, &dp, Accum(1), Accum(4), 40, false, Real(0));
     }
     
-    // 圧力場の勾配を引くことで速度場を非圧縮性にする
-    for (i = 1; i <= N; ++i){
-        for (j = 1; j <= N; ++j){
-            u[IX(i, j)] -= 0.5f * (p[IX(i + 1, j)] - p[IX(i - 1, j)]) / h;
-            v[IX(i, j)] -= 0.5f * (p[IX(i, j + 1)] - p[IX(i, j - 1)]) / h;
+    // 圧力場の勾配を引くことで速度場を非圧縮性にする（有効タイルを使う場合は有効なタイルだけ。無効なタイルの速度は0のまま）
+    for_each_active_tile(N, [&](int i_begin, int i_end, int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            for (int i = i_begin; i < i_end; ++i){
+                u(i, j) = (Real)(u(i, j) - Accum(0.5) * ((Accum)p(i + 1, j) - p(i - 1, j)) / h);
+                v(i, j) = (Real)(v(i, j) - Accum(0.5) * ((Accum)p(i, j + 1) - p(i, j - 1)) / h);
+            }
         }
-    }
+    });
     set_bnd(N, 1, u);   // 速度場 u の境界条件を適用
     set_bnd(N, 2, v);   // 速度場 v の境界条件を適用
+    return pressure_stats;
 }
 
 // 境界条件の適用
 // N: グリッドの一辺
 // b: 境界条件を指定するパラメータ. 0: 境界で値をそのまま内部の値に等しくさせる. 1(x軸), 2(y軸): 境界で色度成分を反転（壁での反射）
 // x: 処理対象のベクター
-void Simulation::set_bnd(int N, int b, std::vector<float>& x){
+// 上下の境界は連続した行、左右の境界は各行の両端なので、メモリ順に走査できるよう別々のループにする
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::set_bnd(int N, int b, Grid2D<Real>& x){
+    set_bnd_as<NativeStorage>(N, b, x);
+}
+
+// 格納形式 S の場の境界条件
+template <typename Real, typename Accum>
+template <typename S>
+void BasicSimulation<Real, Accum>::set_bnd_as(int N, int b, Grid2D<typename S::value_type>& x){
+    SF_PROFILE_SCOPE(profiler, Stage::SetBnd);
+    Real sx = b == 1 ? Real(-1) : Real(1);
+    Real sy = b == 2 ? Real(-1) : Real(1);
     for (int i = 1; i <= N; ++i){
+        // 下端の境界条件
+        x(i, 0) = S::store(sy * S::load(x(i, 1)));
+    }
+    for (int j = 1; j <= N; ++j){
         // 左端の境界条件
-        x[IX(0, i)] = b == 1 ? -x[IX(1, i)] : x[IX(1, i)];
+        x(0, j) = S::store(sx * S::load(x(1, j)));
         // 右端の境界条件
-        x[IX(N + 1, i)] = b == 1 ? -x[IX(N, i)] : x[IX(N, i)];
-        // 下端の境界条件
-        x[IX(i, 0)] = b == 2 ? -x[IX(i, 1)] : x[IX(i, 1)];
+        x(N + 1, j) = S::store(sx * S::load(x(N, j)));
+    }
+    for (int i = 1; i <= N; ++i){
         // 上端の境界条件
-        x[IX(i, N + 1)] = b == 2 ? -x[IX(i, N)] : x[IX(i, N)];
+        x(i, N + 1) = S::store(sy * S::load(x(i, N)));
     }
 }
 
 // 速度の更新
-void Simulation::vel_step(int N, std::vector<float> &u, std::vector<float> &v, std::vector<float> &u0, std::vector<float> &v0, float visc, float dt){
+// u, u0（v, v0）をピンポンバッファとして使い、書き込み先と読み出し元の役割だけを入れ替える
+// 役割の入れ替えは偶数回なので、戻ったときには u, v に結果が入っている
+// 投影処理の圧力と発散は専用の作業領域を使い、最後に u0, v0 へ写す
+// （元の swap を使う実装と同じく、u0, v0 には最後の投影の圧力と発散が残る。移流後の速度を残すと、
+//  ソース項を消さない --no-reset の実行で次のステップに速度として足されてしまう）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::vel_step(int N, Grid2D<Real> &u, Grid2D<Real> &v, Grid2D<Real> &u0, Grid2D<Real> &v0, Real visc, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::VelStep);
+    if (fused_transport){
+        vel_step_fused(N, u, v, u0, v0, visc, dt);
+        return;
+    }
+    PingPong<Real> pu(u, u0);
+    PingPong<Real> pv(v, v0);
+    
     // Step1: add_forceで更新された u0, v0 を次の時間ステップの u, v に反映
-    add_source(N, u, u0, dt);
-    add_source(N, v, v0, dt);
+    add_source(N, pu.cur(), pu.prev(), dt);
+    add_source(N, pv.cur(), pv.prev(), dt);
     
-    // step1で得た新しい値(u, v)をstep2の(u0, v0)として扱いたい
-    std::swap(u0, u);
-    std::swap(v0, v);
+    // step1で得た新しい値をstep2の読み出し元として扱いたい
+    pu.flip();
+    pv.flip();
     
     // Step2: Advect(移流処理)
-    advect(N, 1, u, u0, u0, v0, dt);    // x方向
-    advect(N, 2, v, v0, u0, v0, dt);    // y方向
+    advect(N, 1, pu.cur(), pu.prev(), pu.prev(), pv.prev(), dt);    // x方向
+    advect(N, 2, pv.cur(), pv.prev(), pu.prev(), pv.prev(), dt);    // y方向
     
     // Advectしたら一旦非圧縮にしときたい（速度場の投影）
-    project(N, u, v, u0, v0);
+    project(N, pu.cur(), pv.cur(), pressure, divergence);
     
-    // step2で得た新しい値(u, v)をstep3の(u0, v0)として扱いたい
-    std::swap(u0, u);
-    std::swap(v0, v);
+    // step2で得た新しい値をstep3の読み出し元として扱いたい
+    pu.flip();
+    pv.flip();
     
     // Step3: Diffuse(粘性の扱い)
-    diffuse(N, 1, u, u0, visc, dt);
+    diffuse(N, 1, pu.cur(), pu.prev(), visc, dt);
     // y方向の拡散処理
-    diffuse(N, 2, v, v0, visc, dt);
+    diffuse(N, 2, pv.cur(), pv.prev(), visc, dt);
+    
+    // Step4: Project(投影)
+    project(N, pu.cur(), pv.cur(), pressure, divergence);
+    copy_projection(N, pressure, u0);
+    copy_projection(N, divergence, v0);
+}
+
+// 融合した輸送処理を使う速度の更新
+// Step1（ソース項の加算）と Step2（移流）を1回の走査で行う。u, u0, v, v0 は読むだけで、移流後の値は x_adv, y_adv に書く
+// u と v は同じ逆追跡の位置を使うので、2チャンネルとしてまとめて移流する
+// 融合しない場合との違いは、Step3 の拡散の初期値がソース項を足す前の速度になることだけ
+// （ガウス・ザイデル法で粘性が0なら拡散は右辺をそのまま写すので、初期値によらない。角のセルは fused_corners で揃える）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::vel_step_fused(int N, Grid2D<Real> &u, Grid2D<Real> &v, Grid2D<Real> &u0, Grid2D<Real> &v0, Real visc, Real dt){
+    Grid2D<Real>* d[2] = { &x_adv, &y_adv };
+    Grid2D<Real>* d0[2] = { &u, &v };
+    Grid2D<Real>* s[2] = { &u0, &v0 };
+    const int bs[2] = { 1, 2 };
+    transport(N, 2, bs, d, d0, s, u, v, &u0, &v0, dt);
+    if (fusion_check){
+        check_velocity_transport(N, u, v, u0, v0, dt);
+    }
+    fused_corners(N, u, v, u0, v0, dt);     // 参照比較は u の角を書き換える前に行う
+    project(N, x_adv, y_adv, pressure, divergence);
+    
+    // Step3: Diffuse(粘性の扱い)
+    diffuse(N, 1, u, x_adv, visc, dt);
+    diffuse(N, 2, v, y_adv, visc, dt);
     
     // Step4: Project(投影)
-    project(N, u, v, u0, v0);
+    project(N, u, v, pressure, divergence);
+    copy_projection(N, pressure, u0);
+    copy_projection(N, divergence, v0);
+}
+
+// 移流も拡散も set_bnd も角のセルは書かないので、融合しない場合は u の角に add_source の結果が残り、
+// 次のステップの補間で読まれる。融合した場合も同じ値を置く
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::fused_corners(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& u0, Grid2D<Real>& v0, Real dt){
+    const int corners[4][2] = { { 0, 0 }, { N + 1, 0 }, { 0, N + 1 }, { N + 1, N + 1 } };
+    for (const auto& c : corners){
+        const int i = c[0], j = c[1];
+        u(i, j) += dt * u0(i, j);
+        v(i, j) += dt * v0(i, j);
+    }
 }
 
 // 密度（色の濃さ）の更新
-void Simulation::dens_step(int N, std::vector<float> &x, std::vector<float> &x0, std::vector<float> &u, std::vector<float> &v, float diff, float dt){
-    // ソース項の加算
-    add_source(N, x, x0, dt);
-    std::swap(x, x0);
-    // 拡散処理
-    diffuse(N, 0, x, x0, diff, dt);
-    std::swap(x, x0);
-    // 移流処理
-    advect(N, 0, x, x0, u, v, dt);
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::dens_step(int N, Grid2D<Real> &x, Grid2D<Real> &x0, Grid2D<Real> &u, Grid2D<Real> &v, Real diff, Real dt){
+    Grid2D<Real>* xp = &x;
+    Grid2D<Real>* x0p = &x0;
+    dens_step(N, 1, &xp, &x0p, u, v, diff, dt);
+}
+
+// 複数のスカラー場の更新
+// 拡散と移流は全チャンネルをまとめて行い、速度場の読み込みと補間の重みの計算を共有する
+// x[c], x0[c] は vel_step と同じくピンポンバッファとして使う（役割の入れ替えは偶数回）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::dens_step(int N, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Grid2D<Real> &u, Grid2D<Real> &v, Real diff, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::DensStep);
+    SolveStats stats;   // チャンネルの組ごとの拡散の収束情報をまとめたもの
+    stats.converged = true;
+    // 参照比較モードでは1チャンネルずつ処理し、チャンネルごとに融合しない処理と比べる
+    const int batch = fused_transport && fusion_check ? 1 : kChannelBatch;
+    for (int c0 = 0; c0 < channels; c0 += batch){
+        PingPong<Real, kChannelBatch> f(std::min(batch, channels - c0), x + c0, x0 + c0);
+        if (fused_transport){
+            if (fusion_check){
+                reference_dens_step(N, f.cur(), f.prev(), u, v, diff, dt);
+            }
+            // ソース項の加算は拡散の最初の反復に融合する（書き込み先の初期値がソース項）
+            f.flip();
+            merge_worst(stats, diffuse_with_source(N, 0, f.channels(), f.curs(), f.prevs(), diff, dt));
+        } else {
+            // ソース項の加算
+            for (int c = 0; c < f.channels(); ++c){
+                add_source(N, f.cur(c), f.prev(c), dt);
+            }
+            f.flip();
+            // 拡散処理
+            merge_worst(stats, diffuse(N, 0, f.channels(), f.curs(), f.prevs(), diff, dt));
+        }
+        f.flip();
+        // 移流処理
+        advect(N, 0, f.channels(), f.curs(), f.prevs(), u, v, dt);
+        if (fused_transport && fusion_check){
+            check_same(N, divergence, f.prev(), "dens_step diffuse");
+            check_same(N, pressure, f.cur(), "dens_step advect");
+        }
+    }
+    diffusion_stats = stats;
+}
+
+// 色とトレーサーの更新
+// 16 ビットの格納形式では、ソース項の加算・拡散・移流の各カーネルが要素を fp32 に直しながら処理する
+template <typename Real, typename Accum>
+template <typename S>
+void BasicSimulation<Real, Accum>::dens_step_dye(int N, DyeFields<S>& d, Grid2D<Real>& u, Grid2D<Real>& v, Real diff, Real dt){
+    if constexpr (std::is_same_v<S, NativeStorage>){
+        dens_step(N, d.channels(), d.cur_list.data(), d.prev_list.data(), u, v, diff, dt);
+    } else {
+        using T = typename S::value_type;
+        SF_PROFILE_SCOPE(profiler, Stage::DensStep);
+        SolveStats stats;
+        stats.converged = true;
+        for (int c0 = 0; c0 < d.channels(); c0 += kChannelBatch){
+            PingPong<T, kChannelBatch> f(std::min(kChannelBatch, d.channels() - c0), d.cur_list.data() + c0, d.prev_list.data() + c0);
+            for (int c = 0; c < f.channels(); ++c){
+                add_source_stored<S>(N, f.cur(c), f.prev(c), dt);
+            }
+            f.flip();
+            merge_worst(stats, diffuse_stored<S>(N, 0, f.channels(), f.curs(), f.prevs(), diff, dt));
+            f.flip();
+            advect_stored<S>(N, 0, f.channels(), f.curs(), f.prevs(), u, v, dt);
+        }
+        diffusion_stats = stats;
+    }
+}
+
+template <typename Real, typename Accum>
+template <typename S>
+void BasicSimulation<Real, Accum>::add_source_stored(int N, Grid2D<typename S::value_type>& x, Grid2D<typename S::value_type>& s, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::AddSource);
+    typename S::value_type* xp = x.data();
+    const typename S::value_type* sp = s.data();
+    std::size_t count = (std::size_t)x.pitch() * (N + 2);
+    for (std::size_t k = 0; k < count; ++k){
+        xp[k] = S::store(S::load(xp[k]) + dt * S::load(sp[k]));
+    }
+}
+
+// 共役勾配法は Real の場を前提にしているので、1チャンネルずつ pressure（解）と divergence（右辺）に
+// Real で展開して解き、結果を書き戻す
+// 固定小数点の形式では、ガウス・ザイデル法も同じように展開して解く（反復ごとに丸めると拡散の裾が消えるため）
+template <typename Real, typename Accum>
+template <typename S>
+SolveStats BasicSimulation<Real, Accum>::diffuse_stored(int N, int b, int channels, Grid2D<typename S::value_type>* const* x, Grid2D<typename S::value_type>* const* x0, Real diff, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::Diffuse);
+    Real a = dt * diff * N * N;
+    const bool expand = solver == LinearSolver::ConjugateGradient || is_fixed_point_storage<S>::value;
+    if (!expand){
+        return gauss_seidel<S>(N, b, channels, x, x0, a, 1 + 4 * a, 20, false, Real(0), sparse_mask(N));
+    }
+    SolveStats stats;
+    stats.converged = true;
+    for (int ch = 0; ch < channels; ++ch){
+        for (int j = 0; j <= N + 1; ++j){
+            for (int i = 0; i <= N + 1; ++i){
+                pressure(i, j) = S::load((*x[ch])(i, j));
+                divergence(i, j) = S::load((*x0[ch])(i, j));
+            }
+        }
+        SolveStats s;
+        if (solver == LinearSolver::ConjugateGradient){
+            s = cg.solve(N, b, pressure, divergence, a, 1 + 4 * a, pool.get());
+            set_bnd(N, b, pressure);
+        } else {
+            Grid2D<Real>* pp = &pressure;
+            Grid2D<Real>* dp = &divergence;
+            s = gauss_seidel<NativeStorage>(N, b, 1, &pp, &dp, a, 1 + 4 * a, 20, false, Real(0), sparse_mask(N));
+        }
+        merge_worst(stats, s);
+        store_expanded<S>(N, b, pressure, *x[ch]);
+    }
+    return stats;
+}
+
+// Real で解いた場 src を格納形式 S の dst に書き戻す
+// 固定小数点の形式では行ごとに丸めの誤差を次のセルへ送り（store_carry）、色の総量を保つ。ゴーストセルは set_bnd で決める
+template <typename Real, typename Accum>
+template <typename S>
+void BasicSimulation<Real, Accum>::store_expanded(int N, int b, const Grid2D<Real>& src, Grid2D<typename S::value_type>& dst){
+    if constexpr (is_fixed_point_storage<S>::value){
+        for (int j = 1; j <= N; ++j){
+            float carry = 0.0f;
+            for (int i = 1; i <= N; ++i){
+                dst(i, j) = S::store_carry((float)src(i, j), carry);
+            }
+        }
+        set_bnd_as<S>(N, b, dst);
+    } else {
+        for (int j = 0; j <= N + 1; ++j){
+            for (int i = 0; i <= N + 1; ++i){
+                dst(i, j) = S::store(src(i, j));
+            }
+        }
+    }
+}
+
+// 移流のカーネルは advect_tile_stored（スカラー版）。境界条件は advect_tiles と同じくタイルごとに書く
+template <typename Real, typename Accum>
+template <typename S>
+void BasicSimulation<Real, Accum>::advect_stored(int N, int b, int channels, Grid2D<typename S::value_type>* const* d, Grid2D<typename S::value_type>* const* d0,
+                               Grid2D<Real>& u, Grid2D<Real>& v, Real dt){
+    using T = typename S::value_type;
+    SF_PROFILE_SCOPE(profiler, Stage::Advect);
+    Real dt0 = dt * N;
+    int stride = d[0]->pitch();
+    Real sx = b == 1 ? Real(-1) : Real(1);
+    Real sy = b == 2 ? Real(-1) : Real(1);
+    T* dst[kChannelBatch];
+    const T* src[kChannelBatch];
+    for (int c = 0; c < channels; ++c){
+        dst[c] = d[c]->data();
+        src[c] = d0[c]->data();
+    }
+    auto ghosts = [&](int i_begin, int i_end, int j_begin, int j_end){
+        for (int c = 0; c < channels; ++c){
+            T* p = dst[c];
+            if (j_begin == 1){
+                for (int i = i_begin; i < i_end; ++i) p[i] = S::store(sy * S::load(p[i + stride]));
+            }
+            if (i_begin == 1){
+                for (int j = j_begin; j < j_end; ++j) p[stride * j] = S::store(sx * S::load(p[1 + stride * j]));
+            }
+            if (i_end == N + 1){
+                for (int j = j_begin; j < j_end; ++j) p[N + 1 + stride * j] = S::store(sx * S::load(p[N + stride * j]));
+            }
+            if (j_end == N + 1){
+                for (int i = i_begin; i < i_end; ++i) p[i + stride * (N + 1)] = S::store(sy * S::load(p[i + stride * N]));
+            }
+        }
+    };
+    for_each_active_tile(N, [&](int i_begin, int i_end, int j_begin, int j_end){
+        advect_tile_stored<S, Real>(N, stride, u.pitch(), channels, dst, src, u.data(), v.data(), dt0, i_begin, i_end, j_begin, j_end);
+        ghosts(i_begin, i_end, j_begin, j_end);
+    });
+    for_each_inactive_edge_tile(N, ghosts);
+}
+
+// 融合しない処理（参照比較モード用）
+// 移流して全体に set_bnd を掛ける、融合前の手順そのもの
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::advect_reference(int N, int b, Grid2D<Real>& d, Grid2D<Real>& d0, Grid2D<Real>& u, Grid2D<Real>& v, Real dt){
+    Real* dst[1] = { d.data() };
+    const Real* src[1] = { d0.data() };
+    BasicAdvectFields<Real> f;
+    f.channels = 1;
+    f.d = dst;
+    f.d0 = src;
+    f.u = u.data();
+    f.v = v.data();
+    f.dt = dt;
+    Real dt0 = dt * N;
+    for_each_active_tile(N, [&](int i_begin, int i_end, int j_begin, int j_end){
+        advect_fn(N, u.pitch(), f, dt0, i_begin, i_end, j_begin, j_end);
+    });
+    set_bnd(N, b, d);
+}
+
+// 1チャンネル分の dens_step を融合せずに行う（x, x0 は書き換えない）
+// 結果は拡散後の値が divergence、移流後の値が pressure に入る
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::reference_dens_step(int N, Grid2D<Real>& x, Grid2D<Real>& x0, Grid2D<Real>& u, Grid2D<Real>& v, Real diff, Real dt){
+    pressure = x;
+    divergence = x0;
+    add_source(N, pressure, divergence, dt);
+    diffuse(N, 0, divergence, pressure, diff, dt);
+    advect_reference(N, 0, pressure, divergence, u, v, dt);
+}
+
+// 融合した速度の輸送（x_adv, y_adv）を、add_source してから移流した結果と比べる
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::check_velocity_transport(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& u0, Grid2D<Real>& v0, Real dt){
+    pressure = u;
+    divergence = v;
+    add_source(N, pressure, u0, dt);
+    add_source(N, divergence, v0, dt);
+    if (sparse_mask(N)){
+        residual.fill(Real(0));     // 無効なタイルは移流しないので、x_adv, y_adv と同じく0にしておく
+    }
+    advect_reference(N, 1, residual, pressure, pressure, divergence, dt);
+    check_same(N, residual, x_adv, "vel_step advect u");
+    advect_reference(N, 2, residual, divergence, pressure, divergence, dt);
+    check_same(N, residual, y_adv, "vel_step advect v");
+}
+
+// 内部セルとゴースト層（角を除く）がビット単位で一致するか確かめ、違えば数えて記録する
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::check_same(int N, const Grid2D<Real>& expected, const Grid2D<Real>& actual, const char* stage){
+    bool same = true;
+    for (int j = 0; j <= N + 1 && same; ++j){
+        int i_begin = (j == 0 || j == N + 1) ? 1 : 0;
+        int i_end = (j == 0 || j == N + 1) ? N : N + 1;
+        same = std::memcmp(expected.row(j) + i_begin, actual.row(j) + i_begin, sizeof(Real) * (i_end - i_begin + 1)) == 0;
+    }
+    if (!same){
+        ++fusion_mismatches;
+        SF_LOG_ERROR("fused transport differs from the reference: {}", stage);
+    }
 }
 
 // 密度データの取得
-std::vector<float> Simulation::getDensity(int N){
-    std::vector<float> amal;    // 結果を格納するベクター
-    int i, j;
-    float total = 0.0f;
-    for (int k = 0; k < size; ++k){
-        i = k / (N + 2);
-        j = k % (N + 2);
-        // 境界セル以外のデータを統合
-        if (i != 0 && i != N + 1 && j != 0 && j != N + 1){
-            amal.push_back(std::max(r[k], 0.0f));   // 赤色成分(最低0)
-            amal.push_back(g[k]);    // 緑色成分
-            amal.push_back(b[k]);   // 青色成分
-//            total += r[k] + g[k] + b[k];    // 合計値（デバッグ用コメント）
-        }
-    }
-//    std::cout << "合計: " << total << std::endl;    // 合計値の出力（デバッグ用コメント）
-    
+template <typename Real, typename Accum>
+std::vector<float> BasicSimulation<Real, Accum>::getDensity(int N){
+    std::vector<float> amal((std::size_t)3 * N * N);    // 結果を格納するベクター
+    readDensity(N, amal.data());
     return amal;    // 結果を返す
 }
 
+// 色データを呼び出し側のバッファに書き出す
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::readDensity(int N, PixelFormat fmt, void* dst, std::size_t row_stride) const{
+    std::visit([&](const auto& d){ read_density(d, N, fmt, dst, row_stride); }, dye);
+}
+
+// 行ごとに独立なので、行単位でスレッドに分割する
+template <typename Real, typename Accum>
+template <typename S>
+void BasicSimulation<Real, Accum>::read_density(const DyeFields<S>& d, int N, PixelFormat fmt, void* dst, std::size_t row_stride) const{
+    using T = typename S::value_type;
+    SF_PROFILE_SCOPE(profiler, Stage::ReadDensity);
+    if (row_stride == 0){
+        row_stride = (std::size_t)N * pixel_size(fmt);
+    }
+    unsigned char* out = static_cast<unsigned char*>(dst);
+    pool->parallel_for(1, N + 1, [&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            const T* rr = d.cur[0].row(j);
+            const T* gr = d.cur[1].row(j);
+            const T* br = d.cur[2].row(j);
+            unsigned char* line = out + row_stride * (j - 1);
+            switch (fmt){
+                case PixelFormat::RGB32F: {
+                    float* px = reinterpret_cast<float*>(line);
+                    for (int i = 1; i <= N; ++i, px += 3){
+                        px[0] = std::max((float)S::load(rr[i]), 0.0f);  // 赤色成分(最低0)
+                        px[1] = (float)S::load(gr[i]);   // 緑色成分
+                        px[2] = (float)S::load(br[i]);   // 青色成分
+                    }
+                    break;
+                }
+                case PixelFormat::RGB16F: {
+                    std::uint16_t* px = reinterpret_cast<std::uint16_t*>(line);
+                    for (int i = 1; i <= N; ++i, px += 3){
+                        px[0] = float_to_half(std::max((float)S::load(rr[i]), 0.0f));
+                        px[1] = float_to_half((float)S::load(gr[i]));
+                        px[2] = float_to_half((float)S::load(br[i]));
+                    }
+                    break;
+                }
+                case PixelFormat::RGBA8:
+                case PixelFormat::RGB8: {
+                    // GL_RGB のテクスチャに float で渡したときと同じく 0〜1 にクランプする
+                    auto quantize = [](float v){
+                        v = std::min(std::max(v, 0.0f), 1.0f);
+                        return (unsigned char)(v * 255.0f + 0.5f);
+                    };
+                    const bool alpha = fmt == PixelFormat::RGBA8;
+                    const int step = alpha ? 4 : 3;
+                    unsigned char* px = line;
+                    for (int i = 1; i <= N; ++i, px += step){
+                        px[0] = quantize((float)S::load(rr[i]));
+                        px[1] = quantize((float)S::load(gr[i]));
+                        px[2] = quantize((float)S::load(br[i]));
+                        if (alpha) px[3] = 255;
+                    }
+                    break;
+                }
+            }
+        }
+    });
+}
+
+// 二重バッファのスナップショット
+// 直前に返したバッファには書き込まないので、呼び出し側は次の呼び出しまで前回の結果を読み続けられる
+template <typename Real, typename Accum>
+const std::vector<unsigned char>& BasicSimulation<Real, Accum>::snapshotDensity(int N, PixelFormat fmt){
+    snapshot_index ^= 1;
+    std::vector<unsigned char>& buf = density_snapshot[snapshot_index];
+    // 大きさが変わったときだけ確保し直す（同じ大きさなら毎フレームの確保は発生しない）
+    buf.resize((std::size_t)N * N * pixel_size(fmt));
+    readDensity(N, fmt, buf.data());
+    return buf;
+}
+
 // スタンプ（色の追加）
-void Simulation::stamp(int X, int Y, int W, int H, int N, float R, float G, float B){
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::stamp(int X, int Y, int W, int H, int N, Real R, Real G, Real B){
     // スタンプが範囲外の場合は例外を投げる
     if (X <= 0 || X > N || Y <= 0 || Y > N || X + W > N || Y + H > N){
         throw std::out_of_range("Index is out of range");
     }
     
-    for (int i = Y; i < Y + H; ++i){
-        for (int j = X; j < X + W; ++j){
-            // 色成分を追加
-            r_prev[IX(i, j)] += R;
-            g_prev[IX(i, j)] += G;
-            b_prev[IX(i, j)] += B;
+    std::visit([&](auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        const Real add[3] = { R, G, B };
+        for (int c = 0; c < 3; ++c){
+            auto& p = d.prev[c];
+            for (int i = Y; i < Y + H; ++i){
+                for (int j = X; j < X + W; ++j){
+                    // 色成分を追加
+                    p(i, j) = S::store(S::load(p(i, j)) + add[c]);
+                }
+            }
         }
-    }
+    }, dye);
+    active_tiles.touch(Y, Y + H, X, X + W);
 }
 
 // シンク（色の除去）
-void Simulation::sink(int X, int Y, int W, int H, int N){
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::sink(int X, int Y, int W, int H, int N){
     // シンクが範囲外の場合は例外を投げる
     if (X <= 0 || X > N || Y <= 0 || Y > N || X + W > N || Y + H > N){
         throw std::out_of_range("Index is out of range");
     }
     
-    for (int i = Y; i < Y + H; ++i){
-        for (int j = X; j < X + W; ++j){
-            // 色成分を0にセット
-            r_prev[IX(i, j)] = 0.0f;
-            g_prev[IX(i, j)] = 0.0f;
-            b_prev[IX(i, j)] = 0.0f;
+    std::visit([&](auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        // 色成分とトレーサーを0にセット
+        for (auto& p : d.prev){
+            for (int i = Y; i < Y + H; ++i){
+                for (int j = X; j < X + W; ++j){
+                    p(i, j) = S::store(0);
+                }
+            }
         }
+    }, dye);
+}
+
+// トレーサーの数
+template <typename Real, typename Accum>
+int BasicSimulation<Real, Accum>::getTracerCount() const{
+    return std::visit([](const auto& d){ return d.channels() - 3; }, dye);
+}
+
+// トレーサーの追加
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::stampTracer(int id, int X, int Y, int W, int H, int N, Real amount){
+    // スタンプが範囲外の場合は例外を投げる
+    if (X <= 0 || X > N || Y <= 0 || Y > N || X + W > N || Y + H > N){
+        throw std::out_of_range("Index is out of range");
+    }
+    if (id < 0 || id >= getTracerCount()){
+        throw std::out_of_range("Tracer id is out of range");
+    }
+    std::visit([&](auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        auto& t = d.prev[3 + id];
+        for (int i = Y; i < Y + H; ++i){
+            for (int j = X; j < X + W; ++j){
+                t(i, j) = S::store(S::load(t(i, j)) + amount);
+            }
+        }
+    }, dye);
+    active_tiles.touch(Y, Y + H, X, X + W);
+}
+
+// トレーサーの読み出し
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::readTracer(int id, int N, Real* dst) const{
+    if (id < 0 || id >= getTracerCount()){
+        throw std::out_of_range("Tracer id is out of range");
     }
+    std::visit([&](const auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        const auto& t = d.cur[3 + id];
+        for (int j = 1; j <= N; ++j){
+            for (int i = 1; i <= N; ++i){
+                dst[(std::size_t)(j - 1) * N + (i - 1)] = S::load(t(i, j));
+            }
+        }
+    }, dye);
 }
 
 // シミュレーションの更新
-void Simulation::update(int N, float dt){
+// adaptive では、外力（前ステップの値）を dt 分加えた速度から部分ステップの数を決める（場はまだ変えない）
+// 部分ステップが1つなら固定の時間刻みと同じく advance(N, dt) で進める
+// 2つ以上なら、ソース項を dt 分まとめて加えてから、ソース項なしで進める
+// （各部分ステップの前に前ステップの値を0にする。中間の値をソース項として足さない）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::update(int N, Real dt){
+    SF_PROFILE_SCOPE(profiler, Stage::Update);
+    ++step_count;
+    sim_time += dt;
+    if (!timestep_options.adaptive){
+        advance(N, dt);
+        return;
+    }
+    last_cfl = dt * N * max_speed(N, dt);
+    int substeps = (int)std::ceil(last_cfl / (Real)timestep_options.cfl);
+    substeps = std::clamp(substeps, 1, timestep_options.max_substeps);
+    if (last_cfl > (Real)timestep_options.cfl * substeps){
+        SF_LOG_DEBUG("CFL {} exceeds the target with {} substeps", last_cfl, substeps);
+    }
+    last_substeps = substeps;
+    if (substeps == 1){
+        advance(N, dt);
+        return;
+    }
+    apply_sources(N, dt);
+    Real h = dt / substeps;
+    for (int s = 0; s < substeps; ++s){
+        clear_sources();
+        advance(N, h);
+    }
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::setTimestepOptions(const TimestepOptions& opt){
+    timestep_options = opt;
+    timestep_options.cfl = opt.cfl > 0.0f ? opt.cfl : 1.0f;
+    timestep_options.max_substeps = std::max(1, opt.max_substeps);
+    last_substeps = 1;
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::apply_sources(int N, Real dt){
+    add_source(N, x, x_prev, dt);
+    add_source(N, y, y_prev, dt);
+    std::visit([&](auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        for (int c = 0; c < d.channels(); ++c){
+            add_source_stored<S>(N, d.cur[c], d.prev[c], dt);
+        }
+    }, dye);
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::clear_sources(){
+    x_prev.fill(Real(0));
+    y_prev.fill(Real(0));
+    std::visit([](auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        for (auto& p : d.prev){
+            p.fill(S::store(0));
+        }
+    }, dye);
+}
+
+// 行ごとの最大値は row_speed に書き、呼び出し側スレッドでまとめる（CG の内積と同じ形）
+// 速度は add_source と同じ式で x + dt * x_prev として読む（x は変えない）
+template <typename Real, typename Accum>
+Real BasicSimulation<Real, Accum>::max_speed(int N, Real dt){
+    if ((int)row_speed.size() < N + 2){
+        row_speed.assign(N + 2, Real(0));
+    }
+    pool->parallel_for(1, N + 1, [&](int j_begin, int j_end){
+        for (int j = j_begin; j < j_end; ++j){
+            const Real* u = x.row(j);
+            const Real* v = y.row(j);
+            const Real* su = x_prev.row(j);
+            const Real* sv = y_prev.row(j);
+            Real m = Real(0);
+            for (int i = 1; i <= N; ++i){
+                Real a = std::max(std::abs(u[i] + dt * su[i]), std::abs(v[i] + dt * sv[i]));
+                m = m < a ? a : m;
+            }
+            row_speed[j] = m;
+        }
+    });
+    Real m = Real(0);
+    for (int j = 1; j <= N; ++j){
+        m = std::max(m, row_speed[j]);
+    }
+    return m;
+}
+
+// 1ステップ分の更新
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::advance(int N, Real dt){
+    if (sparse_options.enabled){
+        update_active_tiles(N);
+    }
+    if (task_graph && !fusion_check){
+        advance_tasks(N, dt);
+        return;
+    }
     vel_step(N, x, y, x_prev, y_prev, viscosity, dt);   // 速度の更新
 //    dens_step(N, dens, dens_prev, x, y, diffusion, dt); // 密度の更新
-    dens_step(N, r, r_prev, x, y, diffusion, dt); // 赤色成分の更新
-    dens_step(N, g, g_prev, x, y, diffusion, dt); // 緑色成分の更新
-    dens_step(N, b, b_prev, x, y, diffusion, dt); // 青色成分の更新
+    // 色成分（赤・緑・青）とトレーサーの更新
+    std::visit([&](auto& d){ dens_step_dye(N, d, x, y, diffusion, dt); }, dye);
+}
+
+// 作業グラフでの1ステップ分の更新（vel_step・dens_step と同じ処理を同じ場の組で行うので、結果はビット単位で一致する）
+// 速度: 成分ごとに「ソース項の加算」→「移流」（両成分の加算の後）→ 投影 →「拡散」→ 投影
+//   融合した輸送処理では、成分ごとの輸送（ソース項の加算と移流）から始める
+// 色とトレーサー: 2回目の投影の後、チャンネルごとに「ソース項の加算と拡散」→「移流」
+// 共役勾配法の拡散は作業領域（cg と、16 ビットの格納形式では pressure, divergence）を共有するので、拡散の作業を順につなぐ
+// （固定小数点の形式の色はガウス・ザイデル法でも pressure, divergence で解くので同じ）
+// （移流は次のチャンネルの拡散と並行に進む）
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::advance_tasks(int N, Real dt){
+    Grid2D<Real>* vel[2] = { &x, &y };
+    Grid2D<Real>* vel0[2] = { &x_prev, &y_prev };
+    Grid2D<Real>* adv[2] = { &x_adv, &y_adv };   // 融合した輸送処理での移流後の速度
+    const int bs[2] = { 1, 2 };
+    const bool serial_diffusion = solver == LinearSolver::ConjugateGradient || dye_storage == DyeStorage::Fixed16;
+    graph.clear();
+    
+    // 作業の番号 k から成分・チャンネルを求めるため、種類ごとの最初の番号を覚えておく
+    int source_node = 0, advect_node = 0, diffuse_node = 0;
+    auto source = [&](int k, int){
+        int c = k - source_node;
+        add_source(N, *vel[c], *vel0[c], dt);
+    };
+    auto advect_velocity = [&](int k, int){
+        int c = k - advect_node;
+        if (fused_transport){
+            transport(N, 1, &bs[c], &adv[c], &vel[c], &vel0[c], x, y, &x_prev, &y_prev, dt);
+        } else {
+            advect(N, bs[c], *vel0[c], *vel[c], x, y, dt);
+        }
+    };
+    auto project_advected = [&](int, int){
+        if (fused_transport){
+            fused_corners(N, x, y, x_prev, y_prev, dt);    // 両成分の移流が u, v の角を読み終えてから
+            project(N, x_adv, y_adv, pressure, divergence);
+        } else {
+            project(N, x_prev, y_prev, pressure, divergence);
+        }
+    };
+    auto diffuse_velocity = [&](int k, int){
+        int c = k - diffuse_node;
+        diffuse_solve(N, bs[c], 1, &vel[c], fused_transport ? &adv[c] : &vel0[c], viscosity, dt);
+    };
+    auto project_diffused = [&](int, int){
+        project(N, x, y, pressure, divergence);
+        copy_projection(N, pressure, x_prev);   // vel_step と同じく最後の投影の圧力と発散を残す（色の拡散が作業領域を使う前に）
+        copy_projection(N, divergence, y_prev);
+    };
+    
+    int advected[2], diffused[2];
+    if (!fused_transport){
+        source_node = graph.add(source);
+        graph.add(source);
+    }
+    advect_node = graph.size();
+    for (int c = 0; c < 2; ++c){
+        advected[c] = graph.add(advect_velocity);
+        if (!fused_transport){
+            graph.precede(source_node, advected[c]);
+            graph.precede(source_node + 1, advected[c]);
+        }
+    }
+    int projected = graph.add(project_advected);
+    diffuse_node = graph.size();
+    for (int c = 0; c < 2; ++c){
+        graph.precede(advected[c], projected);
+        diffused[c] = graph.add(diffuse_velocity);
+        graph.precede(projected, diffused[c]);
+    }
+    if (serial_diffusion){
+        graph.precede(diffused[0], diffused[1]);
+    }
+    int velocity_done = graph.add(project_diffused);
+    graph.precede(diffused[0], velocity_done);
+    graph.precede(diffused[1], velocity_done);
+    
+    std::visit([&](auto& d){
+        using S = typename std::decay_t<decltype(d)>::storage;
+        using T = typename S::value_type;
+        const int channels = d.channels();
+        channel_stats.assign(channels, SolveStats());
+        // vel_step と同じく、x（cur）と x0（prev）の役割を入れ替えながら使う
+        int dye_diffuse_node = 0, dye_advect_node = 0;
+        auto diffuse_dye = [&](int k, int){
+            int c = k - dye_diffuse_node;
+            Grid2D<T>* xc = &d.cur[c];
+            Grid2D<T>* x0c = &d.prev[c];
+            if constexpr (std::is_same_v<S, NativeStorage>){
+                if (fused_transport){
+                    channel_stats[c] = diffuse_with_source(N, 0, 1, &x0c, &xc, diffusion, dt);
+                } else {
+                    add_source(N, *xc, *x0c, dt);
+                    channel_stats[c] = diffuse_solve(N, 0, 1, &x0c, &xc, diffusion, dt);
+                }
+            } else {
+                add_source_stored<S>(N, *xc, *x0c, dt);
+                channel_stats[c] = diffuse_stored<S>(N, 0, 1, &x0c, &xc, diffusion, dt);
+            }
+        };
+        auto advect_dye = [&](int k, int){
+            int c = k - dye_advect_node;
+            Grid2D<T>* xc = &d.cur[c];
+            Grid2D<T>* x0c = &d.prev[c];
+            if constexpr (std::is_same_v<S, NativeStorage>){
+                advect(N, 0, 1, &xc, &x0c, x, y, dt);
+            } else {
+                advect_stored<S>(N, 0, 1, &xc, &x0c, x, y, dt);
+            }
+        };
+        dye_diffuse_node = graph.size();
+        for (int c = 0; c < channels; ++c){
+            int k = graph.add(diffuse_dye);
+            graph.precede(velocity_done, k);
+            if (serial_diffusion && c > 0){
+                graph.precede(k - 1, k);
+            }
+        }
+        dye_advect_node = graph.size();
+        for (int c = 0; c < channels; ++c){
+            int k = graph.add(advect_dye);
+            graph.precede(dye_diffuse_node + c, k);
+        }
+        tasks->run(graph);
+    }, dye);
+    
+    SolveStats stats;
+    stats.converged = true;
+    for (const SolveStats& s : channel_stats){
+        merge_worst(stats, s);
+    }
+    diffusion_stats = stats;
 }
 
 // シミュレーションのリセット
-void Simulation::reset(int N){
-    std::fill(x_prev.begin(), x_prev.end(), 0.0f);
-    std::fill(y_prev.begin(), y_prev.end(), 0.0f);
-    std::fill(r_prev.begin(), r_prev.end(), 0.0f);
-    std::fill(g_prev.begin(), g_prev.end(), 0.0f);
-    std::fill(b_prev.begin(), b_prev.end(), 0.0f);
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::reset(int N){
+    // 速度・色成分・トレーサーの前ステップの値
+    clear_sources();
     
     // シンクの例
     sink(10, 10, 2, 2, N);
     sink(20, 20, 2, 2, N);
 }
+
+template <typename Real, typename Accum>
+template <typename Self, typename F>
+void BasicSimulation<Real, Accum>::for_each_state_field(Self& self, F&& fn){
+    fn("u", self.x);
+    fn("v", self.y);
+    fn("u_prev", self.x_prev);
+    fn("v_prev", self.y_prev);
+    fn("dens", self.dens);
+    fn("dens_prev", self.dens_prev);
+    std::visit([&](auto& d){
+        for (int c = 0; c < d.channels(); ++c){
+            fn("dye" + std::to_string(c), d.cur[c]);
+            fn("dye" + std::to_string(c) + "_prev", d.prev[c]);
+        }
+    }, self.dye);
+}
+
+template <typename Real, typename Accum>
+CheckpointHeader BasicSimulation<Real, Accum>::checkpoint_header() const{
+    CheckpointHeader h = {};
+    h.n = (std::uint32_t)x.n();
+    h.real_bytes = sizeof(Real);
+    h.accum_bytes = sizeof(Accum);
+    h.dye_storage = (std::uint32_t)dye_storage;
+    h.channels = (std::uint32_t)std::visit([](const auto& d){ return d.channels(); }, dye);
+    h.viscosity = viscosity;
+    h.diffusion = diffusion;
+    h.time = sim_time;
+    h.step = step_count;
+    return h;
+}
+
+template <typename Real, typename Accum>
+std::vector<CheckpointBlock> BasicSimulation<Real, Accum>::checkpoint_blocks() const{
+    std::vector<CheckpointBlock> blocks;
+    for_each_state_field(*this, [&](const std::string& name, const auto& g){
+        blocks.push_back(CheckpointBlock::of(name, g));
+    });
+    return blocks;
+}
+
+template <typename Real, typename Accum>
+std::size_t BasicSimulation<Real, Accum>::checkpointBytes() const{
+    return checkpoint_bytes(checkpoint_blocks());
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::serializeCheckpoint(unsigned char* image) const{
+    checkpoint_serialize(checkpoint_header(), checkpoint_blocks(), image);
+}
+
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::saveCheckpoint(const std::string& path) const{
+    std::vector<unsigned char, AlignedAllocator<unsigned char, kCheckpointAlignment>> image(checkpointBytes());
+    serializeCheckpoint(image.data());
+    checkpoint_finalize(image.data(), image.size());
+    checkpoint_write_file(path, image.data(), image.size());
+}
+
+// 場の領域をファイルのブロックに付け替える（アリーナの領域は使わなくなるが、解放はしない）
+// 付け替える前に全ての場を確かめるので、失敗した場合は何も変えない
+template <typename Real, typename Accum>
+void BasicSimulation<Real, Accum>::restoreCheckpoint(const std::string& path, bool verify){
+    auto m = std::make_shared<MappedCheckpoint>(path, verify);
+    const CheckpointHeader& h = m->header();
+    const int channels = std::visit([](const auto& d){ return d.channels(); }, dye);
+    if (h.n != (std::uint32_t)x.n() || h.real_bytes != sizeof(Real) || h.accum_bytes != sizeof(Accum) ||
+        h.dye_storage != (std::uint32_t)dye_storage || h.channels != (std::uint32_t)channels){
+        throw std::runtime_error("checkpoint does not match the simulation (N=" + std::to_string(h.n) +
+                                 ", channels=" + std::to_string(h.channels) + "): " + path);
+    }
+    for_each_state_field(*this, [&](const std::string& name, auto& g){
+        checkpoint_field(*m, name, g);
+    });
+    for_each_state_field(*this, [&](const std::string& name, auto& g){
+        using G = std::decay_t<decltype(g)>;
+        g = G(checkpoint_field(*m, name, g), g.n());
+    });
+    viscosity = (Real)h.viscosity;
+    diffusion = (Real)h.diffusion;
+    step_count = h.step;
+    sim_time = h.time;
+    checkpoint_map = std::move(m);  // 前に復元したファイルは、全ての場を付け替えた後で閉じる
+    active_tiles = ActiveTileMask();    // 次の update で全てのタイルを判定し直す
+    last_substeps = 1;
+    SF_LOG_INFO("restored checkpoint (step {}, N={})", step_count, h.n);
+}
+
+template class BasicSimulation<float>;
+template class BasicSimulation<double>;
+template class BasicSimulation<float, double>;
@@ -7,80 +7,472 @@
 
 // #pragma once → ヘッダーファイルが一度だけインクルードされる
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <variant>
 #include <vector>
 
-// インデックス計算用マクロ
-// グリッドの座標（i, j)を1D配列(一次元配列)のインデックスに変換
-#define IX(i, j) ((i) + (N + 2) * (j))
+#include "active_tiles.hpp"
+#include "advect_kernels.hpp"
+#include "cg_solver.hpp"
+#include "checkpoint.hpp"
+#include "dye_storage.hpp"
+#include "field_arena.hpp"
+#include "grid2d.hpp"
+#include "multigrid.hpp"
+#include "numa.hpp"
+#include "pixel_format.hpp"
+#include "profiler.hpp"
+#include "solve_stats.hpp"
+#include "thread_pool.hpp"
+#include "work_stealing_pool.hpp"
 
-class Simulation {
+// 陰的な線形系（拡散・圧力のポアソン方程式）の解法
+enum class LinearSolver {
+    GaussSeidel,            // 辞書式順序のガウス・ザイデル法（シングルスレッド）
+    RedBlackGaussSeidel,    // 赤黒順序のガウス・ザイデル法（行単位でマルチスレッド）
+    ConjugateGradient,      // 前処理付き共役勾配法（残差が許容値に達するまで反復）
+};
+
+// 投影処理での圧力のポアソン方程式の解法
+enum class PressureSolver {
+    Iterative,  // lin_solve で解く（LinearSolver の設定に従う、ガウス・ザイデル法は固定40回）
+    Multigrid,  // 幾何マルチグリッド法（残差が許容値に達するまで反復）
+};
+
+// 時間刻みの制御
+// adaptive では update(N, dt) の dt を、逆追跡の距離（dt * N * max|u| セル）が cfl 以下になる数の部分ステップに分けて進める
+// 速度が小さい間は部分ステップは1つ（dt をそのまま使う）で、速い入力があったフレームだけ細かくする
+struct TimestepOptions {
+    bool adaptive = false;  // CFL 条件から部分ステップの数を決めるか（既定は無効: 常に1ステップ）
+    float cfl = 2.0f;       // 1部分ステップで逆追跡する距離の上限（セル数）
+    int max_substeps = 8;   // 1回の update での部分ステップ数の上限（超える場合は cfl を守らない）
+};
+
+// 計算の精度
+enum class Precision {
+    Float32,    // BasicSimulation<float>
+    Float64,    // BasicSimulation<double>
+    Mixed,      // BasicSimulation<float, double>: 格納は fp32、圧力の計算と残差は fp64
+};
+
+inline const char* precision_name(Precision p){
+    switch (p){
+        case Precision::Float32: return "fp32";
+        case Precision::Float64: return "fp64";
+        case Precision::Mixed: return "mixed";
+    }
+    return "unknown";
+}
+
+/**
+ * Real: 場の要素の型（float / double）
+ * Accum: 投影処理（発散・圧力のポアソン方程式・圧力勾配）と残差を計算する型
+ *   Real = float, Accum = double が混合精度で、格納と移流・拡散は fp32 のまま、圧力の反復の近傍の和と残差を fp64 で計算する
+ *   （共役勾配法は拡散と圧力で同じソルバーを使うので、拡散でも Accum で計算する）
+ * 実体は float, double, (float, double) の3通りだけを simulation.cpp で生成する
+ */
+template <typename Real, typename Accum = Real>
+class BasicSimulation {
+public:
+    using real_type = Real;
+    using accum_type = Accum;
+    // Real と同じ型の格納形式（dens_step の経路で処理する色とトレーサーの形式）
+    using NativeStorage = std::conditional_t<std::is_same_v<Real, double>, Float64Storage, Float32Storage>;
+    static constexpr DyeStorage kNativeDye = std::is_same_v<Real, double> ? DyeStorage::Float64 : DyeStorage::Float32;
+    
 private:
-    int size;   // グリッドのサイズ
-    std::vector<float> x;   // x方向の速度
-    std::vector<float> y;   // y方向の速度
-    std::vector<float> x_prev;   // 前ステップのx方向の速度
-    std::vector<float> y_prev;   // 前ステップのy方向の速度
-    std::vector<float> dens;    // 密度（色の濃さ）
-    std::vector<float> dens_prev;   // 前ステップの密度（色の濃さ）
-    
-    std::vector<float> r;   // 赤色成分
-    std::vector<float> r_prev;  // 前ステップの赤色成分
-    std::vector<float> g;   // 緑色成分
-    std::vector<float> g_prev;  // 前ステップの緑色の成分
-    std::vector<float> b;   // 青色成分
-    std::vector<float> b_prev;  // 前ステップの青色成分
-    
-    float viscosity = 0.0f; // 流体の粘土
-    float diffusion = 0.001f;   // 拡散率
+    FieldArena arena;   // 全ての場の記憶領域（1回だけ確保する）
+    
+    Grid2D<Real> x;   // x方向の速度
+    Grid2D<Real> y;   // y方向の速度
+    Grid2D<Real> x_prev;   // 前ステップのx方向の速度
+    Grid2D<Real> y_prev;   // 前ステップのy方向の速度
+    Grid2D<Real> dens;    // 密度（色の濃さ）
+    Grid2D<Real> dens_prev;   // 前ステップの密度（色の濃さ）
+    
+    // 同じ速度場で輸送されるスカラー場: 色成分（赤・緑・青）と追加のトレーサー（色以外の受動スカラー）
+    // チャンネルは r, g, b, トレーサーの順。格納形式ごとに要素の型が違うので、コンストラクタで選んだものを持つ
+    using DyeVariant = std::variant<DyeFields<Float32Storage>, DyeFields<Float64Storage>, DyeFields<Float16Storage>,
+                                    DyeFields<BFloat16Storage>, DyeFields<Fixed16Storage<>>>;
+    DyeVariant dye;
+    DyeStorage dye_storage = kNativeDye;
+    
+    // 投影処理とソルバーの作業領域（速度場の前ステップの値とは別に持つ）
+    Grid2D<Real> pressure;     // 圧力
+    Grid2D<Real> divergence;   // 速度場の発散
+    Grid2D<Real> residual;     // 残差（マルチグリッド法・共役勾配法で共有）
+    // 融合した輸送処理での移流後の速度（u, u0 を読みながら書くため、別の領域に書く）
+    Grid2D<Real> x_adv;
+    Grid2D<Real> y_adv;
+    
+    Real viscosity = Real(0); // 流体の粘土
+    Real diffusion = Real(0.001);   // 拡散率
+    
+    LinearSolver solver = LinearSolver::GaussSeidel;    // 線形ソルバーの種類
+    std::unique_ptr<WorkStealingPool> tasks;    // 作業グラフを実行するプール（作業グラフを使う場合だけ）
+    std::unique_ptr<ThreadPool> pool;   // 赤黒ガウス・ザイデル法で使うスレッドプール（作業グラフを使う場合は tasks に任せる）
+    NumaOptions numa_options;           // スレッドの固定（プールを作り直すときも使う）
+    
+    bool task_graph = false;    // 1ステップを作業グラフとして tasks で実行するか
+    TaskGraph graph;            // advance_tasks で毎回作り直す（領域は使い回す）
+    std::vector<SolveStats> channel_stats;  // 作業グラフでのチャンネルごとの拡散の収束情報
+    
+    PressureSolver pressure_solver = PressureSolver::Iterative; // 圧力ソルバーの種類
+    BasicMultigridSolver<Real, Accum> multigrid;  // マルチグリッド法の作業領域
+    SolveStats pressure_stats;  // 直近の圧力ソルバーの収束情報
+    
+    BasicConjugateGradientSolver<Real, Accum> cg; // 共役勾配法の作業領域
+    SolveStats diffusion_stats; // 直近の拡散処理の収束情報
+    bool residual_telemetry = false;    // ガウス・ザイデル法でも反復の前後の残差ノルムを求めるか
+    
+    SimdIsa simd_isa = SimdIsa::Scalar;     // 移流カーネルの命令セット
+    BasicAdvectKernel<Real> advect_fn = nullptr;    // 移流カーネル（fp64 はスカラー版のみ）
+    
+    int tile_size = 64;     // タイル分割したループでのタイルの一辺（セル数）
+    
+    SparseOptions sparse_options;   // 有効なタイルだけを処理する設定
+    ActiveTileMask active_tiles;    // 有効なタイル（update の最初に判定し直す）
+    std::vector<unsigned char> tile_seed;   // タイルごとのしきい値の判定結果（active_tiles の作業領域）
+    
+    TimestepOptions timestep_options;   // 時間刻みの制御
+    int last_substeps = 1;      // 直近の update での部分ステップ数
+    Real last_cfl = Real(0);    // 直近の update での（分割前の dt に対する）CFL 数
+    std::vector<Real> row_speed;    // max_speed の行ごとの最大値
+    
+    bool fused_transport = false;   // ソース項の加算・移流・境界条件を融合した輸送処理を使うか
+    bool fusion_check = false;      // 参照比較モード
+    std::uint64_t fusion_mismatches = 0;    // 参照比較モードで一致しなかった場の数
+    
+    std::vector<unsigned char> density_snapshot[2];    // snapshotDensity の二重バッファ
+    int snapshot_index = 0;     // 直前に書き込んだバッファ
+    
+    std::uint64_t step_count = 0;   // update を呼んだ回数
+    double sim_time = 0.0;          // update で進めた時間の合計
+    std::shared_ptr<MappedCheckpoint> checkpoint_map;   // restoreCheckpoint で場の領域として使っているファイル
+    
+#ifdef SF_PROFILE
+    mutable StageProfiler profiler;     // 処理段階ごとの所要時間（const な readDensity からも記録する）
+#endif
+    
+    // [1, N] x [1, N] をタイルに分割し、fn(i_begin, i_end, j_begin, j_end) を呼ぶ（タイルの行単位で並列処理）
+    template <typename F>
+    void for_each_tile(int N, F&& fn);
+    // 有効なタイルだけで fn を呼ぶ（有効タイルを使わない場合は for_each_tile と同じ）
+    template <typename F>
+    void for_each_active_tile(int N, F&& fn);
+    // 有効タイルを使う場合に、格子の境界に接する無効なタイルで fn を呼ぶ
+    template <typename F>
+    void for_each_inactive_edge_tile(int N, F&& fn);
+    // 拡散のガウス・ザイデル法に渡す有効タイル（使わない場合は nullptr）
+    const ActiveTileMask* sparse_mask(int N) const;
+    // 有効なタイルを判定し直し、無効になったタイルの場を0にする
+    void update_active_tiles(int N);
+    
+    // チェックポイントに含める場ごとに fn(名前, 格子) を呼ぶ（速度・密度・色とトレーサー、それぞれの前ステップの値）
+    template <typename Self, typename F>
+    static void for_each_state_field(Self& self, F&& fn);
+    CheckpointHeader checkpoint_header() const;
+    std::vector<CheckpointBlock> checkpoint_blocks() const;
+    
+    // 1ステップ分の更新（速度・色・トレーサー）
+    void advance(int N, Real dt);
+    // advance の vel_step と色・トレーサーの更新を、独立な処理を別々の作業にした作業グラフで行う
+    void advance_tasks(int N, Real dt);
+    // スレッド数と task_graph に合わせて pool（と tasks）を作り直す
+    void make_pools(int threads);
+    // 速度と色・トレーサーにソース項を dt 分加える（前ステップの値はそのまま）
+    void apply_sources(int N, Real dt);
+    // 速度と色・トレーサーの前ステップの値（ソース項）を0にする
+    void clear_sources();
+    // ソース項を dt 分加えた内部セルの速度の成分の絶対値の最大値（行単位で並列に求めてまとめる。場は変えない）
+    Real max_speed(int N, Real dt);
+    
+    // 以下の2つの x[c], x0[c] は格子の (0, 0) を指し、stride は行の要素数（Grid2D::pitch）
+    // 辞書式（メモリ順）ガウス・ザイデル法を iters 回反復する（channels 個の場をセルごとにまとめて更新）
+    // 反復をまたいだウェーブフロントで処理し、各反復の後の set_bnd も行単位で行う
+    // S は格納形式（dye_storage.hpp）。要素は S::load で読み、更新式は A で計算して S::store で書き戻す
+    // A: 更新式の型（拡散は Real、圧力は Accum）
+    // fold_source: 最初の反復で各行を更新する直前に x0 += dt * x を行う（ソース項の加算を融合する）
+    // mask: nullptr でなければ、有効なタイルのセルだけを更新する（他のセルは0のまま）
+    template <typename S, typename A>
+    void gauss_seidel_wavefront(int N, int stride, int b, int channels, typename S::value_type* const* x, typename S::value_type* const* x0,
+                                A a, A c, int iters, bool fold_source, Real dt, const ActiveTileMask* mask);
+    // 赤黒ガウス・ザイデル法の1反復（赤→黒の順に色ごとに行を並列処理）
+    template <typename S, typename A>
+    void red_black_sweep(int N, int stride, int channels, typename S::value_type* const* x, typename S::value_type* const* x0,
+                         A a, A c, bool fold_source, Real dt, const ActiveTileMask* mask);
+    template <typename S, typename A = Real>
+    SolveStats gauss_seidel(int N, int b, int channels, Grid2D<typename S::value_type>* const* x, Grid2D<typename S::value_type>* const* x0,
+                            A a, A c, int iters, bool fold_source, Real dt, const ActiveTileMask* mask = nullptr);
+    // ガウス・ザイデル法で解く線形系の残差ノルム ||x0 - (c x - a Σ近傍)||（各セルは A で計算し、2乗和は double で足す）
+    // fold_dt: 右辺を x0 + fold_dt * x とする（fold_source の最初の反復の前の右辺）
+    template <typename S, typename A>
+    double residual_norm(int N, const Grid2D<typename S::value_type>& x, const Grid2D<typename S::value_type>& x0,
+                         A a, A c, Real fold_dt) const;
+    template <typename S>
+    void set_bnd_as(int N, int b, Grid2D<typename S::value_type>& x);
+    // diffuse と同じ処理で、収束情報を diffusion_stats に書かずに返す（並行に進む作業から呼ぶ）
+    SolveStats diffuse_solve(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real diff, Real dt);
+    // ソース項の加算を融合した拡散処理（x の初期値がソース項、x0 がソース項を足す前の場。収束情報は返すだけ）
+    SolveStats diffuse_with_source(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real diff, Real dt);
+    
+    // タイル単位で移流し、タイルが接する境界のゴーストセルも続けて書く（b[c]: c 番目のチャンネルの境界条件）
+    void advect_tiles(int N, int stride, const int* b, const BasicAdvectFields<Real>& f);
+    void vel_step_fused(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& u0, Grid2D<Real>& v0, Real visc, Real dt);
+    // 融合した速度の輸送の後、角のセルを融合しない場合と同じ値にする（u, v にソース項を足し、x_adv, y_adv に u0, v0 を写す）
+    void fused_corners(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& u0, Grid2D<Real>& v0, Real dt);
+    
+    // 参照比較モード（融合しない処理を pressure, divergence, residual を作業領域にして行い、結果を比べる）
+    void advect_reference(int N, int b, Grid2D<Real>& d, Grid2D<Real>& d0, Grid2D<Real>& u, Grid2D<Real>& v, Real dt);
+    void reference_dens_step(int N, Grid2D<Real>& x, Grid2D<Real>& x0, Grid2D<Real>& u, Grid2D<Real>& v, Real diff, Real dt);
+    void check_velocity_transport(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& u0, Grid2D<Real>& v0, Real dt);
+    void check_same(int N, const Grid2D<Real>& expected, const Grid2D<Real>& actual, const char* stage);
+    
+    // 色とトレーサーの更新（NativeStorage は dens_step、それ以外は下の格納形式ごとの処理を使う）
+    template <typename S>
+    void dens_step_dye(int N, DyeFields<S>& d, Grid2D<Real>& u, Grid2D<Real>& v, Real diff, Real dt);
+    template <typename S>
+    void add_source_stored(int N, Grid2D<typename S::value_type>& x, Grid2D<typename S::value_type>& s, Real dt);
+    template <typename S>
+    SolveStats diffuse_stored(int N, int b, int channels, Grid2D<typename S::value_type>* const* x, Grid2D<typename S::value_type>* const* x0, Real diff, Real dt);
+    template <typename S>
+    void store_expanded(int N, int b, const Grid2D<Real>& src, Grid2D<typename S::value_type>& dst);
+    template <typename S>
+    void advect_stored(int N, int b, int channels, Grid2D<typename S::value_type>* const* d, Grid2D<typename S::value_type>* const* d0,
+                       Grid2D<Real>& u, Grid2D<Real>& v, Real dt);
+    template <typename S>
+    void read_density(const DyeFields<S>& d, int N, PixelFormat fmt, void* dst, std::size_t row_stride) const;
     
 public:
     // コンストラクタ
-    Simulation(int size);   // シミュレーションの初期化
+    // tracer_count: r, g, b に加えて輸送するトレーサーの数
+    // storage: 色とトレーサーの場の格納形式（計算は常に Real で行う）
+    // memory: 場の記憶領域として使う外部の領域（FieldArena::kAlignment 境界、arenaBytes バイト以上、所有しない）
+    //   nullptr なら自前で確保する
+    // numa: first_touch では numa.threads 個のスレッドで全ての場を行の区間ごとに初期化する（スレッド数もそれになる）
+    BasicSimulation(int size, int tracer_count = 0, DyeStorage storage = kNativeDye, void* memory = nullptr,
+                    const NumaOptions& numa = NumaOptions());   // シミュレーションの初期化
+    // 全ての場とソルバーの作業領域に必要なバイト数
+    static std::size_t arenaBytes(int size, int tracer_count = 0, DyeStorage storage = kNativeDye);
     // デストラクタ
-    ~Simulation();  // リソースの解放
+    ~BasicSimulation();  // リソースの解放
     
     /**
      * 外力項の加算
      * X, Y: クリックした座標、N: グリッドサイズ、u, v: マウスの動く方向に力の大きさ
      */
-    void add_force(int X, int Y, int N, float u, float v);
+    void add_force(int X, int Y, int N, Real u, Real v);
     
     //  ソース項の加算
-    void add_source(int N, std::vector<float>& x, std::vector<float>& s, float dt);
+    void add_source(int N, Grid2D<Real>& x, Grid2D<Real>& s, Real dt);
     
-    // 拡散処理
-    void diffuse(int N, int b, std::vector<float>& x, std::vector<float>& x0, float diff, float dt);
+    // 拡散処理（収束情報を返す）
+    SolveStats diffuse(int N, int b, Grid2D<Real>& x, Grid2D<Real>& x0, Real diff, Real dt);
+    // 複数の場の拡散処理（ガウス・ザイデル法では1回の走査で全チャンネルを更新する）
+    // 収束情報は全チャンネルのうち最も悪いもの
+    SolveStats diffuse(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real diff, Real dt);
     
     // 移流処理
-    void advect(int N, int b, std::vector<float>& d, std::vector<float>& d0, std::vector<float>&u, std::vector<float>& v, float dt);
+    void advect(int N, int b, Grid2D<Real>& d, Grid2D<Real>& d0, Grid2D<Real>&u, Grid2D<Real>& v, Real dt);
+    // 複数の場の移流処理（逆追跡の位置と補間の重みはセルごとに1度だけ計算する）
+    void advect(int N, int b, int channels, Grid2D<Real>* const* d, Grid2D<Real>* const* d0, Grid2D<Real>& u, Grid2D<Real>& v, Real dt);
+    /**
+     * 融合した輸送処理: d[c] = advect(d0[c] + dt * s[c])、境界条件は b[c]
+     * ソース項の加算・移流・境界条件を1回の走査で行い、d0, s, u, v, us, vs は書き換えない（d はそのどれとも別の格子）
+     * s が nullptr ならソース項なし。us, vs（両方とも指定するか両方 nullptr）を指定すると (u + dt * us, v + dt * vs) で逆追跡する
+     * add_source してから advect した結果とビット単位で一致する
+     */
+    void transport(int N, int channels, const int* b, Grid2D<Real>* const* d, Grid2D<Real>* const* d0, Grid2D<Real>* const* s,
+                   Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>* us, Grid2D<Real>* vs, Real dt);
+    
+    /**
+     * 線形系 c * x[i,j] - a * (x[i-1,j] + x[i+1,j] + x[i,j-1] + x[i,j+1]) = x0[i,j] を反復法で解く
+     * 拡散（a = dt*diff*N*N, c = 1+4a）と圧力のポアソン方程式（a = 1, c = 4）で共通
+     * iters: 反復回数（ConjugateGradient では使わず、許容誤差と反復回数の上限に従う）
+     * 収束情報を返す（ガウス・ザイデル法の残差は setResidualTelemetry を有効にした場合だけ求める）
+     */
+    SolveStats lin_solve(int N, int b, Grid2D<Real>& x, Grid2D<Real>& x0, Real a, Real c, int iters);
+    // channels 個の独立な線形系をまとめて解く（係数と境界条件は共通）
+    SolveStats lin_solve(int N, int b, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Real a, Real c, int iters);
     
-    // 投影処理
-    void project(int N, std::vector<float>& u, std::vector<float>& v, std::vector<float>& p, std::vector<float>& div);
+    // 投影処理（圧力ソルバーの収束情報を返す）
+    SolveStats project(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& p, Grid2D<Real>& div);
     
     // 境界条件の設定
-    void set_bnd(int N, int b, std::vector<float>& x);
+    void set_bnd(int N, int b, Grid2D<Real>& x);
     
     // 更新処理
     
     // 密度(色の濃さ）の更新
-    void dens_step(int N, std::vector<float>& x, std::vector<float>& x0, std::vector<float>& u, std::vector<float>& v, float diff, float dt);
+    void dens_step(int N, Grid2D<Real>& x, Grid2D<Real>& x0, Grid2D<Real>& u, Grid2D<Real>& v, Real diff, Real dt);
+    // 複数のスカラー場（r, g, b, トレーサー）をまとめて更新する
+    void dens_step(int N, int channels, Grid2D<Real>* const* x, Grid2D<Real>* const* x0, Grid2D<Real>& u, Grid2D<Real>& v, Real diff, Real dt);
     
     // 速度の更新
-    void vel_step(int N, std::vector<float>& u, std::vector<float>& v, std::vector<float>& u0, std::vector<float>& v0, float visc, float dt);
+    void vel_step(int N, Grid2D<Real>& u, Grid2D<Real>& v, Grid2D<Real>& u0, Grid2D<Real>& v0, Real visc, Real dt);
     
-    // シミュレーションの全体的な更新
-    void update(int N, float dt);
+    // シミュレーションの全体的な更新（時間 dt だけ進める。adaptive では部分ステップに分ける）
+    void update(int N, Real dt);
     
     // シミュレーションのリセット
     void reset(int N);
     
-    // 密度（色）データの取得
+    // 密度（色）データの取得（毎回新しいベクターを確保する。毎フレーム呼ぶ場合は readDensity を使う）
     std::vector<float> getDensity(int N);
+    /**
+     * 色データを呼び出し側のバッファ dst に書き出す（確保は行わない）
+     * 内部セルを行 j ごとに i の順で並べ、赤色成分は0未満を0にする（getDensity と同じ）
+     * row_stride: dst の1行のバイト数（0 なら N * pixel_size(fmt) で詰める）
+     */
+    void readDensity(int N, PixelFormat fmt, void* dst, std::size_t row_stride = 0) const;
+    void readDensity(int N, float* dst) const { readDensity(N, PixelFormat::RGB32F, dst); }
+    // 色データを内部の二重バッファに書き出して返す
+    // 返したバッファは次の次の呼び出しまで書き換えない（大きさが同じなら確保も行わない）
+    const std::vector<unsigned char>& snapshotDensity(int N, PixelFormat fmt = PixelFormat::RGB32F);
     
     // スタンプ（色の追加）
-    void stamp(int X, int Y, int W, int H, int N, float R, float G, float B);
+    void stamp(int X, int Y, int W, int H, int N, Real R, Real G, Real B);
     
-    // シンク（色の除去）
+    // シンク（色とトレーサーの除去）
     void sink(int X, int Y, int W, int H, int N);
+    
+    // トレーサー
+    int getTracerCount() const;
+    // id 番目のトレーサーを追加する（stamp と同じ範囲指定）
+    void stampTracer(int id, int X, int Y, int W, int H, int N, Real amount);
+    // id 番目のトレーサーの内部セルを Real で dst（N * N 要素、行 j ごとに i の順）に書き出す
+    void readTracer(int id, int N, Real* dst) const;
+    
+    // 色とトレーサーの場の格納形式
+    DyeStorage getDyeStorage() const { return dye_storage; }
+    
+    // 粘性係数・拡散率の設定（ヘッドレス実行などから指定する）
+    void setViscosity(Real visc) { viscosity = visc; }
+    void setDiffusion(Real diff) { diffusion = diff; }
+    Real getViscosity() const { return viscosity; }
+    Real getDiffusion() const { return diffusion; }
+    
+    // 線形ソルバーの選択（インスタンスごと）
+    void setLinearSolver(LinearSolver s) { solver = s; }
+    LinearSolver getLinearSolver() const { return solver; }
+    
+    // 赤黒ガウス・ザイデル法で使うスレッド数（呼び出し側スレッドを含む、0 でハードウェアスレッド数）
+    void setThreadCount(int threads);
+    int getThreadCount() const { return pool->size(); }
+    // 構築時の NUMA 向けの設定（pin_threads はワーカーだけを固定し、呼び出し側スレッドの affinity は変えない）
+    const NumaOptions& getNumaOptions() const { return numa_options; }
+    // 全ての場の記憶領域のページの NUMA ノードごとの数と、スレッドを固定した CPU のノード
+    // （作業グラフのプールと、呼び出し側の 0 番目のスレッドは固定しないので -1）
+    NumaPlacement getNumaPlacement() const;
+    
+    /**
+     * 作業グラフ（既定は無効）
+     * 有効にすると1ステップを、互いに独立な処理を別々の作業にした作業グラフとして work-stealing プールで実行する
+     * （速度の u と v のソース項の加算・移流・拡散、vel_step の後の色とトレーサーのチャンネルごとの更新）
+     * 各処理の中の行ループも同じプールで分け合うので、1つの処理ではスレッドを埋めきれない中くらいの格子で効く
+     * 結果は無効の場合とビット単位で一致する。参照比較モードでは使わない（常に順に処理する）
+     */
+    void setTaskGraph(bool on);
+    bool getTaskGraph() const { return task_graph; }
+    // 作業グラフのプールで作業を盗んだ回数
+    std::uint64_t getTaskSteals() const { return tasks ? tasks->steals() : 0; }
+    
+    // タイル分割したループでのタイルの一辺（セル数）
+    void setTileSize(int tile) { tile_size = std::max(1, tile); }
+    int getTileSize() const { return tile_size; }
+    
+    // 時間刻みの制御（adaptive では、ソース項を dt 分まとめて加えてから、ソース項なしで部分ステップを進める）
+    void setTimestepOptions(const TimestepOptions& opt);
+    const TimestepOptions& getTimestepOptions() const { return timestep_options; }
+    // 直近の update での部分ステップ数と、分割前の dt に対する CFL 数
+    int getLastSubsteps() const { return last_substeps; }
+    Real getLastCfl() const { return last_cfl; }
+    
+    /**
+     * 有効なタイルだけを処理する設定（既定は無効）
+     * 有効にすると update の最初に、速度か色・トレーサーがしきい値を超えるタイルとその周囲を有効なタイルとし、
+     * 移流・拡散（ガウス・ザイデル法）・圧力勾配の適用を有効なタイルだけで行う。無効なタイルの値は0にする
+     * 圧力のポアソン方程式は格子全体で解く。共役勾配法の拡散も格子全体を更新するので、その後は全てのタイルを判定し直す
+     * tile と halo は1未満なら1にする
+     */
+    void setSparseOptions(const SparseOptions& opt);
+    const SparseOptions& getSparseOptions() const { return sparse_options; }
+    // 直近の update での有効なタイルの割合（有効タイルを使わない場合は 1）
+    double getActiveTileFraction() const { return sparse_options.enabled ? active_tiles.activeFraction() : 1.0; }
+    
+    // 移流カーネルの命令セット（既定は Auto: 実行時に CPU の対応状況から選ぶ。fp64 では常に Scalar）
+    void setSimdIsa(SimdIsa isa);
+    SimdIsa getSimdIsa() const { return simd_isa; }
+    
+    // 融合した輸送処理（既定は無効）
+    // 有効にすると vel_step はソース項の加算と移流を1回の走査で行い、dens_step はソース項の加算を拡散の最初の反復に融合する
+    // （色とトレーサーを 16 ビットの形式で持つ場合、それらの更新は融合しない）
+    void setFusedTransport(bool on) { fused_transport = on; }
+    bool getFusedTransport() const { return fused_transport; }
+    // 参照比較モード: 融合した処理と同じ入力で融合しない処理も行い、結果がビット単位で一致するか確かめる（検証用で遅い）
+    void setFusionCheck(bool on) { fusion_check = on; }
+    bool getFusionCheck() const { return fusion_check; }
+    // 参照比較モードで一致しなかった場の数
+    std::uint64_t getFusionMismatches() const { return fusion_mismatches; }
+    
+    // 圧力ソルバーの選択
+    void setPressureSolver(PressureSolver s) { pressure_solver = s; }
+    PressureSolver getPressureSolver() const { return pressure_solver; }
+    void setMultigridOptions(const MultigridOptions& opt) { multigrid.setOptions(opt); }
+    const MultigridOptions& getMultigridOptions() const { return multigrid.getOptions(); }
+    
+    void setConjugateGradientOptions(const ConjugateGradientOptions& opt) { cg.setOptions(opt); }
+    const ConjugateGradientOptions& getConjugateGradientOptions() const { return cg.getOptions(); }
+    
+    // ガウス・ザイデル法（辞書式・赤黒）の拡散と圧力でも反復の前後に残差ノルムを求める（1回の解ごとに2回の走査が増える）
+    // 無効のときは、それらの収束情報の残差は NaN になる（共役勾配法とマルチグリッド法は常に求める）
+    void setResidualTelemetry(bool on) { residual_telemetry = on; }
+    bool getResidualTelemetry() const { return residual_telemetry; }
+    
+    // 直近の project での圧力ソルバーの収束情報
+    const SolveStats& getPressureStats() const { return pressure_stats; }
+    // 直近の diffuse での収束情報
+    const SolveStats& getDiffusionStats() const { return diffusion_stats; }
+    
+    // update を呼んだ回数と進めた時間の合計（チェックポイントに含める）
+    std::uint64_t getStepCount() const { return step_count; }
+    double getTime() const { return sim_time; }
+    
+    /**
+     * チェックポイント（checkpoint.hpp）
+     * 全ての場（速度・密度・色とトレーサー、それぞれの前ステップの値）・粘性係数・拡散率・N・ステップ数を含める
+     * 作業領域（圧力・発散・残差・ソルバーの作業領域）と設定（ソルバーの種類・スレッド数など）は含めない
+     */
+    // チェックポイントの大きさ（バイト）
+    std::size_t checkpointBytes() const;
+    // image（checkpointBytes バイト、64 バイト境界）に並べる（チェックサムは checkpoint_finalize で付ける）
+    void serializeCheckpoint(unsigned char* image) const;
+    // path に書き出す（呼び出し側スレッドで書き終えるまで待つ。非同期に書く場合は CheckpointWriter を使う）
+    void saveCheckpoint(const std::string& path) const;
+    /**
+     * path のチェックポイントから復元する
+     * ファイルを mmap し、場の領域をファイルのブロックに付け替える（値は写さず、ページは触れたときに読み込まれる）
+     * N・要素の型・色とトレーサーの格納形式とチャンネル数が一致しない場合や、ファイルが壊れている場合は
+     * std::runtime_error を投げ、状態は変えない
+     * verify: ブロックのチェックサムを確かめる（全てのページを一度読む）
+     */
+    void restoreCheckpoint(const std::string& path, bool verify = true);
+    
+    // 処理段階ごとの所要時間の記録（SF_PROFILE なしでビルドした場合は nullptr）
+    // update を呼ぶスレッドから、または更新を止めてから読む
+#ifdef SF_PROFILE
+    StageProfiler* getProfiler() { return &profiler; }
+#else
+    StageProfiler* getProfiler() { return nullptr; }
+#endif
 };
+
+// 既定の単精度版と、倍精度版・混合精度版
+using Simulation = BasicSimulation<float>;
+using SimulationF64 = BasicSimulation<double>;
+using SimulationMixed = BasicSimulation<float, double>;
@@ -0,0 +1,28 @@
+//
+//  simulation_batch.cpp
+//  2D-StableFluids
+//
+
+#include "simulation_batch.hpp"
+
+#include <stdexcept>
+
+template <typename Sim>
+BasicSimulationBatch<Sim>::BasicSimulationBatch(int count, int N, int threads, int tracer_count, DyeStorage storage)
+    : n(N), pool(threads) {
+    if (count < 0 || N <= 0){
+        throw std::invalid_argument("batch requires a non-negative count and a positive size");
+    }
+    // インスタンスの境界をページに揃え、隣のインスタンスとページを共有しないようにする
+    const std::size_t per = FieldArena::round_up(Sim::arenaBytes(N, tracer_count, storage));
+    memory.reserve(per * count);
+    instances.reserve(count);
+    for (int k = 0; k < count; ++k){
+        void* base = memory.take_array<unsigned char>(per);
+        instances.push_back(std::make_unique<Sim>(N, tracer_count, storage, base));
+    }
+}
+
+template class BasicSimulationBatch<Simulation>;
+template class BasicSimulationBatch<SimulationF64>;
+template class BasicSimulationBatch<SimulationMixed>;
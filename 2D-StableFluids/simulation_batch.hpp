@@ -0,0 +1,93 @@
+//
+//  simulation_batch.hpp
+//  2D-StableFluids
+//
+//  多数の小さな Simulation（パラメータの掃引など）をまとめて進めるバッチ実行。
+//  - 全てのインスタンスの場を1つの連続した領域に、インスタンスの順に並べる（確保は1回）
+//  - 1つのインスタンスを指定したステップ数だけ進める処理を1つの作業とし、work-stealing プールで分け合う
+//    インスタンスごとにソルバー・粘性係数などが違って所要時間が揃わなくても、空いたスレッドが残りを引き受ける
+//    （格子の大きさは全てのインスタンスで同じ）
+//  各インスタンスの内部は1スレッドで進める（インスタンスの中を分割するより、インスタンス単位で並べる方が効率がよい大きさを想定）。
+//
+
+#pragma once
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "field_arena.hpp"
+#include "simulation.hpp"
+#include "work_stealing_pool.hpp"
+
+template <typename Sim>
+class BasicSimulationBatch {
+public:
+    using real_type = typename Sim::real_type;
+
+    /**
+     * count 個の一辺 N のインスタンスを作る（初期状態は Simulation のコンストラクタと同じ）
+     * threads: インスタンスを進めるスレッド数（呼び出し側を含む、0 でハードウェアスレッド数）
+     */
+    BasicSimulationBatch(int count, int N, int threads = 0, int tracer_count = 0, DyeStorage storage = Sim::kNativeDye);
+
+    BasicSimulationBatch(const BasicSimulationBatch&) = delete;
+    BasicSimulationBatch& operator=(const BasicSimulationBatch&) = delete;
+
+    int size() const { return (int)instances.size(); }
+    int gridSize() const { return n; }
+    int getThreadCount() const { return pool.size(); }
+    // k 番目のインスタンス（設定の変更・イベントの適用・結果の読み出し用。advance の実行中は触らない）
+    Sim& operator[](int k) { return *instances[k]; }
+    const Sim& operator[](int k) const { return *instances[k]; }
+
+    // 全てのインスタンスを steps ステップ進める
+    void advance(int steps, real_type dt){
+        advance(steps, dt, [](int, Sim&, int){});
+    }
+    /**
+     * 全てのインスタンスを steps ステップ進める
+     * 各ステップの update の前に、そのインスタンスを進めているスレッドで before(k, sim, step) を呼ぶ
+     * （reset・外力・スタンプなどを適用する。step は advance の呼び出しの中でのステップ番号）
+     * before は複数のスレッドから同時に呼ばれる（別々のインスタンスについて）
+     * before か update が例外を投げた場合、そのインスタンスはそこで止め、他のインスタンスを進め終えてから最初の例外を投げ直す
+     */
+    template <typename F>
+    void advance(int steps, real_type dt, F&& before){
+        std::exception_ptr error;
+        std::mutex error_mtx;
+        pool.for_each(size(), [&](int k, int){
+            Sim& sim = *instances[k];
+            try {
+                for (int s = 0; s < steps; ++s){
+                    before(k, sim, s);
+                    sim.update(n, dt);
+                }
+            } catch (...){
+                std::lock_guard<std::mutex> lock(error_mtx);
+                if (!error) error = std::current_exception();
+            }
+        });
+        total_steps += (std::uint64_t)steps * size();
+        if (error) std::rethrow_exception(error);
+    }
+
+    // これまでに進めたインスタンス・ステップの合計
+    std::uint64_t instanceSteps() const { return total_steps; }
+    // 作業を他のスレッドから盗んだ回数
+    std::uint64_t steals() const { return pool.steals(); }
+    // 全てのインスタンスの場の領域（バイト）
+    std::size_t arenaBytes() const { return memory.capacity(); }
+
+private:
+    int n;
+    FieldArena memory;  // 全てのインスタンスの場（インスタンスごとにページ境界で区切る）
+    std::vector<std::unique_ptr<Sim>> instances;
+    WorkStealingPool pool;
+    std::uint64_t total_steps = 0;
+};
+
+using SimulationBatch = BasicSimulationBatch<Simulation>;
+using SimulationBatchF64 = BasicSimulationBatch<SimulationF64>;
+using SimulationBatchMixed = BasicSimulationBatch<SimulationMixed>;
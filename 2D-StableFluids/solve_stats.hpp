@@ -0,0 +1,18 @@
+//
+//  solve_stats.hpp
+//  2D-StableFluids
+//
+//  反復ソルバーの収束情報
+//
+//  ガウス・ザイデル法は反復回数が固定なので converged は常に false になる。残差は
+//  BasicSimulation::setResidualTelemetry を有効にした場合だけ求め、求めていない場合は NaN にする。
+//
+
+#pragma once
+
+struct SolveStats {
+    int iterations = 0;             // 実行した反復回数（マルチグリッドではサイクル数）
+    float initial_residual = 0.0f;  // 反復開始前の残差ノルム ||b - Ax||
+    float residual = 0.0f;          // 反復終了後の残差ノルム
+    bool converged = false;         // 許容誤差に達したか
+};
@@ -0,0 +1,46 @@
+//
+//  spsc_queue.hpp
+//  2D-StableFluids
+//
+//  生産者1つ・消費者1つのロックフリーな固定長キュー（リングバッファ）。
+//  push / pop はどちらも待たずに失敗を返す（満杯なら push が false、空なら pop が false）。
+//
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+template <typename T, std::size_t Capacity>
+class SpscQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    // 生産者側
+    bool push(const T& item){
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity) return false;
+        items[t & (Capacity - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 消費者側
+    bool pop(T& item){
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        item = items[h & (Capacity - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::array<T, Capacity> items{};
+    // 生産者と消費者が書き込む位置を別のキャッシュラインに置き、偽共有を避ける
+    alignas(64) std::atomic<std::size_t> head{0};   // 次に取り出す位置（消費者が更新）
+    alignas(64) std::atomic<std::size_t> tail{0};   // 次に書き込む位置（生産者が更新）
+};
@@ -0,0 +1,94 @@
+//
+//  thread_pool.cpp
+//  2D-StableFluids
+//
+
+#include "thread_pool.hpp"
+
+#include "numa.hpp"
+#include "work_stealing_pool.hpp"
+
+ThreadPool::ThreadPool(int threads, bool pin){
+    if (threads < 1) threads = 1;
+    if (pin){
+        std::vector<int> allowed = allowed_cpus();
+        for (int t = 0; t < threads && !allowed.empty(); ++t){
+            cpus.push_back(allowed[t % allowed.size()]);
+        }
+    }
+    for (int t = 1; t < threads; ++t){
+        workers.emplace_back(&ThreadPool::worker_loop, this, t);
+    }
+}
+
+ThreadPool::ThreadPool(WorkStealingPool& tasks) : shared(&tasks), shared_size(tasks.size()) {}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    start_cv.notify_all();
+    for (auto& w : workers){
+        w.join();
+    }
+}
+
+void ThreadPool::run_chunk(int t){
+    int n = job_end - job_begin;
+    int lo = job_begin + (int)((long long)n * t / size());
+    int hi = job_begin + (int)((long long)n * (t + 1) / size());
+    if (lo < hi){
+        (*job)(lo, hi);
+    }
+}
+
+void ThreadPool::parallel_for(int begin, int end, RangeFn fn){
+    if (end <= begin) return;
+    if (shared){
+        shared->parallel_for(begin, end, fn);
+        return;
+    }
+    // ワーカーがいなければそのまま実行
+    if (workers.empty()){
+        fn(begin, end);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        job = &fn;
+        job_begin = begin;
+        job_end = end;
+        pending = (int)workers.size();
+        ++generation;
+    }
+    start_cv.notify_all();
+
+    run_chunk(0);   // 呼び出し側は先頭の区間を担当
+
+    std::unique_lock<std::mutex> lock(mtx);
+    done_cv.wait(lock, [this]{ return pending == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::worker_loop(int id){
+    if (!cpus.empty()){
+        pin_current_thread(cpus[id]);
+    }
+    unsigned long seen = 0;
+    for (;;){
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            start_cv.wait(lock, [&]{ return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+        }
+        run_chunk(id);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--pending == 0){
+                done_cv.notify_one();
+            }
+        }
+    }
+}
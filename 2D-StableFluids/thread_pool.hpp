@@ -0,0 +1,84 @@
+//
+//  thread_pool.hpp
+//  2D-StableFluids
+//
+//  ソルバーの行ループを複数スレッドに分割するための簡易スレッドプール。
+//  parallel_for は呼び出し側スレッドも作業に参加し、全チャンク完了まで戻らない（バリア同期）。
+//  WorkStealingPool を渡して作ると、parallel_for をそのプールに任せる（作業グラフの作業の中から呼べるようにする）。
+//  pin を指定すると、t 番目のワーカーを許可された CPU の t 番目に固定する（NUMA ノードをまたいで移らないようにする）。
+//  呼び出し側スレッドはアプリケーションのものなので固定しない（固定するならアプリケーションが自分で行う）。
+//
+
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class WorkStealingPool;
+
+// parallel_for に渡す fn(lo, hi) への参照
+// std::function と違いラムダを複製しないので、呼び出しのたびにメモリを確保することはない
+// 参照先は parallel_for から戻るまで有効であればよい（引数に直接ラムダを書く使い方を想定）
+class RangeFn {
+public:
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, RangeFn>>>
+    RangeFn(F&& f)
+        : obj(const_cast<void*>(static_cast<const void*>(std::addressof(f)))),
+          call([](void* o, int lo, int hi){ (*static_cast<std::remove_reference_t<F>*>(o))(lo, hi); }) {}
+
+    void operator()(int lo, int hi) const { call(obj, lo, hi); }
+
+private:
+    void* obj;
+    void (*call)(void*, int, int);
+};
+
+class ThreadPool {
+public:
+    // threads: 呼び出し側スレッドを含めた総スレッド数（1 ならワーカーを作らない）
+    // pin: ワーカーを CPU に固定する（t 番目のワーカーを許可された CPU の t 番目に。0 番目の CPU は呼び出し側に残す）
+    //   呼び出し側スレッドの affinity は変えない。CPU がスレッドより少ない場合は順に使い回す。固定できない環境では何もしない
+    explicit ThreadPool(int threads, bool pin = false);
+    // parallel_for を tasks で実行する（ワーカーは作らない。tasks はこのプールより長く有効であること）
+    // 区間は tasks のスレッドが分け合うので、スレッドと区間の対応は毎回同じとは限らない
+    explicit ThreadPool(WorkStealingPool& tasks);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // 総スレッド数
+    int size() const { return shared ? shared_size : (int)workers.size() + 1; }
+
+    /**
+     * [begin, end) を size() 個の連続した区間に分割し、fn(lo, hi) を並列に実行する
+     * 区間の割り当ては毎回同じ（スレッド t は常に t 番目の区間を担当する）
+     */
+    void parallel_for(int begin, int end, RangeFn fn);
+
+    // t 番目のスレッドを固定した CPU（固定していなければ -1。呼び出し側の 0 番目は常に -1）
+    int cpu(int t) const { return cpus.empty() || t == 0 ? -1 : cpus[t]; }
+
+private:
+    void worker_loop(int id);
+    // t 番目のスレッドが担当する区間を実行する
+    void run_chunk(int t);
+
+    std::vector<std::thread> workers;
+    std::vector<int> cpus;                  // cpus[t]: t 番目のワーカーを固定する CPU（固定しなければ空。cpus[0] は使わない）
+    WorkStealingPool* shared = nullptr;     // parallel_for を任せるプール
+    int shared_size = 1;
+    std::mutex mtx;
+    std::condition_variable start_cv;   // ワーカーへのジョブ開始通知
+    std::condition_variable done_cv;    // 呼び出し側への完了通知
+
+    const RangeFn* job = nullptr;
+    int job_begin = 0;
+    int job_end = 0;
+    unsigned long generation = 0;   // ジョブごとに増える番号
+    int pending = 0;                // 未完了のワーカー数
+    bool stopping = false;
+};
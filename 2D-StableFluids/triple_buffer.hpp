@@ -0,0 +1,52 @@
+//
+//  triple_buffer.hpp
+//  2D-StableFluids
+//
+//  生産者1つ・消費者1つの間で最新の値を受け渡すロックフリーの三重バッファ。
+//  生産者は back() に書いて publish()、消費者は update() で最新の値を front() に取り込む。
+//  生産者・消費者はどちらも相手を待たず、消費者が読み終える前に次の値が届いても古い方が捨てられるだけになる。
+//
+
+#pragma once
+#include <atomic>
+
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer() = default;
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // 3つのバッファを同じ値で初期化する（スレッドを開始する前に呼ぶ）
+    void reset(const T& value){
+        for (auto& b : buffers) b = value;
+        back_index = 0;
+        middle.store(1, std::memory_order_relaxed);
+        front_index = 2;
+    }
+
+    // 生産者: 書き込み用のバッファ
+    T& back() { return buffers[back_index]; }
+    // 生産者: back() に書いた内容を公開し、空いたバッファを次の書き込み先にする
+    void publish(){
+        back_index = middle.exchange(back_index | kDirty, std::memory_order_acq_rel) & kIndexMask;
+    }
+
+    // 消費者: 新しい値が公開されていれば front() をそれに切り替えて true を返す
+    bool update(){
+        if ((middle.load(std::memory_order_relaxed) & kDirty) == 0) return false;
+        front_index = middle.exchange(front_index, std::memory_order_acq_rel) & kIndexMask;
+        return true;
+    }
+    // 消費者: 読み出し用のバッファ
+    const T& front() const { return buffers[front_index]; }
+
+private:
+    static constexpr unsigned kIndexMask = 3u;
+    static constexpr unsigned kDirty = 4u;   // 中間のバッファがまだ消費者に取り込まれていない
+
+    T buffers[3];
+    unsigned back_index = 0;            // 生産者だけが使う
+    std::atomic<unsigned> middle{1};    // 受け渡し中のバッファ（添字 | kDirty）
+    unsigned front_index = 2;           // 消費者だけが使う
+};
@@ -0,0 +1,281 @@
+//
+//  work_stealing_pool.cpp
+//  2D-StableFluids
+//
+
+#include "work_stealing_pool.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// このスレッドが作業を実行しているプールと、そのキューの番号
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local int current_index = 0;
+
+// 作業が見つからないとき、眠る前に yield で回る回数
+constexpr int kSpinCount = 64;
+
+} // namespace
+
+int TaskGraph::add(IndexFn fn){
+    if (count == (int)nodes.size()){
+        nodes.emplace_back();
+    }
+    Node& node = nodes[count];
+    node.fn = fn;
+    node.next.clear();
+    node.deps = 0;
+    return count++;
+}
+
+void TaskGraph::precede(int before, int after){
+    nodes[before].next.push_back(after);
+    ++nodes[after].deps;
+}
+
+WorkStealingPool::WorkStealingPool(int threads){
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    queues = std::make_unique<Queue[]>(threads);
+    for (int t = 1; t < threads; ++t){
+        workers.emplace_back(&WorkStealingPool::worker_loop, this, t);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool(){
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    wake_cv.notify_all();
+    for (auto& w : workers){
+        w.join();
+    }
+}
+
+int WorkStealingPool::current_worker() const{
+    return current_pool == this ? current_index : 0;
+}
+
+void WorkStealingPool::for_each(int count, IndexFn fn){
+    if (count <= 0) return;
+    if (workers.empty()){
+        for (int k = 0; k < count; ++k){
+            fn(k, 0);
+        }
+        return;
+    }
+    Join join;
+    join.remaining.store(count, std::memory_order_relaxed);
+    for (int t = 0; t < size(); ++t){
+        int lo = (int)((long long)count * t / size());
+        int hi = (int)((long long)count * (t + 1) / size());
+        std::lock_guard<std::mutex> lock(queues[t].mtx);
+        for (int k = lo; k < hi; ++k){
+            queues[t].items.push_back(Task{ &fn, k, &join });
+        }
+    }
+    signal();
+    wait(join, current_worker());
+    if (join.error) std::rethrow_exception(join.error);
+}
+
+void WorkStealingPool::parallel_for(int begin, int end, RangeFn fn){
+    if (end <= begin) return;
+    if (workers.empty()){
+        fn(begin, end);
+        return;
+    }
+    // 盗まれた区間の所要時間がばらついても揃うように、スレッド数より細かく分ける
+    const int n = end - begin;
+    const int chunks = std::min(n, 4 * size());
+    auto chunk = [&](int k, int){
+        int lo = begin + (int)((long long)n * k / chunks);
+        int hi = begin + (int)((long long)n * (k + 1) / chunks);
+        fn(lo, hi);
+    };
+    IndexFn chunk_fn(chunk);
+    Join join;
+    join.remaining.store(chunks, std::memory_order_relaxed);
+    const int id = current_worker();
+    // 先頭の区間から順に取り出せるように、後ろの区間から先頭に積む
+    for (int k = chunks - 1; k >= 0; --k){
+        push_front(id, Task{ &chunk_fn, k, &join });
+    }
+    signal();
+    wait(join, id);
+    if (join.error) std::rethrow_exception(join.error);
+}
+
+void WorkStealingPool::run(TaskGraph& graph){
+    const int count = graph.size();
+    if (count == 0) return;
+    Join join;
+    join.remaining.store(count, std::memory_order_relaxed);
+    const IndexFn* node_ref = nullptr;
+    // 作業を実行し、依存がなくなった作業を同じスレッドのキューに積む
+    auto node = [&](int k, int worker){
+        TaskGraph::Node& n = graph.nodes[k];
+        if (!join.failed.load(std::memory_order_acquire)){
+            try {
+                (*n.fn)(k, worker);
+            } catch (...){
+                if (!join.failed.exchange(true, std::memory_order_acq_rel)){
+                    join.error = std::current_exception();
+                }
+            }
+        }
+        bool pushed = false;
+        for (int s : n.next){
+            if (graph.nodes[s].pending.fetch_sub(1, std::memory_order_acq_rel) == 1){
+                push_front(worker, Task{ node_ref, s, &join });
+                pushed = true;
+            }
+        }
+        if (pushed) signal();
+    };
+    IndexFn node_fn(node);
+    node_ref = &node_fn;
+    for (int k = 0; k < count; ++k){
+        graph.nodes[k].pending.store(graph.nodes[k].deps, std::memory_order_relaxed);
+    }
+    const int id = current_worker();
+    // 依存のない作業はスレッドに順に配る
+    int t = id;
+    for (int k = count - 1; k >= 0; --k){
+        if (graph.nodes[k].deps == 0){
+            push_front(t, Task{ &node_fn, k, &join });
+            t = (t + 1) % size();
+        }
+    }
+    signal();
+    wait(join, id);
+    if (join.error) std::rethrow_exception(join.error);
+}
+
+void WorkStealingPool::worker_loop(int id){
+    current_pool = this;
+    current_index = id;
+    for (;;){
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            wake_cv.wait(lock, [&]{ return stopping || active.load(std::memory_order_acquire) > 0; });
+            if (stopping) return;
+        }
+        Task t;
+        int spins = 0;
+        while (active.load(std::memory_order_acquire) > 0){
+            // キューを見る前に読む（見た後に積まれた作業は epoch の変化で分かる）
+            const std::uint64_t seen = epoch.load(std::memory_order_seq_cst);
+            if (pop(id, t) || steal(id, t)){
+                execute(t, id);
+                spins = 0;
+            } else if (++spins < kSpinCount){
+                std::this_thread::yield();  // 残りは他のスレッドが実行中
+            } else {
+                park(seen);
+                spins = 0;
+            }
+        }
+    }
+}
+
+void WorkStealingPool::wait(Join& join, int id){
+    const bool outer = current_pool != this;
+    const WorkStealingPool* saved_pool = current_pool;
+    const int saved_index = current_index;
+    if (outer){
+        current_pool = this;
+        current_index = id;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            active.fetch_add(1, std::memory_order_acq_rel);
+        }
+        wake_cv.notify_all();
+    }
+    // 待つ間も作業を実行する（自分の積んだ作業から先に取り出す）
+    Task t;
+    int spins = 0;
+    for (;;){
+        // remaining より先に読む（読んだ後に最後の作業が終わっても、その signal で epoch が変わる）
+        const std::uint64_t seen = epoch.load(std::memory_order_seq_cst);
+        if (join.remaining.load(std::memory_order_acquire) == 0) break;
+        if (pop(id, t) || steal(id, t)){
+            execute(t, id);
+            spins = 0;
+        } else if (++spins < kSpinCount){
+            std::this_thread::yield();  // 残りは他のスレッドが実行中
+        } else {
+            park(seen);
+            spins = 0;
+        }
+    }
+    if (outer){
+        active.fetch_sub(1, std::memory_order_acq_rel);
+        current_pool = saved_pool;
+        current_index = saved_index;
+    }
+}
+
+void WorkStealingPool::execute(const Task& t, int id){
+    Join& join = *t.join;
+    try {
+        (*t.fn)(t.index, id);
+    } catch (...){
+        if (!join.failed.exchange(true, std::memory_order_acq_rel)){
+            join.error = std::current_exception();
+        }
+    }
+    if (join.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        signal();   // 待っているスレッドが眠っていれば起こす
+    }
+}
+
+// epoch を進めてから sleepers を読み、park は sleepers を増やしてから epoch を読む（どちらも seq_cst）
+// どちらかが相手の変更を必ず見るので、眠ったスレッドが知らせを取りこぼすことはない
+// 誰も眠っていなければ mtx は取らない
+void WorkStealingPool::signal(){
+    epoch.fetch_add(1, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) > 0){
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+        }
+        wake_cv.notify_all();
+    }
+}
+
+void WorkStealingPool::park(std::uint64_t seen){
+    std::unique_lock<std::mutex> lock(mtx);
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    wake_cv.wait(lock, [&]{ return stopping || epoch.load(std::memory_order_seq_cst) != seen; });
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void WorkStealingPool::push_front(int id, const Task& t){
+    Queue& q = queues[id];
+    std::lock_guard<std::mutex> lock(q.mtx);
+    q.items.push_front(t);
+}
+
+bool WorkStealingPool::pop(int id, Task& t){
+    Queue& q = queues[id];
+    std::lock_guard<std::mutex> lock(q.mtx);
+    if (q.items.empty()) return false;
+    t = q.items.front();
+    q.items.pop_front();
+    return true;
+}
+
+// 隣のスレッドから順に、キューの末尾（持ち主が最後に取り出すはずの作業）を盗む
+bool WorkStealingPool::steal(int id, Task& t){
+    for (int k = 1; k < size(); ++k){
+        Queue& q = queues[(id + k) % size()];
+        std::lock_guard<std::mutex> lock(q.mtx);
+        if (q.items.empty()) continue;
+        t = q.items.back();
+        q.items.pop_back();
+        steal_count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,146 @@
+//
+//  work_stealing_pool.hpp
+//  2D-StableFluids
+//
+//  大きさの揃わない作業（インスタンスごとのステップなど）を分け合うための work-stealing スレッドプール。
+//  スレッドごとにキューを持ち、自分のキューは先頭から取り出し、空になったら他のスレッドのキューの末尾から盗む。
+//  ThreadPool::parallel_for と違い、区間の割り当ては最初に決めるだけで、終わったスレッドが残りを引き受ける。
+//  作業の中から parallel_for や run を呼んでもよい（待つ間、そのスレッドは他の作業を実行する）。
+//  取り出せる作業がないスレッドは少しの間 yield で回り、それでもなければ作業が積まれるか待っている作業が
+//  終わるまで条件変数で眠る（他のスレッドが長い作業を実行している間、CPU を空ける）。
+//
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+// for_each に渡す fn(index, worker) への参照（RangeFn と同じく複製しない）
+class IndexFn {
+public:
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, IndexFn>>>
+    IndexFn(F&& f)
+        : obj(const_cast<void*>(static_cast<const void*>(std::addressof(f)))),
+          call([](void* o, int index, int worker){ (*static_cast<std::remove_reference_t<F>*>(o))(index, worker); }) {}
+
+    void operator()(int index, int worker) const { call(obj, index, worker); }
+
+private:
+    void* obj;
+    void (*call)(void*, int, int);
+};
+
+/**
+ * 依存関係のある作業の集まり（有向非巡回グラフ）。WorkStealingPool::run で実行する
+ * 作業 k は fn(k, worker) を呼ぶ。fn は IndexFn と同じく参照で持つので、run が終わるまで有効な変数に置く
+ * （add の引数に直接ラムダを書くと、その式の終わりで無効になる）
+ * clear しても領域は解放しないので、毎回同じ形のグラフを作り直す場合は2回目から確保を行わない
+ */
+class TaskGraph {
+public:
+    // 作業を追加し、その番号を返す
+    int add(IndexFn fn);
+    // before が終わってから after を始める
+    void precede(int before, int after);
+    void clear() { count = 0; }
+    int size() const { return count; }
+
+private:
+    friend class WorkStealingPool;
+    struct Node {
+        std::optional<IndexFn> fn;
+        std::vector<int> next;      // この作業を待つ作業
+        int deps = 0;               // 先に終わる必要のある作業の数
+        std::atomic<int> pending{0};    // 実行中の残りの依存の数
+    };
+    std::deque<Node> nodes;     // 要素を動かさないので atomic を持てる
+    int count = 0;
+};
+
+class WorkStealingPool {
+public:
+    // threads: 呼び出し側スレッドを含めた総スレッド数（0 でハードウェアスレッド数）
+    explicit WorkStealingPool(int threads);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    int size() const { return (int)workers.size() + 1; }
+
+    /**
+     * [0, count) の各 index で fn(index, worker) を1回ずつ実行し、全て終わるまで待つ
+     * worker は実行したスレッドの番号（0 が呼び出し側、[0, size())）
+     * 最初は連続した区間ずつ各スレッドのキューに積む
+     * プールの外から同時に呼べるのは1つのスレッドからだけ（作業の中からは呼んでよい）
+     */
+    void for_each(int count, IndexFn fn);
+    /**
+     * [begin, end) を区間に分けて fn(lo, hi) を実行し、全て終わるまで待つ（ThreadPool::parallel_for と同じ形）
+     * 区間は呼び出したスレッドのキューに積み、空いたスレッドが盗む。区間の数はスレッド数の数倍
+     */
+    void parallel_for(int begin, int end, RangeFn fn);
+    /**
+     * graph の作業を依存関係の順に実行し、全て終わるまで待つ
+     * 依存の残っていない作業から始め、作業が終わるたびに、待っていた作業のうち依存がなくなったものを
+     * そのスレッドのキューの先頭に積む（続けて同じスレッドで実行されやすい）
+     * 作業が例外を投げた場合、まだ始めていない作業は実行せずに飛ばし、全て終えてから最初の例外を投げ直す
+     */
+    void run(TaskGraph& graph);
+
+    // これまでに他のスレッドのキューから盗んだ回数
+    std::uint64_t steals() const { return steal_count.load(std::memory_order_relaxed); }
+
+private:
+    // 1回の for_each / parallel_for / run の完了待ち
+    struct Join {
+        std::atomic<int> remaining{0};  // 終わっていない作業の数
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;       // 最初の例外（failed を立てたスレッドだけが書く）
+    };
+    struct Task {
+        const IndexFn* fn = nullptr;
+        int index = 0;
+        Join* join = nullptr;
+    };
+    // スレッドごとのキュー（別のキャッシュラインに置く）
+    struct alignas(64) Queue {
+        std::mutex mtx;
+        std::deque<Task> items;
+    };
+
+    void worker_loop(int id);
+    // 呼び出したスレッドのキューの番号（プールの外のスレッドは 0）
+    int current_worker() const;
+    // プールの外から呼ばれた場合はワーカーを起こし、join の作業が全て終わるまで他の作業も実行しながら待つ
+    void wait(Join& join, int id);
+    void execute(const Task& t, int id);
+    // 作業を積んだ、または join が終わったことを眠っているスレッドに知らせる
+    void signal();
+    // signal の回数が seen から変わるまで（または stopping まで）眠る
+    void park(std::uint64_t seen);
+    void push_front(int id, const Task& t);
+    bool pop(int id, Task& t);
+    bool steal(int id, Task& t);
+
+    std::unique_ptr<Queue[]> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> active{0};     // プールの外から呼ばれて実行中の for_each / parallel_for / run の数
+    std::atomic<std::uint64_t> steal_count{0};
+    std::atomic<std::uint64_t> epoch{0};    // signal の回数
+    std::atomic<int> sleepers{0};           // park で眠っているスレッドの数
+
+    std::mutex mtx;
+    std::condition_variable wake_cv;        // active が増えた・signal・stopping
+    bool stopping = false;
+};
@@ -0,0 +1,433 @@
+//
+//  simulation_bench.cpp
+//  2D-StableFluids
+//
+//  Simulation の各処理のベンチマーク（Google Benchmark）。
+//  N = 64 〜 2048 の各グリッドで、1秒あたりの処理セル数（cells/s）と実効メモリ帯域（bytes_per_second）を報告する。
+//
+//  実効帯域は「各反復で触る場を1回ずつ読み書きする」とみなした名目上の転送量から求める。
+//  ガウス・ザイデル法のウェーブフロントなどキャッシュで再利用される分も数えるので、
+//  実際の DRAM 転送量よりも大きくなり得る（回帰の検出と機種間の比較に使う値）。
+//
+//  各処理は単精度（Simulation）・倍精度（SimulationF64）・混合精度（SimulationMixed）の3通りで測る。
+//  名目上の転送量は場の要素の大きさ（Real）で数え、投影処理と update では圧力ソルバーの残差も報告する。
+//  ガウス・ザイデル法の残差は計測した反復の後に、同じ入力を残差を求める設定で1回だけ解き直して求める（時間には含めない）。
+//
+//  実行例: stablefluids_bench --benchmark_filter=advect
+//         stablefluids_bench --benchmark_filter='BM_project<.*>/1024'
+//
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "distributed_simulation.hpp"
+#include "simulation.hpp"
+#include "simulation_batch.hpp"
+
+namespace {
+
+constexpr float kDt = 0.1f;
+constexpr float kVisc = 0.0001f;
+constexpr float kDiff = 0.001f;
+constexpr int kDiffuseIters = 20;   // diffuse の反復回数
+constexpr int kPressureIters = 40;  // project の圧力ソルバーの反復回数
+constexpr int64_t kF = sizeof(float);
+
+// 1セルあたりの名目上の転送量（バイト）
+constexpr int64_t kAddSourceBytes = 3 * kF;                             // x, s を読み x を書く
+constexpr int64_t kAdvectBytes = 4 * kF;                                // u, v, d0 を読み d を書く
+constexpr int64_t kTransportBytes = 5 * kF;                             // u, v, d0, s を読み d を書く（add_source + advect の融合）
+constexpr int64_t kDiffuseBytes = kDiffuseIters * 3 * kF;               // 反復ごとに x0, x を読み x を書く
+constexpr int64_t kProjectBytes = 4 * kF                                // u, v を読み div, p を書く
+                                + kPressureIters * 3 * kF               // 圧力の反復
+                                + 5 * kF;                               // p を読み u, v を更新する
+constexpr int64_t kDensStepBytes = kAddSourceBytes + kDiffuseBytes + kAdvectBytes;  // 1チャンネル分
+constexpr int64_t kVelStepBytes = 2 * kAddSourceBytes + 2 * kAdvectBytes + 2 * kDiffuseBytes + 2 * kProjectBytes;
+constexpr int64_t kUpdateBytes = kVelStepBytes + 3 * kDensStepBytes;    // 速度 + r, g, b
+
+// ベンチマーク用の場（滑らかな速度場と染料）
+template <typename Sim>
+struct Fields {
+    using Real = typename Sim::real_type;
+    int N;
+    Sim sim;
+    Grid2D<Real> u, v, u0, v0, d, d0;
+
+    explicit Fields(int n) : N(n), sim(n), u(n), v(n), u0(n), v0(n), d(n), d0(n){
+        const float pi = 3.14159265f;
+        for (int j = 0; j <= N + 1; ++j){
+            for (int i = 0; i <= N + 1; ++i){
+                float x = (float)i / N;
+                float y = (float)j / N;
+                u(i, j) = u0(i, j) = std::sin(pi * x) * std::cos(pi * y);
+                v(i, j) = v0(i, j) = -std::cos(pi * x) * std::sin(pi * y);
+                d(i, j) = d0(i, j) = (std::abs(x - 0.5f) < 0.1f && std::abs(y - 0.5f) < 0.1f) ? 1.0f : 0.0f;
+            }
+        }
+    }
+};
+
+// cells/s とバイト数を設定する（bytes_per_cell は fp32 の場で数えた値で、Real の大きさに合わせて換算する）
+template <typename Sim>
+void report(benchmark::State& state, int64_t cells, int64_t bytes_per_cell){
+    int64_t bytes = bytes_per_cell * (int64_t)sizeof(typename Sim::real_type) / kF;
+    state.counters["cells/s"] = benchmark::Counter((double)cells * state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed(cells * bytes * state.iterations());
+}
+
+// 直近の圧力ソルバーの残差（精度ごとの比較用。求めていない残差は報告しない）
+void report_residual(benchmark::State& state, const SolveStats& st){
+    if (std::isnan(st.initial_residual) || std::isnan(st.residual)) return;
+    state.counters["initial_residual"] = st.initial_residual;
+    state.counters["residual"] = st.residual;
+}
+
+template <typename Sim>
+void BM_add_source(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.add_source(f.N, f.d, f.d0, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kAddSourceBytes);
+}
+
+template <typename Sim>
+void BM_advect(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.advect(f.N, 0, f.d, f.d0, f.u, f.v, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kAdvectBytes);
+}
+
+// ソース項の加算と移流を融合した輸送処理（add_source + advect の 7 * 4 バイトと比べる）
+template <typename Sim>
+void BM_transport(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    Grid2D<typename Sim::real_type>* d = &f.d;
+    Grid2D<typename Sim::real_type>* d0 = &f.d0;
+    Grid2D<typename Sim::real_type>* s = &f.u0;
+    const int b = 0;
+    for (auto _ : state){
+        f.sim.transport(f.N, 1, &b, &d, &d0, &s, f.u, f.v, nullptr, nullptr, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kTransportBytes);
+}
+
+template <typename Sim>
+void BM_diffuse(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.diffuse(f.N, 0, f.d, f.d0, kDiff, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kDiffuseBytes);
+}
+
+template <typename Sim>
+void BM_project(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.project(f.N, f.u, f.v, f.u0, f.v0);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kProjectBytes);
+    // 計測した反復で u, v は投影済みになっているので、初期状態の場を解き直す
+    Fields<Sim> g(f.N);
+    g.sim.setResidualTelemetry(true);
+    g.sim.project(g.N, g.u, g.v, g.u0, g.v0);
+    report_residual(state, g.sim.getPressureStats());
+}
+
+// set_bnd はゴーストセル（4N 個）だけを書く
+template <typename Sim>
+void BM_set_bnd(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.set_bnd(f.N, 1, f.u);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, 4 * (int64_t)f.N, 2 * kF);
+}
+
+template <typename Sim>
+void BM_dens_step(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.dens_step(f.N, f.d, f.d0, f.u, f.v, kDiff, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kDensStepBytes);
+}
+
+template <typename Sim>
+void BM_vel_step(benchmark::State& state){
+    Fields<Sim> f((int)state.range(0));
+    for (auto _ : state){
+        f.sim.vel_step(f.N, f.u, f.v, f.u0, f.v0, kVisc, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)f.N * f.N, kVelStepBytes);
+}
+
+// 色を置き、中央の 8x8 セルに力を加えて1ステップ進める（速度が0だと圧力の解が自明になり、残差を比べられない）
+template <typename Sim>
+void step_once(Sim& sim, int N){
+    sim.reset(N);
+    sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+    for (int j = N / 2 - 4; j < N / 2 + 4; ++j){
+        for (int i = N / 2 - 4; i < N / 2 + 4; ++i){
+            sim.add_force(i, j, N, 1.0f, 0.5f);
+        }
+    }
+    sim.update(N, kDt);
+}
+
+// state.range(1): 融合した輸送処理を使うか
+template <typename Sim>
+void BM_update(benchmark::State& state){
+    int N = (int)state.range(0);
+    Sim sim(N);
+    sim.setFusedTransport(state.range(1) != 0);
+    sim.setViscosity(kVisc);
+    sim.setDiffusion(kDiff);
+    for (auto _ : state){
+        step_once(sim, N);
+        benchmark::ClobberMemory();
+    }
+    report<Sim>(state, (int64_t)N * N, kUpdateBytes);
+    sim.setResidualTelemetry(true);
+    step_once(sim, N);
+    report_residual(state, sim.getPressureStats());
+}
+
+// state.range(1): 色の格納形式（DyeStorage の値）
+// 色の場の転送量は要素のバイト数で数える（u, v は float のまま）
+void BM_update_dye(benchmark::State& state){
+    int N = (int)state.range(0);
+    DyeStorage storage = (DyeStorage)state.range(1);
+    Simulation sim(N, 0, storage);
+    sim.setViscosity(kVisc);
+    sim.setDiffusion(kDiff);
+    int64_t e = storage == DyeStorage::Float32 ? kF : 2;
+    int64_t dens_bytes = 3 * e + kDiffuseIters * 3 * e + (2 * kF + 2 * e);
+    state.SetLabel(dye_storage_name(storage));
+    for (auto _ : state){
+        sim.reset(N);
+        sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+        sim.update(N, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Simulation>(state, (int64_t)N * N, kVelStepBytes + 3 * dens_bytes);
+}
+
+// 一部の領域だけに色と速度がある場面で、有効なタイルだけを処理する場合と比べる
+// state.range(1): 有効タイルを使うか
+// 毎ステップ中央付近に外力と色を加え続ける（最初の数ステップで有効なタイルの範囲が落ち着く）
+void BM_update_sparse(benchmark::State& state){
+    int N = (int)state.range(0);
+    Simulation sim(N);
+    SparseOptions sparse;
+    sparse.enabled = state.range(1) != 0;
+    sim.setSparseOptions(sparse);
+    sim.setViscosity(kVisc);
+    sim.setDiffusion(kDiff);
+    auto step = [&]{
+        sim.reset(N);
+        sim.add_force(N / 2, N / 2, N, 5.0f, 5.0f);
+        sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+        sim.update(N, kDt);
+    };
+    for (int k = 0; k < 20; ++k){
+        step();
+    }
+    for (auto _ : state){
+        step();
+        benchmark::ClobberMemory();
+    }
+    report<Simulation>(state, (int64_t)N * N, kUpdateBytes);
+    state.counters["active"] = sim.getActiveTileFraction();
+}
+
+// 中くらいの格子で、1ステップを作業グラフとして進める場合と順に進める場合を比べる（どちらもハードウェアスレッド数）
+// state.range(1): 作業グラフを使うか
+void BM_update_tasks(benchmark::State& state){
+    int N = (int)state.range(0);
+    Simulation sim(N);
+    sim.setTaskGraph(state.range(1) != 0);
+    sim.setThreadCount(0);
+    sim.setViscosity(kVisc);
+    sim.setDiffusion(kDiff);
+    for (auto _ : state){
+        sim.reset(N);
+        sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+        sim.update(N, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Simulation>(state, (int64_t)N * N, kUpdateBytes);
+    state.counters["steals"] = (double)sim.getTaskSteals();
+}
+
+// 大きな格子の update を、構築したスレッドが全ての場を初期化する場合と、ソルバーのスレッドが first-touch で
+// 初期化してスレッドを CPU に固定する場合で比べる（どちらもハードウェアスレッド数、複数ソケットのマシンで差が出る）
+// state.range(1): first-touch とスレッドの固定を使うか
+void BM_update_numa(benchmark::State& state){
+    int N = (int)state.range(0);
+    NumaOptions numa;
+    numa.first_touch = numa.pin_threads = state.range(1) != 0;
+    numa.threads = 0;
+    Simulation sim(N, 0, Simulation::kNativeDye, nullptr, numa);
+    sim.setLinearSolver(LinearSolver::RedBlackGaussSeidel);
+    sim.setViscosity(kVisc);
+    sim.setDiffusion(kDiff);
+    for (auto _ : state){
+        sim.reset(N);
+        sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+        sim.update(N, kDt);
+        benchmark::ClobberMemory();
+    }
+    report<Simulation>(state, (int64_t)N * N, kUpdateBytes);
+    NumaPlacement pl = sim.getNumaPlacement();
+    for (std::size_t node = 0; node < pl.pages.size(); ++node){
+        state.counters["node" + std::to_string(node) + "_MiB"] = (double)(pl.pages[node] * pl.page_bytes) / (1024.0 * 1024.0);
+    }
+}
+
+// 小さな格子を多数まとめて進めるバッチ実行のスループット（インスタンス・ステップ / 秒）
+// state.range(1): スレッド数（1 は全てのインスタンスを呼び出し側で順に進める場合）
+void BM_batch(benchmark::State& state){
+    int N = (int)state.range(0);
+    int threads = (int)state.range(1);
+    constexpr int kInstances = 128;
+    SimulationBatch batch(kInstances, N, threads);
+    for (int k = 0; k < batch.size(); ++k){
+        batch[k].setViscosity(kVisc * (k % 4));
+        batch[k].setDiffusion(kDiff);
+    }
+    auto before = [N](int k, Simulation& sim, int){
+        sim.reset(N);
+        sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+        sim.add_force(N / 2, N / 2, N, (float)(k % 7), 5.0f);
+    };
+    for (auto _ : state){
+        batch.advance(1, kDt, before);
+        benchmark::ClobberMemory();
+    }
+    state.counters["sim_steps/s"] = benchmark::Counter((double)state.iterations() * kInstances, benchmark::Counter::kIsRate);
+    state.counters["steals"] = (double)batch.steals();
+}
+
+// 領域分割（ランクはスレッド、袖は LoopbackTransport で送り合う）の1ステップ
+// state.range(1): ランク数。各反復でランク 0 以外のステップをスレッドで進める（スレッドの起動も時間に含む）
+void BM_distributed(benchmark::State& state){
+    int N = (int)state.range(0);
+    int ranks = (int)state.range(1);
+    LoopbackHub hub(ranks);
+    std::vector<std::unique_ptr<LoopbackTransport>> transports;
+    std::vector<std::unique_ptr<DistributedSimulation>> sims;
+    for (int r = 0; r < ranks; ++r){
+        transports.push_back(std::make_unique<LoopbackTransport>(hub, r));
+        sims.push_back(std::make_unique<DistributedSimulation>(N, *transports[r]));
+        sims[r]->setViscosity(kVisc);
+        sims[r]->setDiffusion(kDiff);
+    }
+    auto step = [&](int r){
+        sims[r]->reset(N);
+        sims[r]->stamp(N / 2, N / 2, 4, 4, N, 100.0f, 50.0f, 20.0f);
+        sims[r]->update(N, kDt);
+    };
+    for (auto _ : state){
+        std::vector<std::thread> others;
+        for (int r = 1; r < ranks; ++r){
+            others.emplace_back(step, r);
+        }
+        step(0);
+        for (auto& t : others){
+            t.join();
+        }
+        benchmark::ClobberMemory();
+    }
+    std::uint64_t bytes = 0;
+    for (auto& t : transports){
+        bytes += t->bytesSent();
+    }
+    report<Simulation>(state, (int64_t)N * N, kUpdateBytes);
+    state.counters["halo_bytes/step"] = (double)bytes / std::max<benchmark::IterationCount>(1, state.iterations());
+}
+
+// 既定の 720 / 6 = 120 を含む小さな格子と、1 スレッド・ハードウェアスレッド数
+void batch_sizes(benchmark::internal::Benchmark* b){
+    int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+    b->ArgsProduct({ { 64, 120, 180 }, { 1, hw } })->ArgNames({ "N", "threads" })->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+// 1つの処理ではスレッドを埋めきれない 128 ~ 512 と、作業グラフの有無（0, 1）
+void task_sizes(benchmark::internal::Benchmark* b){
+    b->ArgsProduct({ { 128, 256, 512 }, { 0, 1 } })->ArgNames({ "N", "graph" })->Unit(benchmark::kMicrosecond)->UseRealTime();
+}
+
+// メモリ帯域で律速される 1024, 2048 と、first-touch の有無（0, 1）
+void numa_sizes(benchmark::internal::Benchmark* b){
+    b->ArgsProduct({ { 1024, 2048 }, { 0, 1 } })->ArgNames({ "N", "first_touch" })->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+// 袖の送り合いが目立つ 256 と 1024、ランク数 1, 2, 4
+void distributed_sizes(benchmark::internal::Benchmark* b){
+    b->ArgsProduct({ { 256, 1024 }, { 1, 2, 4 } })->ArgNames({ "N", "ranks" })->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+// N = 64, 128, ..., 2048
+void grid_sizes(benchmark::internal::Benchmark* b){
+    b->RangeMultiplier(2)->Range(64, 2048)->Unit(benchmark::kMicrosecond);
+}
+
+// grid_sizes に融合の有無（0, 1）を加えたもの
+void grid_sizes_fused(benchmark::internal::Benchmark* b){
+    b->ArgsProduct({ benchmark::CreateRange(64, 2048, 2), { 0, 1 } })->ArgNames({ "N", "fused" })->Unit(benchmark::kMicrosecond);
+}
+
+// grid_sizes に有効タイルの有無（0, 1）を加えたもの
+void grid_sizes_sparse(benchmark::internal::Benchmark* b){
+    b->ArgsProduct({ benchmark::CreateRange(64, 2048, 2), { 0, 1 } })->ArgNames({ "N", "sparse" })->Unit(benchmark::kMicrosecond);
+}
+
+// grid_sizes に色の格納形式（fp32, fp16, bf16, fixed16）を加えたもの
+void grid_sizes_dye(benchmark::internal::Benchmark* b){
+    b->ArgsProduct({ benchmark::CreateRange(64, 2048, 2), { 0, 1, 2, 3 } })->ArgNames({ "N", "dye" })->Unit(benchmark::kMicrosecond);
+}
+
+} // namespace
+
+// 単精度・倍精度・混合精度の3通りを登録する
+#define SF_BENCHMARK_PRECISIONS(fn, sizes) \
+    BENCHMARK_TEMPLATE(fn, Simulation)->Apply(sizes); \
+    BENCHMARK_TEMPLATE(fn, SimulationF64)->Apply(sizes); \
+    BENCHMARK_TEMPLATE(fn, SimulationMixed)->Apply(sizes)
+
+SF_BENCHMARK_PRECISIONS(BM_add_source, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_advect, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_transport, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_diffuse, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_project, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_set_bnd, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_dens_step, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_vel_step, grid_sizes);
+SF_BENCHMARK_PRECISIONS(BM_update, grid_sizes_fused);
+BENCHMARK(BM_update_dye)->Apply(grid_sizes_dye);
+BENCHMARK(BM_update_sparse)->Apply(grid_sizes_sparse);
+BENCHMARK(BM_update_tasks)->Apply(task_sizes);
+BENCHMARK(BM_batch)->Apply(batch_sizes);
+BENCHMARK(BM_distributed)->Apply(distributed_sizes);
+BENCHMARK(BM_update_numa)->Apply(numa_sizes);
+
+BENCHMARK_MAIN();
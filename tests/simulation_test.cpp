@@ -0,0 +1,618 @@
+//
+//  simulation_test.cpp
+//  2D-StableFluids
+//
+//  Simulation の回帰テスト（CTest からケース名を引数にして1つずつ実行する）。
+//  - multigrid:   奇数・偶数の N でマルチグリッド法の圧力が少ないサイクルで収束する
+//  - cg:          奇数・偶数の N で共役勾配法の拡散と圧力が収束する
+//  - residual:    ガウス・ザイデル法でも、残差を求める設定では拡散と圧力の残差を返し、求めない設定では NaN になる（結果は変わらない）
+//  - simd:        SIMD 版（4幅・AVX2・AVX-512）とスカラー版の移流で、同じ入力から同じ状態（ビット単位）になる
+//  - fused:       融合した輸送処理が、参照比較モードで add_source → advect の参照実装とビット単位で一致する
+//                 （速度の拡散の初期値だけが違うので、粘性が0のガウス・ザイデル法では全体の結果も一致する）
+//  - adaptive:    CFL から部分ステップを決める update が、部分ステップ1つなら固定の時間刻みとビット単位で一致し、
+//                 速い流れでは複数の部分ステップに分けても値が有限のまま進む
+//  - dye_mass:    固定小数点（fixed16）で持つ色の総量が、fp32 の総量から許容値以上ずれない（拡散の裾を丸めで失わない）
+//  - sparse:      有効なタイルだけを処理した色が、全体を処理した場合と許容値内で一致する（halo 0 は 1 に切り上げる。
+//                 しきい値を下回って無効になったタイルを0にする場合を含む）
+//  - checkpoint:  保存したファイルから復元して進めた場合と、そのまま進めた場合で同じ状態になる
+//                 （非同期の書き出しの失敗は後の成功で消えない）
+//  - task_graph:  作業グラフで並列に進めた場合と、1スレッドで順に進めた場合で同じ状態になる
+//  - batch:       SimulationBatch で設定の違うインスタンスをまとめて進めた結果が、それぞれを単独の Simulation で
+//                 進めた場合と同じ状態になる
+//  - distributed: 領域分割版（LoopbackHub のスレッドをランクにする）で集めた色が、赤黒ガウス・ザイデル法の
+//                 Simulation とランク数・袖の行数によらずビット単位で一致する（移流の距離が袖を超えるステップを含む）。
+//                 途中で例外を投げたランクがあれば、他のランクは待ち続けずに抜ける
+//  状態は serializeCheckpoint の内容（全ての場とステップ数・時刻）で比べる。
+//  失敗したケースは理由を表示して 1 を返す。CPU が対応しないなどで確かめられない場合は 77（スキップ）を返す。
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "distributed_simulation.hpp"
+#include "simulation.hpp"
+#include "simulation_batch.hpp"
+
+namespace {
+
+constexpr int kSkip = 77;
+
+int failures = 0;
+
+void check(bool ok, const std::string& what){
+    if (!ok){
+        std::fprintf(stderr, "FAILED: %s\n", what.c_str());
+        ++failures;
+    }
+}
+
+// ステップ s の入力: 中央に色を置き、s < forced_steps の間は力を加える
+template <typename Sim>
+void apply_events(Sim& sim, int N, int s, int forced_steps = 20){
+    sim.stamp(N / 2, N / 2, 3, 3, N, 100.0f, 50.0f, 20.0f);
+    for (int t = 0; t < sim.getTracerCount(); ++t){
+        sim.stampTracer(t, N / 3, N / 3, 2, 2, N, 5.0f);
+    }
+    if (s < forced_steps){
+        for (int k = 0; k < 6; ++k){
+            for (int l = 0; l < 6; ++l){
+                sim.add_force(N / 2 + k, N / 3 + l, N, 0.5f, 0.2f);
+            }
+        }
+    }
+}
+
+// apply_events の入力で steps ステップ進める
+template <typename Sim>
+void drive(Sim& sim, int N, int first, int steps, int forced_steps = 20){
+    for (int s = first; s < first + steps; ++s){
+        apply_events(sim, N, s, forced_steps);
+        sim.update(N, 0.1f);
+    }
+}
+
+template <typename Sim>
+std::vector<unsigned char> state(const Sim& sim){
+    std::vector<unsigned char, AlignedAllocator<unsigned char, kCheckpointAlignment>> image(sim.checkpointBytes());
+    sim.serializeCheckpoint(image.data());
+    return std::vector<unsigned char>(image.begin(), image.end());
+}
+
+// 色とトレーサー（融合した輸送処理は作業領域の場を入れ替えるので、読み出せる結果で比べる）
+template <typename Sim>
+std::vector<float> dye(const Sim& sim, int N){
+    std::vector<float> out((std::size_t)N * N * 3);
+    sim.readDensity(N, out.data());
+    std::vector<typename Sim::real_type> tracer((std::size_t)N * N);
+    for (int t = 0; t < sim.getTracerCount(); ++t){
+        sim.readTracer(t, N, tracer.data());
+        out.insert(out.end(), tracer.begin(), tracer.end());
+    }
+    return out;
+}
+
+bool same_bits(const std::vector<float>& a, const std::vector<float>& b){
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+}
+
+// 力を加えた後の最初のステップの圧力（と拡散）の解が許容値まで収束したか
+template <typename Sim>
+void check_converged(Sim& sim, int N, const std::string& label, int max_iterations, bool diffusion){
+    drive(sim, N, 0, 3);
+    const SolveStats& p = sim.getPressureStats();
+    check(p.converged, label + ": pressure did not converge (" + std::to_string(p.iterations) + " iterations)");
+    check(p.iterations <= max_iterations, label + ": pressure took " + std::to_string(p.iterations) + " iterations");
+    if (diffusion){
+        check(sim.getDiffusionStats().converged, label + ": diffusion did not converge");
+    }
+}
+
+int test_multigrid(){
+    for (int N : { 63, 64, 65, 97, 127, 128 }){
+        for (MultigridCycle cycle : { MultigridCycle::V, MultigridCycle::F }){
+            MultigridOptions opt;
+            opt.cycle = cycle;
+            Simulation f32(N);
+            f32.setPressureSolver(PressureSolver::Multigrid);
+            f32.setMultigridOptions(opt);
+            SimulationF64 f64(N);
+            f64.setPressureSolver(PressureSolver::Multigrid);
+            f64.setMultigridOptions(opt);
+            const std::string label = "multigrid N=" + std::to_string(N) + (cycle == MultigridCycle::V ? " V" : " F");
+            check_converged(f32, N, label + " fp32", 6, false);
+            check_converged(f64, N, label + " fp64", 6, false);
+        }
+    }
+    return 0;
+}
+
+int test_cg(){
+    for (int N : { 63, 64, 65, 128 }){
+        for (Preconditioner pc : { Preconditioner::None, Preconditioner::Jacobi, Preconditioner::IncompleteCholesky }){
+            ConjugateGradientOptions opt;
+            opt.preconditioner = pc;
+            opt.max_iterations = 8 * N;     // 前処理なしでは反復回数が N に比例して増える
+            Simulation sim(N);
+            sim.setLinearSolver(LinearSolver::ConjugateGradient);
+            sim.setConjugateGradientOptions(opt);
+            sim.setViscosity(0.0001f);
+            const std::string label = "cg N=" + std::to_string(N) + " preconditioner " + std::to_string((int)pc);
+            check_converged(sim, N, label, opt.max_iterations - 1, true);
+        }
+    }
+    return 0;
+}
+
+int test_simd(){
+    int tested = 0;
+    for (SimdIsa isa : { SimdIsa::Vector4, SimdIsa::AVX2, SimdIsa::AVX512 }){
+        if (resolve_simd_isa(isa) != isa) continue;
+        for (int N : { 61, 64 }){
+            // 融合した輸送処理ではソース項を足しながら移流する版を使う
+            for (bool fused : { false, true }){
+                Simulation scalar(N, 2), simd(N, 2);
+                scalar.setSimdIsa(SimdIsa::Scalar);
+                simd.setSimdIsa(isa);
+                scalar.setFusedTransport(fused);
+                simd.setFusedTransport(fused);
+                drive(scalar, N, 0, 30);
+                drive(simd, N, 0, 30);
+                check(state(scalar) == state(simd), std::string(simd_isa_name(isa)) + " differs from scalar at N=" +
+                                                    std::to_string(N) + (fused ? " (fused)" : ""));
+            }
+        }
+        ++tested;
+    }
+    if (tested == 0){
+        std::printf("no SIMD kernel is available on this CPU\n");
+        return kSkip;
+    }
+    return 0;
+}
+
+int test_fused(){
+    for (LinearSolver solver : { LinearSolver::GaussSeidel, LinearSolver::RedBlackGaussSeidel, LinearSolver::ConjugateGradient }){
+        for (float visc : { 0.0f, 0.0001f }){
+            for (int N : { 61, 64 }){
+                Simulation ref(N, 3), fused(N, 3);
+                for (Simulation* sim : { &ref, &fused }){
+                    sim->setLinearSolver(solver);
+                    sim->setViscosity(visc);
+                    sim->setThreadCount(3);
+                    sim->setTileSize(24);
+                }
+                fused.setFusedTransport(true);
+                fused.setFusionCheck(true);
+                drive(ref, N, 0, 30);
+                drive(fused, N, 0, 30);
+                const std::string where = " (solver " + std::to_string((int)solver) + ", viscosity " +
+                                          std::to_string(visc) + ", N=" + std::to_string(N) + ")";
+                check(fused.getFusionMismatches() == 0, "fusion check reported mismatches" + where);
+                if (visc == 0.0f && solver != LinearSolver::ConjugateGradient){
+                    check(same_bits(dye(ref, N), dye(fused, N)), "fused transport differs from the reference" + where);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int test_adaptive(){
+    const int N = 64;
+    {
+        // cfl が十分大きければ常に部分ステップは1つで、固定の時間刻みと同じ計算になる
+        Simulation fixed(N, 2), adaptive(N, 2);
+        TimestepOptions opt;
+        opt.adaptive = true;
+        opt.cfl = 1e6f;
+        adaptive.setTimestepOptions(opt);
+        drive(fixed, N, 0, 25);
+        drive(adaptive, N, 0, 25);
+        check(adaptive.getLastSubsteps() == 1, "adaptive with a large cfl took " +
+                                               std::to_string(adaptive.getLastSubsteps()) + " substeps");
+        check(state(fixed) == state(adaptive), "adaptive with one substep differs from the fixed step");
+    }
+    {
+        // 小さい cfl で強い力を加え続け、部分ステップに分けるフレームを作る
+        Simulation sim(N, 2);
+        TimestepOptions opt;
+        opt.adaptive = true;
+        opt.cfl = 0.5f;
+        sim.setTimestepOptions(opt);
+        int max_substeps = 0;
+        bool finite = true;
+        for (int s = 0; s < 20; ++s){
+            sim.stamp(N / 2, N / 2, 3, 3, N, 100.0f, 50.0f, 20.0f);
+            for (int k = 0; k < 6; ++k){
+                sim.add_force(N / 2 + k, N / 3, N, 20.0f, 10.0f);
+            }
+            sim.update(N, 0.1f);
+            max_substeps = std::max(max_substeps, sim.getLastSubsteps());
+            finite = finite && std::isfinite((double)sim.getLastCfl());
+        }
+        for (float d : dye(sim, N)){
+            finite = finite && std::isfinite(d);
+        }
+        check(max_substeps > 1, "forced adaptive run never split a frame into substeps");
+        check(finite, "forced adaptive run produced non-finite values");
+    }
+    return 0;
+}
+
+// ビューアと同じく毎ステップ reset を呼び、ステップ 0 に1度だけ色を置いて、最初の10ステップは力を加えて進める
+template <typename Sim>
+void drive_click(Sim& sim, int N, int first, int steps){
+    for (int s = first; s < first + steps; ++s){
+        sim.reset(N);
+        if (s == 0){
+            sim.stamp(N / 2, N / 2, 4, 4, N, 100.0f, 100.0f, 100.0f);
+        }
+        if (s < 10){
+            for (int k = 0; k < 6; ++k){
+                sim.add_force(N / 2 + k, N / 3, N, 0.5f, 0.2f);
+            }
+        }
+        sim.update(N, 0.1f);
+    }
+}
+
+template <typename Sim>
+double dye_total(const Sim& sim, int N){
+    std::vector<float> rgb((std::size_t)N * N * 3);
+    sim.readDensity(N, rgb.data());
+    double total = 0.0;
+    for (float d : rgb){
+        total += d;
+    }
+    return total;
+}
+
+int test_dye_mass(){
+    const int N = 64;
+    for (LinearSolver solver : { LinearSolver::GaussSeidel, LinearSolver::RedBlackGaussSeidel, LinearSolver::ConjugateGradient }){
+        for (bool graph : { false, true }){
+            Simulation f32(N, 0, DyeStorage::Float32), fixed(N, 0, DyeStorage::Fixed16);
+            for (Simulation* sim : { &f32, &fixed }){
+                sim->setLinearSolver(solver);
+                sim->setTaskGraph(graph);
+                sim->setThreadCount(graph ? 3 : 1);
+            }
+            int done = 0;
+            for (int steps : { 10, 50 }){
+                drive_click(f32, N, done, steps - done);
+                drive_click(fixed, N, done, steps - done);
+                done = steps;
+                double expected = dye_total(f32, N);
+                double actual = dye_total(fixed, N);
+                check(expected > 100.0 && std::abs(actual - expected) <= 0.01 * expected,
+                      "fixed16 dye total " + std::to_string(actual) + " vs fp32 " + std::to_string(expected) + " after " +
+                      std::to_string(steps) + " steps (solver " + std::to_string((int)solver) + (graph ? ", task graph)" : ")"));
+            }
+        }
+    }
+    return 0;
+}
+
+// 全体を処理した dense と有効なタイルだけを処理した sparse の色の総量と値を比べる
+void check_sparse_close(const Simulation& dense, const Simulation& sparse, int N, const std::string& label){
+    const std::vector<float> a = dye(dense, N), b = dye(sparse, N);
+    double total_a = 0.0, total_b = 0.0, max_diff = 0.0;
+    for (std::size_t k = 0; k < a.size(); ++k){
+        total_a += a[k];
+        total_b += b[k];
+        max_diff = std::max(max_diff, (double)std::abs(a[k] - b[k]));
+    }
+    check(std::abs(total_a - total_b) <= 1e-4 * total_a, label + ": sparse dye total " + std::to_string(total_b) +
+                                                        " vs dense " + std::to_string(total_a));
+    check(max_diff <= 1e-4, label + ": sparse dye differs from dense by " + std::to_string(max_diff));
+}
+
+int test_sparse(){
+    const int N = 96;
+    SparseOptions opt;
+    opt.enabled = true;
+    opt.halo = 0;
+    {
+        Simulation dense(N), sparse(N);
+        sparse.setSparseOptions(opt);
+        check(sparse.getSparseOptions().halo == 1, "sparse halo 0 was not raised to 1");
+        // 力で広がる色（halo 0 のままだと有効な領域が広がらず、拡散した色が無効なタイルで消える）
+        int done = 0;
+        for (int steps : { 10, 40 }){
+            drive_click(dense, N, done, steps - done);
+            drive_click(sparse, N, done, steps - done);
+            done = steps;
+            check_sparse_close(dense, sparse, N, "forced, " + std::to_string(steps) + " steps");
+        }
+    }
+    {
+        // 力を加えず、離れた位置に薄い色を置く。薄い色は拡散してしきい値を下回り、そのタイルは無効になって0になる
+        Simulation dense(N), sparse(N);
+        sparse.setSparseOptions(opt);
+        double fraction = 1.0;
+        bool retired = false;
+        for (int s = 0; s < 30; ++s){
+            for (Simulation* sim : { &dense, &sparse }){
+                sim->reset(N);
+                if (s == 0){
+                    sim->stamp(N / 2, N / 2, 4, 4, N, 100.0f, 100.0f, 100.0f);
+                    sim->stamp(N - 12, 8, 2, 2, N, 5e-4f, 5e-4f, 5e-4f);
+                }
+                sim->update(N, 0.1f);
+            }
+            retired = retired || sparse.getActiveTileFraction() < fraction;
+            fraction = sparse.getActiveTileFraction();
+        }
+        check(retired, "no tile was retired in the quiet sparse run");
+        check_sparse_close(dense, sparse, N, "quiet");
+    }
+    return 0;
+}
+
+template <typename Sim>
+void round_trip(const char* label, DyeStorage storage, const std::string& path){
+    const int N = 48;
+    Sim original(N, 2, storage), restored(N, 2, storage);
+    for (Sim* sim : { &original, &restored }){
+        sim->setViscosity(0.0001f);
+    }
+    drive(original, N, 0, 10);
+    original.saveCheckpoint(path);
+    restored.restoreCheckpoint(path);
+    check(state(original) == state(restored), std::string(label) + ": restored state differs");
+    // 付け替えたファイルの領域から続けて進めても一致する
+    drive(original, N, 10, 15);
+    drive(restored, N, 10, 15);
+    check(state(original) == state(restored), std::string(label) + ": state after restoring differs");
+    check(restored.getStepCount() == 25, std::string(label) + ": step count not restored");
+}
+
+int test_checkpoint(){
+    const std::string path = "simulation_test_checkpoint.bin";
+    round_trip<Simulation>("fp32", Simulation::kNativeDye, path);
+    round_trip<SimulationF64>("fp64", SimulationF64::kNativeDye, path);
+    round_trip<SimulationMixed>("mixed fp16", DyeStorage::Float16, path);
+    // 格子の大きさが違うファイルは復元しない
+    Simulation other(40);
+    bool threw = false;
+    try {
+        other.restoreCheckpoint(path);
+    } catch (const std::runtime_error&){
+        threw = true;
+    }
+    check(threw, "restoring a checkpoint of another grid size did not throw");
+    // 非同期の書き出しの失敗は、後の書き出しが成功しても wait と failed に残る
+    {
+        CheckpointWriter writer;
+        writer.submit(other, "simulation_test_missing_dir/checkpoint.bin");
+        writer.submit(other, path);
+        check(!writer.wait(), "a failed asynchronous checkpoint was hidden by a later success");
+        check(writer.failed() == 1 && writer.written() == 1 && !writer.lastError().empty(),
+              "checkpoint writer counts: " + std::to_string(writer.written()) + " written, " +
+              std::to_string(writer.failed()) + " failed");
+    }
+    std::remove(path.c_str());
+    return 0;
+}
+
+int test_task_graph(){
+    for (LinearSolver solver : { LinearSolver::GaussSeidel, LinearSolver::RedBlackGaussSeidel }){
+        for (int tracers : { 0, 5 }){
+            const int N = 96;
+            Simulation serial(N, tracers), graph(N, tracers);
+            for (Simulation* sim : { &serial, &graph }){
+                sim->setLinearSolver(solver);
+                sim->setViscosity(0.0001f);
+            }
+            serial.setThreadCount(1);
+            graph.setTaskGraph(true);
+            graph.setThreadCount(4);
+            drive(serial, N, 0, 25);
+            drive(graph, N, 0, 25);
+            check(state(serial) == state(graph), "task graph differs from the serial run (solver " +
+                                                 std::to_string((int)solver) + ", tracers " + std::to_string(tracers) + ")");
+        }
+    }
+    return 0;
+}
+
+int test_residual(){
+    for (LinearSolver solver : { LinearSolver::GaussSeidel, LinearSolver::RedBlackGaussSeidel }){
+        const int N = 64;
+        Simulation plain(N), telemetry(N);
+        for (Simulation* sim : { &plain, &telemetry }){
+            sim->setLinearSolver(solver);
+            sim->setViscosity(0.0001f);
+        }
+        telemetry.setResidualTelemetry(true);
+        drive(plain, N, 0, 3);
+        drive(telemetry, N, 0, 3);
+        const std::string label = "solver " + std::to_string((int)solver);
+        check(std::isnan(plain.getPressureStats().residual), label + ": pressure residual reported without telemetry");
+        check(std::isnan(plain.getDiffusionStats().residual), label + ": diffusion residual reported without telemetry");
+        for (const SolveStats* st : { &telemetry.getPressureStats(), &telemetry.getDiffusionStats() }){
+            const std::string what = label + (st == &telemetry.getPressureStats() ? " pressure" : " diffusion");
+            check(st->initial_residual > 0.0f && std::isfinite(st->initial_residual), what + ": no initial residual");
+            check(st->residual > 0.0f && std::isfinite(st->residual), what + ": no final residual");
+        }
+        // 圧力の40回の反復では、赤黒順序の最初の反復で黒のセルに残差が寄るため2ノルムが減るとは限らない
+        // 拡散（対角優位）は20回の反復で確実に減る
+        const SolveStats& diffusion = telemetry.getDiffusionStats();
+        check(diffusion.residual < diffusion.initial_residual, label + ": diffusion residual did not decrease (" +
+              std::to_string(diffusion.initial_residual) + " -> " + std::to_string(diffusion.residual) + ")");
+        check(state(plain) == state(telemetry), label + ": residual telemetry changed the result");
+    }
+    return 0;
+}
+
+// drive と同じく steps ステップ進め、ステップ kick_step でだけ強い力も加える
+// （移流の距離が袖の行数と1つのランクの行数を超え、隣のランクが中継するステップを作る）
+// after_step は各ステップの後に呼ぶ
+template <typename Sim, typename F>
+void drive_kicked(Sim& sim, int N, int steps, int kick_step, F&& after_step){
+    for (int s = 0; s < steps; ++s){
+        if (s == kick_step){
+            for (int k = 0; k < 4; ++k){
+                for (int l = 0; l < 4; ++l){
+                    sim.add_force(N / 2 + k, N / 2 + l, N, 3.0f, 40.0f);
+                }
+            }
+        }
+        drive(sim, N, s, 1);
+        after_step();
+    }
+}
+
+int test_batch(){
+    const int N = 48, K = 6;
+    const LinearSolver solvers[] = { LinearSolver::GaussSeidel, LinearSolver::RedBlackGaussSeidel, LinearSolver::ConjugateGradient };
+    // インスタンスごとにソルバーと粘性係数を変える
+    auto configure = [&](Simulation& sim, int k){
+        sim.setLinearSolver(solvers[k % 3]);
+        sim.setViscosity(k < 3 ? 0.0f : 0.0001f);
+    };
+    SimulationBatch batch(K, N, 3, 2);
+    for (int k = 0; k < K; ++k){
+        configure(batch[k], k);
+    }
+    batch.advance(25, 0.1f, [&](int, Simulation& sim, int s){ apply_events(sim, N, s); });
+    for (int k = 0; k < K; ++k){
+        Simulation single(N, 2);
+        single.setThreadCount(1);
+        configure(single, k);
+        drive(single, N, 0, 25);
+        check(state(batch[k]) == state(single), "batch instance " + std::to_string(k) + " differs from a single simulation");
+    }
+    return 0;
+}
+
+int test_distributed(){
+    const int steps = 16, kick_step = 8;
+    for (int N : { 40, 63 }){
+        Simulation ref(N, 2);
+        ref.setLinearSolver(LinearSolver::RedBlackGaussSeidel);
+        ref.setViscosity(0.0001f);
+        drive_kicked(ref, N, steps, kick_step, []{});
+        std::vector<float> expected((std::size_t)N * N * 3);
+        ref.readDensity(N, expected.data());
+        for (int ranks = 1; ranks <= 4; ++ranks){
+            for (int halo : { 1, 2, 4 }){
+                LoopbackHub hub(ranks);
+                std::vector<float> gathered((std::size_t)N * N * 3);
+                std::vector<std::string> errors(ranks);
+                int widest = 0;
+                auto rank_main = [&](int r){
+                    try {
+                        LoopbackTransport transport(hub, r);
+                        DistributedSimulation sim(N, transport, halo, 2);
+                        sim.setViscosity(0.0001f);
+                        drive_kicked(sim, N, steps, kick_step, [&]{
+                            if (r == 0) widest = std::max(widest, sim.getLastHaloWidth());
+                        });
+                        sim.gatherDensity(N, r == 0 ? gathered.data() : nullptr);
+                    } catch (const std::exception& e){
+                        errors[r] = e.what();
+                        hub.abort();
+                    }
+                };
+                std::vector<std::thread> threads;
+                for (int r = 1; r < ranks; ++r){
+                    threads.emplace_back(rank_main, r);
+                }
+                rank_main(0);
+                for (std::thread& t : threads){
+                    t.join();
+                }
+                const std::string where = " (N=" + std::to_string(N) + ", ranks " + std::to_string(ranks) +
+                                          ", halo " + std::to_string(halo) + ")";
+                for (int r = 0; r < ranks; ++r){
+                    check(errors[r].empty(), "rank " + std::to_string(r) + " threw: " + errors[r] + where);
+                }
+                check(widest > halo, "no advection step was wider than the halo (widest " + std::to_string(widest) + ")" + where);
+                check(same_bits(expected, gathered), "gathered density differs from Simulation" + where);
+            }
+        }
+    }
+    // 0番以外のランクが途中で例外を投げても、袖や最大値を待っている他のランクは打ち切られて抜ける
+    {
+        const int N = 40, ranks = 3;
+        LoopbackHub hub(ranks);
+        std::vector<std::string> errors(ranks);
+        auto rank_main = [&](int r){
+            try {
+                LoopbackTransport transport(hub, r);
+                DistributedSimulation sim(N, transport, 2, 0);
+                for (int s = 0; s < 10; ++s){
+                    if (r == 1 && s == 3) throw std::runtime_error("rank 1 failed");
+                    apply_events(sim, N, s);
+                    sim.update(N, 0.1f);
+                }
+            } catch (const std::exception& e){
+                errors[r] = e.what();
+                hub.abort();
+            }
+        };
+        std::vector<std::thread> threads;
+        for (int r = 1; r < ranks; ++r){
+            threads.emplace_back(rank_main, r);
+        }
+        rank_main(0);
+        for (std::thread& t : threads){
+            t.join();
+        }
+        check(errors[1] == "rank 1 failed", "rank 1 error was not recorded: " + errors[1]);
+        check(!errors[0].empty() && !errors[2].empty(), "peers of a failed rank were not aborted");
+    }
+    return 0;
+}
+
+struct Case {
+    const char* name;
+    int (*run)();
+};
+
+const Case kCases[] = {
+    { "multigrid", test_multigrid },
+    { "cg", test_cg },
+    { "residual", test_residual },
+    { "simd", test_simd },
+    { "fused", test_fused },
+    { "adaptive", test_adaptive },
+    { "dye_mass", test_dye_mass },
+    { "sparse", test_sparse },
+    { "checkpoint", test_checkpoint },
+    { "task_graph", test_task_graph },
+    { "batch", test_batch },
+    { "distributed", test_distributed },
+};
+
+} // namespace
+
+int main(int argc, char **argv){
+    if (argc != 2){
+        std::fprintf(stderr, "usage: %s CASE\n", argv[0]);
+        return 2;
+    }
+    for (const Case& c : kCases){
+        if (std::strcmp(argv[1], c.name) != 0) continue;
+        int rc = 0;
+        try {
+            rc = c.run();
+        } catch (const std::exception& e){
+            std::fprintf(stderr, "FAILED: %s threw: %s\n", c.name, e.what());
+            return 1;
+        }
+        if (failures > 0) return 1;
+        return rc;
+    }
+    std::fprintf(stderr, "unknown case: %s\n", argv[1]);
+    return 2;
+}
@@ -0,0 +1,800 @@
+//
+//  headless.cpp
+//  2D-StableFluids
+//
+//  ウィンドウを作らずに Simulation::update を回すバッチ実行ドライバ。
+//  ディスプレイのないノードでの実行とソルバーのスループット計測に使う。
+//
+//  使い方:
+//    stablefluids_headless [--size N] [--steps S] [--dt DT]
+//                          [--visc V] [--diff D] [--script FILE] [--no-reset]
+//                          [--solver gs|rbgs|cg] [--precond none|jacobi|ic] [--threads T]
+//                          [--pressure iter|mg-v|mg-f] [--tol TOL] [--residuals]
+//                          [--simd auto|scalar|vec4|avx2|avx512] [--tracers K] [--tile T]
+//                          [--trace FILE] [--log trace|debug|info|warn|error|off]
+//                          [--fused] [--fusion-check] [--dye fp32|fp64|fp16|bf16|fixed16]
+//                          [--precision fp32|fp64|mixed]
+//                          [--sparse] [--sparse-tile T] [--sparse-halo H] [--sparse-threshold E]
+//                          [--adaptive] [--cfl C] [--max-substeps K]
+//                          [--checkpoint FILE] [--checkpoint-every K] [--restore FILE]
+//                          [--export raw|png|pipe] [--export-path PATH] [--export-every K]
+//                          [--export-workers T] [--export-queue D] [--export-drop]
+//                          [--ffmpeg CMD] [--ffmpeg-args ARGS] [--fps F] [--png-level L]
+//                          [--batch K] [--task-graph] [--ranks R] [--halo H]
+//                          [--first-touch] [--pin]
+//
+//  スクリプトファイルは 1 行 1 イベントで、先頭の数値がイベントを適用するステップ番号:
+//    <step> add_force X Y U V
+//    <step> stamp X Y W H R G B
+//    <step> sink X Y W H
+//    <step> tracer ID X Y W H AMOUNT
+//  '#' 以降はコメントとして無視する。
+//
+//  既定ではビューアと同じく毎ステップ reset を呼び、(10, 10) と (20, 20) にシンクを置く。
+//  そのため --size が 22 未満の格子では --no-reset が必要になる（付けない場合は理由を表示して終了する）。
+//
+//  --sparse は速度か色がしきい値 E を超えるタイル（一辺 T、周囲 H タイルを含む）だけを移流・拡散する。T と H は1以上。
+//  有効なタイルの割合のステップ平均を表示する。
+//
+//  --adaptive は各ステップの dt を、逆追跡の距離が C セル以下になるよう最大 K 個の部分ステップに分ける。
+//  部分ステップ数の平均と最大、CFL 数の最大を表示する。
+//
+//  --checkpoint は最後のステップの後に状態を FILE に書き出す。--checkpoint-every K を付けると K ステップごとにも書き出す
+//  （書き出しは別スレッドで行い、場を写す間だけステップを止める）。
+//  --restore は FILE の状態から再開する。格子の大きさ・精度・色の格納形式・トレーサー数・粘性係数・拡散率は FILE に従い、
+//  保存したステップの次から --steps まで進める（それより前のステップのイベントは適用済みとして飛ばす）。
+//
+//  --export は K ステップごとに色の場をフレームとして書き出す（raw: float の RGB、png: 8 ビットの PNG、
+//  pipe: RGB24 を ffmpeg に渡して動画にする）。raw と png の PATH は %05d のようなフレーム番号を含むファイル名、
+//  pipe の PATH は動画のファイル名。圧縮と書き出しは T スレッドで行い、書き出し待ちが D フレームになると
+//  ステップを止めて待つ（--export-drop では待たずにフレームを捨てる）。待った時間の合計を表示する。
+//
+//  --batch は同じ設定のインスタンスを K 個作り、インスタンス単位の作業を --threads 個のスレッドで分け合って進める
+//  （各インスタンスの内部は1スレッド）。インスタンス・ステップ / 秒を表示する。
+//
+//  --task-graph は1ステップの独立な処理（速度の u と v、色の r, g, b）を作業グラフとして --threads 個のスレッドで
+//  並行に進める（各処理の行ループも同じスレッドで分け合う）。作業を盗んだ回数を表示する。
+//
+//  --ranks は格子を R 個のランクに行の帯で分けて進める（DistributedSimulation。ランクは1つのプロセスの中のスレッドで、
+//  袖の行は LoopbackTransport で送り合う）。各ランクは上下 H 行の袖を持つ。拡散と圧力は赤黒ガウス・ザイデル法で、
+//  精度は fp32、圧力は iter だけ（--solver rbgs の1つの Simulation と同じ結果になる）。送った袖のバイト数を表示する。
+//
+//  --first-touch は全ての場を --threads 個のソルバーのスレッドが担当する行から初期化し、ページを各スレッドの NUMA ノードに置く。
+//  --pin はソルバーのスレッドを CPU に固定する。どちらかを付けると場のページの NUMA ノードごとの量を表示する。
+//
+//  --residuals はガウス・ザイデル法（gs, rbgs）の拡散と圧力でも反復の前後の残差ノルムを求める（付けない場合は n/a と表示する）。
+//  反復回数は固定なので、残差が減っていない（発散・停滞している）ことを確かめるのに使う。
+//
+//  --precision は計算の精度（mixed は格納が fp32 で、圧力の計算と残差が fp64）。--dye の既定はこれに合わせる。
+//
+//  STABLEFLUIDS_ENABLE_PROFILING を有効にしてビルドした場合は、処理段階ごとの p50/p95/p99 を表示し、
+//  --trace で Chrome のトレース形式（chrome://tracing, Perfetto で開ける）の JSON を書き出す。
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "distributed_simulation.hpp"
+#include "frame_export.hpp"
+#include "logger.hpp"
+#include "numa.hpp"
+#include "simulation.hpp"
+#include "simulation_batch.hpp"
+
+namespace {
+
+// スクリプトで指定されるイベント
+struct Event {
+    enum Kind { AddForce, Stamp, Sink, Tracer } kind;
+    int step;
+    int X, Y, W, H;
+    int id;         // tracer: トレーサーの番号
+    float a, b, c;  // add_force: (u, v)、stamp: (R, G, B)、tracer: (量)
+};
+
+struct Options {
+    int N = 120;            // 720 / 6（ビューアの既定値と同じ）
+    int steps = 1000;
+    float dt = 0.1f;
+    float visc = 0.0f;
+    float diff = 0.001f;
+    bool reset = true;      // ビューアと同じく毎ステップ reset を呼ぶ
+    LinearSolver solver = LinearSolver::GaussSeidel;
+    int threads = 1;        // 0 でハードウェアスレッド数
+    PressureSolver pressure = PressureSolver::Iterative;
+    MultigridOptions mg;
+    ConjugateGradientOptions cg;
+    SimdIsa simd = SimdIsa::Auto;
+    int tracers = 0;
+    int tile = 64;
+    std::string script;
+    std::string trace;      // Chrome トレースの出力先
+    LogLevel log = LogLevel::Off;
+    bool fused = false;         // 融合した輸送処理
+    bool fusion_check = false;  // 融合しない処理との比較（--fused を含む）
+    std::optional<DyeStorage> dye;  // 色とトレーサーの格納形式（既定は精度に合わせる）
+    Precision precision = Precision::Float32;
+    SparseOptions sparse;   // 有効なタイルだけを処理する設定
+    TimestepOptions timestep;   // 時間刻みの制御
+    std::string checkpoint;     // チェックポイントの出力先
+    int checkpoint_every = 0;   // チェックポイントを書き出す間隔（0 なら最後だけ）
+    std::string restore;        // 再開するチェックポイント
+    bool export_frames = false; // フレームを書き出すか
+    FrameExportOptions frames;  // フレームの書き出しの設定
+    int export_every = 1;       // フレームを書き出す間隔（ステップ数）
+    int batch = 0;              // バッチ実行のインスタンス数（0 なら1つの Simulation を進める）
+    bool task_graph = false;    // 1ステップを作業グラフとして進める
+    int ranks = 0;              // 領域分割のランク数（0 なら1つの Simulation を進める）
+    int halo = 4;               // 領域分割の袖の行数
+    NumaOptions numa;           // first-touch での初期化とスレッドの固定
+    bool residuals = false;     // ガウス・ザイデル法でも残差を求める
+};
+
+void usage(const char *prog){
+    std::cerr << "usage: " << prog
+              << " [--size N] [--steps S] [--dt DT] [--visc V] [--diff D]"
+                 " [--script FILE] [--no-reset] [--solver gs|rbgs|cg] [--precond none|jacobi|ic] [--threads T]"
+                 " [--pressure iter|mg-v|mg-f] [--tol TOL] [--residuals]"
+                 " [--simd auto|scalar|vec4|avx2|avx512] [--tracers K] [--tile T] [--trace FILE] [--log LEVEL]"
+                 " [--fused] [--fusion-check] [--dye fp32|fp64|fp16|bf16|fixed16] [--precision fp32|fp64|mixed]"
+                 " [--sparse] [--sparse-tile T] [--sparse-halo H] [--sparse-threshold E]"
+                 " [--adaptive] [--cfl C] [--max-substeps K]"
+                 " [--checkpoint FILE] [--checkpoint-every K] [--restore FILE]"
+                 " [--export raw|png|pipe] [--export-path PATH] [--export-every K] [--export-workers T]"
+                 " [--export-queue D] [--export-drop] [--ffmpeg CMD] [--ffmpeg-args ARGS] [--fps F] [--png-level L]"
+                 " [--batch K] [--task-graph] [--ranks R] [--halo H] [--first-touch] [--pin]" << std::endl;
+}
+
+LinearSolver parse_solver(const std::string &name){
+    if (name == "gs") return LinearSolver::GaussSeidel;
+    if (name == "rbgs") return LinearSolver::RedBlackGaussSeidel;
+    if (name == "cg") return LinearSolver::ConjugateGradient;
+    throw std::invalid_argument("unknown solver " + name);
+}
+
+Preconditioner parse_preconditioner(const std::string &name){
+    if (name == "none") return Preconditioner::None;
+    if (name == "jacobi") return Preconditioner::Jacobi;
+    if (name == "ic") return Preconditioner::IncompleteCholesky;
+    throw std::invalid_argument("unknown preconditioner " + name);
+}
+
+SimdIsa parse_simd(const std::string &name){
+    for (SimdIsa isa : {SimdIsa::Auto, SimdIsa::Scalar, SimdIsa::Vector4, SimdIsa::AVX2, SimdIsa::AVX512}){
+        if (name == simd_isa_name(isa)) return isa;
+    }
+    throw std::invalid_argument("unknown instruction set " + name);
+}
+
+DyeStorage parse_dye_storage(const std::string &name){
+    for (DyeStorage st : {DyeStorage::Float32, DyeStorage::Float64, DyeStorage::Float16, DyeStorage::BFloat16, DyeStorage::Fixed16}){
+        if (name == dye_storage_name(st)) return st;
+    }
+    throw std::invalid_argument("unknown dye storage " + name);
+}
+
+Precision parse_precision(const std::string &name){
+    for (Precision p : {Precision::Float32, Precision::Float64, Precision::Mixed}){
+        if (name == precision_name(p)) return p;
+    }
+    throw std::invalid_argument("unknown precision " + name);
+}
+
+FrameFormat parse_frame_format(const std::string &name){
+    for (FrameFormat f : {FrameFormat::Raw, FrameFormat::Png, FrameFormat::Pipe}){
+        if (name == frame_format_name(f)) return f;
+    }
+    throw std::invalid_argument("unknown frame format " + name);
+}
+
+// 処理段階ごとの所要時間（マイクロ秒）
+void print_profile(const StageProfiler &prof){
+    std::cout << "stage         calls      p50(us)      p95(us)      p99(us)      max(us)\n";
+    for (int s = 0; s < (int)Stage::Count; ++s){
+        StageSummary st = prof.summary((Stage)s);
+        if (st.count == 0) continue;
+        char line[128];
+        std::snprintf(line, sizeof(line), "%-12s %6zu %12.1f %12.1f %12.1f %12.1f\n",
+                      stage_name((Stage)s), st.count, st.p50, st.p95, st.p99, st.max);
+        std::cout << line;
+    }
+}
+
+// 場のページの NUMA ノードごとの量と、ソルバーのスレッドを固定したノード
+void print_placement(const Options &opt, const NumaPlacement &pl){
+    std::cout << "numa:        first-touch " << (opt.numa.first_touch ? "yes" : "no")
+              << ", pinned " << (opt.numa.pin_threads ? "yes" : "no");
+    if (!pl.available){
+        std::cout << ", placement unavailable\n";
+        return;
+    }
+    const double mib = (double)pl.page_bytes / (1024.0 * 1024.0);
+    for (std::size_t node = 0; node < pl.pages.size(); ++node){
+        std::cout << ", node" << node << " " << pl.pages[node] * mib << " MiB";
+    }
+    if (pl.unplaced > 0){
+        std::cout << ", unplaced " << pl.unplaced * mib << " MiB";
+    }
+    std::cout << "\nthread nodes:";
+    for (int node : pl.thread_nodes){
+        std::cout << " " << (node < 0 ? std::string("-") : std::to_string(node));
+    }
+    std::cout << "\n";
+}
+
+// 残差を求めていない場合（NaN）は n/a と表示する
+void print_stats(const char *label, const SolveStats &st){
+    std::cout << label << st.iterations << " iterations, residual ";
+    if (std::isnan(st.initial_residual) || std::isnan(st.residual)){
+        std::cout << "n/a";
+    } else {
+        std::cout << st.initial_residual << " -> " << st.residual;
+    }
+    std::cout << (st.converged ? " (converged)" : "") << "\n";
+}
+
+Options parse_args(int argc, char **argv){
+    Options opt;
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc){
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "--size") opt.N = std::atoi(value());
+        else if (arg == "--steps") opt.steps = std::atoi(value());
+        else if (arg == "--dt") opt.dt = std::strtof(value(), nullptr);
+        else if (arg == "--visc") opt.visc = std::strtof(value(), nullptr);
+        else if (arg == "--diff") opt.diff = std::strtof(value(), nullptr);
+        else if (arg == "--script") opt.script = value();
+        else if (arg == "--no-reset") opt.reset = false;
+        else if (arg == "--solver") opt.solver = parse_solver(value());
+        else if (arg == "--threads") opt.threads = std::atoi(value());
+        else if (arg == "--pressure"){
+            std::string name = value();
+            if (name == "iter") opt.pressure = PressureSolver::Iterative;
+            else if (name == "mg-v" || name == "mg-f"){
+                opt.pressure = PressureSolver::Multigrid;
+                opt.mg.cycle = name == "mg-v" ? MultigridCycle::V : MultigridCycle::F;
+            }
+            else throw std::invalid_argument("unknown pressure solver " + name);
+        }
+        else if (arg == "--precond") opt.cg.preconditioner = parse_preconditioner(value());
+        else if (arg == "--tile") opt.tile = std::atoi(value());
+        else if (arg == "--tracers") opt.tracers = std::atoi(value());
+        else if (arg == "--simd") opt.simd = parse_simd(value());
+        else if (arg == "--trace") opt.trace = value();
+        else if (arg == "--log") opt.log = parse_log_level(value());
+        else if (arg == "--residuals") opt.residuals = true;
+        else if (arg == "--fused") opt.fused = true;
+        else if (arg == "--fusion-check") opt.fused = opt.fusion_check = true;
+        else if (arg == "--dye") opt.dye = parse_dye_storage(value());
+        else if (arg == "--precision") opt.precision = parse_precision(value());
+        else if (arg == "--sparse") opt.sparse.enabled = true;
+        else if (arg == "--sparse-tile") opt.sparse.tile = std::atoi(value());
+        else if (arg == "--sparse-halo") opt.sparse.halo = std::atoi(value());
+        else if (arg == "--sparse-threshold"){
+            opt.sparse.velocity_threshold = opt.sparse.dye_threshold = std::strtof(value(), nullptr);
+        }
+        else if (arg == "--adaptive") opt.timestep.adaptive = true;
+        else if (arg == "--cfl") opt.timestep.cfl = std::strtof(value(), nullptr);
+        else if (arg == "--max-substeps") opt.timestep.max_substeps = std::atoi(value());
+        else if (arg == "--checkpoint") opt.checkpoint = value();
+        else if (arg == "--checkpoint-every") opt.checkpoint_every = std::atoi(value());
+        else if (arg == "--restore") opt.restore = value();
+        else if (arg == "--export"){
+            opt.export_frames = true;
+            opt.frames.format = parse_frame_format(value());
+        }
+        else if (arg == "--export-path") opt.frames.path = value();
+        else if (arg == "--export-every") opt.export_every = std::atoi(value());
+        else if (arg == "--export-workers") opt.frames.workers = std::atoi(value());
+        else if (arg == "--export-queue") opt.frames.queue_depth = std::atoi(value());
+        else if (arg == "--export-drop") opt.frames.drop_when_full = true;
+        else if (arg == "--ffmpeg") opt.frames.ffmpeg = value();
+        else if (arg == "--ffmpeg-args") opt.frames.ffmpeg_args = value();
+        else if (arg == "--fps") opt.frames.fps = std::atoi(value());
+        else if (arg == "--png-level") opt.frames.png_level = std::atoi(value());
+        else if (arg == "--batch") opt.batch = std::atoi(value());
+        else if (arg == "--task-graph") opt.task_graph = true;
+        else if (arg == "--ranks") opt.ranks = std::atoi(value());
+        else if (arg == "--halo") opt.halo = std::atoi(value());
+        else if (arg == "--first-touch") opt.numa.first_touch = true;
+        else if (arg == "--pin") opt.numa.pin_threads = true;
+        else if (arg == "--tol") opt.mg.tolerance = opt.cg.tolerance = std::strtof(value(), nullptr);
+        else if (arg == "--help" || arg == "-h"){
+            usage(argv[0]);
+            std::exit(0);
+        }
+        else throw std::invalid_argument("unknown option " + arg);
+    }
+    if (opt.N <= 0 || opt.steps < 0 || opt.tracers < 0){
+        throw std::invalid_argument("size must be positive, steps and tracers non-negative");
+    }
+    if (opt.sparse.tile < 1 || opt.sparse.halo < 1){
+        throw std::invalid_argument("--sparse-tile and --sparse-halo must be at least 1");
+    }
+    if (opt.checkpoint_every < 0 || (opt.checkpoint_every > 0 && opt.checkpoint.empty())){
+        throw std::invalid_argument("--checkpoint-every requires --checkpoint and a non-negative interval");
+    }
+    if (opt.batch < 0 || (opt.batch > 0 && (opt.export_frames || !opt.checkpoint.empty() || !opt.restore.empty()))){
+        throw std::invalid_argument("--batch must be non-negative and cannot be combined with --export, --checkpoint or --restore");
+    }
+    if (opt.ranks < 0 || (opt.ranks > 0 && (opt.batch > 0 || opt.task_graph || opt.fused || opt.sparse.enabled ||
+                                            opt.timestep.adaptive || opt.export_frames || !opt.checkpoint.empty() ||
+                                            !opt.restore.empty() || opt.precision != Precision::Float32 ||
+                                            opt.pressure != PressureSolver::Iterative ||
+                                            (opt.dye && *opt.dye != DyeStorage::Float32)))){
+        throw std::invalid_argument("--ranks must be non-negative and supports only fp32 with iterative pressure"
+                                    " (no --batch, --task-graph, --fused, --sparse, --adaptive, --export, --checkpoint or --restore)");
+    }
+    if ((opt.numa.first_touch || opt.numa.pin_threads) && (opt.batch > 0 || opt.ranks > 0)){
+        throw std::invalid_argument("--first-touch and --pin apply to a single simulation (not --batch or --ranks)");
+    }
+    if (opt.export_frames && (opt.frames.path.empty() || opt.export_every <= 0)){
+        throw std::invalid_argument("--export requires --export-path and a positive --export-every");
+    }
+    return opt;
+}
+
+// reset が置く2つのシンク（(10, 10) と (20, 20) の 2x2）が収まる最小の格子の大きさ
+constexpr int kResetMinSize = 22;
+
+// 毎ステップ reset を呼ぶ場合は、格子がシンクの収まる大きさか確かめる（--restore では格子の大きさはファイルに従う）
+void check_reset_size(const Options &opt){
+    if (opt.reset && opt.N < kResetMinSize){
+        throw std::invalid_argument("size " + std::to_string(opt.N) + " is too small for the built-in sinks of reset (needs at least " +
+                                    std::to_string(kResetMinSize) + "); use --no-reset for smaller grids");
+    }
+}
+
+// 再開するチェックポイントに合わせて、格子の大きさ・精度・色の格納形式・トレーサー数を設定する
+void apply_checkpoint_header(Options &opt){
+    CheckpointHeader h = read_checkpoint_header(opt.restore);
+    if (h.channels < 3 || h.dye_storage > (std::uint32_t)DyeStorage::Float64){
+        throw std::runtime_error("unsupported checkpoint layout: " + opt.restore);
+    }
+    if (h.real_bytes == sizeof(float) && h.accum_bytes == sizeof(float)) opt.precision = Precision::Float32;
+    else if (h.real_bytes == sizeof(double) && h.accum_bytes == sizeof(double)) opt.precision = Precision::Float64;
+    else if (h.real_bytes == sizeof(float) && h.accum_bytes == sizeof(double)) opt.precision = Precision::Mixed;
+    else throw std::runtime_error("unsupported checkpoint precision: " + opt.restore);
+    opt.N = (int)h.n;
+    opt.tracers = (int)h.channels - 3;
+    opt.dye = (DyeStorage)h.dye_storage;
+    opt.visc = (float)h.viscosity;
+    opt.diff = (float)h.diffusion;
+}
+
+// スクリプトファイルを読み込み、ステップ順に並べたイベント列を返す
+std::vector<Event> load_script(const std::string &path){
+    std::vector<Event> events;
+    std::ifstream in(path);
+    if (!in){
+        throw std::runtime_error("cannot open script " + path);
+    }
+    std::string line;
+    int lineno = 0;
+    while (std::getline(in, line)){
+        ++lineno;
+        line = line.substr(0, line.find('#'));
+        std::istringstream ss(line);
+        Event e{};
+        std::string kind;
+        if (!(ss >> e.step)) continue;  // 空行
+        ss >> kind;
+        bool ok = false;
+        if (kind == "add_force"){
+            e.kind = Event::AddForce;
+            ok = static_cast<bool>(ss >> e.X >> e.Y >> e.a >> e.b);
+        }
+        else if (kind == "stamp"){
+            e.kind = Event::Stamp;
+            ok = static_cast<bool>(ss >> e.X >> e.Y >> e.W >> e.H >> e.a >> e.b >> e.c);
+        }
+        else if (kind == "sink"){
+            e.kind = Event::Sink;
+            ok = static_cast<bool>(ss >> e.X >> e.Y >> e.W >> e.H);
+        }
+        else if (kind == "tracer"){
+            e.kind = Event::Tracer;
+            ok = static_cast<bool>(ss >> e.id >> e.X >> e.Y >> e.W >> e.H >> e.a);
+        }
+        if (!ok){
+            throw std::runtime_error(path + ":" + std::to_string(lineno) + ": malformed event");
+        }
+        events.push_back(e);
+    }
+    std::stable_sort(events.begin(), events.end(),
+                     [](const Event &l, const Event &r){ return l.step < r.step; });
+    return events;
+}
+
+template <typename Sim>
+void apply(Sim &sim, const Event &e, int N){
+    switch (e.kind){
+        case Event::AddForce: sim.add_force(e.X, e.Y, N, e.a, e.b); break;
+        case Event::Stamp:    sim.stamp(e.X, e.Y, e.W, e.H, N, e.a, e.b, e.c); break;
+        case Event::Sink:     sim.sink(e.X, e.Y, e.W, e.H, N); break;
+        case Event::Tracer:   sim.stampTracer(e.id, e.X, e.Y, e.W, e.H, N, e.a); break;
+    }
+}
+
+// スレッド数以外の設定を sim に適用する
+template <typename Sim>
+void configure(Sim &sim, const Options &opt){
+    sim.setViscosity(opt.visc);
+    sim.setDiffusion(opt.diff);
+    sim.setLinearSolver(opt.solver);
+    sim.setPressureSolver(opt.pressure);
+    sim.setMultigridOptions(opt.mg);
+    sim.setConjugateGradientOptions(opt.cg);
+    sim.setSimdIsa(opt.simd);
+    sim.setTileSize(opt.tile);
+    sim.setFusedTransport(opt.fused);
+    sim.setFusionCheck(opt.fusion_check);
+    sim.setSparseOptions(opt.sparse);
+    sim.setTimestepOptions(opt.timestep);
+    sim.setTaskGraph(opt.task_graph);
+    sim.setResidualTelemetry(opt.residuals);
+}
+
+// 同じ設定の opt.batch 個のインスタンスをバッチで進める（--threads はインスタンスを進めるスレッド数）
+template <typename Sim>
+int run_batch(const Options &opt, const std::vector<Event> &events){
+    const int N = opt.N;
+    BasicSimulationBatch<Sim> batch(opt.batch, N, opt.threads, opt.tracers, opt.dye.value_or(Sim::kNativeDye));
+    for (int k = 0; k < batch.size(); ++k){
+        configure(batch[k], opt);
+    }
+    // ステップ s で適用するイベントは events[first[s], first[s + 1])（events はステップ順）
+    std::vector<size_t> first(opt.steps + 1);
+    for (int s = 0; s <= opt.steps; ++s){
+        first[s] = (size_t)(std::lower_bound(events.begin(), events.end(), s,
+                                             [](const Event &e, int step){ return e.step < step; }) - events.begin());
+    }
+    first[0] = 0;   // 負のステップ番号のイベントは最初のステップで適用する（1つの Simulation の場合と同じ）
+    auto before = [&](int, Sim &sim, int step){
+        if (opt.reset){
+            sim.reset(N);
+        }
+        for (size_t k = first[step]; k < first[step + 1]; ++k){
+            apply(sim, events[k], N);
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    try {
+        batch.advance(opt.steps, opt.dt, before);
+    } catch (const std::out_of_range &e){
+        std::cerr << "event out of range: " << e.what() << std::endl;
+        return 1;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double instance_steps = (double)batch.instanceSteps();
+    double lo = 0.0, hi = 0.0;
+    for (int k = 0; k < batch.size(); ++k){
+        double total = 0.0;
+        for (float d : batch[k].getDensity(N)){
+            total += d;
+        }
+        lo = k == 0 ? total : std::min(lo, total);
+        hi = k == 0 ? total : std::max(hi, total);
+    }
+    std::cout << "grid:        " << N << " x " << N << "\n"
+              << "instances:   " << batch.size() << "\n"
+              << "steps:       " << opt.steps << "\n"
+              << "dt:          " << opt.dt << "\n"
+              << "threads:     " << batch.getThreadCount() << "\n"
+              << "precision:   " << precision_name(opt.precision) << "\n"
+              << "events:      " << events.size() << "\n"
+              << "elapsed:     " << seconds << " s\n"
+              << "sim-steps/s: " << (seconds > 0.0 ? instance_steps / seconds : 0.0) << "\n"
+              << "us/sim-step: " << (instance_steps > 0.0 ? 1e6 * seconds / instance_steps : 0.0) << "\n"
+              << "steals:      " << batch.steals() << "\n"
+              << "arena:       " << batch.arenaBytes() / (1024.0 * 1024.0) << " MiB\n"
+              << "dye total:   " << lo << " .. " << hi << "\n";
+    std::cout.flush();
+    return 0;
+}
+
+// opt.ranks 個のランク（スレッド）で領域分割して進める
+int run_distributed(const Options &opt, const std::vector<Event> &events){
+    const int N = opt.N;
+    LoopbackHub hub(opt.ranks);
+    std::vector<float> density((size_t)N * N * 3);
+    std::vector<std::uint64_t> bytes(opt.ranks), messages(opt.ranks);
+    std::vector<std::string> errors(opt.ranks);
+    int width = 0;
+    // 全てのランクが同じ順でイベントを適用し、同じ順で update を呼ぶ（範囲外のイベントや袖の不足は全てのランクで揃って投げる）
+    auto rank_main = [&](int r){
+        try {
+            LoopbackTransport transport(hub, r);
+            DistributedSimulation sim(N, transport, opt.halo, opt.tracers);
+            sim.setViscosity(opt.visc);
+            sim.setDiffusion(opt.diff);
+            size_t next = 0;
+            for (int step = 0; step < opt.steps; ++step){
+                if (opt.reset){
+                    sim.reset(N);
+                }
+                for (; next < events.size() && events[next].step <= step; ++next){
+                    apply(sim, events[next], N);
+                }
+                sim.update(N, opt.dt);
+                if (r == 0) width = std::max(width, sim.getLastHaloWidth());
+            }
+            sim.gatherDensity(N, r == 0 ? density.data() : nullptr);
+            bytes[r] = transport.bytesSent();
+            messages[r] = transport.messagesSent();
+        } catch (const std::exception &e){
+            errors[r] = e.what();
+            hub.abort();    // 袖や最大値を待っている他のランクを止める
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> ranks;
+    for (int r = 1; r < opt.ranks; ++r){
+        ranks.emplace_back(rank_main, r);
+    }
+    rank_main(0);
+    for (auto &t : ranks){
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    // 全てのランクのエラーを表示する（打ち切られたランクのエラーも含む）
+    bool failed = false;
+    for (int r = 0; r < opt.ranks; ++r){
+        if (!errors[r].empty()){
+            std::cerr << "rank " << r << ": " << errors[r] << std::endl;
+            failed = true;
+        }
+    }
+    if (failed){
+        return 1;
+    }
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::uint64_t total_bytes = 0, total_messages = 0;
+    for (int r = 0; r < opt.ranks; ++r){
+        total_bytes += bytes[r];
+        total_messages += messages[r];
+    }
+    double total = 0.0;
+    for (float d : density){
+        total += d;
+    }
+    std::cout << "grid:        " << N << " x " << N << "\n"
+              << "ranks:       " << opt.ranks << " (halo " << opt.halo << " rows, widest exchange " << width << ")\n"
+              << "steps:       " << opt.steps << "\n"
+              << "dt:          " << opt.dt << "\n"
+              << "viscosity:   " << opt.visc << "\n"
+              << "diffusion:   " << opt.diff << "\n"
+              << "tracers:     " << opt.tracers << "\n"
+              << "events:      " << events.size() << "\n"
+              << "elapsed:     " << seconds << " s\n"
+              << "steps/sec:   " << (seconds > 0.0 ? opt.steps / seconds : 0.0) << "\n"
+              << "ms/step:     " << (opt.steps > 0 ? 1000.0 * seconds / opt.steps : 0.0) << "\n"
+              << "halo sent:   " << total_bytes / (1024.0 * 1024.0) << " MiB in " << total_messages << " messages ("
+              << (opt.steps > 0 ? total_bytes / 1024.0 / opt.steps : 0.0) << " KiB/step)\n"
+              << "dye total:   " << total << "\n";
+    std::cout.flush();
+    return 0;
+}
+
+// 精度ごとの Simulation で実行する
+template <typename Sim>
+int run(const Options &opt, const std::vector<Event> &events){
+    if (opt.batch > 0){
+        return run_batch<Sim>(opt, events);
+    }
+    const int N = opt.N;
+    NumaOptions numa = opt.numa;
+    numa.threads = opt.threads;
+    // プールが固定するのはワーカーだけなので、呼び出し側（このスレッド）は自分で残りの 0 番目の CPU に固定する
+    if (numa.pin_threads){
+        std::vector<int> cpus = allowed_cpus();
+        if (!cpus.empty()) pin_current_thread(cpus[0]);
+    }
+    Sim sim(N, opt.tracers, opt.dye.value_or(Sim::kNativeDye), nullptr, numa);
+    configure(sim, opt);
+    sim.setThreadCount(opt.threads);
+    if (!opt.trace.empty() && !sim.getProfiler()){
+        std::cerr << "--trace requires a build with STABLEFLUIDS_ENABLE_PROFILING" << std::endl;
+        return 1;
+    }
+
+    int first = 0;      // 最初のステップ（再開した場合は保存したステップの次）
+    if (!opt.restore.empty()){
+        try {
+            sim.restoreCheckpoint(opt.restore);
+        } catch (const std::exception &e){
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        first = (int)std::min<std::uint64_t>(sim.getStepCount(), (std::uint64_t)opt.steps);
+    }
+    CheckpointWriter writer;
+    std::unique_ptr<FrameExporter> exporter;
+    if (opt.export_frames){
+        try {
+            exporter = std::make_unique<FrameExporter>(N, opt.frames);
+        } catch (const std::exception &e){
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    size_t next = 0;    // 次に適用するイベント
+    // 保存したステップまでのイベントは適用済み
+    while (next < events.size() && events[next].step < first){
+        ++next;
+    }
+    double active_sum = 0.0;    // ステップごとの有効なタイルの割合の和
+    long substep_sum = 0;       // 部分ステップ数の和
+    int substep_max = 0;
+    double cfl_max = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        for (int step = first; step < opt.steps; ++step){
+            if (opt.reset){
+                sim.reset(N);
+            }
+            for (; next < events.size() && events[next].step <= step; ++next){
+                apply(sim, events[next], N);
+            }
+            sim.update(N, opt.dt);
+            active_sum += sim.getActiveTileFraction();
+            substep_sum += sim.getLastSubsteps();
+            substep_max = std::max(substep_max, sim.getLastSubsteps());
+            cfl_max = std::max(cfl_max, (double)sim.getLastCfl());
+            if (exporter && (step + 1) % opt.export_every == 0){
+                exporter->submit(sim);
+            }
+            if (opt.checkpoint_every > 0 && (step + 1) % opt.checkpoint_every == 0 && step + 1 < opt.steps){
+                writer.submit(sim, opt.checkpoint);
+            }
+        }
+    } catch (const std::out_of_range &e){
+        // stamp / sink の範囲外、または存在しないトレーサー番号
+        std::cerr << "event out of range: " << e.what() << std::endl;
+        return 1;
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (!opt.checkpoint.empty()){
+        writer.submit(sim, opt.checkpoint);
+    }
+    bool saved = writer.wait();
+    bool exported = exporter ? exporter->finish() : true;
+    auto flushed = std::chrono::steady_clock::now();
+
+    const int steps = opt.steps - first;    // この実行で進めたステップ数
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double steps_per_sec = seconds > 0.0 ? steps / seconds : 0.0;
+    std::cout << "grid:        " << N << " x " << N << "\n"
+              << "steps:       " << steps << "\n"
+              << "dt:          " << opt.dt << "\n"
+              << "viscosity:   " << opt.visc << "\n"
+              << "diffusion:   " << opt.diff << "\n"
+              << "threads:     " << sim.getThreadCount() << "\n"
+              << "precision:   " << precision_name(opt.precision) << "\n"
+              << "simd:        " << simd_isa_name(sim.getSimdIsa()) << "\n"
+              << "tracers:     " << sim.getTracerCount() << "\n"
+              << "dye:         " << dye_storage_name(sim.getDyeStorage()) << "\n"
+              << "fused:       " << (opt.fused ? "yes" : "no") << "\n"
+              << "task graph:  " << (opt.task_graph ? "yes (" + std::to_string(sim.getTaskSteals()) + " steals)" : std::string("no")) << "\n"
+              << "events:      " << events.size() << "\n"
+              << "elapsed:     " << seconds << " s\n"
+              << "steps/sec:   " << steps_per_sec << "\n"
+              << "ms/step:     " << (steps > 0 ? 1000.0 * seconds / steps : 0.0) << "\n";
+    if (!opt.restore.empty()){
+        std::cout << "restored:    step " << first << " from " << opt.restore << "\n";
+    }
+    if (exporter){
+        FrameExportStats fs = exporter->stats();
+        std::cout << "frames:      " << fs.written << " written (" << frame_format_name(opt.frames.format) << "), "
+                  << fs.dropped << " dropped, " << fs.failed << " failed, stalled "
+                  << 1000.0 * fs.stall_seconds << " ms, drained in "
+                  << 1000.0 * std::chrono::duration<double>(flushed - end).count() << " ms\n";
+    }
+    if (!opt.checkpoint.empty()){
+        std::cout << "checkpoint:  " << opt.checkpoint << " (" << writer.written() << " written, " << writer.failed()
+                  << " failed, step " << sim.getStepCount() << ")\n";
+    }
+    print_stats("pressure:    ", sim.getPressureStats());
+    print_stats("diffusion:   ", sim.getDiffusionStats());
+    // 色の総量（長時間の実行での質量の減り方を精度ごとに比べる）
+    double total = 0.0;
+    for (float d : sim.getDensity(N)){
+        total += d;
+    }
+    std::cout << "dye total:   " << total << "\n";
+    if (opt.timestep.adaptive){
+        std::cout << "substeps:    " << (steps > 0 ? (double)substep_sum / steps : 0.0) << " mean, "
+                  << substep_max << " max (cfl " << opt.timestep.cfl << ", max CFL " << cfl_max << ")\n";
+    }
+    if (opt.sparse.enabled){
+        std::cout << "active tiles: " << (steps > 0 ? 100.0 * active_sum / steps : 0.0) << " % (mean)\n";
+    }
+    if (opt.fusion_check){
+        std::cout << "mismatches:  " << sim.getFusionMismatches() << "\n";
+    }
+    if (opt.numa.first_touch || opt.numa.pin_threads){
+        print_placement(opt, sim.getNumaPlacement());
+    }
+    if (StageProfiler *prof = sim.getProfiler()){
+        print_profile(*prof);
+        if (!opt.trace.empty()){
+            std::ofstream trace(opt.trace);
+            prof->writeChromeTrace(trace);
+            if (!trace){
+                std::cerr << "cannot write trace " << opt.trace << std::endl;
+                return 1;
+            }
+        }
+    }
+    std::cout.flush();
+    if (!saved){
+        std::cerr << writer.failed() << " checkpoint write(s) failed, last: " << writer.lastError() << std::endl;
+        return 1;
+    }
+    if (!exported){
+        std::cerr << "frame export failed" << std::endl;
+        return 1;
+    }
+    return sim.getFusionMismatches() == 0 ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char **argv){
+    Options opt;
+    std::vector<Event> events;
+    try {
+        opt = parse_args(argc, argv);
+        if (!opt.restore.empty()){
+            apply_checkpoint_header(opt);
+        }
+        check_reset_size(opt);
+        if (!opt.script.empty()){
+            events = load_script(opt.script);
+        }
+    } catch (const std::exception &e){
+        std::cerr << e.what() << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    Logger::instance().setLevel(opt.log);
+    if (opt.export_frames && opt.frames.format == FrameFormat::Pipe){
+        std::signal(SIGPIPE, SIG_IGN);  // ffmpeg が途中で終了しても書き込みの失敗として扱う
+    }
+    int status = 0;
+    if (opt.ranks > 0){
+        status = run_distributed(opt, events);
+        Logger::instance().flush();
+        return status;
+    }
+    switch (opt.precision){
+        case Precision::Float32: status = run<Simulation>(opt, events); break;
+        case Precision::Float64: status = run<SimulationF64>(opt, events); break;
+        case Precision::Mixed: status = run<SimulationMixed>(opt, events); break;
+    }
+    Logger::instance().flush();
+    return status;
+}